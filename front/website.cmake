@@ -0,0 +1,26 @@
+# Stages the web UI for the www partition. Text assets are stored gzipped
+# only, and served with Content-Encoding: gzip by main/http_server.c.
+# file(ARCHIVE_CREATE) gained raw gzip output in 3.19; ESP-IDF 5.1 ships 3.24
+if(CMAKE_VERSION VERSION_LESS 3.19)
+    message(FATAL_ERROR "Staging the web UI needs CMake 3.19 or newer")
+endif()
+
+set(WEBSITE_SRC_DIR "${CMAKE_CURRENT_LIST_DIR}/website")
+set(WEBSITE_GZIP_EXTS ".html" ".js" ".css")
+
+function(stage_website dest)
+    file(REMOVE_RECURSE "${dest}")
+    file(MAKE_DIRECTORY "${dest}")
+    file(GLOB assets RELATIVE "${WEBSITE_SRC_DIR}" CONFIGURE_DEPENDS "${WEBSITE_SRC_DIR}/*")
+    foreach(asset ${assets})
+        get_filename_component(ext "${asset}" LAST_EXT)
+        if(ext IN_LIST WEBSITE_GZIP_EXTS)
+            file(ARCHIVE_CREATE OUTPUT "${dest}/${asset}.gz" PATHS "${WEBSITE_SRC_DIR}/${asset}"
+                 FORMAT raw COMPRESSION GZip COMPRESSION_LEVEL 9)
+        else()
+            file(COPY "${WEBSITE_SRC_DIR}/${asset}" DESTINATION "${dest}")
+        endif()
+        # Restage when an asset changes
+        set_property(DIRECTORY APPEND PROPERTY CMAKE_CONFIGURE_DEPENDS "${WEBSITE_SRC_DIR}/${asset}")
+    endforeach()
+endfunction()
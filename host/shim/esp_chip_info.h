@@ -0,0 +1,6 @@
+#ifndef HOST_ESP_CHIP_INFO_H
+#define HOST_ESP_CHIP_INFO_H
+
+#include <stdint.h>
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef HOST_ESP_RANDOM_H
+#define HOST_ESP_RANDOM_H
+
+#include <stdint.h>
+
+// Pseudo-random with a fixed seed, so that host runs stay repeatable
+uint32_t esp_random(void);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef HOST_ESP_ROM_SYS_H
+#define HOST_ESP_ROM_SYS_H
+
+#include <stdint.h>
+
+// Busy-waits on the target; follows the virtual clock on the host
+void esp_rom_delay_us(uint32_t us);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef HOST_ESP_SYSTEM_H
+#define HOST_ESP_SYSTEM_H
+
+#include <stdbool.h>
+
+// There is nothing to boot into on the host, so a restart ends the process
+void esp_restart(void) __attribute__((noreturn));
+
+// Host only: while trapped, a restart ends just the calling task, so a tool
+// can count restarts and boot again with ota_shim_reboot()
+void esp_restart_shim_trap(bool trap);
+int esp_restart_shim_count(void);
+
+#endif
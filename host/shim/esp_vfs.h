@@ -0,0 +1,7 @@
+#ifndef HOST_ESP_VFS_H
+#define HOST_ESP_VFS_H
+
+// The host build reads web assets straight from the local filesystem
+#include <stdio.h>
+
+#endif
@@ -0,0 +1,287 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "esp_rom_sys.h"
+#include "host_clock.h"
+#include "host_sched.h"
+#include <string.h>
+#include <stdbool.h>
+
+#define TICK_US (1000000 / configTICK_RATE_HZ)
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack_depth,
+                                   void *arg, UBaseType_t priority, TaskHandle_t *handle,
+                                   BaseType_t core_id)
+{
+    (void)stack_depth;
+    (void)core_id;
+    host_thread_t *thread;
+    if(host_sched_spawn(fn, arg, name, (int)priority, &thread) != 0)
+    {
+        return pdFAIL;
+    }
+    if(handle != NULL)
+    {
+        *handle = thread;
+    }
+    return pdPASS;
+}
+
+// The thread itself still comes from the host, which only matters at init
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack_depth,
+                                           void *arg, UBaseType_t priority, StackType_t *stack,
+                                           StaticTask_t *task_buffer, BaseType_t core_id)
+{
+    (void)stack;
+    (void)task_buffer;
+    TaskHandle_t handle = NULL;
+    xTaskCreatePinnedToCore(fn, name, stack_depth, arg, priority, &handle, core_id);
+    return handle;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_depth,
+                       void *arg, UBaseType_t priority, TaskHandle_t *handle)
+{
+    return xTaskCreatePinnedToCore(fn, name, stack_depth, arg, priority, handle, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    host_sched_kill(task);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    host_clock_sleep_us((int64_t)ticks * TICK_US);
+}
+
+void vTaskDelayUntil(TickType_t *previous_wake, TickType_t increment)
+{
+    *previous_wake += increment;
+    host_clock_sleep_until_us((int64_t)*previous_wake * TICK_US);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(host_clock_now_us() / TICK_US);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return host_sched_self();
+}
+
+UBaseType_t uxTaskGetNumberOfTasks(void)
+{
+    return (UBaseType_t)host_sched_thread_count();
+}
+
+// Blocks on q until pred holds or the tick timeout passes. Only the running
+// task touches shim objects, so pred needs no lock.
+#define HOST_WAIT_UNTIL(q, pred, ticks, timed_out) do {                          \
+        int64_t deadline_ = HOST_SCHED_FOREVER;                                  \
+        if((ticks) != portMAX_DELAY)                                             \
+        {                                                                        \
+            deadline_ = host_clock_now_us() + (int64_t)(ticks) * TICK_US;        \
+        }                                                                        \
+        (timed_out) = 0;                                                         \
+        while(!(pred))                                                           \
+        {                                                                        \
+            if((ticks) == 0 || !host_sched_block((q), deadline_))                \
+            {                                                                    \
+                (timed_out) = !(pred);                                           \
+                break;                                                           \
+            }                                                                    \
+        }                                                                        \
+    } while(0)
+
+// ---- Semaphores ----
+
+struct host_sem {
+    host_waitq_t waiters;
+    UBaseType_t count;
+    UBaseType_t max;
+    bool is_static;
+};
+
+_Static_assert(sizeof(struct host_sem) <= sizeof(StaticSemaphore_t), "StaticSemaphore_t too small");
+
+static SemaphoreHandle_t sem_init(struct host_sem *sem, UBaseType_t max_count, UBaseType_t initial_count)
+{
+    sem->count = initial_count;
+    sem->max = max_count;
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+    struct host_sem *sem = calloc(1, sizeof(*sem));
+    if(sem == NULL)
+    {
+        return NULL;
+    }
+    return sem_init(sem, max_count, initial_count);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCountingStatic(UBaseType_t max_count, UBaseType_t initial_count,
+                                                 StaticSemaphore_t *buffer)
+{
+    struct host_sem *sem = memset(buffer, 0, sizeof(*buffer));
+    sem->is_static = true;
+    return sem_init(sem, max_count, initial_count);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buffer)
+{
+    return xSemaphoreCreateCountingStatic(1, 1, buffer);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buffer)
+{
+    return xSemaphoreCreateCountingStatic(1, 0, buffer);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return xSemaphoreCreateCounting(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return xSemaphoreCreateCounting(1, 0);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks_to_wait)
+{
+    int timed_out;
+    host_sched_enter();
+    HOST_WAIT_UNTIL(&sem->waiters, sem->count > 0, ticks_to_wait, timed_out);
+    if(!timed_out)
+    {
+        sem->count--;
+    }
+    return timed_out ? pdFALSE : pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    host_sched_enter();
+    if(sem->count >= sem->max)
+    {
+        return pdFALSE;
+    }
+    sem->count++;
+    host_sched_wake_one(&sem->waiters);
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    if(!sem->is_static)
+    {
+        free(sem);
+    }
+}
+
+// ---- Queues ----
+
+struct host_queue {
+    host_waitq_t senders;
+    host_waitq_t receivers;
+    uint8_t *items;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+    bool is_static;
+};
+
+_Static_assert(sizeof(struct host_queue) <= sizeof(StaticQueue_t), "StaticQueue_t too small");
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    struct host_queue *queue = calloc(1, sizeof(*queue));
+    if(queue == NULL)
+    {
+        return NULL;
+    }
+    queue->items = calloc(length, item_size);
+    if(queue->items == NULL)
+    {
+        free(queue);
+        return NULL;
+    }
+    queue->length = length;
+    queue->item_size = item_size;
+    return queue;
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t item_size, uint8_t *storage,
+                                 StaticQueue_t *queue_buffer)
+{
+    struct host_queue *queue = memset(queue_buffer, 0, sizeof(*queue_buffer));
+    queue->items = storage;
+    queue->length = length;
+    queue->item_size = item_size;
+    queue->is_static = true;
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait)
+{
+    int timed_out;
+    host_sched_enter();
+    HOST_WAIT_UNTIL(&queue->senders, queue->count < queue->length, ticks_to_wait, timed_out);
+    if(timed_out)
+    {
+        return pdFALSE;
+    }
+    UBaseType_t tail = (queue->head + queue->count) % queue->length;
+    memcpy(queue->items + tail * queue->item_size, item, queue->item_size);
+    queue->count++;
+    host_sched_wake_one(&queue->receivers);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait)
+{
+    int timed_out;
+    host_sched_enter();
+    HOST_WAIT_UNTIL(&queue->receivers, queue->count > 0, ticks_to_wait, timed_out);
+    if(timed_out)
+    {
+        return pdFALSE;
+    }
+    memcpy(buffer, queue->items + queue->head * queue->item_size, queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    host_sched_wake_one(&queue->senders);
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    return queue->count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue)
+{
+    return queue->length - queue->count;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    if(!queue->is_static)
+    {
+        free(queue->items);
+        free(queue);
+    }
+}
+
+// ---- ROM ----
+
+void esp_rom_delay_us(uint32_t us)
+{
+    host_clock_sleep_us(us);
+}
@@ -0,0 +1,550 @@
+#include "host_clock.h"
+#include "host_sched.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum {
+    THREAD_READY,
+    THREAD_RUNNING,
+    THREAD_BLOCKED,
+    THREAD_EXTERNAL,
+};
+
+struct host_thread {
+    pthread_cond_t cond;
+    int priority;
+    int state;
+    int woken;
+    int killed;
+    int64_t deadline;
+    host_waitq_t *waitq;
+    host_thread_t *next;        // Ready list or wait queue
+    host_thread_t *sleep_next;  // Timed waiters
+    void (*fn)(void *);
+    void *arg;
+    char name[16];
+};
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond;
+static host_thread_t *current;
+static host_thread_t *ready;
+static host_thread_t *sleepers;
+static host_thread_t idle_thread;
+static int sched_started;
+static atomic_int thread_count;
+
+static int64_t now_us;
+static double clock_speed;
+static int64_t base_wall_us;
+static int64_t base_virtual_us;
+
+static __thread host_thread_t *self;
+
+int64_t host_clock_wall_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// ---- Scheduler internals, all called with sched_lock held ----
+
+static void cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static void ready_push(host_thread_t *t)
+{
+    t->state = THREAD_READY;
+    t->next = NULL;
+    // Highest priority first, FIFO among equals
+    host_thread_t **p = &ready;
+    while(*p && (*p)->priority >= t->priority)
+    {
+        p = &(*p)->next;
+    }
+    t->next = *p;
+    *p = t;
+    pthread_cond_signal(&idle_cond);
+}
+
+static void sleepers_remove(host_thread_t *t)
+{
+    for(host_thread_t **p = &sleepers; *p; p = &(*p)->sleep_next)
+    {
+        if(*p == t)
+        {
+            *p = t->sleep_next;
+            break;
+        }
+    }
+    t->sleep_next = NULL;
+}
+
+static void waitq_remove(host_waitq_t *q, host_thread_t *t)
+{
+    host_thread_t *prev = NULL;
+    for(host_thread_t *p = q->head; p; prev = p, p = p->next)
+    {
+        if(p == t)
+        {
+            if(prev)
+            {
+                prev->next = p->next;
+            }
+            else
+            {
+                q->head = p->next;
+            }
+            if(q->tail == p)
+            {
+                q->tail = prev;
+            }
+            break;
+        }
+    }
+    t->next = NULL;
+}
+
+static void make_ready(host_thread_t *t, int woken)
+{
+    if(t->waitq)
+    {
+        waitq_remove(t->waitq, t);
+        t->waitq = NULL;
+    }
+    if(t->deadline != HOST_SCHED_FOREVER)
+    {
+        sleepers_remove(t);
+    }
+    t->woken = woken;
+    ready_push(t);
+}
+
+// Hands the CPU to the next ready thread, or to the idle loop
+static void dispatch(void)
+{
+    host_thread_t *next = ready;
+    if(next)
+    {
+        ready = next->next;
+        next->next = NULL;
+    }
+    else
+    {
+        next = &idle_thread;
+    }
+    next->state = THREAD_RUNNING;
+    current = next;
+    if(next == &idle_thread)
+    {
+        pthread_cond_broadcast(&idle_cond);
+    }
+    else
+    {
+        pthread_cond_signal(&next->cond);
+    }
+}
+
+static void wait_turn(host_thread_t *t)
+{
+    while(current != t)
+    {
+        pthread_cond_wait(&t->cond, &sched_lock);
+    }
+    if(t->killed)
+    {
+        dispatch();
+        pthread_mutex_unlock(&sched_lock);
+        pthread_exit(NULL);
+    }
+}
+
+static int64_t throttle_limit(int64_t wall)
+{
+    return base_virtual_us + (int64_t)((wall - base_wall_us) * clock_speed);
+}
+
+// Idle task: advances virtual time to the next timed waiter once nothing is
+// ready, no faster than the configured speed
+static void *idle_loop(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&sched_lock);
+    while(1)
+    {
+        if(current != &idle_thread)
+        {
+            pthread_cond_wait(&idle_cond, &sched_lock);
+            continue;
+        }
+        if(ready)
+        {
+            idle_thread.state = THREAD_READY;
+            dispatch();
+            continue;
+        }
+        host_thread_t *earliest = NULL;
+        for(host_thread_t *t = sleepers; t; t = t->sleep_next)
+        {
+            if(earliest == NULL || t->deadline < earliest->deadline)
+            {
+                earliest = t;
+            }
+        }
+        if(earliest == NULL)
+        {
+            // Only external events can make progress now
+            pthread_cond_wait(&idle_cond, &sched_lock);
+            continue;
+        }
+        if(clock_speed > 0)
+        {
+            int64_t wall = host_clock_wall_us();
+            if(throttle_limit(wall) < earliest->deadline)
+            {
+                int64_t wait_us = (int64_t)((earliest->deadline - throttle_limit(wall)) / clock_speed) + 1;
+                struct timespec ts;
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                ts.tv_sec += wait_us / 1000000;
+                ts.tv_nsec += (wait_us % 1000000) * 1000;
+                if(ts.tv_nsec >= 1000000000)
+                {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&idle_cond, &sched_lock, &ts);
+                continue;
+            }
+        }
+        if(earliest->deadline > now_us)
+        {
+            now_us = earliest->deadline;
+        }
+        host_thread_t *t = sleepers;
+        while(t)
+        {
+            host_thread_t *next = t->sleep_next;
+            if(t->deadline <= now_us)
+            {
+                make_ready(t, 0);
+            }
+            t = next;
+        }
+    }
+    return NULL;
+}
+
+static void sched_start(void)
+{
+    if(sched_started)
+    {
+        return;
+    }
+    sched_started = 1;
+    cond_init(&idle_cond);
+    strcpy(idle_thread.name, "IDLE");
+    idle_thread.priority = -1;
+    idle_thread.state = THREAD_RUNNING;
+    current = &idle_thread;
+    base_wall_us = host_clock_wall_us();
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, idle_loop, NULL) != 0)
+    {
+        fprintf(stderr, "host_sched: failed to start idle thread\n");
+        abort();
+    }
+    pthread_detach(thread);
+}
+
+static host_thread_t *thread_new(const char *name, int priority)
+{
+    host_thread_t *t = calloc(1, sizeof(*t));
+    if(t == NULL)
+    {
+        return NULL;
+    }
+    cond_init(&t->cond);
+    t->priority = priority;
+    t->deadline = HOST_SCHED_FOREVER;
+    t->state = THREAD_EXTERNAL;
+    snprintf(t->name, sizeof(t->name), "%s", name);
+    atomic_fetch_add(&thread_count, 1);
+    return t;
+}
+
+// An external event lands between timed wakeups. With a throttled clock the
+// wall has moved on meanwhile, so bring virtual time along, never past the
+// next sleeper.
+static void throttle_catch_up(void)
+{
+    if(clock_speed <= 0)
+    {
+        return;
+    }
+    int64_t target = throttle_limit(host_clock_wall_us());
+    for(host_thread_t *t = sleepers; t; t = t->sleep_next)
+    {
+        if(t->deadline < target)
+        {
+            target = t->deadline;
+        }
+    }
+    if(target > now_us)
+    {
+        now_us = target;
+    }
+}
+
+// ---- Participants ----
+
+void host_sched_enter(void)
+{
+    pthread_mutex_lock(&sched_lock);
+    sched_start();
+    if(self == NULL)
+    {
+        self = thread_new("host", HOST_SCHED_DEFAULT_PRIORITY);
+    }
+    if(self->state == THREAD_EXTERNAL)
+    {
+        throttle_catch_up();
+        ready_push(self);
+        wait_turn(self);
+    }
+    pthread_mutex_unlock(&sched_lock);
+}
+
+void host_sched_leave(void)
+{
+    if(self == NULL || self->state != THREAD_RUNNING)
+    {
+        return;
+    }
+    pthread_mutex_lock(&sched_lock);
+    self->state = THREAD_EXTERNAL;
+    dispatch();
+    pthread_mutex_unlock(&sched_lock);
+}
+
+void host_sched_exit(void)
+{
+    host_sched_enter();
+    pthread_mutex_lock(&sched_lock);
+    host_thread_t *t = self;
+    self = NULL;
+    dispatch();
+    pthread_mutex_unlock(&sched_lock);
+    pthread_cond_destroy(&t->cond);
+    free(t);
+    atomic_fetch_sub(&thread_count, 1);
+    pthread_exit(NULL);
+}
+
+void host_sched_kill(host_thread_t *thread)
+{
+    host_sched_enter();
+    if(thread == NULL || thread == self)
+    {
+        host_sched_exit();
+    }
+    pthread_mutex_lock(&sched_lock);
+    thread->killed = 1;
+    if(thread->state == THREAD_BLOCKED)
+    {
+        make_ready(thread, 0);
+    }
+    pthread_mutex_unlock(&sched_lock);
+}
+
+static void *spawn_entry(void *param)
+{
+    host_thread_t *t = param;
+    self = t;
+    pthread_mutex_lock(&sched_lock);
+    wait_turn(t);
+    pthread_mutex_unlock(&sched_lock);
+    t->fn(t->arg);
+    host_sched_exit();
+    return NULL;
+}
+
+int host_sched_spawn(void (*fn)(void *), void *arg, const char *name, int priority, host_thread_t **out)
+{
+    host_sched_enter();
+    host_thread_t *t = thread_new(name, priority);
+    if(t == NULL)
+    {
+        return -1;
+    }
+    t->fn = fn;
+    t->arg = arg;
+    pthread_t thread;
+    pthread_mutex_lock(&sched_lock);
+    if(pthread_create(&thread, NULL, spawn_entry, t) != 0)
+    {
+        pthread_mutex_unlock(&sched_lock);
+        free(t);
+        atomic_fetch_sub(&thread_count, 1);
+        return -1;
+    }
+    pthread_detach(thread);
+    ready_push(t);
+    if(out)
+    {
+        *out = t;
+    }
+    // A higher priority task starts running right away, as on the target
+    if(t->priority > self->priority)
+    {
+        ready_push(self);
+        dispatch();
+        wait_turn(self);
+    }
+    pthread_mutex_unlock(&sched_lock);
+    return 0;
+}
+
+int host_sched_block(host_waitq_t *q, int64_t deadline_us)
+{
+    host_sched_enter();
+    pthread_mutex_lock(&sched_lock);
+    if(deadline_us != HOST_SCHED_FOREVER && deadline_us <= now_us)
+    {
+        pthread_mutex_unlock(&sched_lock);
+        return 0;
+    }
+    self->state = THREAD_BLOCKED;
+    self->woken = 0;
+    self->deadline = deadline_us;
+    self->waitq = q;
+    self->next = NULL;
+    if(q)
+    {
+        if(q->tail)
+        {
+            q->tail->next = self;
+        }
+        else
+        {
+            q->head = self;
+        }
+        q->tail = self;
+    }
+    if(deadline_us != HOST_SCHED_FOREVER)
+    {
+        self->sleep_next = sleepers;
+        sleepers = self;
+    }
+    dispatch();
+    wait_turn(self);
+    self->deadline = HOST_SCHED_FOREVER;
+    int woken = self->woken;
+    pthread_mutex_unlock(&sched_lock);
+    return woken;
+}
+
+static void preempt_if_needed(host_thread_t *woken)
+{
+    if(woken && woken->priority > self->priority)
+    {
+        ready_push(self);
+        dispatch();
+        wait_turn(self);
+    }
+}
+
+int host_sched_wake_one(host_waitq_t *q)
+{
+    host_sched_enter();
+    pthread_mutex_lock(&sched_lock);
+    host_thread_t *t = q->head;
+    if(t)
+    {
+        make_ready(t, 1);
+        preempt_if_needed(t);
+    }
+    pthread_mutex_unlock(&sched_lock);
+    return t != NULL;
+}
+
+void host_sched_wake_all(host_waitq_t *q)
+{
+    host_sched_enter();
+    pthread_mutex_lock(&sched_lock);
+    host_thread_t *best = NULL;
+    while(q->head)
+    {
+        host_thread_t *t = q->head;
+        if(best == NULL || t->priority > best->priority)
+        {
+            best = t;
+        }
+        make_ready(t, 1);
+    }
+    preempt_if_needed(best);
+    pthread_mutex_unlock(&sched_lock);
+}
+
+host_thread_t *host_sched_self(void)
+{
+    host_sched_enter();
+    return self;
+}
+
+int host_sched_thread_count(void)
+{
+    return atomic_load(&thread_count);
+}
+
+int host_sched_priority(host_thread_t *thread)
+{
+    return thread ? thread->priority : HOST_SCHED_DEFAULT_PRIORITY;
+}
+
+// ---- Clock ----
+
+void host_clock_set_speed(double speed)
+{
+    pthread_mutex_lock(&sched_lock);
+    clock_speed = speed > 0 ? speed : 0;
+    base_wall_us = host_clock_wall_us();
+    base_virtual_us = now_us;
+    pthread_mutex_unlock(&sched_lock);
+}
+
+double host_clock_get_speed(void)
+{
+    return clock_speed;
+}
+
+int64_t host_clock_now_us(void)
+{
+    pthread_mutex_lock(&sched_lock);
+    int64_t now = now_us;
+    pthread_mutex_unlock(&sched_lock);
+    return now;
+}
+
+void host_clock_sleep_until_us(int64_t t_us)
+{
+    while(host_clock_now_us() < t_us)
+    {
+        host_sched_block(NULL, t_us);
+    }
+}
+
+void host_clock_sleep_us(int64_t us)
+{
+    host_clock_sleep_until_us(host_clock_now_us() + us);
+}
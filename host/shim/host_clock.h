@@ -0,0 +1,25 @@
+#ifndef HOST_CLOCK_H
+#define HOST_CLOCK_H
+
+#include <stdint.h>
+
+// Virtual clock shared by every shim on the host build. Threads that use the
+// shims take turns on one simulated CPU like FreeRTOS tasks on the single-core
+// target, and virtual time only advances while all of them are blocked, so
+// host scheduling noise never eats into firmware deadlines.
+
+// Limits virtual time to at most `speed` times wall-clock time; 0 runs as
+// fast as the host allows
+void host_clock_set_speed(double speed);
+double host_clock_get_speed(void);
+
+// Virtual microseconds since start
+int64_t host_clock_now_us(void);
+
+void host_clock_sleep_us(int64_t us);
+void host_clock_sleep_until_us(int64_t t_us);
+
+// Wall-clock microseconds, for measuring the host itself
+int64_t host_clock_wall_us(void);
+
+#endif
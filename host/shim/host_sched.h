@@ -0,0 +1,49 @@
+#ifndef HOST_SCHED_H
+#define HOST_SCHED_H
+
+#include <stdint.h>
+
+// Cooperative single-CPU scheduler behind the FreeRTOS and httpd shims. Only
+// the running thread touches shim state, so wait queues need no locks of
+// their own. Threads join automatically on their first shim call.
+
+#define HOST_SCHED_FOREVER INT64_MAX
+#define HOST_SCHED_DEFAULT_PRIORITY 1
+
+typedef struct host_thread host_thread_t;
+
+typedef struct {
+    host_thread_t *head;
+    host_thread_t *tail;
+} host_waitq_t;
+
+// Starts fn on a new thread that becomes runnable at the given priority
+int host_sched_spawn(void (*fn)(void *), void *arg, const char *name, int priority, host_thread_t **out);
+
+// Makes the calling thread a participant if it is not one yet
+void host_sched_enter(void);
+
+// Gives up the CPU around blocking host I/O, and takes it back afterwards
+void host_sched_leave(void);
+
+// Ends the calling participant; never returns
+void host_sched_exit(void) __attribute__((noreturn));
+
+// Marks another participant for deletion; it exits when next scheduled
+void host_sched_kill(host_thread_t *thread);
+
+// Blocks on q until woken or until the virtual deadline passes.
+// Returns 1 when woken, 0 on timeout.
+int host_sched_block(host_waitq_t *q, int64_t deadline_us);
+
+// Wakes waiters, preempting the caller if one has a higher priority
+int host_sched_wake_one(host_waitq_t *q);
+void host_sched_wake_all(host_waitq_t *q);
+
+host_thread_t *host_sched_self(void);
+int host_sched_priority(host_thread_t *thread);
+
+// Participants alive, spawned or joined, that have not exited
+int host_sched_thread_count(void);
+
+#endif
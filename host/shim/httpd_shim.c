@@ -0,0 +1,847 @@
+#define _GNU_SOURCE  // memmem
+#include "esp_http_server.h"
+#include "host_sched.h"
+#include "host_clock.h"
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define HTTPD_SHIM_MAX_RESP_HDRS 8
+// Async request copies come from a fixed pool, so that serving requests does
+// not show up in pb_heapcheck
+#define HTTPD_SHIM_ASYNC_MAX 32
+
+// TCP bridge limits
+#define HTTPD_BRIDGE_HEAD_MAX 2048
+#define HTTPD_BRIDGE_BODY_MAX (2 * 1024 * 1024)    // Room for a whole firmware image
+#define HTTPD_BRIDGE_XSTR(x) #x
+#define HTTPD_BRIDGE_STR(x) HTTPD_BRIDGE_XSTR(x)
+
+typedef struct host_httpd_session {
+    httpd_req_t req;
+    const httpd_host_request_t *in;
+    httpd_host_response_t *out;
+    size_t body_read;
+    const char *status;
+    const char *type;
+    const char *hdr_fields[HTTPD_SHIM_MAX_RESP_HDRS];
+    const char *hdr_values[HTTPD_SHIM_MAX_RESP_HDRS];
+    int hdr_count;
+    bool headers_sent;
+    bool async;                 // Answered later through an async copy
+    bool done;
+    struct host_httpd_session *next;
+} host_httpd_session_t;
+
+typedef struct {
+    httpd_config_t config;
+    httpd_uri_t *handlers;
+    int handler_count;
+    host_waitq_t work;      // Server task waiting for sessions
+    host_waitq_t done;      // Clients waiting for responses, and httpd_stop
+    host_httpd_session_t *pending_head;
+    host_httpd_session_t *pending_tail;
+    int clients;
+    uint32_t link_rate;         // Bytes per second, 0 for unlimited
+    bool running;
+    bool stopped;
+} host_httpd_t;
+
+static host_httpd_t *last_started;
+static httpd_req_t async_pool[HTTPD_SHIM_ASYNC_MAX];
+static bool async_used[HTTPD_SHIM_ASYNC_MAX];
+
+// ---- Session completion ----
+
+static void session_finish(host_httpd_t *server, host_httpd_session_t *session)
+{
+    session->done = true;
+    host_sched_wake_all(&server->done);
+}
+
+static int status_code(const char *status)
+{
+    return status ? atoi(status) : 200;
+}
+
+static void session_write_headers(host_httpd_session_t *session)
+{
+    if(session->headers_sent)
+    {
+        return;
+    }
+    session->headers_sent = true;
+    httpd_host_response_t *out = session->out;
+    out->status = status_code(session->status);
+    snprintf(out->content_type, sizeof(out->content_type), "%s", session->type ? session->type : "text/html");
+    size_t used = 0;
+    out->headers[0] = '\0';
+    for(int i = 0; i < session->hdr_count && used < sizeof(out->headers); i++)
+    {
+        used += snprintf(out->headers + used, sizeof(out->headers) - used, "%s: %s\n",
+                         session->hdr_fields[i], session->hdr_values[i]);
+    }
+}
+
+static void session_write_body(host_httpd_session_t *session, const char *buf, size_t len)
+{
+    host_httpd_t *server = session->req.handle;
+    if(server->link_rate > 0)
+    {
+        host_clock_sleep_us((int64_t)len * 1000000 / server->link_rate);
+    }
+    httpd_host_response_t *out = session->out;
+    if(out->body != NULL && out->body_cap > 0 && out->body_len < out->body_cap - 1)
+    {
+        size_t room = out->body_cap - 1 - out->body_len;
+        size_t n = len < room ? len : room;
+        memcpy(out->body + out->body_len, buf, n);
+        out->body[out->body_len + n] = '\0';
+    }
+    out->body_len += len;
+}
+
+// ---- Server thread ----
+
+static size_t uri_path_len(const char *uri)
+{
+    const char *query = strchr(uri, '?');
+    return query ? (size_t)(query - uri) : strlen(uri);
+}
+
+static httpd_uri_t *find_handler(host_httpd_t *server, int method, const char *uri)
+{
+    size_t len = uri_path_len(uri);
+    for(int i = 0; i < server->handler_count; i++)
+    {
+        httpd_uri_t *h = &server->handlers[i];
+        if((int)h->method != method)
+        {
+            continue;
+        }
+        if(server->config.uri_match_fn)
+        {
+            if(server->config.uri_match_fn(h->uri, uri, len))
+            {
+                return h;
+            }
+        }
+        else if(strlen(h->uri) == len && strncmp(h->uri, uri, len) == 0)
+        {
+            return h;
+        }
+    }
+    return NULL;
+}
+
+static void process_session(host_httpd_t *server, host_httpd_session_t *session)
+{
+    httpd_uri_t *h = find_handler(server, session->in->method, session->in->uri);
+    if(h == NULL)
+    {
+        httpd_resp_send_err(&session->req, HTTPD_404_NOT_FOUND, "This URI does not exist");
+        session_finish(server, session);
+        return;
+    }
+    session->req.user_ctx = h->user_ctx;
+    if(h->handler(&session->req) != ESP_OK && !session->headers_sent)
+    {
+        // The target closes the socket when a handler fails without answering
+        session->out->status = 0;
+    }
+    if(!session->async)
+    {
+        session_finish(server, session);
+    }
+}
+
+static void server_loop(void *arg)
+{
+    host_httpd_t *server = arg;
+    while(server->running)
+    {
+        host_httpd_session_t *session = server->pending_head;
+        if(session == NULL)
+        {
+            host_sched_block(&server->work, HOST_SCHED_FOREVER);
+            continue;
+        }
+        server->pending_head = session->next;
+        if(server->pending_head == NULL)
+        {
+            server->pending_tail = NULL;
+        }
+        process_session(server, session);
+    }
+    // Drop whatever is still queued
+    for(host_httpd_session_t *s = server->pending_head; s != NULL; s = s->next)
+    {
+        s->out->status = 0;
+        s->done = true;
+    }
+    server->pending_head = server->pending_tail = NULL;
+    server->stopped = true;
+    host_sched_wake_all(&server->done);
+}
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config)
+{
+    host_httpd_t *server = calloc(1, sizeof(*server));
+    if(server == NULL)
+    {
+        return ESP_ERR_HTTPD_ALLOC_MEM;
+    }
+    server->config = *config;
+    server->handlers = calloc(config->max_uri_handlers, sizeof(httpd_uri_t));
+    if(server->handlers == NULL)
+    {
+        free(server);
+        return ESP_ERR_HTTPD_ALLOC_MEM;
+    }
+    server->running = true;
+    if(host_sched_spawn(server_loop, server, "httpd", (int)config->task_priority, NULL) != 0)
+    {
+        free(server->handlers);
+        free(server);
+        return ESP_ERR_HTTPD_TASK;
+    }
+    *handle = server;
+    last_started = server;
+    return ESP_OK;
+}
+
+esp_err_t httpd_stop(httpd_handle_t handle)
+{
+    host_httpd_t *server = handle;
+    if(server == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    server->running = false;
+    host_sched_wake_all(&server->work);
+    if(last_started == server)
+    {
+        last_started = NULL;
+    }
+    // Let blocked clients observe their dropped connections before freeing
+    while(!server->stopped || server->clients > 0)
+    {
+        host_sched_block(&server->done, HOST_SCHED_FOREVER);
+    }
+    free(server->handlers);
+    free(server);
+    return ESP_OK;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler)
+{
+    host_httpd_t *server = handle;
+    if(server == NULL || uri_handler == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for(int i = 0; i < server->handler_count; i++)
+    {
+        if(server->handlers[i].method == uri_handler->method &&
+           strcmp(server->handlers[i].uri, uri_handler->uri) == 0)
+        {
+            return ESP_ERR_HTTPD_HANDLER_EXISTS;
+        }
+    }
+    if(server->handler_count >= server->config.max_uri_handlers)
+    {
+        fprintf(stderr, "httpd: no slots left for registering handler %s\n", uri_handler->uri);
+        return ESP_ERR_HTTPD_HANDLERS_FULL;
+    }
+    server->handlers[server->handler_count++] = *uri_handler;
+    return ESP_OK;
+}
+
+bool httpd_uri_match_wildcard(const char *uri_template, const char *uri_to_match, size_t match_upto)
+{
+    size_t tpl_len = strlen(uri_template);
+    if(tpl_len > 0 && uri_template[tpl_len - 1] == '*')
+    {
+        return match_upto >= tpl_len - 1 && strncmp(uri_template, uri_to_match, tpl_len - 1) == 0;
+    }
+    if(tpl_len > 0 && uri_template[tpl_len - 1] == '?')
+    {
+        return (match_upto == tpl_len - 1 || match_upto == tpl_len) &&
+               strncmp(uri_template, uri_to_match, match_upto < tpl_len - 1 ? match_upto : tpl_len - 1) == 0;
+    }
+    return tpl_len == match_upto && strncmp(uri_template, uri_to_match, match_upto) == 0;
+}
+
+// ---- Request side ----
+
+static host_httpd_session_t *session_of(httpd_req_t *r)
+{
+    return (host_httpd_session_t *)r->aux;
+}
+
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len)
+{
+    host_httpd_session_t *session = session_of(r);
+    size_t remaining = session->in->body_len - session->body_read;
+    size_t n = buf_len < remaining ? buf_len : remaining;
+    memcpy(buf, session->in->body + session->body_read, n);
+    session->body_read += n;
+    return (int)n;
+}
+
+static const char *find_header(httpd_req_t *r, const char *field, size_t *len)
+{
+    const char *line = session_of(r)->in->headers;
+    size_t field_len = strlen(field);
+    while(line != NULL && *line != '\0')
+    {
+        const char *end = strstr(line, "\r\n");
+        if(end == NULL)
+        {
+            end = line + strlen(line);
+        }
+        if(strncasecmp(line, field, field_len) == 0 && line[field_len] == ':')
+        {
+            const char *value = line + field_len + 1;
+            while(*value == ' ')
+            {
+                value++;
+            }
+            *len = end - value;
+            return value;
+        }
+        line = (*end != '\0') ? end + 2 : end;
+    }
+    return NULL;
+}
+
+size_t httpd_req_get_hdr_value_len(httpd_req_t *r, const char *field)
+{
+    size_t len = 0;
+    return find_header(r, field, &len) ? len : 0;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field, char *val, size_t val_size)
+{
+    size_t len = 0;
+    const char *value = find_header(r, field, &len);
+    if(value == NULL)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if(val_size == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t n = len < val_size - 1 ? len : val_size - 1;
+    memcpy(val, value, n);
+    val[n] = '\0';
+    return n < len ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+size_t httpd_req_get_url_query_len(httpd_req_t *r)
+{
+    const char *query = strchr(r->uri, '?');
+    return query ? strlen(query + 1) : 0;
+}
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *r, char *buf, size_t buf_len)
+{
+    const char *query = strchr(r->uri, '?');
+    if(query == NULL)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if(buf_len == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t len = strlen(query + 1);
+    size_t n = len < buf_len - 1 ? len : buf_len - 1;
+    memcpy(buf, query + 1, n);
+    buf[n] = '\0';
+    return n < len ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+esp_err_t httpd_query_key_value(const char *qry, const char *key, char *val, size_t val_size)
+{
+    size_t key_len = strlen(key);
+    const char *p = qry;
+    while(p != NULL && *p != '\0')
+    {
+        const char *end = strchr(p, '&');
+        size_t pair_len = end ? (size_t)(end - p) : strlen(p);
+        if(pair_len > key_len && strncmp(p, key, key_len) == 0 && p[key_len] == '=')
+        {
+            size_t len = pair_len - key_len - 1;
+            if(val_size == 0)
+            {
+                return ESP_ERR_INVALID_ARG;
+            }
+            size_t n = len < val_size - 1 ? len : val_size - 1;
+            memcpy(val, p + key_len + 1, n);
+            val[n] = '\0';
+            return n < len ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+        }
+        p = end ? end + 1 : NULL;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t httpd_req_async_handler_begin(httpd_req_t *r, httpd_req_t **out)
+{
+    if(r == NULL || out == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    httpd_req_t *copy = NULL;
+    host_sched_enter();
+    for(int i = 0; i < HTTPD_SHIM_ASYNC_MAX && copy == NULL; i++)
+    {
+        if(!async_used[i])
+        {
+            async_used[i] = true;
+            copy = &async_pool[i];
+        }
+    }
+    if(copy == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(copy, r, sizeof(*copy));
+    session_of(r)->async = true;
+    *out = copy;
+    return ESP_OK;
+}
+
+esp_err_t httpd_req_async_handler_complete(httpd_req_t *r)
+{
+    if(r == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    session_finish(r->handle, session_of(r));
+    async_used[r - async_pool] = false;
+    return ESP_OK;
+}
+
+// ---- Response side ----
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status)
+{
+    session_of(r)->status = status;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type)
+{
+    session_of(r)->type = type;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value)
+{
+    host_httpd_session_t *session = session_of(r);
+    host_httpd_t *server = r->handle;
+    if(session->hdr_count >= server->config.max_resp_headers || session->hdr_count >= HTTPD_SHIM_MAX_RESP_HDRS)
+    {
+        return ESP_ERR_HTTPD_RESP_HDR;
+    }
+    session->hdr_fields[session->hdr_count] = field;
+    session->hdr_values[session->hdr_count] = value;
+    session->hdr_count++;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len)
+{
+    host_httpd_session_t *session = session_of(r);
+    if(buf_len == HTTPD_RESP_USE_STRLEN)
+    {
+        buf_len = buf ? strlen(buf) : 0;
+    }
+    session_write_headers(session);
+    if(buf_len > 0)
+    {
+        session_write_body(session, buf, buf_len);
+    }
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf, ssize_t buf_len)
+{
+    host_httpd_session_t *session = session_of(r);
+    if(buf_len == HTTPD_RESP_USE_STRLEN)
+    {
+        buf_len = buf ? strlen(buf) : 0;
+    }
+    session_write_headers(session);
+    if(buf != NULL && buf_len > 0)
+    {
+        session_write_body(session, buf, buf_len);
+    }
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error, const char *msg)
+{
+    static const char *statuses[HTTPD_ERR_CODE_MAX] = {
+        [HTTPD_500_INTERNAL_SERVER_ERROR] = "500 Internal Server Error",
+        [HTTPD_501_METHOD_NOT_IMPLEMENTED] = "501 Method Not Implemented",
+        [HTTPD_505_VERSION_NOT_SUPPORTED] = "505 Version Not Supported",
+        [HTTPD_400_BAD_REQUEST] = "400 Bad Request",
+        [HTTPD_401_UNAUTHORIZED] = "401 Unauthorized",
+        [HTTPD_403_FORBIDDEN] = "403 Forbidden",
+        [HTTPD_404_NOT_FOUND] = "404 Not Found",
+        [HTTPD_405_METHOD_NOT_ALLOWED] = "405 Method Not Allowed",
+        [HTTPD_408_REQ_TIMEOUT] = "408 Request Timeout",
+        [HTTPD_411_LENGTH_REQUIRED] = "411 Length Required",
+        [HTTPD_414_URI_TOO_LONG] = "414 URI Too Long",
+        [HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE] = "431 Request Header Fields Too Large",
+    };
+    httpd_resp_set_status(req, statuses[error]);
+    httpd_resp_set_type(req, "text/html");
+    return httpd_resp_send(req, msg, HTTPD_RESP_USE_STRLEN);
+}
+
+// ---- Host client entry point ----
+
+httpd_handle_t httpd_host_default(void)
+{
+    return last_started;
+}
+
+void httpd_host_set_link_rate(httpd_handle_t handle, uint32_t bytes_per_s)
+{
+    host_httpd_t *server = handle;
+    if(server != NULL)
+    {
+        server->link_rate = bytes_per_s;
+    }
+}
+
+esp_err_t httpd_host_request(httpd_handle_t handle, const httpd_host_request_t *request,
+                             httpd_host_response_t *response)
+{
+    host_httpd_t *server = handle;
+    if(server == NULL || request == NULL || response == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if(strlen(request->uri) > HTTPD_MAX_URI_LEN)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    host_httpd_session_t session = {
+        .req = {
+            .handle = server,
+            .method = request->method,
+            .content_len = request->body_len,
+        },
+        .in = request,
+        .out = response,
+    };
+    session.req.aux = &session;
+    strcpy((char *)session.req.uri, request->uri);
+    response->status = 0;
+    response->body_len = 0;
+    response->content_type[0] = '\0';
+    response->headers[0] = '\0';
+    if(response->body != NULL && response->body_cap > 0)
+    {
+        response->body[0] = '\0';
+    }
+
+    host_sched_enter();
+    if(!server->running)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if(server->pending_tail)
+    {
+        server->pending_tail->next = &session;
+    }
+    else
+    {
+        server->pending_head = &session;
+    }
+    server->pending_tail = &session;
+    server->clients++;
+    host_sched_wake_one(&server->work);
+    while(!session.done)
+    {
+        host_sched_block(&server->done, HOST_SCHED_FOREVER);
+    }
+    server->clients--;
+    host_sched_wake_all(&server->done);
+    return ESP_OK;
+}
+
+// ---- TCP bridge ----
+
+typedef struct {
+    int listen_fd;
+    char head[HTTPD_BRIDGE_HEAD_MAX];
+    size_t len;                 // Bytes buffered in head, possibly past the request
+    char *body;                 // Response body
+} bridge_conn_t;
+
+static const char *reason_phrase(int status)
+{
+    switch(status)
+    {
+        case 200: return "OK";
+        case 204: return "No Content";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 408: return "Request Timeout";
+        case 409: return "Conflict";
+        case 413: return "Payload Too Large";
+        case 415: return "Unsupported Media Type";
+        case 422: return "Unprocessable Entity";
+        case 431: return "Request Header Fields Too Large";
+        case 503: return "Service Unavailable";
+        default: return status >= 500 ? "Internal Server Error" : "Status";
+    }
+}
+
+static int bridge_send_all(int fd, const char *buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if(n <= 0)
+        {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int bridge_recv_some(int fd, char *buf, size_t cap)
+{
+    ssize_t n = recv(fd, buf, cap, 0);
+    return n > 0 ? (int)n : -1;
+}
+
+static int bridge_send_simple(int fd, int status)
+{
+    char line[128];
+    int len = snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+                       status, reason_phrase(status));
+    return bridge_send_all(fd, line, len);
+}
+
+static bool bridge_header(const char *headers, const char *field, char *value, size_t cap)
+{
+    size_t field_len = strlen(field);
+    for(const char *line = headers; line != NULL && *line != '\0'; )
+    {
+        const char *end = strstr(line, "\r\n");
+        if(end == NULL)
+        {
+            break;
+        }
+        if(strncasecmp(line, field, field_len) == 0 && line[field_len] == ':')
+        {
+            const char *v = line + field_len + 1;
+            while(*v == ' ')
+            {
+                v++;
+            }
+            size_t n = (size_t)(end - v) < cap - 1 ? (size_t)(end - v) : cap - 1;
+            memcpy(value, v, n);
+            value[n] = '\0';
+            return true;
+        }
+        line = end + 2;
+    }
+    return false;
+}
+
+// Handles one request of a connection; returns false once it should close
+static bool bridge_serve_one(bridge_conn_t *conn, int fd)
+{
+    char *head_end;
+    while((head_end = memmem(conn->head, conn->len, "\r\n\r\n", 4)) == NULL)
+    {
+        if(conn->len == sizeof(conn->head))
+        {
+            bridge_send_simple(fd, 431);
+            return false;
+        }
+        int n = bridge_recv_some(fd, conn->head + conn->len, sizeof(conn->head) - conn->len);
+        if(n < 0)
+        {
+            return false;
+        }
+        conn->len += n;
+    }
+    *head_end = '\0';
+    size_t head_len = head_end - conn->head + 4;
+
+    // Request line, then the header lines the shim's handlers look up
+    char method[8], uri[HTTPD_MAX_URI_LEN + 1];
+    if(sscanf(conn->head, "%7s %" HTTPD_BRIDGE_STR(HTTPD_MAX_URI_LEN) "s", method, uri) != 2)
+    {
+        bridge_send_simple(fd, 400);
+        return false;
+    }
+    char *headers = strstr(conn->head, "\r\n");
+    headers = headers ? headers + 2 : head_end;
+    // find_header() expects every line to end in CRLF
+    head_end[0] = '\r';
+    head_end[1] = '\n';
+    head_end[2] = '\0';
+
+    httpd_host_request_t request = {
+        .method = strcmp(method, "POST") == 0 ? HTTP_POST :
+                  strcmp(method, "PUT") == 0 ? HTTP_PUT :
+                  strcmp(method, "DELETE") == 0 ? HTTP_DELETE :
+                  strcmp(method, "HEAD") == 0 ? HTTP_HEAD : HTTP_GET,
+        .uri = uri,
+        .headers = headers,
+    };
+    char value[32];
+    bool keep_alive = !(bridge_header(headers, "Connection", value, sizeof(value)) && strcasecmp(value, "close") == 0);
+    size_t content_len = bridge_header(headers, "Content-Length", value, sizeof(value)) ? strtoul(value, NULL, 10) : 0;
+    if(content_len > HTTPD_BRIDGE_BODY_MAX)
+    {
+        bridge_send_simple(fd, 413);
+        return false;
+    }
+    char *body = malloc(content_len + 1);
+    if(body == NULL)
+    {
+        return false;
+    }
+    size_t have = conn->len - head_len < content_len ? conn->len - head_len : content_len;
+    memcpy(body, conn->head + head_len, have);
+    while(have < content_len)
+    {
+        int n = bridge_recv_some(fd, body + have, content_len - have);
+        if(n < 0)
+        {
+            free(body);
+            return false;
+        }
+        have += n;
+    }
+    // Keep whatever the client pipelined behind this request
+    size_t used = head_len + (conn->len - head_len < content_len ? conn->len - head_len : content_len);
+    request.body = body;
+    request.body_len = content_len;
+
+    httpd_host_response_t response = {
+        .body = conn->body,
+        .body_cap = HTTPD_BRIDGE_BODY_MAX,
+    };
+    httpd_handle_t server = httpd_host_default();
+    esp_err_t err = server ? httpd_host_request(server, &request, &response) : ESP_ERR_INVALID_STATE;
+    host_sched_leave();
+    free(body);
+    memmove(conn->head, conn->head + used, conn->len - used);
+    conn->len -= used;
+
+    if(err != ESP_OK || response.status == 0)
+    {
+        // The target drops the socket when a handler fails without answering
+        if(err != ESP_OK)
+        {
+            bridge_send_simple(fd, 503);
+        }
+        return false;
+    }
+    if(response.body_len >= HTTPD_BRIDGE_BODY_MAX)
+    {
+        bridge_send_simple(fd, 500);
+        return false;
+    }
+
+    char head[512];
+    int len = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n",
+                       response.status, reason_phrase(response.status), response.content_type, response.body_len);
+    for(const char *line = response.headers; *line != '\0' && len < (int)sizeof(head); )
+    {
+        const char *end = strchr(line, '\n');
+        size_t n = end ? (size_t)(end - line) : strlen(line);
+        len += snprintf(head + len, sizeof(head) - len, "%.*s\r\n", (int)n, line);
+        line = end ? end + 1 : line + n;
+    }
+    if(len < (int)sizeof(head))
+    {
+        len += snprintf(head + len, sizeof(head) - len, "%s\r\n", keep_alive ? "" : "Connection: close\r\n");
+    }
+    if(len >= (int)sizeof(head) || bridge_send_all(fd, head, len) != 0 ||
+       bridge_send_all(fd, conn->body, response.body_len) != 0)
+    {
+        return false;
+    }
+    return keep_alive;
+}
+
+static void *bridge_loop(void *arg)
+{
+    bridge_conn_t *conn = arg;
+    while(1)
+    {
+        int fd = accept(conn->listen_fd, NULL, NULL);
+        if(fd < 0)
+        {
+            continue;
+        }
+        conn->len = 0;
+        while(bridge_serve_one(conn, fd))
+        {
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+esp_err_t httpd_host_listen(uint16_t port, int connections)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0)
+    {
+        return ESP_FAIL;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, connections) != 0)
+    {
+        close(fd);
+        return ESP_FAIL;
+    }
+    for(int i = 0; i < connections; i++)
+    {
+        bridge_conn_t *conn = calloc(1, sizeof(*conn));
+        if(conn == NULL || (conn->body = malloc(HTTPD_BRIDGE_BODY_MAX)) == NULL)
+        {
+            free(conn);
+            return ESP_ERR_NO_MEM;
+        }
+        conn->listen_fd = fd;
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, bridge_loop, conn) != 0)
+        {
+            return ESP_FAIL;
+        }
+        pthread_detach(thread);
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,214 @@
+#include "esp_err.h"
+#include "esp_log.h"
+#include "driver/gpio.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "esp_timer.h"
+#include "esp_ota_ops.h"
+#include "host_clock.h"
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+// ---- esp_timer ----
+
+int64_t esp_timer_get_time(void)
+{
+    return host_clock_now_us();
+}
+
+// ---- esp_err ----
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    switch(code)
+    {
+        case ESP_OK: return "ESP_OK";
+        case ESP_FAIL: return "ESP_FAIL";
+        case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+        case ESP_ERR_INVALID_RESPONSE: return "ESP_ERR_INVALID_RESPONSE";
+        case ESP_ERR_INVALID_CRC: return "ESP_ERR_INVALID_CRC";
+        case ESP_ERR_NOT_FINISHED: return "ESP_ERR_NOT_FINISHED";
+        case ESP_ERR_NVS_NOT_FOUND: return "ESP_ERR_NVS_NOT_FOUND";
+        case ESP_ERR_OTA_PARTITION_CONFLICT: return "ESP_ERR_OTA_PARTITION_CONFLICT";
+        case ESP_ERR_OTA_VALIDATE_FAILED: return "ESP_ERR_OTA_VALIDATE_FAILED";
+        case ESP_ERR_OTA_ROLLBACK_FAILED: return "ESP_ERR_OTA_ROLLBACK_FAILED";
+        default: return "UNKNOWN ERROR";
+    }
+}
+
+// ---- esp_log ----
+
+static esp_log_level_t log_level = ESP_LOG_INFO;
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    (void)tag;
+    log_level = level;
+}
+
+uint32_t esp_log_timestamp(void)
+{
+    return (uint32_t)(host_clock_now_us() / 1000);
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+    static const char letters[] = "NEWIDV";
+    if(level > log_level)
+    {
+        return;
+    }
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    fprintf(stderr, "%c (%u) %s: %s\n", letters[level], esp_log_timestamp(), tag, line);
+}
+
+// ---- gpio ----
+
+static int gpio_levels[GPIO_NUM_MAX];
+
+esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode)
+{
+    (void)mode;
+    return (gpio_num >= 0 && gpio_num < GPIO_NUM_MAX) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+    if(gpio_num < 0 || gpio_num >= GPIO_NUM_MAX)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    __atomic_store_n(&gpio_levels[gpio_num], level ? 1 : 0, __ATOMIC_SEQ_CST);
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num)
+{
+    if(gpio_num < 0 || gpio_num >= GPIO_NUM_MAX)
+    {
+        return 0;
+    }
+    return __atomic_load_n(&gpio_levels[gpio_num], __ATOMIC_SEQ_CST);
+}
+
+// ---- esp_random ----
+
+uint32_t esp_random(void)
+{
+    // xorshift32
+    static uint32_t state = 2463534242u;
+    uint32_t x = __atomic_load_n(&state, __ATOMIC_RELAXED);
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    __atomic_store_n(&state, x, __ATOMIC_RELAXED);
+    return x;
+}
+
+// ---- nvs ----
+
+#define NVS_SHIM_KEYS 16
+
+static struct {
+    char key[16];
+    uint32_t value;
+    int used;
+} nvs_entries[NVS_SHIM_KEYS];
+static pthread_mutex_t nvs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+esp_err_t nvs_flash_init(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    (void)name;
+    (void)open_mode;
+    *out_handle = 1;
+    return ESP_OK;
+}
+
+static esp_err_t nvs_set(const char *key, uint32_t value)
+{
+    esp_err_t err = ESP_ERR_NO_MEM;
+    pthread_mutex_lock(&nvs_lock);
+    for(int i = 0; i < NVS_SHIM_KEYS; i++)
+    {
+        if(!nvs_entries[i].used || strcmp(nvs_entries[i].key, key) == 0)
+        {
+            nvs_entries[i].used = 1;
+            strncpy(nvs_entries[i].key, key, sizeof(nvs_entries[i].key) - 1);
+            nvs_entries[i].value = value;
+            err = ESP_OK;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
+
+static esp_err_t nvs_get(const char *key, uint32_t *out_value)
+{
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+    pthread_mutex_lock(&nvs_lock);
+    for(int i = 0; i < NVS_SHIM_KEYS && nvs_entries[i].used; i++)
+    {
+        if(strcmp(nvs_entries[i].key, key) == 0)
+        {
+            *out_value = nvs_entries[i].value;
+            err = ESP_OK;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
+
+// Types are not kept apart as on the target, where each key has one type
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value)
+{
+    (void)handle;
+    return nvs_set(key, value);
+}
+
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *out_value)
+{
+    (void)handle;
+    uint32_t value;
+    esp_err_t err = nvs_get(key, &value);
+    if(err == ESP_OK)
+    {
+        *out_value = (uint8_t)value;
+    }
+    return err;
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value)
+{
+    (void)handle;
+    return nvs_set(key, value);
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out_value)
+{
+    (void)handle;
+    return nvs_get(key, out_value);
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    (void)handle;
+    return ESP_OK;
+}
@@ -0,0 +1,431 @@
+#include "esp_partition.h"
+#include "esp_ota_ops.h"
+#include "esp_app_desc.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "rom/miniz.h"
+#include "host_sched.h"
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define FLASH_SIZE (4 * 1024 * 1024)
+#define FLASH_SECTOR 4096
+#define APP_IMAGE_MAGIC 0xE9
+
+static const char *TAG = "ota-shim";
+
+// ---- esp_partition ----
+
+// As in partitions.csv
+static const esp_partition_t partitions[] = {
+    { .type = ESP_PARTITION_TYPE_DATA, .subtype = ESP_PARTITION_SUBTYPE_DATA_OTA,
+      .address = 0x10000, .size = 0x2000, .erase_size = FLASH_SECTOR, .label = "otadata" },
+    { .type = ESP_PARTITION_TYPE_APP, .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_0,
+      .address = 0x20000, .size = 0x100000, .erase_size = FLASH_SECTOR, .label = "ota_0" },
+    { .type = ESP_PARTITION_TYPE_APP, .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_1,
+      .address = 0x120000, .size = 0x100000, .erase_size = FLASH_SECTOR, .label = "ota_1" },
+    { .type = ESP_PARTITION_TYPE_DATA, .subtype = ESP_PARTITION_SUBTYPE_DATA_SPIFFS,
+      .address = 0x220000, .size = 0xF0000, .erase_size = FLASH_SECTOR, .label = "www" },
+    { .type = ESP_PARTITION_TYPE_DATA, .subtype = ESP_PARTITION_SUBTYPE_DATA_SPIFFS,
+      .address = 0x310000, .size = 0xF0000, .erase_size = FLASH_SECTOR, .label = "www_b" },
+};
+#define PARTITION_COUNT (sizeof(partitions) / sizeof(partitions[0]))
+
+static uint8_t flash[FLASH_SIZE];
+static pthread_once_t flash_once = PTHREAD_ONCE_INIT;
+
+static void flash_init(void)
+{
+    memset(flash, 0xFF, sizeof(flash));
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char *label)
+{
+    for(size_t i = 0; i < PARTITION_COUNT; i++)
+    {
+        const esp_partition_t *p = &partitions[i];
+        if(p->type == type && (subtype == ESP_PARTITION_SUBTYPE_ANY || p->subtype == subtype) &&
+           (label == NULL || strcmp(p->label, label) == 0))
+        {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    if(src_offset + size > partition->size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    pthread_once(&flash_once, flash_init);
+    memcpy(dst, &flash[partition->address + src_offset], size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+    if(dst_offset + size > partition->size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    pthread_once(&flash_once, flash_init);
+    const uint8_t *bytes = src;
+    uint8_t *dst = &flash[partition->address + dst_offset];
+    for(size_t i = 0; i < size; i++)
+    {
+        // Programming only clears bits; anything else means a missed erase
+        if((dst[i] & bytes[i]) != bytes[i])
+        {
+            ESP_LOGE(TAG, "%s: write over unerased flash at 0x%x", partition->label, (unsigned)(dst_offset + i));
+            return ESP_FAIL;
+        }
+        dst[i] = bytes[i];
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    if(offset % FLASH_SECTOR != 0 || size % FLASH_SECTOR != 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if(offset + size > partition->size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    pthread_once(&flash_once, flash_init);
+    memset(&flash[partition->address + offset], 0xFF, size);
+    return ESP_OK;
+}
+
+// ---- esp_ota ----
+
+static const esp_partition_t *running_part = &partitions[1];
+static const esp_partition_t *boot_part = &partitions[1];
+static const esp_partition_t *rollback_part;   // Slot the running one replaced
+static bool boot_new;           // boot_part holds an image no boot has tried
+static bool pending_verify;
+static bool ota_record;         // otadata has been written by a boot
+static int restart_count;
+static bool restart_trapped;
+static esp_ota_handle_t open_handle;
+static esp_ota_handle_t last_handle;
+static const esp_partition_t *open_part;
+static size_t open_written;
+static size_t open_erased;      // Sequential writes erase up to here
+static pthread_mutex_t ota_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const esp_app_desc_t app_desc = {
+    .version = "host",
+    .project_name = "powerboard",
+    .idf_ver = "host shim",
+};
+
+const esp_app_desc_t *esp_app_get_description(void)
+{
+    return &app_desc;
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size, esp_ota_handle_t *out_handle)
+{
+    if(partition == NULL || partition->type != ESP_PARTITION_TYPE_APP)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if(partition == running_part)
+    {
+        return ESP_ERR_OTA_PARTITION_CONFLICT;
+    }
+    esp_err_t err = ESP_OK;
+    pthread_mutex_lock(&ota_lock);
+    if(open_handle != 0)
+    {
+        // One upload at a time is all the firmware does
+        err = ESP_ERR_INVALID_STATE;
+    }
+    else
+    {
+        open_handle = ++last_handle;
+        open_part = partition;
+        open_written = 0;
+        open_erased = 0;
+        *out_handle = open_handle;
+    }
+    pthread_mutex_unlock(&ota_lock);
+    if(err == ESP_OK && image_size != OTA_WITH_SEQUENTIAL_WRITES)
+    {
+        size_t erase = image_size == OTA_SIZE_UNKNOWN ? partition->size :
+                       (image_size + FLASH_SECTOR - 1) / FLASH_SECTOR * FLASH_SECTOR;
+        err = esp_partition_erase_range(partition, 0, erase);
+        open_erased = erase;
+    }
+    return err;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size)
+{
+    if(handle == 0 || handle != open_handle)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    while(open_erased < open_written + size && open_erased < open_part->size)
+    {
+        esp_partition_erase_range(open_part, open_erased, FLASH_SECTOR);
+        open_erased += FLASH_SECTOR;
+    }
+    esp_err_t err = esp_partition_write(open_part, open_written, data, size);
+    if(err == ESP_OK)
+    {
+        open_written += size;
+    }
+    return err;
+}
+
+static esp_err_t ota_close(esp_ota_handle_t handle)
+{
+    pthread_mutex_lock(&ota_lock);
+    esp_err_t err = handle != 0 && handle == open_handle ? ESP_OK : ESP_ERR_NOT_FOUND;
+    if(err == ESP_OK)
+    {
+        open_handle = 0;
+    }
+    pthread_mutex_unlock(&ota_lock);
+    return err;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle)
+{
+    const esp_partition_t *part = open_part;
+    size_t written = open_written;
+    esp_err_t err = ota_close(handle);
+    if(err != ESP_OK)
+    {
+        return err;
+    }
+    uint8_t magic;
+    esp_partition_read(part, 0, &magic, 1);
+    return written > 0 && magic == APP_IMAGE_MAGIC ? ESP_OK : ESP_ERR_OTA_VALIDATE_FAILED;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle)
+{
+    return ota_close(handle);
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+    if(partition == NULL || partition->type != ESP_PARTITION_TYPE_APP)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    boot_part = partition;
+    boot_new = partition != running_part;
+    return ESP_OK;
+}
+
+const esp_partition_t *esp_ota_get_boot_partition(void)
+{
+    return boot_part;
+}
+
+const esp_partition_t *esp_ota_get_running_partition(void)
+{
+    return running_part;
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from)
+{
+    const esp_partition_t *from = start_from != NULL ? start_from : running_part;
+    return from == &partitions[1] ? &partitions[2] : &partitions[1];
+}
+
+esp_err_t esp_ota_get_state_partition(const esp_partition_t *partition, esp_ota_img_states_t *ota_state)
+{
+    // Only a slot selected for the next boot, or booted through otadata, has a record
+    if(partition != running_part && partition == boot_part)
+    {
+        *ota_state = ESP_OTA_IMG_NEW;
+        return ESP_OK;
+    }
+    if(partition == running_part && ota_record)
+    {
+        *ota_state = pending_verify ? ESP_OTA_IMG_PENDING_VERIFY : ESP_OTA_IMG_VALID;
+        return ESP_OK;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t esp_ota_mark_app_valid_cancel_rollback(void)
+{
+    pending_verify = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_invalid_rollback_and_reboot(void)
+{
+    if(!pending_verify)
+    {
+        return ESP_ERR_OTA_ROLLBACK_FAILED;
+    }
+    boot_part = rollback_part;
+    boot_new = false;
+    pending_verify = false;
+    esp_restart();
+}
+
+void ota_shim_reboot(void)
+{
+    // The bootloader's side of CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+    if(boot_part != running_part)
+    {
+        rollback_part = running_part;
+        running_part = boot_part;
+    }
+    pending_verify = boot_new;
+    boot_new = false;
+    ota_record = true;
+}
+
+void esp_restart_shim_trap(bool trap)
+{
+    restart_trapped = trap;
+}
+
+int esp_restart_shim_count(void)
+{
+    return restart_count;
+}
+
+void esp_restart(void)
+{
+    restart_count++;
+    if(restart_trapped)
+    {
+        ESP_LOGW(TAG, "Restart requested, ending the task");
+        host_sched_exit();
+    }
+    ESP_LOGW(TAG, "Restart requested, ending the process");
+    fflush(stdout);
+    fflush(stderr);
+    _exit(0);
+}
+
+// ---- ROM tinfl ----
+
+static voidpf tinfl_arena_alloc(voidpf opaque, uInt items, uInt size)
+{
+    tinfl_decompressor *r = opaque;
+    size_t len = ((size_t)items * size + 15) & ~(size_t)15;
+    if(r->arena_used + len > sizeof(r->arena))
+    {
+        return Z_NULL;
+    }
+    void *p = &r->arena[r->arena_used];
+    r->arena_used += len;
+    return p;
+}
+
+static void tinfl_arena_free(voidpf opaque, voidpf address)
+{
+    // The arena goes with the decompressor
+}
+
+// Whether the ROM would find its back-references in the caller's buffer: the
+// stream may reach TINFL_LZ_DICT_SIZE back, from where the last call stopped
+static bool tinfl_window_intact(const tinfl_decompressor *r, const mz_uint8 *start, const mz_uint8 *next,
+                                size_t dict_size)
+{
+    uLong total = r->m_state == 1 ? r->z.total_out : 0;
+    if((size_t)(next - start) != total % dict_size || (dict_size < TINFL_LZ_DICT_SIZE && total > dict_size))
+    {
+        ESP_LOGE(TAG, "tinfl: output at %u of a %u byte window after %lu bytes", (unsigned)(next - start),
+                 (unsigned)dict_size, (unsigned long)total);
+        return false;
+    }
+    size_t behind = total < TINFL_LZ_DICT_SIZE ? total : TINFL_LZ_DICT_SIZE;
+    for(size_t i = 1; i <= behind; i++)
+    {
+        if(start[(total - i) % dict_size] != r->history[(total - i) % TINFL_LZ_DICT_SIZE])
+        {
+            ESP_LOGE(TAG, "tinfl: window overwritten %u bytes back", (unsigned)i);
+            return false;
+        }
+    }
+    return true;
+}
+
+tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_next, size_t *pIn_buf_size,
+                              mz_uint8 *pOut_buf_start, mz_uint8 *pOut_buf_next, size_t *pOut_buf_size,
+                              const mz_uint32 decomp_flags)
+{
+    size_t dict_size = 0;
+    if(!(decomp_flags & TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF))
+    {
+        // The ROM takes the buffer's size as the dictionary mask
+        if(pOut_buf_next < pOut_buf_start)
+        {
+            *pIn_buf_size = 0;
+            *pOut_buf_size = 0;
+            return TINFL_STATUS_BAD_PARAM;
+        }
+        dict_size = (size_t)(pOut_buf_next - pOut_buf_start) + *pOut_buf_size;
+        if(dict_size & (dict_size - 1))
+        {
+            *pIn_buf_size = 0;
+            *pOut_buf_size = 0;
+            return TINFL_STATUS_BAD_PARAM;
+        }
+    }
+    if(r->m_state == 2)
+    {
+        *pIn_buf_size = 0;
+        *pOut_buf_size = 0;
+        return TINFL_STATUS_DONE;
+    }
+    if(r->m_state == 0)
+    {
+        memset(&r->z, 0, sizeof(r->z));
+        r->z.zalloc = tinfl_arena_alloc;
+        r->z.zfree = tinfl_arena_free;
+        r->z.opaque = r;
+        r->arena_used = 0;
+        int window_bits = (decomp_flags & TINFL_FLAG_PARSE_ZLIB_HEADER) ? MAX_WBITS : -MAX_WBITS;
+        if(inflateInit2(&r->z, window_bits) != Z_OK)
+        {
+            return TINFL_STATUS_FAILED;
+        }
+        r->m_state = 1;
+    }
+    if(dict_size != 0 && !tinfl_window_intact(r, pOut_buf_start, pOut_buf_next, dict_size))
+    {
+        return TINFL_STATUS_FAILED;
+    }
+    uLong out_before = r->z.total_out;
+    r->z.next_in = (Bytef *)pIn_buf_next;
+    r->z.avail_in = *pIn_buf_size;
+    r->z.next_out = pOut_buf_next;
+    r->z.avail_out = *pOut_buf_size;
+    int ret = inflate(&r->z, Z_NO_FLUSH);
+    *pIn_buf_size -= r->z.avail_in;
+    *pOut_buf_size -= r->z.avail_out;
+    for(size_t i = 0; i < *pOut_buf_size; i++)
+    {
+        r->history[(out_before + i) % TINFL_LZ_DICT_SIZE] = pOut_buf_next[i];
+    }
+    if(ret == Z_STREAM_END)
+    {
+        r->m_state = 2;
+        return TINFL_STATUS_DONE;
+    }
+    if(ret != Z_OK && ret != Z_BUF_ERROR)
+    {
+        return TINFL_STATUS_FAILED;
+    }
+    return r->z.avail_out == 0 ? TINFL_STATUS_HAS_MORE_OUTPUT : TINFL_STATUS_NEEDS_MORE_INPUT;
+}
@@ -0,0 +1,52 @@
+#ifndef HOST_ROM_MINIZ_H
+#define HOST_ROM_MINIZ_H
+
+// The ROM's tinfl inflater, backed on the host by zlib. zlib keeps its own
+// window, so the ROM's use of the caller's wrapping output buffer as the
+// dictionary is checked instead: the buffer must be a power of two of at
+// least TINFL_LZ_DICT_SIZE, each call must continue where the last one
+// stopped, and the history behind it must still hold what was inflated. Its
+// memory comes from an arena inside the decompressor, so that like the ROM
+// version it never allocates and needs no cleanup.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+typedef unsigned char mz_uint8;
+typedef uint32_t mz_uint32;
+
+#define TINFL_LZ_DICT_SIZE 32768
+#define HOST_TINFL_ARENA (48 * 1024)
+
+enum {
+    TINFL_FLAG_PARSE_ZLIB_HEADER = 1,
+    TINFL_FLAG_HAS_MORE_INPUT = 2,
+    TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF = 4,
+    TINFL_FLAG_COMPUTE_ADLER32 = 8,
+};
+
+typedef enum {
+    TINFL_STATUS_BAD_PARAM = -3,
+    TINFL_STATUS_ADLER32_MISMATCH = -2,
+    TINFL_STATUS_FAILED = -1,
+    TINFL_STATUS_DONE = 0,
+    TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+    TINFL_STATUS_HAS_MORE_OUTPUT = 2,
+} tinfl_status;
+
+typedef struct {
+    int m_state;                // 0 before the first call, 1 inflating, 2 done
+    z_stream z;
+    size_t arena_used;
+    uint8_t history[TINFL_LZ_DICT_SIZE];    // The last output, at total_out modulo its size
+    _Alignas(16) uint8_t arena[HOST_TINFL_ARENA];
+} tinfl_decompressor;
+
+#define tinfl_init(r) do { (r)->m_state = 0; } while(0)
+
+tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_next, size_t *pIn_buf_size,
+                              mz_uint8 *pOut_buf_start, mz_uint8 *pOut_buf_next, size_t *pOut_buf_size,
+                              const mz_uint32 decomp_flags);
+
+#endif
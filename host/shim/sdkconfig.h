@@ -0,0 +1,15 @@
+#ifndef HOST_SDKCONFIG_H
+#define HOST_SDKCONFIG_H
+
+// Subset of the generated sdkconfig.h mirroring the values in /sdkconfig
+
+#define CONFIG_IDF_TARGET "esp32s2"
+#define CONFIG_IDF_TARGET_ESP32S2 1
+#define CONFIG_FREERTOS_UNICORE 1
+#define CONFIG_FREERTOS_HZ 100
+#define CONFIG_LOG_DEFAULT_LEVEL 3
+#define CONFIG_HTTPD_MAX_REQ_HDR_LEN 1024
+#define CONFIG_HTTPD_MAX_URI_LEN 512
+#define CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE 1
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef HOST_XTENSA_HAL_H
+#define HOST_XTENSA_HAL_H
+
+#include <string.h>
+
+static inline void *xthal_memcpy(void *dst, const void *src, unsigned len)
+{
+    return memcpy(dst, src, len);
+}
+
+#endif
@@ -0,0 +1,85 @@
+#include "sim_board.h"
+#include "sim_gauge.h"
+#include "host_clock.h"
+#include "power_control.h"
+#include "tasks.h"
+#include "protection.h"
+#include "dlog.h"
+#include "ota_update.h"
+#include "nvs_flash.h"
+#include "esp_log.h"
+
+// Defined by main.c on the target
+nvs_handle_t nvs;
+
+esp_err_t start_http_server();
+esp_err_t stop_http_server();
+
+static const char *TAG = "sim-board";
+
+void sim_board_reset_gauges(void)
+{
+    sim_gauge_reset(FLIGHT_BATTERY, SIM_FLIGHT_CAP_MAH);
+    sim_gauge_reset(PYRO_BATTERY, SIM_PYRO_CAP_MAH);
+}
+
+esp_err_t sim_board_start(const sim_board_conf_t *conf)
+{
+    host_clock_set_speed(conf->speed);
+
+    ESP_ERROR_CHECK(nvs_flash_init());
+    if(nvs_open("nvs", NVS_READWRITE, &nvs) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to open NVS");
+        return ESP_FAIL;
+    }
+    if(ota_init() != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to read the update state");
+        return ESP_FAIL;
+    }
+    dlog_conf_t log_conf = {
+        .priority = TASK_DLOG_PRIORITY,
+        .core = TASK_DLOG_CORE,
+        .sink = dlog_console_sink,
+    };
+    if(dlog_start(&log_conf) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start log drain");
+        return ESP_FAIL;
+    }
+    if(init_power_control() != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to initialize power control");
+        return ESP_FAIL;
+    }
+    // Boot recalls NV and may provision; misuse would cost NV writes on the part
+    for(int bus = 0; bus < SIM_GAUGE_COUNT; bus++)
+    {
+        sim_gauge_stats_t st;
+        sim_gauge_get_stats(bus, &st);
+        if(st.early_reads || st.bad_copies)
+        {
+            ESP_LOGE(TAG, "Gauge %d: %u NV reads during a recall, %u copies of a lost shadow", bus,
+                     st.early_reads, st.bad_copies);
+            return ESP_FAIL;
+        }
+    }
+    // The API serves the sampler's snapshots
+    if(conf->start_http && (start_sampler() != ESP_OK || start_http_server() != ESP_OK))
+    {
+        ESP_LOGE(TAG, "Failed to start HTTP server");
+        return ESP_FAIL;
+    }
+    if(conf->start_protection && protection_start(protection_default_rules, protection_default_rule_count) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start protection");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+httpd_handle_t sim_board_http(void)
+{
+    return httpd_host_default();
+}
@@ -0,0 +1,25 @@
+#ifndef SIM_BOARD_H
+#define SIM_BOARD_H
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+// Host stand-in for main.c: brings up the simulated gauges, power control and
+// the HTTP server without Wi-Fi or SPIFFS.
+
+typedef struct {
+    double speed;               // Virtual clock speed limit relative to wall time, 0 for none
+    int start_http;
+    int start_protection;       // Interlock with the default rules
+} sim_board_conf_t;
+
+// Capacities configured in main/power_control.c
+#define SIM_FLIGHT_CAP_MAH 2000
+#define SIM_PYRO_CAP_MAH 1000
+
+// Resets the gauges to their defaults without starting anything
+void sim_board_reset_gauges(void);
+esp_err_t sim_board_start(const sim_board_conf_t *conf);
+httpd_handle_t sim_board_http(void);
+
+#endif
@@ -0,0 +1,476 @@
+#include "sim_gauge.h"
+#include "host_clock.h"
+#include "driver/i2c.h"
+#include "max17330.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SIM_ADDR_RAM (MAX17330_ADDR_RAM >> 1)
+#define SIM_ADDR_NVS (MAX17330_ADDR_NVS >> 1)
+
+#define TICK_US (1000000 / configTICK_RATE_HZ)
+
+// NV shadow registers, backed by the separate nv array: Recall reloads them,
+// Copy NV Block burns a write history entry and stores them
+#define SIM_NV_FIRST 0x180
+#define SIM_NV_END 0x1F0
+#define SIM_COMMSTAT_NVERROR (1 << 2)
+
+// tRECALL: NV page registers read as 0xFFFF until a recall completes
+#define SIM_RECALL_US 5000
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint16_t regs[SIM_GAUGE_REGS];
+    uint16_t nv[SIM_NV_END - SIM_NV_FIRST];
+    sim_fault_t fault;
+    uint32_t clk;
+    uint32_t link_max_clk;
+    uint32_t link_error_ppm;
+    uint32_t rng;
+    int installed;
+    int64_t recall_until_us;
+    bool shadow_lost;           // A history recall overwrote the NV shadow
+    sim_gauge_stats_t stats;
+} sim_gauge_t;
+
+static sim_gauge_t gauges[SIM_GAUGE_COUNT] = {
+    { .lock = PTHREAD_MUTEX_INITIALIZER, .clk = 100000, .rng = 0x1234567 },
+    { .lock = PTHREAD_MUTEX_INITIALIZER, .clk = 100000, .rng = 0x7654321 },
+};
+
+static sim_gauge_t *gauge(int bus)
+{
+    return (bus >= 0 && bus < SIM_GAUGE_COUNT) ? &gauges[bus] : NULL;
+}
+
+void sim_gauge_reset(int bus, uint32_t capacity_mah)
+{
+    sim_gauge_t *g = gauge(bus);
+    pthread_mutex_lock(&g->lock);
+    memset(g->regs, 0, sizeof(g->regs));
+    g->regs[MAX17330_DEVNAME] = 0x40B0;
+    g->regs[MAX17330_HISTORY_WRITES] = 0x0101;
+    g->regs[MAX17330_nDESIGNCAP] = 2 * capacity_mah;
+    g->regs[MAX17330_FULLCAPREP] = 2 * capacity_mah;
+    g->regs[MAX17330_REPCAP] = capacity_mah;
+    g->regs[MAX17330_REPSOC] = 0x3200;
+    g->regs[MAX17330_VFSOC] = 0x3200;
+    g->regs[MAX17330_AGE] = 0x6400;
+    g->regs[MAX17330_VCELL] = 0xBE00;                 // 3.8 V
+    g->regs[MAX17330_AVGCURRENT] = (uint16_t)-640;    // -100 mA
+    g->regs[MAX17330_CURRENT] = (uint16_t)-640;
+    g->regs[MAX17330_TTE] = 0x1000;
+    g->regs[MAX17330_TTF] = 0xFFFF;
+    g->regs[MAX17330_CHARGINGVOLTAGE] = 0xD700;        // 4.2 V
+    memcpy(g->nv, &g->regs[SIM_NV_FIRST], sizeof(g->nv));
+    g->recall_until_us = 0;
+    g->shadow_lost = false;
+    pthread_mutex_unlock(&g->lock);
+}
+
+void sim_gauge_set_reg(int bus, uint16_t reg, uint16_t value)
+{
+    sim_gauge_t *g = gauge(bus);
+    if(g == NULL || reg >= SIM_GAUGE_REGS)
+    {
+        return;
+    }
+    pthread_mutex_lock(&g->lock);
+    g->regs[reg] = value;
+    // Tools set up the gauge as if it had been provisioned that way
+    if(reg >= SIM_NV_FIRST && reg < SIM_NV_END)
+    {
+        g->nv[reg - SIM_NV_FIRST] = value;
+    }
+    pthread_mutex_unlock(&g->lock);
+}
+
+uint16_t sim_gauge_get_reg(int bus, uint16_t reg)
+{
+    sim_gauge_t *g = gauge(bus);
+    if(g == NULL || reg >= SIM_GAUGE_REGS)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&g->lock);
+    uint16_t value = g->regs[reg];
+    pthread_mutex_unlock(&g->lock);
+    return value;
+}
+
+void sim_gauge_set_fault(int bus, sim_fault_t fault)
+{
+    sim_gauge_t *g = gauge(bus);
+    pthread_mutex_lock(&g->lock);
+    g->fault = fault;
+    pthread_mutex_unlock(&g->lock);
+}
+
+void sim_gauge_set_link(int bus, uint32_t max_clk, uint32_t error_ppm)
+{
+    sim_gauge_t *g = gauge(bus);
+    pthread_mutex_lock(&g->lock);
+    g->link_max_clk = max_clk;
+    g->link_error_ppm = error_ppm;
+    pthread_mutex_unlock(&g->lock);
+}
+
+void sim_gauge_get_stats(int bus, sim_gauge_stats_t *stats)
+{
+    sim_gauge_t *g = gauge(bus);
+    pthread_mutex_lock(&g->lock);
+    *stats = g->stats;
+    pthread_mutex_unlock(&g->lock);
+}
+
+// ---- Register side effects ----
+
+static void handle_write(sim_gauge_t *g, uint16_t reg, uint16_t value)
+{
+    switch(reg)
+    {
+        case MAX17330_COMMAND:
+            if(value == 0xE904)
+            {
+                // Copy NV block burns one entry of the write history
+                uint16_t hist = g->regs[MAX17330_HISTORY_WRITES];
+                if(g->shadow_lost)
+                {
+                    // Would store the history words as configuration
+                    g->stats.bad_copies++;
+                    g->regs[MAX17330_COMMSTAT] |= SIM_COMMSTAT_NVERROR;
+                    break;
+                }
+                if((hist & 0xFF) == 0xFF)
+                {
+                    g->regs[MAX17330_COMMSTAT] |= SIM_COMMSTAT_NVERROR;
+                    break;
+                }
+                uint8_t used = ((hist & 0xFF) << 1) | 1;
+                g->regs[MAX17330_HISTORY_WRITES] = (used << 8) | used;
+                memcpy(g->nv, &g->regs[SIM_NV_FIRST], sizeof(g->nv));
+            }
+            else if(value == 0xE001)
+            {
+                memcpy(&g->regs[SIM_NV_FIRST], g->nv, sizeof(g->nv));
+                g->shadow_lost = false;
+                g->recall_until_us = host_clock_now_us() + SIM_RECALL_US;
+            }
+            else if(value == 0xE29B)
+            {
+                // The history lands in the NV page; take the rest of the
+                // shadow as lost until NV is recalled again
+                memset(&g->regs[SIM_NV_FIRST], 0xFF, sizeof(g->nv));
+                g->shadow_lost = true;
+                g->recall_until_us = host_clock_now_us() + SIM_RECALL_US;
+            }
+            break;
+        case MAX17330_RESET:
+            // Configuration reset reloads NV and completes instantly
+            if(value & 0x8000)
+            {
+                memcpy(&g->regs[SIM_NV_FIRST], g->nv, sizeof(g->nv));
+                g->shadow_lost = false;
+            }
+            g->regs[reg] = value & ~0x8000;
+            break;
+        case MAX17330_COMMSTAT:
+            break;
+        default:
+            g->regs[reg] = value;
+            break;
+    }
+}
+
+// ---- Simulated I2C driver ----
+
+// Seeded per gauge so that runs with link errors are repeatable
+static bool link_error(sim_gauge_t *g)
+{
+    uint32_t ppm = g->link_error_ppm;
+    if(g->link_max_clk != 0 && g->clk > g->link_max_clk)
+    {
+        ppm = SIM_LINK_OVERCLOCK_PPM;
+    }
+    if(ppm == 0)
+    {
+        return false;
+    }
+    g->rng ^= g->rng << 13;
+    g->rng ^= g->rng >> 17;
+    g->rng ^= g->rng << 5;
+    return g->rng % 1000000 < ppm;
+}
+
+static esp_err_t bus_begin(sim_gauge_t *g, uint8_t addr, size_t bytes, TickType_t ticks_to_wait)
+{
+    if(g == NULL || !g->installed)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    g->stats.transactions++;
+    if(g->fault == SIM_FAULT_STUCK)
+    {
+        g->stats.errors++;
+        pthread_mutex_unlock(&g->lock);
+        host_clock_sleep_us((int64_t)ticks_to_wait * TICK_US);
+        pthread_mutex_lock(&g->lock);
+        return ESP_ERR_TIMEOUT;
+    }
+    if(g->fault == SIM_FAULT_NACK || (addr != SIM_ADDR_RAM && addr != SIM_ADDR_NVS) || link_error(g))
+    {
+        g->stats.errors++;
+        return ESP_FAIL;
+    }
+    // Start, address, data and stop at nine clocks per byte
+    int64_t busy_us = (int64_t)(bytes + 2) * 9 * 1000000 / g->clk;
+    g->stats.busy_us += busy_us;
+    g->stats.bytes += bytes;
+    pthread_mutex_unlock(&g->lock);
+    host_clock_sleep_us(busy_us);
+    pthread_mutex_lock(&g->lock);
+    return ESP_OK;
+}
+
+static uint16_t reg_base(uint8_t addr, uint8_t offset)
+{
+    return (addr == SIM_ADDR_NVS ? 0x100 : 0x000) | offset;
+}
+
+esp_err_t i2c_param_config(i2c_port_t i2c_num, const i2c_config_t *i2c_conf)
+{
+    sim_gauge_t *g = gauge(i2c_num);
+    if(g == NULL || i2c_conf->master.clk_speed == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&g->lock);
+    g->clk = i2c_conf->master.clk_speed;
+    pthread_mutex_unlock(&g->lock);
+    return ESP_OK;
+}
+
+esp_err_t i2c_driver_install(i2c_port_t i2c_num, i2c_mode_t mode, size_t slv_rx_buf_len,
+                             size_t slv_tx_buf_len, int intr_alloc_flags)
+{
+    (void)mode;
+    (void)slv_rx_buf_len;
+    (void)slv_tx_buf_len;
+    (void)intr_alloc_flags;
+    sim_gauge_t *g = gauge(i2c_num);
+    if(g == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&g->lock);
+    esp_err_t err = g->installed ? ESP_FAIL : ESP_OK;
+    g->installed = 1;
+    pthread_mutex_unlock(&g->lock);
+    return err;
+}
+
+esp_err_t i2c_driver_delete(i2c_port_t i2c_num)
+{
+    sim_gauge_t *g = gauge(i2c_num);
+    if(g == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&g->lock);
+    g->installed = 0;
+    // Recovery clocks free a slave that was holding SDA
+    if(g->fault == SIM_FAULT_STUCK)
+    {
+        g->fault = SIM_FAULT_NONE;
+    }
+    pthread_mutex_unlock(&g->lock);
+    return ESP_OK;
+}
+
+esp_err_t i2c_reset_tx_fifo(i2c_port_t i2c_num)
+{
+    return gauge(i2c_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t i2c_reset_rx_fifo(i2c_port_t i2c_num)
+{
+    return gauge(i2c_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t i2c_master_write_to_device(i2c_port_t i2c_num, uint8_t device_address,
+                                     const uint8_t *write_buffer, size_t write_size,
+                                     TickType_t ticks_to_wait)
+{
+    sim_gauge_t *g = gauge(i2c_num);
+    if(g == NULL || write_size < 1)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&g->lock);
+    esp_err_t err = bus_begin(g, device_address, write_size, ticks_to_wait);
+    if(err == ESP_OK)
+    {
+        g->stats.writes++;
+        uint16_t reg = reg_base(device_address, write_buffer[0]);
+        for(size_t i = 1; i + 1 < write_size && reg < SIM_GAUGE_REGS; i += 2, reg++)
+        {
+            handle_write(g, reg, write_buffer[i] | (write_buffer[i + 1] << 8));
+        }
+    }
+    pthread_mutex_unlock(&g->lock);
+    return err;
+}
+
+esp_err_t i2c_master_read_from_device(i2c_port_t i2c_num, uint8_t device_address,
+                                      uint8_t *read_buffer, size_t read_size,
+                                      TickType_t ticks_to_wait)
+{
+    // The MAX17330 always needs a register address first
+    (void)i2c_num;
+    (void)device_address;
+    (void)read_buffer;
+    (void)read_size;
+    (void)ticks_to_wait;
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t i2c_master_write_read_device(i2c_port_t i2c_num, uint8_t device_address,
+                                       const uint8_t *write_buffer, size_t write_size,
+                                       uint8_t *read_buffer, size_t read_size,
+                                       TickType_t ticks_to_wait)
+{
+    sim_gauge_t *g = gauge(i2c_num);
+    if(g == NULL || write_size != 1)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&g->lock);
+    esp_err_t err = bus_begin(g, device_address, write_size + read_size + 1, ticks_to_wait);
+    if(err == ESP_OK)
+    {
+        g->stats.reads++;
+        uint16_t reg = reg_base(device_address, write_buffer[0]);
+        bool recalling = host_clock_now_us() < g->recall_until_us;
+        if(recalling && reg >= SIM_NV_FIRST)
+        {
+            g->stats.early_reads++;
+        }
+        for(size_t i = 0; i + 1 < read_size; i += 2, reg++)
+        {
+            uint16_t value = reg < SIM_GAUGE_REGS && !(recalling && reg >= SIM_NV_FIRST) ? g->regs[reg] : 0xFFFF;
+            read_buffer[i] = value & 0xFF;
+            read_buffer[i + 1] = value >> 8;
+        }
+    }
+    pthread_mutex_unlock(&g->lock);
+    return err;
+}
+
+// ---- Trace loading and playback ----
+
+static int event_cmp(const void *a, const void *b)
+{
+    const sim_trace_event_t *ea = a, *eb = b;
+    if(ea->t_us != eb->t_us)
+    {
+        return (ea->t_us > eb->t_us) - (ea->t_us < eb->t_us);
+    }
+    // Keep file order for simultaneous events
+    return (ea->order > eb->order) - (ea->order < eb->order);
+}
+
+int sim_trace_load(sim_trace_t *trace, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if(file == NULL)
+    {
+        return -1;
+    }
+    memset(trace, 0, sizeof(*trace));
+    size_t cap = 0;
+    char line[128];
+    unsigned line_no = 0;
+    while(fgets(line, sizeof(line), file))
+    {
+        line_no++;
+        char *p = line;
+        while(*p == ' ' || *p == '\t')
+        {
+            p++;
+        }
+        if(*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+        {
+            continue;
+        }
+        char *end;
+        double t_ms = strtod(p, &end);
+        if(*end != ',')
+        {
+            fprintf(stderr, "%s:%u: malformed trace line\n", path, line_no);
+            fclose(file);
+            sim_trace_free(trace);
+            return -1;
+        }
+        long bus = strtol(end + 1, &end, 0);
+        long reg = strtol(end + 1, &end, 0);
+        long value = strtol(end + 1, &end, 0);
+        if(bus < 0 || bus >= SIM_GAUGE_COUNT || reg < 0 || reg >= SIM_GAUGE_REGS || value < 0 || value > 0xFFFF)
+        {
+            fprintf(stderr, "%s:%u: value out of range\n", path, line_no);
+            fclose(file);
+            sim_trace_free(trace);
+            return -1;
+        }
+        if(trace->count == cap)
+        {
+            cap = cap ? cap * 2 : 1024;
+            sim_trace_event_t *events = realloc(trace->events, cap * sizeof(*events));
+            if(events == NULL)
+            {
+                fclose(file);
+                sim_trace_free(trace);
+                return -1;
+            }
+            trace->events = events;
+        }
+        trace->events[trace->count] = (sim_trace_event_t) {
+            .t_us = (int64_t)(t_ms * 1000),
+            .bus = bus,
+            .reg = reg,
+            .value = value,
+            .order = trace->count,
+        };
+        trace->count++;
+    }
+    fclose(file);
+    // Traces captured from two gauges may interleave out of order
+    qsort(trace->events, trace->count, sizeof(*trace->events), event_cmp);
+    return 0;
+}
+
+void sim_trace_free(sim_trace_t *trace)
+{
+    free(trace->events);
+    memset(trace, 0, sizeof(*trace));
+}
+
+size_t sim_trace_apply(sim_trace_t *trace, int64_t t_us)
+{
+    size_t applied = 0;
+    while(trace->next < trace->count && trace->events[trace->next].t_us <= t_us)
+    {
+        const sim_trace_event_t *e = &trace->events[trace->next++];
+        sim_gauge_set_reg(e->bus, e->reg, e->value);
+        applied++;
+    }
+    return applied;
+}
+
+int64_t sim_trace_duration_us(const sim_trace_t *trace)
+{
+    return trace->count ? trace->events[trace->count - 1].t_us : 0;
+}
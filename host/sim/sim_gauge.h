@@ -0,0 +1,72 @@
+#ifndef SIM_GAUGE_H
+#define SIM_GAUGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Simulated MAX17330 fuel gauges, one per I2C port. They answer on the same
+// RAM (0x6C) and NV (0x16) addresses as the real part and serve a 0x200 word
+// register file that the tools update from recorded traces. The NV
+// configuration words live in a separate store behind the register file, so
+// recall, Copy NV Block, its write history and config resets behave as on the
+// part; sim_gauge_set_reg() sets both. Recalls take tRECALL, and a history
+// recall leaves the NV shadow unusable until NV is recalled again.
+
+#define SIM_GAUGE_COUNT 2
+#define SIM_GAUGE_REGS 0x200
+
+typedef enum {
+    SIM_FAULT_NONE = 0,
+    SIM_FAULT_NACK,     // Every transaction is NACKed immediately
+    SIM_FAULT_STUCK,    // Bus hangs until the caller's timeout expires, cleared
+                        // by a bus recovery (driver reinstall)
+} sim_fault_t;
+
+typedef struct {
+    uint32_t transactions;
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t bytes;
+    uint32_t errors;
+    int64_t busy_us;
+    uint32_t early_reads;       // NV page reads before a recall completed
+    uint32_t bad_copies;        // NV copies refused after a history recall
+} sim_gauge_stats_t;
+
+// Restores power-on register defaults for a gauge of the given capacity
+void sim_gauge_reset(int bus, uint32_t capacity_mah);
+void sim_gauge_set_reg(int bus, uint16_t reg, uint16_t value);
+uint16_t sim_gauge_get_reg(int bus, uint16_t reg);
+void sim_gauge_set_fault(int bus, sim_fault_t fault);
+void sim_gauge_get_stats(int bus, sim_gauge_stats_t *stats);
+
+// Link quality of a harness: transactions NACK at error_ppm, and at
+// SIM_LINK_OVERCLOCK_PPM when clocked above max_clk (0 for no limit)
+#define SIM_LINK_OVERCLOCK_PPM 250000
+void sim_gauge_set_link(int bus, uint32_t max_clk, uint32_t error_ppm);
+
+// ---- Recorded register traces ----
+
+typedef struct {
+    int64_t t_us;
+    uint8_t bus;
+    uint16_t reg;
+    uint16_t value;
+    uint32_t order;
+} sim_trace_event_t;
+
+typedef struct {
+    sim_trace_event_t *events;
+    size_t count;
+    size_t next;
+} sim_trace_t;
+
+// Loads a "time_ms,bus,reg,value" CSV trace, '#' starts a comment
+int sim_trace_load(sim_trace_t *trace, const char *path);
+void sim_trace_free(sim_trace_t *trace);
+
+// Applies every event up to and including t_us, returns how many were applied
+size_t sim_trace_apply(sim_trace_t *trace, int64_t t_us);
+int64_t sim_trace_duration_us(const sim_trace_t *trace);
+
+#endif
@@ -0,0 +1,1096 @@
+// Ground-station aggregator. Follows the /status long-poll of several boards
+// at once from a single poll() loop, with one non-blocking connection per
+// board, and merges the feeds into one time-aligned view.
+//
+//   pb_aggregator [-l port] [-i interval_ms] [-S stale_ms] [-d seconds] [-q] board ...
+//
+// A board is host[:port][@iface][=name]. Every board answers on
+// 192.168.4.1 on its own access point, so each needs its own Wi-Fi
+// interface, selected with @iface (SO_BINDTODEVICE, needs CAP_NET_RAW).
+// Simulated boards from pb_simboard are reached as localhost:<port>.
+//
+// Every interval the latest snapshot of each board is sampled into a row of
+// the timeline, together with its age. The merged view is served on -l:
+//
+//   GET /boards                per-board state, freshness and loss stats, clock
+//                              offset, stage latencies and the latest /status body
+//   GET /timeline?since=<row>  rows after <row>, one cell per board
+//
+// Each board's clock is related to ours by a GET /time between long-polls
+// every AGG_CLOCK_SYNC_MS, keeping the fastest of the last few exchanges. With
+// that, the stage stamps of each new snapshot split its way from the gauge
+// read to our socket into per-stage latencies, and the data age says how old
+// the newest values are, clock error and gauge conversion period included.
+//
+// A summary is printed every few seconds unless -q. With -d the aggregator
+// stops after that many seconds and exits non-zero if any board never
+// delivered a snapshot.
+
+#define _GNU_SOURCE     // memmem, accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "cJSON.h"
+
+#define AGG_MAX_BOARDS 16
+#define AGG_MAX_CLIENTS 8
+#define AGG_HISTORY 600             // Timeline rows kept, ten minutes at 1 s
+#define AGG_RESPONSE_MAX 16384
+#define AGG_REQUEST_MAX 1024
+
+#define AGG_CONNECT_TIMEOUT_MS 3000
+#define AGG_RESPONSE_TIMEOUT_MS 30000   // The board answers a long-poll within 20 s
+#define AGG_RETRY_MIN_MS 500
+#define AGG_RETRY_MAX_MS 10000
+#define AGG_SUMMARY_MS 5000
+
+#define AGG_CLOCK_SYNC_MS 10000
+#define AGG_CLOCK_SAMPLES 8         // Exchanges the offset is picked from
+#define AGG_LATENCY_WINDOW 256      // Snapshots behind the latency percentiles
+
+typedef enum {
+    BOARD_IDLE = 0,             // Waiting to reconnect
+    BOARD_CONNECTING,
+    BOARD_SENDING,
+    BOARD_RECEIVING,
+} board_state_t;
+
+// Stages of a snapshot's way to us, in the order they happen
+typedef enum {
+    STAGE_GAUGE = 0,            // Gauge read transaction, slower battery
+    STAGE_PUBLISH,              // End of the last read to the snapshot's publication
+    STAGE_JSON,                 // Publication to serialization
+    STAGE_SEND,                 // Serialization to the answer leaving the board
+    STAGE_NETWORK,              // Leaving the board to its first byte here
+    STAGE_TOTAL,                // Start of the first read to its first byte here
+    STAGE_COUNT,
+} stage_t;
+
+static const char *const stage_names[STAGE_COUNT] = {
+    "gauge", "publish", "json", "send", "network", "total",
+};
+
+typedef struct {
+    int64_t values[AGG_LATENCY_WINDOW];
+    uint32_t count;             // Ever added
+} latency_t;
+
+typedef struct {
+    int64_t offset_us;          // Board clock minus ours
+    int64_t rtt_us;
+} clock_sample_t;
+
+typedef struct {
+    clock_sample_t samples[AGG_CLOCK_SAMPLES];
+    uint32_t count;
+    int64_t offset_us;          // From the fastest exchange kept
+    int64_t err_us;             // Half its round trip
+    int64_t adc_us;             // Conversion period the board reports
+    int64_t next_ms;            // Next exchange due
+} board_clock_t;
+
+typedef struct {
+    char name[32];
+    char spec[96];
+    char iface[16];
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    int fd;
+    board_state_t state;
+    int64_t deadline_ms;        // Connect or response timeout, or the next retry
+    int retry_ms;
+    char out[192];
+    size_t out_len;
+    size_t out_sent;
+    char in[AGG_RESPONSE_MAX];
+    size_t in_len;
+    bool timing;                // The request in flight is a /time exchange
+    int64_t sent_us;            // Request fully written
+    int64_t first_us;           // First byte of the answer
+
+    cJSON *status;              // Latest /status body
+    bool have_seq;
+    uint32_t seq;
+    int64_t heard_ms;           // Last answer of any kind
+    int64_t updated_ms;         // Last new snapshot
+
+    uint32_t updates;
+    uint32_t lost;              // Snapshots the board published but we never saw
+    uint32_t unchanged;         // Long-polls that timed out with 304
+    uint32_t restarts;          // Sequence went backwards
+    uint32_t connects;
+    uint32_t errors;
+    uint32_t timeouts;
+    int64_t max_gap_ms;         // Longest silence between answers
+
+    board_clock_t clock;
+    latency_t stages[STAGE_COUNT];
+    int64_t checked_us;         // Board time the sampler last confirmed the snapshot, 0 if unknown
+} board_t;
+
+typedef struct {
+    bool valid;                 // Had a snapshot at sampling time
+    bool connected;
+    bool armed;
+    uint32_t seq;
+    int32_t age_ms;
+    float voltage[2];
+    float soc[2];
+} cell_t;
+
+typedef struct {
+    uint32_t index;
+    int64_t t_ms;               // Unix time
+    cell_t cells[AGG_MAX_BOARDS];
+} row_t;
+
+typedef struct {
+    int fd;                     // -1 for a free slot
+    char in[AGG_REQUEST_MAX];
+    size_t in_len;
+    char *out;
+    size_t out_len;
+    size_t out_sent;
+} client_t;
+
+static board_t boards[AGG_MAX_BOARDS];
+static int board_count;
+static client_t clients[AGG_MAX_CLIENTS];
+static int listen_fd = -1;
+static row_t rows[AGG_HISTORY];
+static uint32_t row_count;
+static int interval_ms = 1000;
+static int stale_ms = AGG_RESPONSE_TIMEOUT_MS;
+static volatile sig_atomic_t stopping;
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t unix_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+// ---- Board connections ----
+
+static int board_parse(board_t *b, const char *spec)
+{
+    char host[96] = "";
+    char port[8] = "80";
+    snprintf(b->spec, sizeof(b->spec), "%s", spec);
+
+    char buf[96];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    char *name = strchr(buf, '=');
+    if(name != NULL)
+    {
+        *name++ = '\0';
+    }
+    char *iface = strchr(buf, '@');
+    if(iface != NULL)
+    {
+        *iface++ = '\0';
+        snprintf(b->iface, sizeof(b->iface), "%s", iface);
+    }
+    char *colon = strchr(buf, ':');
+    if(colon != NULL)
+    {
+        *colon++ = '\0';
+        snprintf(port, sizeof(port), "%s", colon);
+    }
+    snprintf(host, sizeof(host), "%s", buf);
+    snprintf(b->name, sizeof(b->name), "%s", name ? name : spec);
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res;
+    if(getaddrinfo(host, port, &hints, &res) != 0)
+    {
+        return -1;
+    }
+    memcpy(&b->addr, res->ai_addr, res->ai_addrlen);
+    b->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    b->fd = -1;
+    b->retry_ms = AGG_RETRY_MIN_MS;
+    return 0;
+}
+
+static void board_close(board_t *b)
+{
+    if(b->fd >= 0)
+    {
+        close(b->fd);
+        b->fd = -1;
+    }
+}
+
+// Drops the connection and retries later, backing off while the board stays away
+static void board_fail(board_t *b, int64_t now, bool timeout)
+{
+    board_close(b);
+    if(timeout)
+    {
+        b->timeouts++;
+    }
+    else
+    {
+        b->errors++;
+    }
+    b->state = BOARD_IDLE;
+    b->deadline_ms = now + b->retry_ms;
+    b->retry_ms = b->retry_ms * 2 < AGG_RETRY_MAX_MS ? b->retry_ms * 2 : AGG_RETRY_MAX_MS;
+}
+
+static void board_request(board_t *b, int64_t now)
+{
+    b->timing = now >= b->clock.next_ms;
+    if(b->timing)
+    {
+        b->out_len = snprintf(b->out, sizeof(b->out), "GET /time HTTP/1.1\r\nHost: board\r\n\r\n");
+    }
+    else if(b->have_seq)
+    {
+        b->out_len = snprintf(b->out, sizeof(b->out), "GET /status?since=%u HTTP/1.1\r\nHost: board\r\n\r\n", b->seq);
+    }
+    else
+    {
+        b->out_len = snprintf(b->out, sizeof(b->out), "GET /status HTTP/1.1\r\nHost: board\r\n\r\n");
+    }
+    b->out_sent = 0;
+    b->in_len = 0;
+    b->state = BOARD_SENDING;
+    b->deadline_ms = now + AGG_RESPONSE_TIMEOUT_MS;
+}
+
+static void board_connect(board_t *b, int64_t now)
+{
+    b->fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(b->fd < 0)
+    {
+        board_fail(b, now, false);
+        return;
+    }
+    if(b->iface[0] != '\0' && setsockopt(b->fd, SOL_SOCKET, SO_BINDTODEVICE, b->iface, strlen(b->iface)) != 0)
+    {
+        fprintf(stderr, "%s: cannot bind to %s: %s\n", b->name, b->iface, strerror(errno));
+        board_fail(b, now, false);
+        return;
+    }
+    if(connect(b->fd, (struct sockaddr *)&b->addr, b->addr_len) != 0 && errno != EINPROGRESS)
+    {
+        board_fail(b, now, false);
+        return;
+    }
+    b->state = BOARD_CONNECTING;
+    b->deadline_ms = now + AGG_CONNECT_TIMEOUT_MS;
+}
+
+static void board_take_snapshot(board_t *b, cJSON *status, int64_t now)
+{
+    cJSON *seq_item = cJSON_GetObjectItem(status, "seq");
+    uint32_t seq = cJSON_IsNumber(seq_item) ? (uint32_t)seq_item->valuedouble : 0;
+    if(b->have_seq)
+    {
+        if(seq < b->seq)
+        {
+            b->restarts++;
+        }
+        else if(seq > b->seq + 1)
+        {
+            b->lost += seq - b->seq - 1;
+        }
+    }
+    b->have_seq = true;
+    b->seq = seq;
+    b->updates++;
+    b->updated_ms = now;
+    cJSON_Delete(b->status);
+    b->status = status;
+}
+
+// ---- Latency tracing ----
+
+static void latency_add(latency_t *l, int64_t us)
+{
+    l->values[l->count % AGG_LATENCY_WINDOW] = us;
+    l->count++;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile over the window, -1 while empty
+static int64_t latency_pct(const latency_t *l, double pct)
+{
+    size_t n = l->count < AGG_LATENCY_WINDOW ? l->count : AGG_LATENCY_WINDOW;
+    if(n == 0)
+    {
+        return -1;
+    }
+    int64_t sorted[AGG_LATENCY_WINDOW];
+    memcpy(sorted, l->values, n * sizeof(sorted[0]));
+    qsort(sorted, n, sizeof(sorted[0]), cmp_int64);
+    size_t rank = (size_t)(pct / 100.0 * n + 0.999999);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static bool board_synced(const board_t *b)
+{
+    return b->clock.count > 0;
+}
+
+// One exchange: the board's time fell somewhere between sending the request
+// and the first byte of the answer, so the midpoint is off by at most half
+// the round trip. The fastest recent exchange gives the tightest bound.
+static void board_clock_sample(board_t *b, cJSON *body, int64_t now)
+{
+    cJSON *us = cJSON_GetObjectItem(body, "us");
+    cJSON *adc = cJSON_GetObjectItem(body, "adc_us");
+    b->clock.next_ms = now + AGG_CLOCK_SYNC_MS;
+    if(!cJSON_IsNumber(us))
+    {
+        return;
+    }
+    board_clock_t *c = &b->clock;
+    c->adc_us = cJSON_IsNumber(adc) ? (int64_t)adc->valuedouble : 0;
+    clock_sample_t *sample = &c->samples[c->count % AGG_CLOCK_SAMPLES];
+    sample->rtt_us = b->first_us - b->sent_us;
+    sample->offset_us = (int64_t)us->valuedouble - (b->sent_us + b->first_us) / 2;
+    c->count++;
+    const clock_sample_t *best = sample;
+    for(uint32_t i = 0; i < c->count && i < AGG_CLOCK_SAMPLES; i++)
+    {
+        best = c->samples[i].rtt_us < best->rtt_us ? &c->samples[i] : best;
+    }
+    c->offset_us = best->offset_us;
+    c->err_us = best->rtt_us / 2;
+}
+
+static int64_t json_int(cJSON *obj, const char *key)
+{
+    cJSON *item = cJSON_GetObjectItem(obj, key);
+    return cJSON_IsNumber(item) ? (int64_t)item->valuedouble : 0;
+}
+
+static int64_t json_index_int(cJSON *array, int index)
+{
+    cJSON *item = cJSON_GetArrayItem(array, index);
+    return cJSON_IsNumber(item) ? (int64_t)item->valuedouble : 0;
+}
+
+// Splits a new snapshot's way here into stages from its stamps. Stages on
+// the board need no clock sync; the network and total need the offset.
+static void board_trace(board_t *b, cJSON *status, int64_t board_sent_us)
+{
+    cJSON *t = cJSON_GetObjectItem(status, "t");
+    cJSON *read = cJSON_GetObjectItem(t, "read");
+    cJSON *read_end = cJSON_GetObjectItem(t, "read_end");
+    int64_t publish = json_int(t, "publish");
+    int64_t json = json_int(t, "json");
+    if(publish == 0 || json == 0 || board_sent_us == 0)
+    {
+        return;     // Firmware without stamps, or nothing read yet
+    }
+    int64_t first_read = INT64_MAX, last_read_end = 0, gauge = 0;
+    for(int k = 0; k < 2; k++)
+    {
+        int64_t start = json_index_int(read, k);
+        int64_t end = json_index_int(read_end, k);
+        if(start == 0)
+        {
+            continue;   // This gauge never answered
+        }
+        first_read = start < first_read ? start : first_read;
+        last_read_end = end > last_read_end ? end : last_read_end;
+        gauge = end - start > gauge ? end - start : gauge;
+    }
+    if(last_read_end == 0)
+    {
+        return;
+    }
+    latency_add(&b->stages[STAGE_GAUGE], gauge);
+    latency_add(&b->stages[STAGE_PUBLISH], publish - last_read_end);
+    latency_add(&b->stages[STAGE_JSON], json - publish);
+    latency_add(&b->stages[STAGE_SEND], board_sent_us - json);
+    if(board_synced(b))
+    {
+        int64_t arrival = b->first_us + b->clock.offset_us;
+        latency_add(&b->stages[STAGE_NETWORK], arrival - board_sent_us);
+        latency_add(&b->stages[STAGE_TOTAL], arrival - first_read);
+    }
+}
+
+// Upper bound on how old the newest values are now: since the sampler last
+// confirmed them, plus the gauge's conversion period and the clock error.
+// -1 until both a snapshot and a clock exchange are in.
+static int64_t board_data_age_us(const board_t *b, int64_t now)
+{
+    if(!board_synced(b) || b->checked_us == 0)
+    {
+        return -1;
+    }
+    return now + b->clock.offset_us - b->checked_us + b->clock.adc_us + b->clock.err_us;
+}
+
+// Returns the header's value in the response head, or NULL
+static const char *http_header(const char *head, const char *field)
+{
+    size_t len = strlen(field);
+    for(const char *line = strstr(head, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n"))
+    {
+        if(strncasecmp(line + 2, field, len) == 0 && line[2 + len] == ':')
+        {
+            return line + 3 + len;
+        }
+    }
+    return NULL;
+}
+
+// Handles a complete response once it is in; returns false while more is due
+static bool board_response(board_t *b, int64_t now)
+{
+    char *head_end = memmem(b->in, b->in_len, "\r\n\r\n", 4);
+    if(head_end == NULL)
+    {
+        if(b->in_len == sizeof(b->in))
+        {
+            board_fail(b, now, false);
+            return true;
+        }
+        return false;
+    }
+    *head_end = '\0';
+    size_t head_len = head_end - b->in + 4;
+    const char *length = http_header(b->in, "Content-Length");
+    size_t content_len = length ? strtoul(length, NULL, 10) : 0;
+    if(head_len + content_len >= sizeof(b->in))
+    {
+        board_fail(b, now, false);
+        return true;
+    }
+    if(b->in_len < head_len + content_len)
+    {
+        *head_end = '\r';
+        return false;
+    }
+
+    int code = 0;
+    sscanf(b->in, "HTTP/%*s %d", &code);
+    const char *connection = http_header(b->in, "Connection");
+    bool keep_alive = connection == NULL || strncasecmp(connection, " close", 6) != 0;
+    b->in[head_len + content_len] = '\0';
+
+    if(b->heard_ms != 0 && now - b->heard_ms > b->max_gap_ms)
+    {
+        b->max_gap_ms = now - b->heard_ms;
+    }
+    const char *board_sent = http_header(b->in, "X-Board-Us");
+    const char *checked = http_header(b->in, "X-Checked-Us");
+    if(checked != NULL)
+    {
+        b->checked_us = strtoll(checked, NULL, 10);
+    }
+    if(code == 200 && b->timing)
+    {
+        cJSON *body = cJSON_Parse(b->in + head_len);
+        board_clock_sample(b, body, now);
+        cJSON_Delete(body);
+    }
+    else if(code == 404 && b->timing)
+    {
+        // Firmware without /time; stay with long-polls
+        b->clock.next_ms = INT64_MAX;
+    }
+    else if(code == 200)
+    {
+        cJSON *status = cJSON_Parse(b->in + head_len);
+        if(status == NULL)
+        {
+            board_fail(b, now, false);
+            return true;
+        }
+        board_trace(b, status, board_sent ? strtoll(board_sent, NULL, 10) : 0);
+        board_take_snapshot(b, status, now);
+    }
+    else if(code == 304)
+    {
+        b->unchanged++;
+    }
+    else
+    {
+        board_fail(b, now, false);
+        return true;
+    }
+    b->heard_ms = now;
+    b->retry_ms = AGG_RETRY_MIN_MS;
+
+    if(keep_alive)
+    {
+        board_request(b, now);
+    }
+    else
+    {
+        board_close(b);
+        board_connect(b, now);
+    }
+    return true;
+}
+
+static void board_event(board_t *b, short revents, int64_t now)
+{
+    if(b->state == BOARD_CONNECTING && (revents & (POLLOUT | POLLERR | POLLHUP)))
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(b->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if(err != 0)
+        {
+            board_fail(b, now, false);
+            return;
+        }
+        b->connects++;
+        board_request(b, now);
+    }
+    if(b->state == BOARD_SENDING && (revents & (POLLOUT | POLLERR | POLLHUP)))
+    {
+        ssize_t n = send(b->fd, b->out + b->out_sent, b->out_len - b->out_sent, MSG_NOSIGNAL);
+        if(n < 0 && errno != EAGAIN)
+        {
+            board_fail(b, now, false);
+            return;
+        }
+        b->out_sent += n > 0 ? n : 0;
+        if(b->out_sent == b->out_len)
+        {
+            b->state = BOARD_RECEIVING;
+            b->sent_us = now_us();
+        }
+        return;
+    }
+    if(b->state == BOARD_RECEIVING && (revents & (POLLIN | POLLERR | POLLHUP)))
+    {
+        ssize_t n = recv(b->fd, b->in + b->in_len, sizeof(b->in) - b->in_len, 0);
+        if(n < 0 && errno == EAGAIN)
+        {
+            return;
+        }
+        if(n <= 0)
+        {
+            // Closed before the response was complete
+            board_fail(b, now, false);
+            return;
+        }
+        if(b->in_len == 0)
+        {
+            b->first_us = now_us();
+        }
+        b->in_len += n;
+        board_response(b, now);
+    }
+}
+
+static void board_timers(board_t *b, int64_t now)
+{
+    if(now < b->deadline_ms)
+    {
+        return;
+    }
+    if(b->state == BOARD_IDLE)
+    {
+        board_connect(b, now);
+    }
+    else
+    {
+        board_fail(b, now, true);
+    }
+}
+
+static int32_t board_age_ms(const board_t *b, int64_t now)
+{
+    return b->heard_ms ? (int32_t)(now - b->heard_ms) : -1;
+}
+
+static bool board_fresh(const board_t *b, int64_t now)
+{
+    return b->heard_ms != 0 && now - b->heard_ms <= stale_ms;
+}
+
+// ---- Timeline ----
+
+static void sample_row(int64_t now)
+{
+    row_t *row = &rows[row_count % AGG_HISTORY];
+    row->index = row_count++;
+    row->t_ms = unix_ms();
+    for(int i = 0; i < board_count; i++)
+    {
+        board_t *b = &boards[i];
+        cell_t *cell = &row->cells[i];
+        memset(cell, 0, sizeof(*cell));
+        cell->connected = b->state == BOARD_SENDING || b->state == BOARD_RECEIVING;
+        if(b->status == NULL)
+        {
+            continue;
+        }
+        cell->valid = true;
+        cell->seq = b->seq;
+        cell->age_ms = board_age_ms(b, now);
+        cell->armed = cJSON_IsTrue(cJSON_GetObjectItem(b->status, "armed"));
+        cJSON *battery = cJSON_GetObjectItem(b->status, "battery");
+        for(int k = 0; k < 2; k++)
+        {
+            cJSON *obj = cJSON_GetArrayItem(battery, k);
+            cJSON *voltage = cJSON_GetObjectItem(obj, "voltage");
+            cJSON *soc = cJSON_GetObjectItem(obj, "soc");
+            cell->voltage[k] = cJSON_IsNumber(voltage) ? voltage->valuedouble : 0;
+            cell->soc[k] = cJSON_IsNumber(soc) ? soc->valuedouble : 0;
+        }
+    }
+}
+
+// ---- API ----
+
+static char *boards_json(int64_t now)
+{
+    cJSON *root = cJSON_CreateArray();
+    for(int i = 0; i < board_count; i++)
+    {
+        board_t *b = &boards[i];
+        cJSON *obj = cJSON_CreateObject();
+        cJSON_AddStringToObject(obj, "name", b->name);
+        cJSON_AddStringToObject(obj, "address", b->spec);
+        cJSON_AddBoolToObject(obj, "connected", b->state == BOARD_SENDING || b->state == BOARD_RECEIVING);
+        cJSON_AddBoolToObject(obj, "fresh", board_fresh(b, now));          // Heard from within stale_ms
+        cJSON_AddNumberToObject(obj, "age_ms", board_age_ms(b, now));       // Since the last answer, -1 if never
+        cJSON_AddNumberToObject(obj, "seq", b->seq);
+        cJSON_AddNumberToObject(obj, "updates", b->updates);
+        cJSON_AddNumberToObject(obj, "lost", b->lost);                      // Snapshots skipped over
+        cJSON_AddNumberToObject(obj, "loss", b->updates + b->lost ? (double)b->lost / (b->updates + b->lost) : 0);
+        cJSON_AddNumberToObject(obj, "unchanged", b->unchanged);
+        cJSON_AddNumberToObject(obj, "restarts", b->restarts);
+        cJSON_AddNumberToObject(obj, "connects", b->connects);
+        cJSON_AddNumberToObject(obj, "errors", b->errors);
+        cJSON_AddNumberToObject(obj, "timeouts", b->timeouts);
+        cJSON_AddNumberToObject(obj, "max_gap_ms", b->max_gap_ms);
+        int64_t data_age = board_data_age_us(b, now_us());
+        cJSON_AddNumberToObject(obj, "data_age_ms", data_age < 0 ? -1 : data_age / 1000.0);   // Bound, -1 if unknown
+        if(board_synced(b))
+        {
+            cJSON *clock = cJSON_CreateObject();
+            cJSON_AddItemToObject(obj, "clock", clock);
+            cJSON_AddNumberToObject(clock, "offset_us", b->clock.offset_us);  // Board minus ours
+            cJSON_AddNumberToObject(clock, "err_us", b->clock.err_us);
+            cJSON_AddNumberToObject(clock, "adc_us", b->clock.adc_us);
+        }
+        cJSON *latency = cJSON_CreateObject();                                 // Per stage, ms
+        cJSON_AddItemToObject(obj, "latency", latency);
+        for(int k = 0; k < STAGE_COUNT; k++)
+        {
+            const latency_t *l = &b->stages[k];
+            if(l->count == 0)
+            {
+                continue;
+            }
+            cJSON *stage = cJSON_CreateObject();
+            cJSON_AddItemToObject(latency, stage_names[k], stage);
+            cJSON_AddNumberToObject(stage, "p50", latency_pct(l, 50) / 1000.0);
+            cJSON_AddNumberToObject(stage, "p99", latency_pct(l, 99) / 1000.0);
+            cJSON_AddNumberToObject(stage, "max", latency_pct(l, 100) / 1000.0);
+        }
+        if(b->status != NULL)
+        {
+            cJSON_AddItemToObject(obj, "status", cJSON_Duplicate(b->status, 1));
+        }
+        cJSON_AddItemToArray(root, obj);
+    }
+    char *json = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return json;
+}
+
+static char *timeline_json(const char *uri)
+{
+    const char *since_str = strstr(uri, "since=");
+    long long since = since_str ? atoll(since_str + 6) : -1;
+    uint32_t first = row_count > AGG_HISTORY ? row_count - AGG_HISTORY : 0;
+    if(since + 1 > (long long)first)
+    {
+        first = since + 1 < (long long)row_count ? (uint32_t)(since + 1) : row_count;
+    }
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "interval_ms", interval_ms);
+    cJSON *names = cJSON_CreateArray();
+    cJSON_AddItemToObject(root, "boards", names);
+    for(int i = 0; i < board_count; i++)
+    {
+        cJSON_AddItemToArray(names, cJSON_CreateString(boards[i].name));
+    }
+    cJSON *row_array = cJSON_CreateArray();
+    cJSON_AddItemToObject(root, "rows", row_array);
+    for(uint32_t r = first; r < row_count; r++)
+    {
+        const row_t *row = &rows[r % AGG_HISTORY];
+        cJSON *obj = cJSON_CreateObject();
+        cJSON_AddNumberToObject(obj, "row", row->index);
+        cJSON_AddNumberToObject(obj, "t_ms", row->t_ms);                    // Unix time of sampling
+        cJSON *cells = cJSON_CreateArray();
+        cJSON_AddItemToObject(obj, "cells", cells);
+        for(int i = 0; i < board_count; i++)
+        {
+            const cell_t *cell = &row->cells[i];
+            if(!cell->valid)
+            {
+                cJSON_AddItemToArray(cells, cJSON_CreateNull());
+                continue;
+            }
+            cJSON *c = cJSON_CreateObject();
+            cJSON_AddNumberToObject(c, "seq", cell->seq);
+            cJSON_AddNumberToObject(c, "age_ms", cell->age_ms);
+            cJSON_AddBoolToObject(c, "connected", cell->connected);
+            cJSON_AddBoolToObject(c, "armed", cell->armed);
+            cJSON *voltage = cJSON_CreateFloatArray(cell->voltage, 2);           // Flight, pyro (V)
+            cJSON_AddItemToObject(c, "voltage", voltage);
+            cJSON *soc = cJSON_CreateFloatArray(cell->soc, 2);
+            cJSON_AddItemToObject(c, "soc", soc);
+            cJSON_AddItemToArray(cells, c);
+        }
+        cJSON_AddItemToArray(row_array, obj);
+    }
+    char *json = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return json;
+}
+
+static void client_close(client_t *c)
+{
+    close(c->fd);
+    free(c->out);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+static void client_respond(client_t *c, int64_t now)
+{
+    char method[8] = "", uri[256] = "";
+    sscanf(c->in, "%7s %255s", method, uri);
+    char *body = NULL;
+    const char *status = "200 OK";
+    if(strcmp(method, "GET") != 0)
+    {
+        status = "405 Method Not Allowed";
+    }
+    else if(strcmp(uri, "/boards") == 0)
+    {
+        body = boards_json(now);
+    }
+    else if(strncmp(uri, "/timeline", 9) == 0 && (uri[9] == '\0' || uri[9] == '?'))
+    {
+        body = timeline_json(uri);
+    }
+    else
+    {
+        status = "404 Not Found";
+    }
+    size_t body_len = body ? strlen(body) : 0;
+    c->out = malloc(body_len + 256);
+    if(c->out == NULL)
+    {
+        free(body);
+        client_close(c);
+        return;
+    }
+    c->out_len = sprintf(c->out, "HTTP/1.1 %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n"
+                                 "Access-Control-Allow-Origin: *\r\nConnection: close\r\n\r\n", status, body_len);
+    memcpy(c->out + c->out_len, body ? body : "", body_len);
+    c->out_len += body_len;
+    c->out_sent = 0;
+    free(body);
+}
+
+static void client_event(client_t *c, short revents, int64_t now)
+{
+    if(c->out == NULL && (revents & POLLIN))
+    {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len, 0);
+        if(n <= 0)
+        {
+            client_close(c);
+            return;
+        }
+        c->in_len += n;
+        c->in[c->in_len] = '\0';
+        if(strstr(c->in, "\r\n\r\n") != NULL || c->in_len == sizeof(c->in) - 1)
+        {
+            client_respond(c, now);
+        }
+        return;
+    }
+    if(c->out != NULL && (revents & (POLLOUT | POLLERR | POLLHUP)))
+    {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if(n < 0 && errno == EAGAIN)
+        {
+            return;
+        }
+        if(n <= 0 || (c->out_sent += n) == c->out_len)
+        {
+            client_close(c);
+        }
+    }
+}
+
+static void accept_clients(void)
+{
+    int fd;
+    while((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+    {
+        client_t *slot = NULL;
+        for(int i = 0; i < AGG_MAX_CLIENTS && slot == NULL; i++)
+        {
+            slot = clients[i].fd < 0 ? &clients[i] : NULL;
+        }
+        if(slot == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        slot->fd = fd;
+    }
+}
+
+static int open_listener(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if(fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, AGG_MAX_CLIENTS) != 0)
+    {
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// ---- Summary ----
+
+static const char *state_name(const board_t *b)
+{
+    switch(b->state)
+    {
+        case BOARD_IDLE: return "retry";
+        case BOARD_CONNECTING: return "connect";
+        default: return "up";
+    }
+}
+
+static void print_summary(int64_t now)
+{
+    printf("%-16s %-7s %8s %8s %8s %6s %7s %8s %6s %6s %9s %9s %9s\n", "board", "state", "seq", "age ms", "updates",
+           "lost", "loss", "connects", "errors", "tmo", "max gap", "data age", "p99 total");
+    for(int i = 0; i < board_count; i++)
+    {
+        board_t *b = &boards[i];
+        int64_t data_age = board_data_age_us(b, now_us());
+        printf("%-16s %-7s %8u %8d %8u %6u %6.2f%% %8u %6u %6u %9lld %9lld %9lld\n", b->name, state_name(b), b->seq,
+               board_age_ms(b, now), b->updates, b->lost,
+               b->updates + b->lost ? 100.0 * b->lost / (b->updates + b->lost) : 0.0, b->connects, b->errors,
+               b->timeouts, (long long)b->max_gap_ms, (long long)(data_age < 0 ? -1 : data_age / 1000),
+               (long long)latency_pct(&b->stages[STAGE_TOTAL], 99) / 1000);
+    }
+    fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-l port] [-i interval_ms] [-S stale_ms] [-d seconds] [-q] "
+                    "host[:port][@iface][=name] ...\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    int port = 8090;
+    int64_t duration_ms = 0;
+    bool quiet = false;
+    int opt;
+    while((opt = getopt(argc, argv, "l:i:S:d:q")) != -1)
+    {
+        switch(opt)
+        {
+            case 'l': port = atoi(optarg); break;
+            case 'i': interval_ms = atoi(optarg); break;
+            case 'S': stale_ms = atoi(optarg); break;
+            case 'd': duration_ms = atoll(optarg) * 1000; break;
+            case 'q': quiet = true; break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if(optind == argc || argc - optind > AGG_MAX_BOARDS || interval_ms <= 0)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    for(int i = optind; i < argc; i++)
+    {
+        if(board_parse(&boards[board_count], argv[i]) != 0)
+        {
+            fprintf(stderr, "cannot resolve %s\n", argv[i]);
+            return 2;
+        }
+        board_count++;
+    }
+    for(int i = 0; i < AGG_MAX_CLIENTS; i++)
+    {
+        clients[i].fd = -1;
+    }
+    if(port != 0 && (listen_fd = open_listener(port)) < 0)
+    {
+        fprintf(stderr, "cannot listen on port %d\n", port);
+        return 2;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    int64_t start = now_ms();
+    int64_t next_row = start + interval_ms;
+    int64_t next_summary = start + AGG_SUMMARY_MS;
+    for(int i = 0; i < board_count; i++)
+    {
+        board_connect(&boards[i], start);
+    }
+
+    struct pollfd fds[AGG_MAX_BOARDS + AGG_MAX_CLIENTS + 1];
+    while(!stopping && (duration_ms == 0 || now_ms() - start < duration_ms))
+    {
+        // One descriptor per board and client, plus the listener
+        int n = 0;
+        int64_t now = now_ms();
+        int64_t wake = next_row < next_summary ? next_row : next_summary;
+        for(int i = 0; i < board_count; i++)
+        {
+            board_t *b = &boards[i];
+            wake = b->deadline_ms < wake ? b->deadline_ms : wake;
+            fds[n].fd = b->fd;
+            fds[n].events = b->state == BOARD_RECEIVING ? POLLIN : POLLOUT;
+            fds[n].revents = 0;
+            if(b->state == BOARD_IDLE)
+            {
+                fds[n].fd = -1;
+            }
+            n++;
+        }
+        for(int i = 0; i < AGG_MAX_CLIENTS; i++)
+        {
+            fds[n].fd = clients[i].fd;
+            fds[n].events = clients[i].out ? POLLOUT : POLLIN;
+            fds[n].revents = 0;
+            n++;
+        }
+        fds[n].fd = listen_fd;
+        fds[n].events = POLLIN;
+        fds[n].revents = 0;
+        n++;
+
+        int timeout = wake > now ? (int)(wake - now) : 0;
+        if(poll(fds, n, timeout) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            return 1;
+        }
+
+        now = now_ms();
+        for(int i = 0; i < board_count; i++)
+        {
+            if(fds[i].revents)
+            {
+                board_event(&boards[i], fds[i].revents, now);
+            }
+            board_timers(&boards[i], now);
+        }
+        for(int i = 0; i < AGG_MAX_CLIENTS; i++)
+        {
+            if(fds[board_count + i].revents && clients[i].fd >= 0)
+            {
+                client_event(&clients[i], fds[board_count + i].revents, now);
+            }
+        }
+        if(fds[n - 1].revents & POLLIN)
+        {
+            accept_clients();
+        }
+        while(now >= next_row)
+        {
+            sample_row(now);
+            next_row += interval_ms;
+        }
+        if(now >= next_summary)
+        {
+            if(!quiet)
+            {
+                print_summary(now);
+            }
+            next_summary += AGG_SUMMARY_MS;
+        }
+    }
+
+    print_summary(now_ms());
+    int ret = 0;
+    for(int i = 0; i < board_count; i++)
+    {
+        if(boards[i].updates == 0)
+        {
+            ret = 1;
+        }
+        board_close(&boards[i]);
+        cJSON_Delete(boards[i].status);
+    }
+    return ret;
+}
@@ -0,0 +1,75 @@
+// Decodes a deferred log stream, such as the body of GET /log, into text
+// using the same format table as the firmware.
+//
+//   curl -s http://192.168.4.1/log > board.dlog
+//   pb_dlog board.dlog
+//
+// Reads stdin when no file is given. Lines follow the ESP_LOG layout:
+// level letter, timestamp in ms, tag and message.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dlog.h"
+
+#define STREAM_MAX (1 << 20)
+
+int main(int argc, char **argv)
+{
+    FILE *in = argc > 1 ? fopen(argv[1], "rb") : stdin;
+    if(in == NULL || argc > 2)
+    {
+        fprintf(stderr, "usage: %s [stream.dlog]\n", argv[0]);
+        return 2;
+    }
+    uint8_t *buf = malloc(STREAM_MAX);
+    size_t len = buf ? fread(buf, 1, STREAM_MAX, in) : 0;
+    if(in != stdin)
+    {
+        fclose(in);
+    }
+    if(len < DLOG_WIRE_HEADER || memcmp(buf, DLOG_WIRE_MAGIC, 3) != 0)
+    {
+        fprintf(stderr, "not a deferred log stream\n");
+        free(buf);
+        return 1;
+    }
+    if(buf[3] != DLOG_WIRE_VERSION)
+    {
+        fprintf(stderr, "stream version %u, this decoder reads %u\n", buf[3], DLOG_WIRE_VERSION);
+        free(buf);
+        return 1;
+    }
+
+    static const char letters[] = "NEWIDV";
+    size_t pos = DLOG_WIRE_HEADER;
+    unsigned records = 0, unknown = 0;
+    dlog_record_t rec;
+    esp_err_t err;
+    while((err = dlog_decode(buf, len, &pos, &rec)) != ESP_ERR_NOT_FOUND)
+    {
+        if(err == ESP_ERR_INVALID_SIZE)
+        {
+            fprintf(stderr, "stream truncated at byte %zu\n", pos);
+            break;
+        }
+        if(err != ESP_OK)
+        {
+            // Newer firmware than this decoder; the record length is still known
+            unknown++;
+            if(rec.argc > DLOG_MAX_ARGS)
+            {
+                fprintf(stderr, "corrupt record at byte %zu\n", pos);
+                break;
+            }
+            continue;
+        }
+        char text[256];
+        dlog_format(&rec, text, sizeof(text));
+        printf("%c (%u) %s: %s\n", letters[dlog_level(rec.id)], rec.ts_ms, dlog_tag(rec.id), text);
+        records++;
+    }
+    fprintf(stderr, "%u records, %u with unknown format\n", records, unknown);
+    free(buf);
+    return 0;
+}
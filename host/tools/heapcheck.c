@@ -0,0 +1,320 @@
+// Checks that the firmware reaches a heap-free steady state: once the board
+// is up, nothing may call malloc or free again.
+//
+//   pb_heapcheck [-w warmup_s] [-t seconds] [-c clients]
+//
+// Starts the simulated board with the HTTP server and the protection
+// interlock, lets it warm up, then counts every allocator call in the process
+// while the gauges keep changing and clients cycle through every endpoint,
+// arm and disarm, and send an oversized /arm body. The allocator is replaced
+// for the whole process, so tool and shim code counts as well and keeps its
+// own buffers static. The exit status is non-zero if any call was seen; the
+// first distinct call sites are printed with a backtrace.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <execinfo.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_http_server.h"
+#include "esp_log.h"
+#include "host_clock.h"
+#include "sim_board.h"
+#include "sim_gauge.h"
+#include "max17330.h"
+
+#define CLIENT_BODY_CAP 8192
+#define MAX_CLIENTS 8
+#define STEP_MS 100
+#define SITES_MAX 8
+#define SITE_DEPTH 12
+
+// ---- Allocator hooks ----
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+void __libc_free(void *ptr);
+
+typedef struct {
+    void *frames[SITE_DEPTH];
+    int depth;
+    const char *call;
+    uint32_t count;
+} alloc_site_t;
+
+static atomic_bool counting = false;
+static atomic_uint calls = 0;
+static atomic_ulong bytes = 0;
+static alloc_site_t sites[SITES_MAX];
+static atomic_int site_count = 0;
+static __thread bool in_hook = false;
+
+static void heap_call(const char *call, size_t size)
+{
+    if(!atomic_load(&counting) || in_hook)
+    {
+        return;
+    }
+    in_hook = true;
+    atomic_fetch_add(&calls, 1);
+    atomic_fetch_add(&bytes, size);
+    void *frames[SITE_DEPTH];
+    int depth = backtrace(frames, SITE_DEPTH);
+    // Firmware tasks take turns on one simulated CPU, so sites need no lock
+    bool known = false;
+    for(int i = 0; i < atomic_load(&site_count) && !known; i++)
+    {
+        if(sites[i].depth == depth && memcmp(sites[i].frames, frames, depth * sizeof(void *)) == 0)
+        {
+            sites[i].count++;
+            known = true;
+        }
+    }
+    if(!known && atomic_load(&site_count) < SITES_MAX)
+    {
+        alloc_site_t *site = &sites[atomic_fetch_add(&site_count, 1)];
+        memcpy(site->frames, frames, depth * sizeof(void *));
+        site->depth = depth;
+        site->call = call;
+        site->count = 1;
+    }
+    in_hook = false;
+}
+
+void *malloc(size_t size)
+{
+    heap_call("malloc", size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    heap_call("calloc", n * size);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    heap_call("realloc", size);
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+    heap_call("memalign", size);
+    return __libc_memalign(align, size);
+}
+
+int posix_memalign(void **out, size_t align, size_t size)
+{
+    heap_call("posix_memalign", size);
+    *out = __libc_memalign(align, size);
+    return *out ? 0 : 12;   // ENOMEM
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    heap_call("aligned_alloc", size);
+    return __libc_memalign(align, size);
+}
+
+void free(void *ptr)
+{
+    if(ptr != NULL)
+    {
+        heap_call("free", 0);
+    }
+    __libc_free(ptr);
+}
+
+// ---- Clients ----
+
+typedef struct {
+    httpd_method_t method;
+    const char *uri;
+    size_t body_len;
+} client_req_t;
+
+static const client_req_t client_reqs[] = {
+    { HTTP_GET, "/status", 0 },
+    { HTTP_GET, "/status?fields=battery,health", 0 },
+    { HTTP_GET, "/time", 0 },
+    { HTTP_GET, "/battery", 0 },
+    { HTTP_GET, "/history", 0 },
+    { HTTP_GET, "/history?since=250", 0 },
+    { HTTP_GET, "/link", 0 },
+    { HTTP_GET, "/tasks", 0 },
+    { HTTP_GET, "/protection", 0 },
+    { HTTP_GET, "/log", 0 },
+    { HTTP_GET, "/arm", 0 },
+    { HTTP_POST, "/arm", 6 },
+    { HTTP_POST, "/arm", 4096 },    // Refused with 413 before it is read
+    { HTTP_GET, "/", 0 },
+    { HTTP_GET, "/pspha.png", 0 },
+    { HTTP_GET, "/favicon.ico", 0 },
+    { HTTP_GET, "/nonexistent", 0 },
+};
+#define CLIENT_REQ_COUNT (sizeof(client_reqs) / sizeof(client_reqs[0]))
+
+static char client_bodies[MAX_CLIENTS][CLIENT_BODY_CAP];
+static char post_body[4096];
+static int64_t end_us;
+static SemaphoreHandle_t clients_done;
+static uint32_t requests;
+static uint32_t failed;
+
+static void client_task(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    char *body = client_bodies[id];
+    uint32_t long_poll_seq = 0;
+    for(size_t i = id; host_clock_now_us() < end_us; i++)
+    {
+        const client_req_t *cr = &client_reqs[i % CLIENT_REQ_COUNT];
+        char uri[48];
+        const char *path = cr->uri;
+        // Every round also parks a long-poll until the snapshot moves on
+        if(i % CLIENT_REQ_COUNT == 0 && long_poll_seq != 0)
+        {
+            snprintf(uri, sizeof(uri), "/status?since=%lu", (unsigned long)long_poll_seq);
+            path = uri;
+        }
+        httpd_host_request_t rq = {
+            .method = cr->method,
+            .uri = path,
+            .body = post_body,
+            .body_len = cr->body_len,
+        };
+        httpd_host_response_t rs = {
+            .body = body,
+            .body_cap = CLIENT_BODY_CAP,
+        };
+        esp_err_t err = httpd_host_request(httpd_host_default(), &rq, &rs);
+        requests++;
+        bool expected = rs.status == 200 || rs.status == 304 || rs.status == 409 ||
+                        (cr->body_len > 64 && rs.status == 413) || (strcmp(cr->uri, "/nonexistent") == 0 && rs.status == 404);
+        if(err != ESP_OK || !expected)
+        {
+            failed++;
+            fprintf(stderr, "%s %s: status %d\n", cr->method == HTTP_POST ? "POST" : "GET", path, rs.status);
+        }
+        const char *seq = rs.status == 200 ? strstr(body, "\"seq\":") : NULL;
+        if(seq != NULL)
+        {
+            long_poll_seq = strtoul(seq + 6, NULL, 10);
+        }
+        vTaskDelay(pdMS_TO_TICKS(50));
+    }
+    xSemaphoreGive(clients_done);
+    // Deleting the task would free its host thread while still counting
+    while(1)
+    {
+        vTaskDelay(portMAX_DELAY);
+    }
+}
+
+// Sweeps both packs' VCELL, SOC and current so that every sample changes
+static void drift(int64_t t_us)
+{
+    for(int bus = 0; bus < SIM_GAUGE_COUNT; bus++)
+    {
+        int64_t phase = (t_us / 1000000 + bus * 37) % 120;
+        int64_t ramp = phase < 60 ? phase : 120 - phase;
+        sim_gauge_set_reg(bus, MAX17330_VCELL, 0xB000 + (uint16_t)(ramp * 0x80));    // 3.4 V to 4.0 V
+        sim_gauge_set_reg(bus, MAX17330_VFSOC, (uint16_t)(ramp * 0x6400 / 60));
+        sim_gauge_set_reg(bus, MAX17330_CURRENT, (uint16_t)(0x10000 - 0x100 - ramp * 8));
+    }
+}
+
+static void print_sites(void)
+{
+    for(int i = 0; i < atomic_load(&site_count); i++)
+    {
+        fprintf(stderr, "%s called %u times from:\n", sites[i].call, sites[i].count);
+        fflush(stderr);
+        backtrace_symbols_fd(sites[i].frames, sites[i].depth, fileno(stderr));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int warmup_s = 10;
+    int duration_s = 120;
+    int clients = 3;
+    int opt;
+    while((opt = getopt(argc, argv, "w:t:c:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'w': warmup_s = atoi(optarg); break;
+            case 't': duration_s = atoi(optarg); break;
+            case 'c': clients = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-w warmup_s] [-t seconds] [-c clients]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(warmup_s < 0 || duration_s <= 0 || clients <= 0 || clients > MAX_CLIENTS)
+    {
+        fprintf(stderr, "need -t > 0 and 1..%d clients\n", MAX_CLIENTS);
+        return 2;
+    }
+    esp_log_level_set("*", ESP_LOG_WARN);
+    memset(post_body, 'x', sizeof(post_body));
+    // backtrace() loads its unwinder on first use, which allocates
+    void *frame;
+    backtrace(&frame, 1);
+
+    sim_board_reset_gauges();
+    sim_board_conf_t board = {
+        .start_http = 1,
+        .start_protection = 1,
+    };
+    if(sim_board_start(&board) != ESP_OK)
+    {
+        return 1;
+    }
+
+    // Everything the run needs is created before counting starts
+    clients_done = xSemaphoreCreateCounting(MAX_CLIENTS, 0);
+    int64_t start_us = host_clock_now_us() + (int64_t)warmup_s * 1000000;
+    end_us = start_us + (int64_t)duration_s * 1000000;
+    for(int i = 0; i < clients; i++)
+    {
+        xTaskCreate(client_task, "client", 4096, (void *)(intptr_t)i, tskIDLE_PRIORITY + 1, NULL);
+    }
+    while(host_clock_now_us() < start_us)
+    {
+        drift(host_clock_now_us());
+        host_clock_sleep_us(STEP_MS * 1000);
+    }
+
+    atomic_store(&counting, true);
+    while(host_clock_now_us() < end_us)
+    {
+        drift(host_clock_now_us());
+        host_clock_sleep_us(STEP_MS * 1000);
+    }
+    for(int i = 0; i < clients; i++)
+    {
+        xSemaphoreTake(clients_done, portMAX_DELAY);
+    }
+    atomic_store(&counting, false);
+
+    printf("%d s steady state after %d s warm-up, %d clients: %u requests, %u unexpected\n",
+           duration_s, warmup_s, clients, requests, failed);
+    printf("heap calls: %u, %lu bytes requested\n", atomic_load(&calls), atomic_load(&bytes));
+    print_sites();
+    bool pass = atomic_load(&calls) == 0 && failed == 0 && requests > 0;
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    fflush(stdout);
+    // Tasks still hold the scheduler, so skip atexit handlers
+    _exit(pass ? 0 : 1);
+}
@@ -0,0 +1,355 @@
+// Drives the host build of the HTTP server with concurrent simulated clients,
+// the way a handful of phones and a laptop hit the board's access point.
+//
+//   pb_loadtest [-c pollers] [-a arm_period_ms] [-d downloaders] [-t seconds]
+//               [-r link_kBps] [-s speed] [-A arm_p99_limit_ms]
+//
+// Pollers behave like the web UI: a long-poll on /status that the server
+// answers when the snapshot changes, backing off a second when it could not
+// park the request. One client toggles /arm every arm period, and downloaders keep
+// fetching every asset and the chart history as if a new phone loaded the page.
+// Every client's responses cost virtual time at the link rate, so large
+// downloads hold the task sending them. The report lists per-endpoint throughput and latency in
+// virtual time, heap use of the whole process and the timing of the periodic
+// firmware tasks. The exit status is non-zero if any request failed, a
+// periodic task missed a deadline or the /arm p99 exceeds -A.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_http_server.h"
+#include "esp_log.h"
+#include "host_clock.h"
+#include "sim_board.h"
+#include "tasks.h"
+#include "samples.h"
+
+#define CLIENT_BODY_CAP 4096
+#define CLIENT_PRIORITY (tskIDLE_PRIORITY + 1)
+#define POLL_PERIOD_US 1000000
+#define HEAP_SAMPLE_US 100000
+
+typedef enum {
+    EP_STATUS,
+    EP_ARM_GET,
+    EP_ARM_POST,
+    EP_INDEX,
+    EP_HISTORY,
+    EP_PNG,
+    EP_FAVICON,
+    EP_COUNT,
+} endpoint_t;
+
+static const struct {
+    const char *name;
+    httpd_method_t method;
+    const char *uri;
+} endpoints[EP_COUNT] = {
+    [EP_STATUS]   = { "GET /status",      HTTP_GET,  "/status" },
+    [EP_ARM_GET]  = { "GET /arm",         HTTP_GET,  "/arm" },
+    [EP_ARM_POST] = { "POST /arm",        HTTP_POST, "/arm" },
+    [EP_INDEX]    = { "GET /",            HTTP_GET,  "/" },
+    [EP_HISTORY]  = { "GET /history",     HTTP_GET,  "/history" },
+    [EP_PNG]      = { "GET /pspha.png",   HTTP_GET,  "/pspha.png" },
+    [EP_FAVICON]  = { "GET /favicon.ico", HTTP_GET,  "/favicon.ico" },
+};
+
+typedef struct {
+    samples_t latency_us;
+    uint32_t ok;                // 200, or 304 for a long-poll that timed out
+    uint32_t busy;              // 503 from a full worker queue
+    uint32_t failed;            // Dropped connections and other statuses
+    uint64_t bytes;
+} endpoint_stats_t;
+
+// Clients take turns on the simulated CPU, so the counters need no locking
+static endpoint_stats_t stats[EP_COUNT];
+static int64_t end_us;
+static int arm_period_ms = 5000;
+static SemaphoreHandle_t clients_done;
+
+static size_t heap_in_use(void)
+{
+    return mallinfo2().uordblks;
+}
+
+// Returns the HTTP status, 0 for a dropped connection
+static int request(endpoint_t ep, const char *uri, char *body)
+{
+    httpd_host_request_t rq = {
+        .method = endpoints[ep].method,
+        .uri = uri ? uri : endpoints[ep].uri,
+        .body = "toggle",
+        .body_len = endpoints[ep].method == HTTP_POST ? 6 : 0,
+    };
+    httpd_host_response_t rs = {
+        .body = body,
+        .body_cap = CLIENT_BODY_CAP,
+    };
+    int64_t start = host_clock_now_us();
+    esp_err_t err = httpd_host_request(httpd_host_default(), &rq, &rs);
+    endpoint_stats_t *st = &stats[ep];
+    samples_add(&st->latency_us, host_clock_now_us() - start);
+    st->bytes += rs.body_len;
+    if(err == ESP_OK && (rs.status == 200 || rs.status == 304))
+    {
+        st->ok++;
+    }
+    else if(err == ESP_OK && rs.status == 503)
+    {
+        st->busy++;
+    }
+    else
+    {
+        st->failed++;
+    }
+    return err == ESP_OK ? rs.status : 0;
+}
+
+static void poller_task(void *arg)
+{
+    char *body = malloc(CLIENT_BODY_CAP);
+    // Phones connect at different moments within the polling period
+    int64_t next = host_clock_now_us() + (int64_t)(intptr_t)arg * 137000 % POLL_PERIOD_US;
+    host_clock_sleep_until_us(next);
+    long seq = -1;
+    char uri[48];
+    while(host_clock_now_us() < end_us)
+    {
+        if(seq < 0)
+        {
+            snprintf(uri, sizeof(uri), "/status");
+        }
+        else
+        {
+            snprintf(uri, sizeof(uri), "/status?since=%ld", seq);
+        }
+        int status = request(EP_STATUS, uri, body);
+        const char *field = strstr(body, "\"seq\":");
+        long got = field ? strtol(field + 6, NULL, 10) : -1;
+        if(status != 200 && status != 304)
+        {
+            host_clock_sleep_us(POLL_PERIOD_US);
+        }
+        else if(status == 200)
+        {
+            if(got == seq)
+            {
+                // No room to park the request, so back off like the UI
+                host_clock_sleep_us(POLL_PERIOD_US);
+            }
+            seq = got;
+        }
+    }
+    free(body);
+    xSemaphoreGive(clients_done);
+    vTaskDelete(NULL);
+}
+
+static void armer_task(void *arg)
+{
+    char *body = malloc(CLIENT_BODY_CAP);
+    int64_t next = host_clock_now_us();
+    while(1)
+    {
+        next += (int64_t)arm_period_ms * 1000;
+        host_clock_sleep_until_us(next);
+        if(host_clock_now_us() >= end_us)
+        {
+            break;
+        }
+        request(EP_ARM_POST, NULL, body);
+        request(EP_ARM_GET, NULL, body);
+    }
+    free(body);
+    xSemaphoreGive(clients_done);
+    vTaskDelete(NULL);
+}
+
+static void downloader_task(void *arg)
+{
+    char *body = malloc(CLIENT_BODY_CAP);
+    while(host_clock_now_us() < end_us)
+    {
+        request(EP_INDEX, NULL, body);
+        request(EP_HISTORY, NULL, body);
+        request(EP_PNG, NULL, body);
+        request(EP_FAVICON, NULL, body);
+    }
+    free(body);
+    xSemaphoreGive(clients_done);
+    vTaskDelete(NULL);
+}
+
+static size_t heap_peak;
+
+static void heap_task(void *arg)
+{
+    while(host_clock_now_us() < end_us)
+    {
+        size_t used = heap_in_use();
+        if(used > heap_peak)
+        {
+            heap_peak = used;
+        }
+        vTaskDelay(pdMS_TO_TICKS(HEAP_SAMPLE_US / 1000));
+    }
+    xSemaphoreGive(clients_done);
+    vTaskDelete(NULL);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-c pollers] [-a arm_period_ms] [-d downloaders] [-t seconds] "
+                    "[-r link_kBps] [-s speed] [-A arm_p99_limit_ms]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    int pollers = 6;
+    int downloaders = 1;
+    int duration_s = 60;
+    int link_kbps = 200;
+    double speed = 0;
+    double arm_limit_ms = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "c:a:d:t:r:s:A:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'c': pollers = atoi(optarg); break;
+            case 'a': arm_period_ms = atoi(optarg); break;
+            case 'd': downloaders = atoi(optarg); break;
+            case 't': duration_s = atoi(optarg); break;
+            case 'r': link_kbps = atoi(optarg); break;
+            case 's': speed = atof(optarg); break;
+            case 'A': arm_limit_ms = atof(optarg); break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if(pollers < 0 || downloaders < 0 || duration_s <= 0 || link_kbps < 0 || speed < 0 || arm_period_ms < 0)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    esp_log_level_set("*", ESP_LOG_WARN);
+    // Keep every thread on the main arena so that mallinfo2() sees all of it
+    mallopt(M_ARENA_MAX, 1);
+
+    sim_board_reset_gauges();
+    sim_board_conf_t board = {
+        .speed = speed,
+        .start_http = 1,
+        .start_protection = 1,
+    };
+    if(sim_board_start(&board) != ESP_OK)
+    {
+        return 1;
+    }
+    httpd_host_set_link_rate(httpd_host_default(), (uint32_t)link_kbps * 1000);
+
+    int clients = pollers + downloaders + (arm_period_ms > 0) + 1;
+    for(int ep = 0; ep < EP_COUNT; ep++)
+    {
+        // Polls run at 1 Hz; downloads are far slower than that on any link
+        samples_reserve(&stats[ep].latency_us, (size_t)duration_s * clients + 1024);
+    }
+    clients_done = xSemaphoreCreateCounting(clients, 0);
+    size_t heap_base = heap_in_use();
+    heap_peak = heap_base;
+    int64_t start_us = host_clock_now_us();
+    int64_t wall0_us = host_clock_wall_us();
+    end_us = start_us + (int64_t)duration_s * 1000000;
+
+    xTaskCreate(heap_task, "heap", 2048, NULL, CLIENT_PRIORITY, NULL);
+    for(int i = 0; i < pollers; i++)
+    {
+        xTaskCreate(poller_task, "poller", 2048, (void *)(intptr_t)i, CLIENT_PRIORITY, NULL);
+    }
+    for(int i = 0; i < downloaders; i++)
+    {
+        xTaskCreate(downloader_task, "downloader", 2048, NULL, CLIENT_PRIORITY, NULL);
+    }
+    if(arm_period_ms > 0)
+    {
+        xTaskCreate(armer_task, "armer", 2048, NULL, CLIENT_PRIORITY, NULL);
+    }
+    for(int i = 0; i < clients; i++)
+    {
+        xSemaphoreTake(clients_done, portMAX_DELAY);
+    }
+    double elapsed_s = (host_clock_now_us() - start_us) / 1e6;
+    double wall_s = (host_clock_wall_us() - wall0_us) / 1e6;
+    size_t heap_end = heap_in_use();
+
+    printf("%d pollers, %d downloaders, arm every %d ms, %d kB/s links: %.1f s simulated in %.2f s wall\n",
+           pollers, downloaders, arm_period_ms, link_kbps, elapsed_s, wall_s);
+    printf("%-18s %8s %6s %6s %6s %8s %9s %9s %9s %9s\n",
+           "endpoint", "requests", "ok", "503", "failed", "req/s", "p50 ms", "p99 ms", "max ms", "kB");
+    uint32_t failed = 0;
+    for(int ep = 0; ep < EP_COUNT; ep++)
+    {
+        endpoint_stats_t *st = &stats[ep];
+        size_t n = st->latency_us.count;
+        if(n == 0)
+        {
+            continue;
+        }
+        failed += st->failed;
+        printf("%-18s %8zu %6u %6u %6u %8.2f %9.2f %9.2f %9.2f %9.1f\n",
+               endpoints[ep].name, n, st->ok, st->busy, st->failed, n / elapsed_s,
+               samples_pct(&st->latency_us, 50) / 1000.0, samples_pct(&st->latency_us, 99) / 1000.0,
+               samples_pct(&st->latency_us, 100) / 1000.0, st->bytes / 1000.0);
+    }
+    printf("heap in use: %zu B at start, %zu B peak, %zu B at end\n", heap_base, heap_peak, heap_end);
+
+    task_period_stats_t periodic[TASK_PERIODIC_MAX];
+    size_t periodic_count = task_period_get_stats(periodic, TASK_PERIODIC_MAX);
+    uint32_t misses = 0;
+    for(size_t i = 0; i < periodic_count; i++)
+    {
+        task_period_stats_t *p = &periodic[i];
+        printf("task %s: %u runs every %u ms, %u missed, jitter avg %u us max %u us, exec avg %u us max %u us\n",
+               p->name, p->runs, p->period_ms, p->misses, p->jitter_avg_us, p->jitter_max_us,
+               p->exec_avg_us, p->exec_max_us);
+        misses += p->misses;
+    }
+
+    int ret = 0;
+    if(failed > 0)
+    {
+        printf("FAIL: %u failed requests\n", failed);
+        ret = 1;
+    }
+    if(misses > 0)
+    {
+        printf("FAIL: %u deadline misses\n", misses);
+        ret = 1;
+    }
+    double arm_p99_ms = 0;
+    for(int ep = EP_ARM_GET; ep <= EP_ARM_POST; ep++)
+    {
+        double p99 = samples_pct(&stats[ep].latency_us, 99) / 1000.0;
+        arm_p99_ms = p99 > arm_p99_ms ? p99 : arm_p99_ms;
+    }
+    if(arm_limit_ms > 0 && arm_p99_ms > arm_limit_ms)
+    {
+        printf("FAIL: /arm p99 %.2f ms exceeds %.2f ms\n", arm_p99_ms, arm_limit_ms);
+        ret = 1;
+    }
+    if(ret == 0)
+    {
+        printf("PASS\n");
+    }
+    for(int ep = 0; ep < EP_COUNT; ep++)
+    {
+        samples_free(&stats[ep].latency_us);
+    }
+    return ret;
+}
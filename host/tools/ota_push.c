@@ -0,0 +1,490 @@
+// Pushes firmware and web assets to several boards at once over Wi-Fi, in
+// place of flashing each over USB.
+//
+//   pb_ota [-a app.bin] [-w www.bin] [-Z] [-n] [-T timeout_s] board ...
+//
+// A board is host[:port][@iface][=name], as for pb_aggregator. Each image is
+// hashed and gzipped once, then every board is updated from a thread of its
+// own: the images go to /ota/app and /ota/www, then /ota/restart, and /ota is
+// polled until the board has passed its health check on the new slots or
+// rolled back. -Z sends the images uncompressed, -n only stages them, so that
+// they start with the next restart. The exit status is non-zero unless every
+// board ended up running what was sent.
+
+#define _GNU_SOURCE     // memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "cJSON.h"
+#include "mbedtls/sha256.h"
+
+#define OTA_MAX_BOARDS 16
+#define OTA_RESPONSE_MAX 2048
+#define OTA_CONNECT_TIMEOUT_MS 3000
+#define OTA_IO_TIMEOUT_MS 20000         // Erasing a sector can hold up the board for a while
+#define OTA_POLL_MS 1000
+#define OTA_REBOOT_GRACE_MS 2000        // The board restarts 500 ms after answering
+
+typedef struct {
+    const char *path;
+    const char *uri;
+    uint8_t *data;              // As sent, gzipped unless -Z
+    size_t len;
+    size_t raw_len;
+    char sha256[65];            // Of the raw image
+} image_t;
+
+typedef struct {
+    char spec[96];
+    char name[32];
+    char iface[16];
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    pthread_t thread;
+
+    char before[16];            // App slot running before the update
+    char want_app[16];          // Slots the update should end up on
+    char want_www[16];
+    char running[16];
+    char version[32];
+    bool ok;
+    char result[128];
+    int64_t upload_ms;
+    int64_t total_ms;
+} board_t;
+
+static board_t boards[OTA_MAX_BOARDS];
+static int board_count;
+static image_t images[2] = {
+    { .uri = "/ota/app" },
+    { .uri = "/ota/www" },
+};
+static bool gzip = true;
+static bool restart = true;
+static int timeout_s = 90;
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// ---- Images ----
+
+static int image_load(image_t *img)
+{
+    FILE *f = fopen(img->path, "rb");
+    struct stat st;
+    if(f == NULL || fstat(fileno(f), &st) != 0 || st.st_size == 0)
+    {
+        fprintf(stderr, "%s: cannot read\n", img->path);
+        if(f != NULL)
+        {
+            fclose(f);
+        }
+        return -1;
+    }
+    img->raw_len = st.st_size;
+    uint8_t *raw = malloc(img->raw_len);
+    size_t got = raw ? fread(raw, 1, img->raw_len, f) : 0;
+    fclose(f);
+    if(got != img->raw_len)
+    {
+        fprintf(stderr, "%s: short read\n", img->path);
+        free(raw);
+        return -1;
+    }
+
+    uint8_t digest[32];
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    mbedtls_sha256_update(&sha, raw, img->raw_len);
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    for(int i = 0; i < 32; i++)
+    {
+        sprintf(&img->sha256[i * 2], "%02x", digest[i]);
+    }
+
+    if(!gzip)
+    {
+        img->data = raw;
+        img->len = img->raw_len;
+        return 0;
+    }
+    // A gzip wrapper, which is what the board expects with Content-Encoding: gzip
+    z_stream z = { 0 };
+    if(deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        free(raw);
+        return -1;
+    }
+    size_t cap = deflateBound(&z, img->raw_len) + 32;
+    img->data = malloc(cap);
+    z.next_in = raw;
+    z.avail_in = img->raw_len;
+    z.next_out = img->data;
+    z.avail_out = cap;
+    int ret = img->data ? deflate(&z, Z_FINISH) : Z_MEM_ERROR;
+    img->len = z.total_out;
+    deflateEnd(&z);
+    free(raw);
+    if(ret != Z_STREAM_END)
+    {
+        fprintf(stderr, "%s: compression failed\n", img->path);
+        return -1;
+    }
+    return 0;
+}
+
+// ---- HTTP ----
+
+static int board_parse(board_t *b, const char *spec)
+{
+    char host[96] = "";
+    char port[8] = "80";
+    snprintf(b->spec, sizeof(b->spec), "%s", spec);
+
+    char buf[96];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    char *name = strchr(buf, '=');
+    if(name != NULL)
+    {
+        *name++ = '\0';
+    }
+    char *iface = strchr(buf, '@');
+    if(iface != NULL)
+    {
+        *iface++ = '\0';
+        snprintf(b->iface, sizeof(b->iface), "%s", iface);
+    }
+    char *colon = strchr(buf, ':');
+    if(colon != NULL)
+    {
+        *colon++ = '\0';
+        snprintf(port, sizeof(port), "%s", colon);
+    }
+    snprintf(host, sizeof(host), "%s", buf);
+    snprintf(b->name, sizeof(b->name), "%s", name ? name : spec);
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res;
+    if(getaddrinfo(host, port, &hints, &res) != 0)
+    {
+        return -1;
+    }
+    memcpy(&b->addr, res->ai_addr, res->ai_addrlen);
+    b->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static void set_timeout(int fd, int timeout_ms)
+{
+    struct timeval tv = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static bool send_all(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    while(len > 0)
+    {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if(n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// One request on a connection of its own. Returns the status, with the body
+// in resp, or -1 if the board could not be reached or did not answer.
+static int http_request(const board_t *b, const char *method, const char *uri, const image_t *img,
+                        char *resp, size_t resp_cap)
+{
+    int fd = socket(b->addr.ss_family, SOCK_STREAM, 0);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    if(b->iface[0] != '\0' && setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, b->iface, strlen(b->iface)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    set_timeout(fd, OTA_CONNECT_TIMEOUT_MS);
+    if(connect(fd, (const struct sockaddr *)&b->addr, b->addr_len) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    set_timeout(fd, OTA_IO_TIMEOUT_MS);
+
+    char head[256];
+    int head_len;
+    if(img != NULL)
+    {
+        head_len = snprintf(head, sizeof(head),
+                            "%s %s HTTP/1.1\r\nHost: board\r\nConnection: close\r\n"
+                            "Content-Length: %zu\r\nX-SHA256: %s\r\n%s\r\n",
+                            method, uri, img->len, img->sha256, gzip ? "Content-Encoding: gzip\r\n" : "");
+    }
+    else
+    {
+        head_len = snprintf(head, sizeof(head),
+                            "%s %s HTTP/1.1\r\nHost: board\r\nConnection: close\r\nContent-Length: 0\r\n\r\n",
+                            method, uri);
+    }
+    // The board may refuse an image before it has all of it, so a failed send
+    // still reads the answer
+    if(send_all(fd, head, head_len) && img != NULL)
+    {
+        send_all(fd, img->data, img->len);
+    }
+
+    char in[OTA_RESPONSE_MAX];
+    size_t in_len = 0;
+    const char *body = NULL;
+    size_t body_len = 0;
+    while(in_len < sizeof(in) - 1)
+    {
+        ssize_t n = recv(fd, in + in_len, sizeof(in) - 1 - in_len, 0);
+        if(n <= 0)
+        {
+            break;
+        }
+        in_len += n;
+        in[in_len] = '\0';
+        const char *end = body ? body : memmem(in, in_len, "\r\n\r\n", 4);
+        if(end != NULL && body == NULL)
+        {
+            body = end + 4;
+            const char *cl = strcasestr(in, "\r\ncontent-length:");
+            body_len = cl && cl < end ? strtoul(cl + 17, NULL, 10) : SIZE_MAX;
+        }
+        if(body != NULL && (size_t)(in + in_len - body) >= body_len)
+        {
+            break;
+        }
+    }
+    close(fd);
+    in[in_len] = '\0';
+    int status;
+    if(body == NULL || sscanf(in, "HTTP/1.%*d %d", &status) != 1)
+    {
+        return -1;
+    }
+    snprintf(resp, resp_cap, "%s", body);
+    return status;
+}
+
+// ---- Updating one board ----
+
+static void json_string(char *out, size_t cap, const cJSON *obj, const char *field)
+{
+    const cJSON *item = cJSON_GetObjectItem(obj, field);
+    snprintf(out, cap, "%s", cJSON_IsString(item) ? item->valuestring : "");
+}
+
+static cJSON *board_status(board_t *b)
+{
+    char resp[OTA_RESPONSE_MAX];
+    if(http_request(b, "GET", "/ota", NULL, resp, sizeof(resp)) != 200)
+    {
+        return NULL;
+    }
+    return cJSON_Parse(resp);
+}
+
+static void *board_update(void *arg)
+{
+    board_t *b = arg;
+    int64_t start = now_ms();
+    char resp[OTA_RESPONSE_MAX];
+
+    cJSON *st = board_status(b);
+    if(st == NULL)
+    {
+        snprintf(b->result, sizeof(b->result), "not reachable");
+        return NULL;
+    }
+    json_string(b->before, sizeof(b->before), st, "running");
+    bool trial = cJSON_IsTrue(cJSON_GetObjectItem(st, "trial"));
+    cJSON_Delete(st);
+    if(trial)
+    {
+        snprintf(b->result, sizeof(b->result), "still trying an earlier update");
+        return NULL;
+    }
+
+    for(int i = 0; i < 2; i++)
+    {
+        const image_t *img = &images[i];
+        if(img->path == NULL)
+        {
+            continue;
+        }
+        int status = http_request(b, "POST", img->uri, img, resp, sizeof(resp));
+        if(status != 200)
+        {
+            // Errors come back as plain text naming the esp_err_t
+            resp[strcspn(resp, "\r\n")] = '\0';
+            snprintf(b->result, sizeof(b->result), "%s: %d %.80s", img->uri, status, status < 0 ? "no answer" : resp);
+            return NULL;
+        }
+        cJSON *up = cJSON_Parse(resp);
+        if(i == 0)
+        {
+            json_string(b->want_app, sizeof(b->want_app), up, "boot");
+        }
+        else
+        {
+            json_string(b->want_www, sizeof(b->want_www), up, "www_next");
+        }
+        cJSON_Delete(up);
+    }
+    b->upload_ms = now_ms() - start;
+
+    if(!restart)
+    {
+        b->ok = true;
+        snprintf(b->result, sizeof(b->result), "staged%s%s%s%s", b->want_app[0] ? ", app " : "", b->want_app,
+                 b->want_www[0] ? ", www " : "", b->want_www);
+        b->total_ms = now_ms() - start;
+        return NULL;
+    }
+    int status = http_request(b, "POST", "/ota/restart", NULL, resp, sizeof(resp));
+    if(status != 200)
+    {
+        snprintf(b->result, sizeof(b->result), "/ota/restart: %d", status);
+        return NULL;
+    }
+
+    // Unreachable while it restarts, on trial until the health check passes
+    usleep(OTA_REBOOT_GRACE_MS * 1000);
+    int64_t deadline = now_ms() + (int64_t)timeout_s * 1000;
+    while(now_ms() < deadline)
+    {
+        st = board_status(b);
+        if(st != NULL && !cJSON_IsTrue(cJSON_GetObjectItem(st, "trial")))
+        {
+            char www[16];
+            json_string(b->running, sizeof(b->running), st, "running");
+            json_string(b->version, sizeof(b->version), st, "version");
+            json_string(www, sizeof(www), st, "www");
+            cJSON_Delete(st);
+            b->total_ms = now_ms() - start;
+            bool app_ok = b->want_app[0] == '\0' || strcmp(b->running, b->want_app) == 0;
+            bool www_ok = b->want_www[0] == '\0' || strcmp(www, b->want_www) == 0;
+            b->ok = app_ok && www_ok;
+            if(b->ok)
+            {
+                snprintf(b->result, sizeof(b->result), "running %s %s, www %s", b->running, b->version, www);
+            }
+            else
+            {
+                snprintf(b->result, sizeof(b->result), "rolled back to %s, www %s", b->running, www);
+            }
+            return NULL;
+        }
+        cJSON_Delete(st);
+        usleep(OTA_POLL_MS * 1000);
+    }
+    snprintf(b->result, sizeof(b->result), "no healthy answer within %d s", timeout_s);
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-a app.bin] [-w www.bin] [-Z] [-n] [-T timeout_s] board ...\n"
+                    "  board is host[:port][@iface][=name]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while((opt = getopt(argc, argv, "a:w:ZnT:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'a': images[0].path = optarg; break;
+            case 'w': images[1].path = optarg; break;
+            case 'Z': gzip = false; break;
+            case 'n': restart = false; break;
+            case 'T': timeout_s = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if(optind >= argc || argc - optind > OTA_MAX_BOARDS || (images[0].path == NULL && images[1].path == NULL) ||
+       timeout_s <= 0)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    for(int i = 0; i < 2; i++)
+    {
+        if(images[i].path == NULL)
+        {
+            continue;
+        }
+        if(image_load(&images[i]) != 0)
+        {
+            return 1;
+        }
+        printf("%s: %zu bytes, %zu sent, sha256 %s\n", images[i].path, images[i].raw_len, images[i].len,
+               images[i].sha256);
+    }
+    for(int i = optind; i < argc; i++)
+    {
+        if(board_parse(&boards[board_count], argv[i]) != 0)
+        {
+            fprintf(stderr, "%s: cannot resolve\n", argv[i]);
+            return 2;
+        }
+        board_count++;
+    }
+
+    for(int i = 0; i < board_count; i++)
+    {
+        pthread_create(&boards[i].thread, NULL, board_update, &boards[i]);
+    }
+    int ok = 0;
+    printf("%-16s %-8s %9s %9s  %s\n", "board", "was", "upload_ms", "total_ms", "result");
+    for(int i = 0; i < board_count; i++)
+    {
+        board_t *b = &boards[i];
+        pthread_join(b->thread, NULL);
+        ok += b->ok;
+        printf("%-16s %-8s %9lld %9lld  %s%s\n", b->name, b->before[0] ? b->before : "-", (long long)b->upload_ms,
+               (long long)b->total_ms, b->ok ? "" : "FAILED: ", b->result);
+    }
+    printf("%d of %d boards updated\n", ok, board_count);
+    return ok == board_count ? 0 : 1;
+}
@@ -0,0 +1,275 @@
+// Checks updates over Wi-Fi on the simulated board. Uploads and arming
+// exclude each other and both work again once the other side is done. A
+// gzipped image whose back-references reach across pages and the inflate
+// window's wrap arrives intact. An
+// update that fails its health check within OTA_HEALTH_TIMEOUT_MS is rolled
+// back, app slot and asset slot, and one that passes is kept.
+//
+//   pb_otacheck
+//
+// Each case prints PASS or FAIL; the exit status is non-zero if any failed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_http_server.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "mbedtls/sha256.h"
+#include "host_clock.h"
+#include "sim_board.h"
+#include "power_control.h"
+#include "ota_update.h"
+#include <zlib.h>
+
+#define IMAGE_SIZE 8192
+#define APP_IMAGE_MAGIC 0xE9
+#define BODY_CAP 1024
+#define WWW_SIZE 0xF0000        // As in partitions.csv
+#define WWW_GZIP_CAP 8192
+#define GZIP_APP_SIZE (96 * 1024)
+#define GZIP_APP_BLOCK 20000    // Repeats this far back: across pages, not a power of two
+
+extern uint8_t armed;
+extern nvs_handle_t nvs;
+
+static uint8_t image[IMAGE_SIZE];
+static uint8_t www_image[WWW_SIZE];
+static uint8_t www_gzip[WWW_GZIP_CAP];
+static uint8_t gzip_app[GZIP_APP_SIZE];
+static uint8_t gzip_app_z[GZIP_APP_SIZE];
+static char body[BODY_CAP];
+static int failures;
+
+static void check(bool ok, const char *what)
+{
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    failures += !ok;
+}
+
+static int request(httpd_method_t method, const char *uri, const char *headers, const void *data, size_t len)
+{
+    httpd_host_request_t rq = {
+        .method = method,
+        .uri = uri,
+        .headers = headers,
+        .body = data,
+        .body_len = len,
+    };
+    httpd_host_response_t rs = {
+        .body = body,
+        .body_cap = sizeof(body) - 1,
+    };
+    if(httpd_host_request(httpd_host_default(), &rq, &rs) != ESP_OK)
+    {
+        return 0;
+    }
+    body[rs.body_len < sizeof(body) ? rs.body_len : sizeof(body) - 1] = '\0';
+    return rs.status;
+}
+
+static void hex_header(char *headers, size_t headers_len, const uint8_t sha256[OTA_SHA256_LEN], const char *extra)
+{
+    int len = snprintf(headers, headers_len, "X-SHA256: ");
+    for(int i = 0; i < OTA_SHA256_LEN; i++)
+    {
+        len += snprintf(headers + len, headers_len - len, "%02x", sha256[i]);
+    }
+    snprintf(headers + len, headers_len - len, "\r\n%s", extra);
+}
+
+// An app image that passes esp_ota_end() on the host: the magic byte, then filler
+static void make_image(uint8_t sha256[OTA_SHA256_LEN], char *headers, size_t headers_len)
+{
+    image[0] = APP_IMAGE_MAGIC;
+    for(size_t i = 1; i < sizeof(image); i++)
+    {
+        image[i] = (uint8_t)(i * 31);
+    }
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    mbedtls_sha256_update(&sha, image, sizeof(image));
+    mbedtls_sha256_finish(&sha, sha256);
+    mbedtls_sha256_free(&sha);
+    hex_header(headers, headers_len, sha256, "");
+}
+
+static size_t gzip_compress(const uint8_t *in, size_t len, uint8_t *out, size_t cap)
+{
+    z_stream z = { 0 };
+    deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY);
+    z.next_in = (Bytef *)in;
+    z.avail_in = len;
+    z.next_out = out;
+    z.avail_out = cap;
+    int ret = deflate(&z, Z_FINISH);
+    size_t out_len = ret == Z_STREAM_END ? z.total_out : 0;
+    deflateEnd(&z);
+    return out_len;
+}
+
+// An erased asset slot's worth, gzipped so it goes through the inflate window
+static size_t make_www_image(char *headers, size_t headers_len)
+{
+    memset(www_image, 0xFF, sizeof(www_image));
+    uint8_t sha256[OTA_SHA256_LEN];
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    mbedtls_sha256_update(&sha, www_image, sizeof(www_image));
+    mbedtls_sha256_finish(&sha, sha256);
+    mbedtls_sha256_free(&sha);
+    hex_header(headers, headers_len, sha256, "Content-Encoding: gzip\r\n");
+    return gzip_compress(www_image, sizeof(www_image), www_gzip, sizeof(www_gzip));
+}
+
+static void check_gzip(void)
+{
+    // Noise that deflate cannot shorten except by copying the earlier block
+    uint32_t x = 12345;
+    for(size_t i = 0; i < GZIP_APP_BLOCK; i++)
+    {
+        x = x * 1103515245 + 12345;
+        gzip_app[i] = x >> 16;
+    }
+    gzip_app[0] = APP_IMAGE_MAGIC;
+    for(size_t i = GZIP_APP_BLOCK; i < sizeof(gzip_app); i++)
+    {
+        gzip_app[i] = gzip_app[i - GZIP_APP_BLOCK];
+    }
+    uint8_t sha256[OTA_SHA256_LEN];
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    mbedtls_sha256_update(&sha, gzip_app, sizeof(gzip_app));
+    mbedtls_sha256_finish(&sha, sha256);
+    mbedtls_sha256_free(&sha);
+    char headers[128];
+    hex_header(headers, sizeof(headers), sha256, "Content-Encoding: gzip\r\n");
+    size_t len = gzip_compress(gzip_app, sizeof(gzip_app), gzip_app_z, sizeof(gzip_app_z));
+    check(len > 0 && len < 2 * GZIP_APP_BLOCK, "gzipped app image refers back across pages");
+
+    check(request(HTTP_POST, "/ota/app", headers, gzip_app_z, len) == 200, "gzipped upload inflates intact");
+    ota_status_t status;
+    ota_get_status(&status);
+    check(status.last_result == ESP_OK && status.last_bytes == sizeof(gzip_app), "whole image written");
+}
+
+static bool never_healthy(void)
+{
+    return false;
+}
+
+static bool always_healthy(void)
+{
+    return true;
+}
+
+static uint8_t nvs_u8(const char *key)
+{
+    uint8_t value = 0;
+    nvs_get_u8(nvs, key, &value);
+    return value;
+}
+
+// Sends both images and boots into them
+static bool boot_update(const char *app_headers, const char *www_headers, size_t www_len)
+{
+    bool sent = request(HTTP_POST, "/ota/app", app_headers, image, sizeof(image)) == 200 &&
+                request(HTTP_POST, "/ota/www", www_headers, www_gzip, www_len) == 200;
+    ota_shim_reboot();
+    ota_init();
+    return sent;
+}
+
+static void check_rollback(void)
+{
+    uint8_t sha256[OTA_SHA256_LEN];
+    char app_headers[96];
+    char www_headers[128];
+    make_image(sha256, app_headers, sizeof(app_headers));
+    size_t www_len = make_www_image(www_headers, sizeof(www_headers));
+    check(www_len > 0, "gzipped asset image");
+    esp_restart_shim_trap(true);
+
+    // Never healthy: both slots go back once the timeout passes
+    check(boot_update(app_headers, www_headers, www_len), "update sent");
+    check(ota_on_trial() && strcmp(esp_ota_get_running_partition()->label, "ota_1") == 0 &&
+          strcmp(ota_www_label(), "www_b") == 0 && nvs_u8("www_try") == 0, "update booted on trial");
+    check(ota_health_start(never_healthy) == ESP_OK, "health check started");
+    vTaskDelay(pdMS_TO_TICKS(OTA_HEALTH_TIMEOUT_MS - 2 * OTA_HEALTH_PERIOD_MS));
+    check(esp_restart_shim_count() == 0 && ota_on_trial(), "still on trial before the timeout");
+    vTaskDelay(pdMS_TO_TICKS(4 * OTA_HEALTH_PERIOD_MS));
+    check(esp_restart_shim_count() == 1 && strcmp(esp_ota_get_boot_partition()->label, "ota_0") == 0,
+          "restarted into the previous app after the timeout");
+    check(nvs_u8("www_slot") != 2 && nvs_u8("www_try") == 0, "asset slot left on the previous one");
+    ota_shim_reboot();
+    ota_init();
+    check(!ota_on_trial() && strcmp(esp_ota_get_running_partition()->label, "ota_0") == 0 &&
+          strcmp(ota_www_label(), "www") == 0, "rolled back boot runs the previous images");
+
+    // Healthy: both slots are kept
+    check(boot_update(app_headers, www_headers, www_len) && ota_on_trial(), "update booted on trial again");
+    check(ota_health_start(always_healthy) == ESP_OK, "health check started");
+    vTaskDelay(pdMS_TO_TICKS(2 * OTA_HEALTH_PERIOD_MS));
+    check(!ota_on_trial() && esp_restart_shim_count() == 1 && nvs_u8("www_slot") == 2, "healthy update kept");
+    ota_shim_reboot();
+    ota_init();
+    check(!ota_on_trial() && strcmp(esp_ota_get_running_partition()->label, "ota_1") == 0 &&
+          strcmp(ota_www_label(), "www_b") == 0, "next boot runs the kept images");
+    esp_restart_shim_trap(false);
+}
+
+static void check_arming(void)
+{
+    uint8_t sha256[OTA_SHA256_LEN];
+    char headers[96];
+    make_image(sha256, headers, sizeof(headers));
+
+    // Arming in the middle of an upload
+    check(ota_begin(OTA_IMAGE_APP, false, sizeof(image), sha256) == ESP_OK, "upload starts while disarmed");
+    check(request(HTTP_POST, "/arm", NULL, "toggle", 6) == 409 && !armed, "arming refused during an upload");
+    check(set_armed() == ESP_ERR_INVALID_STATE && !armed, "set_armed() refused during an upload");
+    ota_abort();
+    check(request(HTTP_POST, "/arm", NULL, "toggle", 6) == 200 && armed, "arming allowed after the upload");
+
+    // Uploading while armed
+    check(request(HTTP_POST, "/ota/app", headers, image, sizeof(image)) == 409, "upload refused while armed");
+    check(ota_begin(OTA_IMAGE_APP, false, sizeof(image), sha256) == ESP_ERR_INVALID_STATE && !ota_busy(),
+          "ota_begin() refused while armed");
+    check(request(HTTP_POST, "/arm", NULL, "toggle", 6) == 200 && !armed, "disarming");
+
+    // A whole upload leaves arming possible again
+    check(request(HTTP_POST, "/ota/app", headers, image, sizeof(image)) == 200, "upload while disarmed");
+    check(set_armed() == ESP_OK, "arming after a finished upload");
+    set_disarmed();
+}
+
+int main(int argc, char **argv)
+{
+    (void)argv;
+    if(argc > 1)
+    {
+        fprintf(stderr, "usage: pb_otacheck\n");
+        return 2;
+    }
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    sim_board_reset_gauges();
+    sim_board_conf_t board = {
+        .start_http = 1,
+    };
+    if(sim_board_start(&board) != ESP_OK)
+    {
+        return 1;
+    }
+    check_arming();
+    check_gzip();
+    check_rollback();
+    printf("%s: %d failed\n", failures ? "FAIL" : "PASS", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,196 @@
+// Measures the protection interlock's reaction time against the simulated
+// gauges. Each trial arms the board, waits a random fraction of the poll
+// period, then puts a fault into a gauge's registers and times how long the
+// arm output takes to go low. Short current pulses, like an igniter firing,
+// must not trip at all.
+//
+//   pb_protlat [-n trials] [-S seed]
+//
+// The exit status is non-zero if a fault was missed, a pulse tripped, any
+// reaction exceeded the rule's bound from protection_bound_us(), or a poll ran
+// over the budget that bound assumes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "host_clock.h"
+#include "sim_gauge.h"
+#include "sim_board.h"
+#include "power_control.h"
+#include "protection.h"
+#include "driver/gpio.h"
+#include "esp_log.h"
+#include "samples.h"
+
+#define ARM_GPIO GPIO_NUM_5            // ARM_PIN in main/power_control.c
+#define PULSE_MS 20
+
+typedef struct {
+    const char *name;
+    const char *rule;           // Rule expected to trip, NULL for none
+    int bus;
+    uint16_t reg;
+    uint16_t value;
+    int pulse_ms;               // Restore after this long, 0 to hold until tripped
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    { "pyro discharge fault",   "pyro_fault",   PYRO_BATTERY,   MAX17330_PROTSTATUS, MAX17330_PROT_ODCP, 0 },
+    { "pyro undervoltage",      "pyro_uv",      PYRO_BATTERY,   MAX17330_VCELL,      0x8C00, 0 },      // 2.8 V
+    { "pyro overcurrent",       "pyro_oc",      PYRO_BATTERY,   MAX17330_CURRENT,    (uint16_t)-28800, 0 }, // 4.5 A
+    { "flight undervoltage",    "flight_uv",    FLIGHT_BATTERY, MAX17330_VCELL,      0x8C00, 0 },
+    { "flight protection",      "flight_fault", FLIGHT_BATTERY, MAX17330_PROTSTATUS, MAX17330_PROT_UVP, 0 },
+    { "igniter pulse",          NULL,           PYRO_BATTERY,   MAX17330_CURRENT,    (uint16_t)-28800, PULSE_MS },
+};
+#define SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static const prot_rule_t *find_rule(const char *name, uint8_t *index)
+{
+    size_t count;
+    const prot_rule_t *rules = protection_get_rules(&count);
+    for(size_t i = 0; i < count; i++)
+    {
+        if(strcmp(rules[i].name, name) == 0)
+        {
+            *index = i;
+            return &rules[i];
+        }
+    }
+    return NULL;
+}
+
+static uint32_t trip_total(void)
+{
+    prot_stats_t stats;
+    protection_get_stats(&stats);
+    return stats.trips;
+}
+
+static int wait_released(int64_t timeout_us)
+{
+    int64_t end = host_clock_now_us() + timeout_us;
+    prot_stats_t stats;
+    do
+    {
+        host_clock_sleep_us(PROT_PERIOD_MS * 1000);
+        protection_get_stats(&stats);
+    } while(stats.holding_safe && host_clock_now_us() < end);
+    return stats.holding_safe ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    int trials = 60;
+    unsigned seed = 1;
+    int opt;
+    while((opt = getopt(argc, argv, "n:S:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': trials = atoi(optarg); break;
+            case 'S': seed = strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-n trials] [-S seed]\n", argv[0]);
+                return 2;
+        }
+    }
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    srand(seed);
+
+    sim_board_reset_gauges();
+    sim_board_conf_t board = {
+        .start_protection = 1,
+    };
+    if(sim_board_start(&board) != ESP_OK)
+    {
+        return 1;
+    }
+
+    samples_t latency[SCENARIOS] = {{0}};
+    uint32_t missed[SCENARIOS] = {0}, false_trips[SCENARIOS] = {0}, over_bound[SCENARIOS] = {0};
+    for(int t = 0; t < trials; t++)
+    {
+        const scenario_t *sc = &scenarios[t % SCENARIOS];
+        samples_t *lat = &latency[t % SCENARIOS];
+        if(wait_released(2000000) != 0 || set_armed() != ESP_OK)
+        {
+            fprintf(stderr, "board did not become armable before trial %d\n", t);
+            return 1;
+        }
+        // Land anywhere within the poll period
+        host_clock_sleep_us(PROT_PERIOD_MS * 1000 + rand() % (PROT_PERIOD_MS * 1000));
+
+        uint32_t trips_before = trip_total();
+        uint16_t saved = sim_gauge_get_reg(sc->bus, sc->reg);
+        int64_t onset_us = host_clock_now_us();
+        sim_gauge_set_reg(sc->bus, sc->reg, sc->value);
+
+        if(sc->rule == NULL)
+        {
+            host_clock_sleep_us((int64_t)sc->pulse_ms * 1000);
+            sim_gauge_set_reg(sc->bus, sc->reg, saved);
+            host_clock_sleep_us(10 * PROT_PERIOD_MS * 1000);
+            if(trip_total() != trips_before || gpio_get_level(ARM_GPIO) == 0)
+            {
+                false_trips[t % SCENARIOS]++;
+            }
+            set_disarmed();
+            continue;
+        }
+
+        uint8_t index = 0;
+        const prot_rule_t *rule = find_rule(sc->rule, &index);
+        int64_t bound_us = rule ? protection_bound_us(rule) : 0;
+        while(gpio_get_level(ARM_GPIO) != 0 && host_clock_now_us() - onset_us < 4 * bound_us)
+        {
+            host_clock_sleep_us(1000);
+        }
+        sim_gauge_set_reg(sc->bus, sc->reg, saved);
+
+        prot_trip_t trips[PROT_TRIP_LOG];
+        size_t n = protection_get_trips(trips, PROT_TRIP_LOG);
+        if(rule == NULL || trip_total() == trips_before || gpio_get_level(ARM_GPIO) != 0 ||
+           trips[n - 1].rule != index)
+        {
+            missed[t % SCENARIOS]++;
+            continue;
+        }
+        int64_t reaction_us = trips[n - 1].ts_us - onset_us;
+        samples_add(lat, reaction_us);
+        if(reaction_us > bound_us)
+        {
+            over_bound[t % SCENARIOS]++;
+        }
+    }
+
+    printf("%-22s %6s %6s %6s %9s %9s %9s %9s\n", "scenario", "trials", "missed", "false", "p50 ms", "p99 ms", "max ms",
+           "bound ms");
+    int ret = 0;
+    for(size_t s = 0; s < SCENARIOS; s++)
+    {
+        const scenario_t *sc = &scenarios[s];
+        uint8_t index;
+        const prot_rule_t *rule = sc->rule ? find_rule(sc->rule, &index) : NULL;
+        unsigned runs = trials / SCENARIOS + (s < trials % SCENARIOS);
+        printf("%-22s %6u %6u %6u %9.2f %9.2f %9.2f %9.2f\n", sc->name, runs, missed[s], false_trips[s],
+               samples_pct(&latency[s], 50) / 1000.0, samples_pct(&latency[s], 99) / 1000.0,
+               samples_pct(&latency[s], 100) / 1000.0, rule ? protection_bound_us(rule) / 1000.0 : 0.0);
+        if(missed[s] || false_trips[s] || over_bound[s])
+        {
+            ret = 1;
+        }
+        samples_free(&latency[s]);
+    }
+    prot_stats_t stats;
+    protection_get_stats(&stats);
+    printf("%u polls, %u errors, poll avg %u us max %u us, %u over budget, worst case %.0f ms per poll\n",
+           stats.polls, stats.poll_errors, stats.poll_avg_us, stats.poll_max_us, stats.budget_overruns,
+           PROT_POLL_WORST_US / 1000.0);
+    if(stats.budget_overruns)
+    {
+        ret = 1;
+    }
+    printf("%s\n", ret ? "FAIL" : "PASS");
+    return ret;
+}
@@ -0,0 +1,268 @@
+// Replays a recorded MAX17330 register trace through the simulated I2C bus,
+// the unmodified gauge driver and the HTTP server, at a multiple of real time.
+//
+//   pb_replay -t trace.csv [-s speed] [-p period_ms] [-o out.csv]
+//             [-H http_every] [-e expected.csv] [-T tolerance]
+//             [-L link_max_khz] [-R link_error_ppm]
+//
+// Every sample period both gauges are decoded through get_battery() and one
+// CSV row per battery is written. With -e the rows are compared against a
+// previous run and the exit status reports any mismatch. Speed 0 runs as
+// fast as the host allows. -L and -R model a marginal harness on both buses
+// to exercise the adaptive I2C clock.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include "host_clock.h"
+#include "sim_gauge.h"
+#include "sim_board.h"
+#include "power_control.h"
+#include "i2c_bus.h"
+#include "esp_log.h"
+#include "samples.h"
+
+#define CSV_HEADER "t_ms,battery,soc,curr_cap,max_cap,current,voltage,charge_voltage,charge_current,tte,ttf,age,cycles,charging"
+#define CSV_FIELDS 14
+
+static int format_row(char *buf, size_t len, int64_t t_ms, int battery, const battery_stat_t *st)
+{
+    return snprintf(buf, len, "%lld,%d,%.6f,%.1f,%.1f,%.5f,%.6f,%.6f,%.5f,%.3f,%.3f,%.6f,%u,%u",
+                    (long long)t_ms, battery, st->soc, st->curr_cap, st->max_cap, st->current_mah,
+                    st->batt_voltage, st->charge_voltage, st->charge_current, st->tte_min,
+                    st->ttf_min, st->battery_age, st->charge_cycles, st->charging);
+}
+
+// Returns 0 when both rows hold the same fields within tolerance
+static int compare_rows(const char *got, const char *want, double tol)
+{
+    const char *a = got, *b = want;
+    for(int i = 0; i < CSV_FIELDS; i++)
+    {
+        char *ea, *eb;
+        double x = strtod(a, &ea), y = strtod(b, &eb);
+        if(ea == a || eb == b || fabs(x - y) > tol * fmax(1.0, fabs(y)))
+        {
+            return -1;
+        }
+        a = (*ea == ',') ? ea + 1 : ea;
+        b = (*eb == ',') ? eb + 1 : eb;
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s -t trace.csv [-s speed] [-p period_ms] [-o out.csv] "
+                    "[-H http_every] [-e expected.csv] [-T tolerance] "
+                    "[-L link_max_khz] [-R link_error_ppm]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *trace_path = NULL;
+    const char *out_path = NULL;
+    const char *expect_path = NULL;
+    double speed = 0;
+    int period_ms = 1000;
+    int http_every = 10;
+    double tol = 1e-6;
+    uint32_t link_max_khz = 0;
+    uint32_t link_error_ppm = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "t:s:p:o:H:e:T:L:R:")) != -1)
+    {
+        switch(opt)
+        {
+            case 't': trace_path = optarg; break;
+            case 's': speed = atof(optarg); break;
+            case 'p': period_ms = atoi(optarg); break;
+            case 'o': out_path = optarg; break;
+            case 'H': http_every = atoi(optarg); break;
+            case 'e': expect_path = optarg; break;
+            case 'T': tol = atof(optarg); break;
+            case 'L': link_max_khz = strtoul(optarg, NULL, 0); break;
+            case 'R': link_error_ppm = strtoul(optarg, NULL, 0); break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if(trace_path == NULL || period_ms <= 0 || speed < 0)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    sim_trace_t trace;
+    if(sim_trace_load(&trace, trace_path) != 0)
+    {
+        fprintf(stderr, "failed to load trace %s\n", trace_path);
+        return 2;
+    }
+    FILE *out = out_path ? fopen(out_path, "w") : stdout;
+    FILE *expect = expect_path ? fopen(expect_path, "r") : NULL;
+    if(out == NULL || (expect_path && expect == NULL))
+    {
+        fprintf(stderr, "failed to open output or expectation file\n");
+        return 2;
+    }
+    esp_log_level_set("*", ESP_LOG_WARN);
+    esp_log_level_set("i2c-bus", ESP_LOG_INFO);
+
+    // Registers recorded at t=0 stand in for the gauge state at power-up
+    sim_board_reset_gauges();
+    sim_trace_apply(&trace, 0);
+    for(int b = 0; b < SIM_GAUGE_COUNT; b++)
+    {
+        sim_gauge_set_link(b, link_max_khz * 1000, link_error_ppm);
+    }
+    sim_board_conf_t board = {
+        .speed = speed,
+        .start_http = http_every > 0,
+    };
+    if(sim_board_start(&board) != ESP_OK)
+    {
+        return 1;
+    }
+    // Trace time starts once the firmware is up
+    int64_t t0_us = host_clock_now_us();
+    int64_t wall0_us = host_clock_wall_us();
+
+    samples_t decode_us = {0}, bus_us = {0}, http_us = {0}, lag_us = {0};
+    uint32_t bus_before[SIM_GAUGE_COUNT];
+    for(int b = 0; b < SIM_GAUGE_COUNT; b++)
+    {
+        sim_gauge_stats_t st;
+        sim_gauge_get_stats(b, &st);
+        bus_before[b] = st.transactions;
+    }
+
+    fprintf(out, CSV_HEADER "\n");
+    char expect_line[256];
+    if(expect && !fgets(expect_line, sizeof(expect_line), expect))
+    {
+        fprintf(stderr, "expectation file is empty\n");
+        return 2;
+    }
+
+    static char http_body[8192];
+    unsigned mismatches = 0, rows = 0, http_errors = 0;
+    int64_t duration_us = sim_trace_duration_us(&trace);
+    uint64_t tick = 0;
+    for(int64_t t_us = 0; t_us <= duration_us; t_us += (int64_t)period_ms * 1000, tick++)
+    {
+        host_clock_sleep_until_us(t0_us + t_us);
+        samples_add(&lag_us, host_clock_now_us() - (t0_us + t_us));
+        sim_trace_apply(&trace, t_us);
+
+        for(int b = 0; b < SIM_GAUGE_COUNT; b++)
+        {
+            int64_t start = host_clock_wall_us();
+            int64_t start_virtual = host_clock_now_us();
+            battery_stat_t stat = get_battery(b);
+            samples_add(&bus_us, host_clock_now_us() - start_virtual);
+            samples_add(&decode_us, host_clock_wall_us() - start);
+
+            char row[256];
+            format_row(row, sizeof(row), t_us / 1000, b, &stat);
+            fprintf(out, "%s\n", row);
+            rows++;
+            if(expect)
+            {
+                if(!fgets(expect_line, sizeof(expect_line), expect) || compare_rows(row, expect_line, tol) != 0)
+                {
+                    if(mismatches++ < 10)
+                    {
+                        fprintf(stderr, "mismatch at t=%lld ms battery %d\n  got:  %s\n  want: %s",
+                                (long long)(t_us / 1000), b, row, expect_line);
+                    }
+                }
+            }
+        }
+
+        if(http_every > 0 && tick % http_every == 0)
+        {
+            httpd_host_request_t request = {
+                .method = HTTP_GET,
+                .uri = "/battery",
+            };
+            httpd_host_response_t response = {
+                .body = http_body,
+                .body_cap = sizeof(http_body),
+            };
+            int64_t start = host_clock_wall_us();
+            if(httpd_host_request(sim_board_http(), &request, &response) != ESP_OK || response.status != 200)
+            {
+                http_errors++;
+            }
+            samples_add(&http_us, host_clock_wall_us() - start);
+        }
+    }
+    int64_t wall_us = host_clock_wall_us() - wall0_us;
+    if(out != stdout)
+    {
+        fclose(out);
+    }
+
+    uint32_t bus_total = 0;
+    for(int b = 0; b < SIM_GAUGE_COUNT; b++)
+    {
+        sim_gauge_stats_t st;
+        sim_gauge_get_stats(b, &st);
+        bus_total += st.transactions - bus_before[b];
+    }
+
+    fprintf(stderr, "replayed %.1f s of trace (%zu events) in %.3f s wall, %.0fx real time\n",
+            duration_us / 1e6, trace.count, wall_us / 1e6, wall_us ? (double)duration_us / wall_us : 0.0);
+    fprintf(stderr, "decoded %u rows, %.1f bus transactions per sample\n",
+            rows, rows ? (double)bus_total / rows : 0.0);
+    for(int b = 0; b < SIM_GAUGE_COUNT; b++)
+    {
+        max17330_cache_stats_t cache;
+        if(get_cache_stats(b, &cache) == ESP_OK)
+        {
+            fprintf(stderr, "gauge %d shadow: %u hits, %u bus reads, %u bus writes, %u writes skipped\n",
+                    b, cache.hits, cache.bus_reads, cache.bus_writes, cache.writes_skipped);
+        }
+        i2c_bus_stats_t bus;
+        if(i2c_bus_get_stats(b, &bus) == ESP_OK)
+        {
+            fprintf(stderr, "bus %d: %u transactions, %u errors, %u timeouts, %u expired, %u recoveries\n",
+                    b, bus.transactions, bus.errors, bus.timeouts, bus.expired, bus.recoveries);
+            fprintf(stderr, "bus %d link: %u Hz (max %u), %u steps down, %u up, %u probes failed, "
+                    "latency avg %u us max %u us\n",
+                    b, bus.clk, bus.clk_max, bus.step_downs, bus.step_ups, bus.probes_failed,
+                    bus.latency_avg_us, bus.latency_max_us);
+        }
+    }
+    fprintf(stderr, "decode wall time us: p50 %lld p99 %lld max %lld\n",
+            (long long)samples_pct(&decode_us, 50), (long long)samples_pct(&decode_us, 99),
+            (long long)samples_pct(&decode_us, 100));
+    fprintf(stderr, "decode virtual us: p50 %lld p99 %lld max %lld\n",
+            (long long)samples_pct(&bus_us, 50), (long long)samples_pct(&bus_us, 99),
+            (long long)samples_pct(&bus_us, 100));
+    fprintf(stderr, "schedule lag virtual us: p50 %lld p99 %lld max %lld\n",
+            (long long)samples_pct(&lag_us, 50), (long long)samples_pct(&lag_us, 99),
+            (long long)samples_pct(&lag_us, 100));
+    if(http_us.count)
+    {
+        fprintf(stderr, "/battery: %zu requests, %u errors, wall us p50 %lld max %lld\n",
+                http_us.count, http_errors, (long long)samples_pct(&http_us, 50),
+                (long long)samples_pct(&http_us, 100));
+    }
+
+    if(expect)
+    {
+        if(fgets(expect_line, sizeof(expect_line), expect))
+        {
+            fprintf(stderr, "expectation file has more rows than the replay\n");
+            mismatches++;
+        }
+        fclose(expect);
+        fprintf(stderr, "%s: %u mismatching rows\n", mismatches ? "FAIL" : "PASS", mismatches);
+    }
+    sim_trace_free(&trace);
+    return (mismatches || http_errors) ? 1 : 0;
+}
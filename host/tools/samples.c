@@ -0,0 +1,45 @@
+#include "samples.h"
+#include <stdlib.h>
+
+void samples_add(samples_t *s, int64_t v)
+{
+    if(s->count == s->cap)
+    {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->values = realloc(s->values, s->cap * sizeof(*s->values));
+    }
+    s->values[s->count++] = v;
+}
+
+void samples_reserve(samples_t *s, size_t cap)
+{
+    if(cap > s->cap)
+    {
+        s->cap = cap;
+        s->values = realloc(s->values, s->cap * sizeof(*s->values));
+    }
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int64_t samples_pct(samples_t *s, double pct)
+{
+    if(s->count == 0)
+    {
+        return 0;
+    }
+    qsort(s->values, s->count, sizeof(*s->values), cmp_i64);
+    size_t idx = (size_t)(pct / 100.0 * (s->count - 1) + 0.5);
+    return s->values[idx];
+}
+
+void samples_free(samples_t *s)
+{
+    free(s->values);
+    s->values = NULL;
+    s->count = s->cap = 0;
+}
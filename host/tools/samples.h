@@ -0,0 +1,25 @@
+#ifndef SAMPLES_H
+#define SAMPLES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Growable list of measurements for percentile reports in the host tools
+
+typedef struct {
+    int64_t *values;
+    size_t count;
+    size_t cap;
+} samples_t;
+
+void samples_add(samples_t *s, int64_t v);
+
+// Allocates room up front, e.g. to keep the tool's own growth out of heap figures
+void samples_reserve(samples_t *s, size_t cap);
+
+// Nearest-rank percentile, pct 100 is the maximum; sorts the values in place
+int64_t samples_pct(samples_t *s, double pct);
+
+void samples_free(samples_t *s);
+
+#endif
@@ -0,0 +1,107 @@
+// Runs one simulated board and serves its HTTP API on a real TCP port, as a
+// stand-in for a board on the bench when developing tools that talk to it.
+//
+//   pb_simboard [-p port] [-s speed] [-t trace.csv] [-d seconds]
+//
+// With -t the gauges follow the recorded trace, restarting it when it ends;
+// otherwise both packs slowly discharge and recover so that the snapshot
+// changes every sample. Speed defaults to real time. Runs until killed, or
+// for -d seconds of virtual time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "host_clock.h"
+#include "sim_gauge.h"
+#include "sim_board.h"
+#include "max17330.h"
+#include "esp_http_server.h"
+#include "esp_log.h"
+
+#define STEP_MS 100
+#define BRIDGE_CONNECTIONS 7    // HTTP_MAX_SOCKETS in main/http_server.c
+
+// Sweeps VCELL between 3.3 V and 4.1 V over ten minutes, phase shifted per pack
+static void drift(int64_t t_us)
+{
+    for(int bus = 0; bus < SIM_GAUGE_COUNT; bus++)
+    {
+        int64_t t_s = t_us / 1000000 + bus * 150;
+        int64_t phase = t_s % 600;
+        int64_t ramp = phase < 300 ? phase : 600 - phase;
+        uint16_t vcell = 0xA900 + (uint16_t)(ramp * (0xD200 - 0xA900) / 300);
+        sim_gauge_set_reg(bus, MAX17330_VCELL, vcell);
+        sim_gauge_set_reg(bus, MAX17330_VFSOC, (uint16_t)(ramp * 0x6400 / 300));
+        sim_gauge_set_reg(bus, MAX17330_REPCAP, (uint16_t)(ramp * (bus ? SIM_PYRO_CAP_MAH : SIM_FLIGHT_CAP_MAH) * 2 / 300));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int port = 8080;
+    double speed = 1.0;
+    const char *trace_path = NULL;
+    int64_t duration_s = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "p:s:t:d:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'p': port = atoi(optarg); break;
+            case 's': speed = atof(optarg); break;
+            case 't': trace_path = optarg; break;
+            case 'd': duration_s = atoll(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-p port] [-s speed] [-t trace.csv] [-d seconds]\n", argv[0]);
+                return 2;
+        }
+    }
+    esp_log_level_set("*", ESP_LOG_WARN);
+
+    sim_trace_t trace = {0};
+    if(trace_path != NULL && sim_trace_load(&trace, trace_path) != 0)
+    {
+        fprintf(stderr, "cannot load trace %s\n", trace_path);
+        return 1;
+    }
+
+    sim_board_reset_gauges();
+    sim_board_conf_t board = {
+        .speed = speed,
+        .start_http = 1,
+        .start_protection = 1,
+    };
+    if(sim_board_start(&board) != ESP_OK)
+    {
+        return 1;
+    }
+    if(httpd_host_listen(port, BRIDGE_CONNECTIONS) != ESP_OK)
+    {
+        fprintf(stderr, "cannot listen on port %d\n", port);
+        return 1;
+    }
+    printf("simulated board listening on port %d\n", port);
+    fflush(stdout);
+
+    int64_t trace_start_us = host_clock_now_us();
+    while(duration_s == 0 || host_clock_now_us() < duration_s * 1000000)
+    {
+        int64_t now_us = host_clock_now_us();
+        if(trace_path != NULL)
+        {
+            if(trace.next == trace.count)
+            {
+                trace.next = 0;
+                trace_start_us = now_us;
+            }
+            sim_trace_apply(&trace, now_us - trace_start_us);
+        }
+        else
+        {
+            drift(now_us);
+        }
+        host_clock_sleep_us(STEP_MS * 1000);
+    }
+    sim_trace_free(&trace);
+    return 0;
+}
@@ -0,0 +1,633 @@
+// Soak test: runs the simulated board for hours or days of virtual time, the
+// way it sits armed on the pad through a long hold, and looks for anything
+// that slowly gets worse.
+//
+//   pb_soak [-t hours] [-w window_min] [-W warmup_windows] [-f fault_period_s]
+//           [-p phones] [-S seed] [-o windows.csv]
+//
+// The sampler, protection interlock and HTTP server run as on the board, and
+// the server is stopped and started again every RESET_INTERVAL, as
+// reset_interface() does along with the Wi-Fi. Around them:
+//   - an armer keeps the board armed for long holds with short breaks, and
+//     checks that the output never drops without a trip;
+//   - phones join at random, load the page, long-poll /status for a while and
+//     leave, up to -p at a time, while a monitor client works through the API;
+//   - every -f seconds on average a fault is injected: a NACKing or stuck
+//     gauge, a noisy link, or an undervoltage that trips the interlock.
+// Every window records the heap in use, the size of the heap and its free
+// chunks, the task and file descriptor counts, API latency percentiles and the
+// periodic tasks' execution times and misses, optionally as CSV. After the
+// warm-up, each series is tested for a monotonic trend (Mann-Kendall) whose
+// fitted rise over the run exceeds the metric's tolerance. The exit status is
+// non-zero on any such drift, a periodic task that stopped running, an
+// unexpected response or a disarm without a trip.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <malloc.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_http_server.h"
+#include "esp_log.h"
+#include "driver/gpio.h"
+#include "host_clock.h"
+#include "sim_board.h"
+#include "sim_gauge.h"
+#include "max17330.h"
+#include "protection.h"
+#include "tasks.h"
+#include "main.h"
+#include "samples.h"
+
+#define ARM_GPIO GPIO_NUM_5            // ARM_PIN in main/power_control.c
+#define CLIENT_BODY_CAP 8192
+#define CLIENT_PRIORITY (tskIDLE_PRIORITY + 1)
+#define MAX_PHONES 8
+#define STEP_MS 100
+#define MONITOR_PERIOD_MS 2000
+#define ARM_HOLD_S 1800                 // Armed on the pad
+#define ARM_BREAK_S 300                 // Disarmed in between
+#define LATENCY_RESERVE 65536
+#define LINK_RATE 200000                // Bytes per second, as pb_loadtest's default
+
+// A trend counts once Mann-Kendall's tau reaches this over at least
+// TREND_MIN_WINDOWS windows and the fitted line rises past the tolerance
+#define TREND_TAU 0.5
+#define TREND_MIN_WINDOWS 8
+
+esp_err_t start_http_server();
+esp_err_t stop_http_server();
+
+typedef enum {
+    M_HEAP_USED,
+    M_HEAP_SIZE,
+    M_FREE_CHUNKS,
+    M_TASKS,
+    M_FDS,
+    M_API_P50,
+    M_API_P99,
+    M_ARM_P99,
+    M_SAMPLER_EXEC,
+    M_PROT_EXEC,
+    M_MISSES,
+    METRIC_COUNT,
+} metric_t;
+
+static const struct {
+    const char *name;
+    double tolerance;           // Rise over the run that is still noise
+} metrics[METRIC_COUNT] = {
+    [M_HEAP_USED]    = { "heap_used_B",     4096 },
+    [M_HEAP_SIZE]    = { "heap_size_B",     65536 },
+    [M_FREE_CHUNKS]  = { "free_chunks",     64 },
+    [M_TASKS]        = { "tasks",           0.5 },
+    [M_FDS]          = { "fds",             0.5 },
+    [M_API_P50]      = { "api_p50_ms",      1 },
+    [M_API_P99]      = { "api_p99_ms",      2 },
+    [M_ARM_P99]      = { "arm_p99_ms",      2 },
+    [M_SAMPLER_EXEC] = { "sampler_exec_us", 200 },
+    [M_PROT_EXEC]    = { "prot_exec_us",    200 },
+    [M_MISSES]       = { "misses",          2 },
+};
+
+typedef enum {
+    FAULT_NACK,
+    FAULT_STUCK,
+    FAULT_NOISE,
+    FAULT_UNDERVOLTAGE,
+    FAULT_KINDS,
+} fault_kind_t;
+
+static const char *fault_names[FAULT_KINDS] = { "nack", "stuck", "noise", "undervoltage" };
+
+// Clients, the fault injector and the recorder take turns on the simulated
+// CPU, so none of this needs locking
+static int64_t end_us;
+static int fault_period_s = 600;
+static int max_phones = 4;
+static int undervoltage_bus = -1;
+static uint32_t fault_counts[FAULT_KINDS];
+static uint32_t requests;
+static uint32_t dropped;                // Connections lost to a server restart
+static uint32_t unexpected;
+static uint32_t server_restarts;
+static uint32_t holds;
+static uint32_t safed;                  // Holds ended by a trip
+static uint32_t spurious_disarms;
+static uint32_t phones_joined;
+static int phones_alive;
+static samples_t api_latency_us;
+static samples_t arm_latency_us;
+
+static char phone_bodies[MAX_PHONES][CLIENT_BODY_CAP];
+static bool phone_used[MAX_PHONES];
+static char monitor_body[CLIENT_BODY_CAP];
+static char armer_body[CLIENT_BODY_CAP];
+
+static int64_t random_us(int64_t min_us, int64_t max_us)
+{
+    return min_us + (int64_t)((double)rand() / RAND_MAX * (max_us - min_us));
+}
+
+// Returns the HTTP status, 0 for a dropped connection
+static int request(httpd_method_t method, const char *uri, char *body, samples_t *latency)
+{
+    httpd_host_request_t rq = {
+        .method = method,
+        .uri = uri,
+        .body = "toggle",
+        .body_len = method == HTTP_POST ? 6 : 0,
+    };
+    httpd_host_response_t rs = {
+        .body = body,
+        .body_cap = CLIENT_BODY_CAP,
+    };
+    int64_t start = host_clock_now_us();
+    // Between a stop and the next start there is no server at all
+    httpd_handle_t server = httpd_host_default();
+    esp_err_t err = server != NULL ? httpd_host_request(server, &rq, &rs) : ESP_ERR_INVALID_STATE;
+    requests++;
+    if(err != ESP_OK || rs.status == 0)
+    {
+        dropped++;
+        return 0;
+    }
+    if(latency != NULL)
+    {
+        samples_add(latency, host_clock_now_us() - start);
+    }
+    if(rs.status != 200 && rs.status != 304 && rs.status != 503 && !(rs.status == 409 && strcmp(uri, "/arm") == 0))
+    {
+        unexpected++;
+        fprintf(stderr, "%.3f h: %s %s: status %d\n", host_clock_now_us() / 3.6e9,
+                method == HTTP_POST ? "POST" : "GET", uri, rs.status);
+    }
+    return rs.status;
+}
+
+// ---- Clients ----
+
+static void phone_task(void *arg)
+{
+    int slot = (int)(intptr_t)arg;
+    char *body = phone_bodies[slot];
+    static const char *page[] = { "/", "/history", "/pspha.png", "/favicon.ico" };
+    for(size_t i = 0; i < sizeof(page) / sizeof(page[0]); i++)
+    {
+        request(HTTP_GET, page[i], body, NULL);
+    }
+    int64_t leave_us = host_clock_now_us() + random_us(10000000, 900000000);
+    long seq = -1;
+    char uri[48];
+    while(host_clock_now_us() < leave_us && host_clock_now_us() < end_us)
+    {
+        if(seq < 0)
+        {
+            snprintf(uri, sizeof(uri), "/status");
+        }
+        else
+        {
+            snprintf(uri, sizeof(uri), "/status?since=%ld", seq);
+        }
+        int status = request(HTTP_GET, uri, body, NULL);
+        const char *field = status == 200 ? strstr(body, "\"seq\":") : NULL;
+        long got = field ? strtol(field + 6, NULL, 10) : -1;
+        if(status != 200 && status != 304)
+        {
+            // Reconnects after the access point comes back
+            seq = -1;
+            vTaskDelay(pdMS_TO_TICKS(1000));
+        }
+        else if(status == 200)
+        {
+            if(got == seq)
+            {
+                vTaskDelay(pdMS_TO_TICKS(1000));
+            }
+            seq = got;
+        }
+    }
+    phone_used[slot] = false;
+    phones_alive--;
+    vTaskDelete(NULL);
+}
+
+static void churn_task(void *arg)
+{
+    while(host_clock_now_us() < end_us)
+    {
+        vTaskDelay(pdMS_TO_TICKS(random_us(5000000, 120000000) / 1000));
+        for(int slot = 0; slot < max_phones; slot++)
+        {
+            if(!phone_used[slot])
+            {
+                phone_used[slot] = true;
+                phones_alive++;
+                phones_joined++;
+                xTaskCreate(phone_task, "phone", 4096, (void *)(intptr_t)slot, CLIENT_PRIORITY, NULL);
+                break;
+            }
+        }
+    }
+    vTaskDelete(NULL);
+}
+
+static void monitor_task(void *arg)
+{
+    static const char *api[] = {
+        "/status", "/battery", "/arm", "/protection", "/tasks", "/link", "/history?since=250", "/log", "/ota",
+    };
+    for(size_t i = 0; host_clock_now_us() < end_us; i++)
+    {
+        const char *uri = api[i % (sizeof(api) / sizeof(api[0]))];
+        request(HTTP_GET, uri, monitor_body, strcmp(uri, "/arm") == 0 ? &arm_latency_us : &api_latency_us);
+        vTaskDelay(pdMS_TO_TICKS(MONITOR_PERIOD_MS));
+    }
+    vTaskDelete(NULL);
+}
+
+static uint32_t trip_total(void)
+{
+    prot_stats_t stats;
+    protection_get_stats(&stats);
+    return stats.trips;
+}
+
+// POST /arm toggles, so it is only sent when the output is not where the
+// phase wants it
+static void armer_task(void *arg)
+{
+    int64_t phase_end = host_clock_now_us();
+    bool hold = false;
+    bool was_armed = false;
+    uint32_t trips = trip_total();
+    while(host_clock_now_us() < end_us)
+    {
+        if(host_clock_now_us() >= phase_end)
+        {
+            hold = !hold;
+            holds += hold;
+            phase_end = host_clock_now_us() + (int64_t)(hold ? ARM_HOLD_S : ARM_BREAK_S) * 1000000;
+        }
+        bool level = gpio_get_level(ARM_GPIO);
+        if(hold && was_armed && !level)
+        {
+            // The interlock drives the output low before it logs the trip
+            vTaskDelay(pdMS_TO_TICKS(2 * PROT_PERIOD_MS));
+            if(trip_total() == trips)
+            {
+                spurious_disarms++;
+                fprintf(stderr, "%.3f h: disarmed without a trip\n", host_clock_now_us() / 3.6e9);
+            }
+            else
+            {
+                safed++;
+            }
+        }
+        trips = trip_total();
+        if(level != hold)
+        {
+            request(HTTP_POST, "/arm", armer_body, &arm_latency_us);
+        }
+        was_armed = gpio_get_level(ARM_GPIO);
+        vTaskDelay(pdMS_TO_TICKS(1000));
+    }
+    vTaskDelete(NULL);
+}
+
+// ---- Board ----
+
+// Stands in for reset_interface(), which also restarts the Wi-Fi
+static void interface_task(void *arg)
+{
+    static task_period_t period;
+    task_period_init(&period, "reset_interface", RESET_INTERVAL);
+    while(1)
+    {
+        task_period_wait(&period);
+        if(stop_http_server() != ESP_OK || start_http_server() != ESP_OK)
+        {
+            fprintf(stderr, "%.3f h: HTTP server restart failed\n", host_clock_now_us() / 3.6e9);
+            unexpected++;
+        }
+        httpd_host_set_link_rate(httpd_host_default(), LINK_RATE);
+        server_restarts++;
+    }
+}
+
+static void fault_task(void *arg)
+{
+    while(1)
+    {
+        vTaskDelay(pdMS_TO_TICKS(random_us(fault_period_s * 500000LL, fault_period_s * 1500000LL) / 1000));
+        int bus = rand() % SIM_GAUGE_COUNT;
+        fault_kind_t kind = rand() % FAULT_KINDS;
+        fault_counts[kind]++;
+        switch(kind)
+        {
+            case FAULT_NACK:
+                sim_gauge_set_fault(bus, SIM_FAULT_NACK);
+                vTaskDelay(pdMS_TO_TICKS(random_us(1000000, 10000000) / 1000));
+                sim_gauge_set_fault(bus, SIM_FAULT_NONE);
+                break;
+            case FAULT_STUCK:
+                sim_gauge_set_fault(bus, SIM_FAULT_STUCK);
+                vTaskDelay(pdMS_TO_TICKS(random_us(1000000, 5000000) / 1000));
+                sim_gauge_set_fault(bus, SIM_FAULT_NONE);
+                break;
+            case FAULT_NOISE:
+                sim_gauge_set_link(bus, 0, 20000);
+                vTaskDelay(pdMS_TO_TICKS(60000));
+                sim_gauge_set_link(bus, 0, 0);
+                break;
+            default:
+                undervoltage_bus = bus;
+                vTaskDelay(pdMS_TO_TICKS(2000));
+                undervoltage_bus = -1;
+                break;
+        }
+    }
+}
+
+// Sweeps both packs' VCELL, SOC and current so that every sample changes
+static void drift(int64_t t_us)
+{
+    for(int bus = 0; bus < SIM_GAUGE_COUNT; bus++)
+    {
+        int64_t phase = (t_us / 1000000 + bus * 37) % 120;
+        int64_t ramp = phase < 60 ? phase : 120 - phase;
+        uint16_t vcell = bus == undervoltage_bus ? 0x8C00 : 0xB000 + (uint16_t)(ramp * 0x80);     // 2.8 V, or 3.4 V to 4.0 V
+        sim_gauge_set_reg(bus, MAX17330_VCELL, vcell);
+        sim_gauge_set_reg(bus, MAX17330_VFSOC, (uint16_t)(ramp * 0x6400 / 60));
+        sim_gauge_set_reg(bus, MAX17330_CURRENT, (uint16_t)(0x10000 - 0x100 - ramp * 8));
+    }
+}
+
+// ---- Recording ----
+
+static int count_fds(void)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    if(dir == NULL)
+    {
+        return -1;
+    }
+    int n = 0;
+    while(readdir(dir) != NULL)
+    {
+        n++;
+    }
+    closedir(dir);
+    return n - 3;   // ".", ".." and the directory itself
+}
+
+static task_period_stats_t periodic_last[TASK_PERIODIC_MAX];
+static size_t periodic_last_count;
+
+// Fills one window's metrics; returns the number of periodic tasks that did
+// not run at all although their period fits the window several times
+static int record(double *m, int64_t window_us)
+{
+    // Heap first, before anything here allocates
+    struct mallinfo2 mi = mallinfo2();
+    m[M_HEAP_USED] = mi.uordblks;
+    m[M_HEAP_SIZE] = mi.arena + mi.hblkhd;
+    m[M_FREE_CHUNKS] = mi.ordblks;
+    m[M_TASKS] = (double)uxTaskGetNumberOfTasks() - phones_alive;
+    m[M_FDS] = count_fds();
+    m[M_API_P50] = samples_pct(&api_latency_us, 50) / 1000.0;
+    m[M_API_P99] = samples_pct(&api_latency_us, 99) / 1000.0;
+    m[M_ARM_P99] = samples_pct(&arm_latency_us, 99) / 1000.0;
+    api_latency_us.count = 0;
+    arm_latency_us.count = 0;
+
+    task_period_stats_t periodic[TASK_PERIODIC_MAX];
+    size_t count = task_period_get_stats(periodic, TASK_PERIODIC_MAX);
+    int stalled = 0;
+    m[M_MISSES] = 0;
+    m[M_SAMPLER_EXEC] = m[M_PROT_EXEC] = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        task_period_stats_t *p = &periodic[i];
+        uint32_t runs = p->runs, misses = p->misses;
+        if(i < periodic_last_count)
+        {
+            runs -= periodic_last[i].runs;
+            misses -= periodic_last[i].misses;
+        }
+        if(runs == 0 && (int64_t)p->period_ms * 2000 < window_us)
+        {
+            fprintf(stderr, "%.3f h: task %s did not run this window\n", host_clock_now_us() / 3.6e9, p->name);
+            stalled++;
+        }
+        m[M_MISSES] += misses;
+        if(strcmp(p->name, "sampler") == 0)
+        {
+            m[M_SAMPLER_EXEC] = p->exec_avg_us;
+        }
+        else if(strcmp(p->name, "protection") == 0)
+        {
+            m[M_PROT_EXEC] = p->exec_avg_us;
+        }
+    }
+    memcpy(periodic_last, periodic, count * sizeof(periodic[0]));
+    periodic_last_count = count;
+    return stalled;
+}
+
+// Mann-Kendall statistic normalised to [-1, 1], and the rise of the
+// least-squares line from the first window to the last
+static void trend(const double *y, size_t n, double *tau, double *rise)
+{
+    long s = 0;
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for(size_t i = 0; i < n; i++)
+    {
+        for(size_t j = i + 1; j < n; j++)
+        {
+            s += (y[j] > y[i]) - (y[j] < y[i]);
+        }
+        sx += i;
+        sy += y[i];
+        sxx += (double)i * i;
+        sxy += i * y[i];
+    }
+    *tau = n > 1 ? s / (n * (n - 1) / 2.0) : 0;
+    double den = n * sxx - sx * sx;
+    double slope = den != 0 ? (n * sxy - sx * sy) / den : 0;
+    *rise = slope * (n > 0 ? n - 1 : 0);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-t hours] [-w window_min] [-W warmup_windows] [-f fault_period_s] "
+                    "[-p phones] [-S seed] [-o windows.csv]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    double hours = 24;
+    int window_min = 10;
+    int warmup = 6;
+    unsigned seed = 1;
+    const char *csv_path = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "t:w:W:f:p:S:o:")) != -1)
+    {
+        switch(opt)
+        {
+            case 't': hours = atof(optarg); break;
+            case 'w': window_min = atoi(optarg); break;
+            case 'W': warmup = atoi(optarg); break;
+            case 'f': fault_period_s = atoi(optarg); break;
+            case 'p': max_phones = atoi(optarg); break;
+            case 'S': seed = strtoul(optarg, NULL, 0); break;
+            case 'o': csv_path = optarg; break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    size_t windows = window_min > 0 ? (size_t)(hours * 60 / window_min) : 0;
+    if(windows < (size_t)warmup + TREND_MIN_WINDOWS || warmup < 0 || fault_period_s <= 0 ||
+       max_phones < 0 || max_phones > MAX_PHONES)
+    {
+        fprintf(stderr, "need at least %d windows after the warm-up, -f > 0 and 0..%d phones\n",
+                TREND_MIN_WINDOWS, MAX_PHONES);
+        usage(argv[0]);
+        return 2;
+    }
+    FILE *csv = NULL;
+    if(csv_path != NULL && (csv = fopen(csv_path, "w")) == NULL)
+    {
+        perror(csv_path);
+        return 2;
+    }
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    // Keep every thread on the main arena so that mallinfo2() sees all of it
+    mallopt(M_ARENA_MAX, 1);
+    srand(seed);
+
+    double (*series)[METRIC_COUNT] = calloc(windows, sizeof(*series));
+    samples_reserve(&api_latency_us, LATENCY_RESERVE);
+    samples_reserve(&arm_latency_us, LATENCY_RESERVE);
+
+    sim_board_reset_gauges();
+    sim_board_conf_t board = {
+        .start_http = 1,
+        .start_protection = 1,
+    };
+    if(sim_board_start(&board) != ESP_OK)
+    {
+        return 1;
+    }
+    httpd_host_set_link_rate(httpd_host_default(), LINK_RATE);
+
+    int64_t start_us = host_clock_now_us();
+    int64_t window_us = (int64_t)window_min * 60000000;
+    int64_t wall0_us = host_clock_wall_us();
+    end_us = start_us + (int64_t)windows * window_us;
+    xTaskCreate(interface_task, "reset_interface", 4096, NULL, CLIENT_PRIORITY, NULL);
+    xTaskCreate(fault_task, "fault", 4096, NULL, CLIENT_PRIORITY, NULL);
+    xTaskCreate(armer_task, "armer", 4096, NULL, CLIENT_PRIORITY, NULL);
+    xTaskCreate(monitor_task, "monitor", 4096, NULL, CLIENT_PRIORITY, NULL);
+    if(max_phones > 0)
+    {
+        xTaskCreate(churn_task, "churn", 4096, NULL, CLIENT_PRIORITY, NULL);
+    }
+
+    if(csv != NULL)
+    {
+        fprintf(csv, "t_h");
+        for(int k = 0; k < METRIC_COUNT; k++)
+        {
+            fprintf(csv, ",%s", metrics[k].name);
+        }
+        fprintf(csv, "\n");
+    }
+    int stalled = 0;
+    for(size_t w = 0; w < windows; w++)
+    {
+        int64_t window_end = start_us + (int64_t)(w + 1) * window_us;
+        while(host_clock_now_us() < window_end)
+        {
+            drift(host_clock_now_us());
+            host_clock_sleep_us(STEP_MS * 1000);
+        }
+        stalled += record(series[w], window_us);
+        if(csv != NULL)
+        {
+            fprintf(csv, "%.3f", (host_clock_now_us() - start_us) / 3.6e9);
+            for(int k = 0; k < METRIC_COUNT; k++)
+            {
+                fprintf(csv, ",%.3f", series[w][k]);
+            }
+            fprintf(csv, "\n");
+            fflush(csv);
+        }
+    }
+    double wall_s = (host_clock_wall_us() - wall0_us) / 1e6;
+
+    printf("%.1f h simulated in %.1f s wall, %zu windows of %d min, first %d skipped\n",
+           windows * window_min / 60.0, wall_s, windows, window_min, warmup);
+    printf("%u requests, %u dropped by %u server restarts, %u unexpected; %u phones joined\n",
+           requests, dropped, server_restarts, unexpected, phones_joined);
+    printf("faults:");
+    for(int k = 0; k < FAULT_KINDS; k++)
+    {
+        printf(" %s %u", fault_names[k], fault_counts[k]);
+    }
+    printf("; %u holds, %u ended by a trip, %u disarms without one\n", holds, safed, spurious_disarms);
+
+    printf("%-16s %12s %12s %12s %12s %7s %12s\n", "metric", "min", "max", "fit start", "fit end", "tau", "");
+    int drifting = 0;
+    size_t n = windows - warmup;
+    double *y = malloc(n * sizeof(*y));
+    for(int k = 0; k < METRIC_COUNT; k++)
+    {
+        double lo = series[warmup][k], hi = lo, sum = 0;
+        for(size_t i = 0; i < n; i++)
+        {
+            y[i] = series[warmup + i][k];
+            lo = y[i] < lo ? y[i] : lo;
+            hi = y[i] > hi ? y[i] : hi;
+            sum += y[i];
+        }
+        double tau, rise;
+        trend(y, n, &tau, &rise);
+        double mean = sum / n;
+        bool drift_up = tau >= TREND_TAU && rise > metrics[k].tolerance;
+        drifting += drift_up;
+        printf("%-16s %12.2f %12.2f %12.2f %12.2f %7.2f %12s\n", metrics[k].name, lo, hi,
+               mean - rise / 2, mean + rise / 2, tau, drift_up ? "DRIFT" : "");
+    }
+    free(y);
+
+    bool pass = drifting == 0 && stalled == 0 && unexpected == 0 && spurious_disarms == 0;
+    if(drifting > 0)
+    {
+        printf("FAIL: %d metrics drift upwards\n", drifting);
+    }
+    if(stalled > 0)
+    {
+        printf("FAIL: periodic tasks stalled in %d windows\n", stalled);
+    }
+    if(unexpected > 0)
+    {
+        printf("FAIL: %u unexpected responses\n", unexpected);
+    }
+    if(spurious_disarms > 0)
+    {
+        printf("FAIL: %u disarms without a trip\n", spurious_disarms);
+    }
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    fflush(stdout);
+    if(csv != NULL)
+    {
+        fclose(csv);
+    }
+    // Tasks still hold the scheduler, so skip atexit handlers
+    _exit(pass ? 0 : 1);
+}
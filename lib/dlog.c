@@ -0,0 +1,321 @@
+#include "dlog.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define DLOG_SPEC_MAX 16
+
+// Bounded multi-producer ring. Slot i is free for position pos when
+// seq + i == pos and holds a record for pos when seq + i == pos + 1, so the
+// zero-initialized array starts out free without an init pass.
+typedef struct {
+    atomic_uint seq;
+    dlog_record_t rec;
+} dlog_slot_t;
+
+static const struct {
+    esp_log_level_t level;
+    const char *tag;
+    const char *format;
+} formats[DLOG_ID_COUNT] = {
+#define DLOG_ENTRY(id, level, tag, format) [id] = { level, tag, format },
+    DLOG_FORMATS(DLOG_ENTRY)
+#undef DLOG_ENTRY
+};
+
+static dlog_slot_t ring[DLOG_RING_LEN];
+static atomic_uint head = 0;
+static unsigned tail = 0;                   // Drain task only
+static atomic_uint written = 0;
+static atomic_uint dropped = 0;
+static uint32_t drained = 0;
+
+static dlog_conf_t dlog_conf;
+static TaskHandle_t drain_task = NULL;
+static StaticTask_t drain_task_buf;
+static StackType_t drain_task_stack[DLOG_TASK_STACK];
+static SemaphoreHandle_t history_lock = NULL;
+static StaticSemaphore_t history_lock_buf;
+static dlog_record_t history[DLOG_HISTORY_LEN];
+static uint32_t history_count = 0;          // Records ever drained into history
+
+void dlog_write(dlog_id_t id, uint8_t argc, const uint32_t *args)
+{
+    unsigned pos = atomic_load_explicit(&head, memory_order_relaxed);
+    dlog_slot_t *slot;
+    while(1)
+    {
+        unsigned idx = pos & (DLOG_RING_LEN - 1);
+        slot = &ring[idx];
+        int diff = (int)(atomic_load_explicit(&slot->seq, memory_order_acquire) + idx - pos);
+        if(diff == 0)
+        {
+            if(atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(diff < 0)
+        {
+            // The drain task has not caught up with this slot yet
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+    }
+
+    slot->rec.ts_ms = (uint32_t)(esp_timer_get_time() / 1000);
+    slot->rec.id = id;
+    slot->rec.argc = argc < DLOG_MAX_ARGS ? argc : DLOG_MAX_ARGS;
+    memcpy(slot->rec.args, args, slot->rec.argc * sizeof(uint32_t));
+    unsigned idx = pos & (DLOG_RING_LEN - 1);
+    atomic_store_explicit(&slot->seq, pos + 1 - idx, memory_order_release);
+    atomic_fetch_add_explicit(&written, 1, memory_order_relaxed);
+}
+
+static bool dlog_take(dlog_record_t *rec)
+{
+    unsigned idx = tail & (DLOG_RING_LEN - 1);
+    dlog_slot_t *slot = &ring[idx];
+    if(atomic_load_explicit(&slot->seq, memory_order_acquire) + idx != tail + 1)
+    {
+        return false;
+    }
+    *rec = slot->rec;
+    atomic_store_explicit(&slot->seq, tail + DLOG_RING_LEN - idx, memory_order_release);
+    tail++;
+    return true;
+}
+
+static void dlog_drain_task(void *arg)
+{
+    while(1)
+    {
+        dlog_record_t rec;
+        while(dlog_take(&rec))
+        {
+            xSemaphoreTake(history_lock, portMAX_DELAY);
+            history[history_count % DLOG_HISTORY_LEN] = rec;
+            history_count++;
+            drained++;
+            xSemaphoreGive(history_lock);
+            if(dlog_conf.sink)
+            {
+                dlog_conf.sink(&rec, dlog_conf.sink_arg);
+            }
+        }
+        vTaskDelay(pdMS_TO_TICKS(DLOG_DRAIN_MS));
+    }
+}
+
+esp_err_t dlog_start(const dlog_conf_t *conf)
+{
+    if(drain_task != NULL)
+    {
+        return ESP_OK;
+    }
+    dlog_conf = *conf;
+    history_lock = xSemaphoreCreateMutexStatic(&history_lock_buf);
+    drain_task = xTaskCreateStaticPinnedToCore(dlog_drain_task, "dlog", DLOG_TASK_STACK, NULL, conf->priority,
+                                               drain_task_stack, &drain_task_buf, conf->core);
+    if(drain_task == NULL)
+    {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+void dlog_get_stats(dlog_stats_t *stats)
+{
+    stats->written = atomic_load(&written);
+    stats->dropped = atomic_load(&dropped);
+    stats->drained = drained;
+}
+
+esp_log_level_t dlog_level(uint16_t id)
+{
+    return id < DLOG_ID_COUNT ? formats[id].level : ESP_LOG_NONE;
+}
+
+const char *dlog_tag(uint16_t id)
+{
+    return id < DLOG_ID_COUNT ? formats[id].tag : "dlog";
+}
+
+void dlog_console_sink(const dlog_record_t *rec, void *arg)
+{
+    char text[192];
+    dlog_format(rec, text, sizeof(text));
+    ESP_LOG_LEVEL(dlog_level(rec->id), dlog_tag(rec->id), "%s", text);
+}
+
+// ---- Formatting ----
+
+static int dlog_format_arg(char *buf, size_t len, const char *spec, char conv, uint32_t arg)
+{
+    switch(conv)
+    {
+        case 'd':
+        case 'i':
+            return snprintf(buf, len, spec, (int)(int32_t)arg);
+        case 'f':
+        case 'e':
+        case 'g':
+        {
+            float value;
+            memcpy(&value, &arg, sizeof(value));
+            return snprintf(buf, len, spec, (double)value);
+        }
+        default:
+            return snprintf(buf, len, spec, (unsigned)arg);
+    }
+}
+
+int dlog_format(const dlog_record_t *rec, char *buf, size_t len)
+{
+    if(len == 0)
+    {
+        return 0;
+    }
+    if(rec->id >= DLOG_ID_COUNT)
+    {
+        return snprintf(buf, len, "unknown record %u", rec->id);
+    }
+    const char *f = formats[rec->id].format;
+    size_t used = 0;
+    uint8_t argi = 0;
+    buf[0] = '\0';
+    while(*f && used < len - 1)
+    {
+        if(*f != '%')
+        {
+            buf[used++] = *f++;
+            continue;
+        }
+        if(f[1] == '%')
+        {
+            buf[used++] = '%';
+            f += 2;
+            continue;
+        }
+        // Copy the conversion without length modifiers, e.g. "%08.3f"
+        char spec[DLOG_SPEC_MAX];
+        size_t s = 0;
+        spec[s++] = *f++;
+        while(*f && strchr("diuxXcfeg", *f) == NULL && s < sizeof(spec) - 2)
+        {
+            if(*f != 'l' && *f != 'h')
+            {
+                spec[s++] = *f;
+            }
+            f++;
+        }
+        if(*f == '\0')
+        {
+            break;
+        }
+        char conv = *f++;
+        spec[s++] = conv;
+        spec[s] = '\0';
+        uint32_t arg = argi < rec->argc ? rec->args[argi] : 0;
+        argi++;
+        int n = dlog_format_arg(buf + used, len - used, spec, conv, arg);
+        if(n > 0)
+        {
+            used += (size_t)n < len - used ? (size_t)n : len - used - 1;
+        }
+    }
+    buf[used] = '\0';
+    return (int)used;
+}
+
+// ---- Wire encoding ----
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+size_t dlog_encode_history(uint8_t *buf, size_t len)
+{
+    if(len < DLOG_WIRE_HEADER)
+    {
+        return 0;
+    }
+    memcpy(buf, DLOG_WIRE_MAGIC, 3);
+    buf[3] = DLOG_WIRE_VERSION;
+    size_t used = DLOG_WIRE_HEADER;
+    if(history_lock == NULL)
+    {
+        return used;
+    }
+
+    xSemaphoreTake(history_lock, portMAX_DELAY);
+    uint32_t first = history_count > DLOG_HISTORY_LEN ? history_count - DLOG_HISTORY_LEN : 0;
+    for(uint32_t i = first; i < history_count; i++)
+    {
+        const dlog_record_t *rec = &history[i % DLOG_HISTORY_LEN];
+        size_t size = 8 + 4 * rec->argc;
+        if(used + size > len)
+        {
+            break;
+        }
+        uint8_t *p = buf + used;
+        put_u32(p, rec->ts_ms);
+        p[4] = rec->id;
+        p[5] = rec->id >> 8;
+        p[6] = rec->argc;
+        p[7] = 0;
+        for(uint8_t a = 0; a < rec->argc; a++)
+        {
+            put_u32(p + 8 + 4 * a, rec->args[a]);
+        }
+        used += size;
+    }
+    xSemaphoreGive(history_lock);
+    return used;
+}
+
+esp_err_t dlog_decode(const uint8_t *buf, size_t len, size_t *pos, dlog_record_t *rec)
+{
+    if(*pos >= len)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if(len - *pos < 8)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const uint8_t *p = buf + *pos;
+    rec->ts_ms = get_u32(p);
+    rec->id = p[4] | (p[5] << 8);
+    rec->argc = p[6];
+    if(rec->argc > DLOG_MAX_ARGS)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if(len - *pos < 8 + 4 * (size_t)rec->argc)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    for(uint8_t a = 0; a < rec->argc; a++)
+    {
+        rec->args[a] = get_u32(p + 8 + 4 * a);
+    }
+    *pos += 8 + 4 * rec->argc;
+    return rec->id < DLOG_ID_COUNT ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
@@ -0,0 +1,100 @@
+#ifndef DLOG_H
+#define DLOG_H
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "dlog_formats.h"
+
+// Deferred binary logging. DLOG() copies a format ID and its raw 32-bit
+// arguments into a lock-free ring and returns; nothing is formatted or
+// written on the caller's side. A low-priority drain task hands records to a
+// sink such as dlog_console_sink() and keeps the most recent ones for the
+// /log endpoint. When the ring is full new records are
+// dropped and counted rather than blocking the caller.
+
+#define DLOG_RING_LEN 64                // Power of two
+#define DLOG_MAX_ARGS 9
+#define DLOG_HISTORY_LEN 64
+#define DLOG_DRAIN_MS 50
+#define DLOG_TASK_STACK 3072
+
+// Wire format of an encoded stream: "DLG" plus DLOG_WIRE_VERSION, then per
+// record a little-endian u32 timestamp (ms), u16 id, u8 argc, u8 reserved
+// and argc u32 arguments
+#define DLOG_WIRE_MAGIC "DLG"
+#define DLOG_WIRE_VERSION 1
+#define DLOG_WIRE_HEADER 4
+#define DLOG_WIRE_RECORD_MAX (8 + 4 * DLOG_MAX_ARGS)
+
+typedef enum {
+#define DLOG_ID(id, level, tag, format) id,
+    DLOG_FORMATS(DLOG_ID)
+#undef DLOG_ID
+    DLOG_ID_COUNT,
+} dlog_id_t;
+
+typedef struct {
+    uint32_t ts_ms;
+    uint16_t id;
+    uint8_t argc;
+    uint32_t args[DLOG_MAX_ARGS];
+} dlog_record_t;
+
+typedef void (*dlog_sink_t)(const dlog_record_t *rec, void *arg);
+
+typedef struct {
+    UBaseType_t priority;
+    BaseType_t core;
+    dlog_sink_t sink;           // NULL keeps records for /log only
+    void *sink_arg;
+} dlog_conf_t;
+
+typedef struct {
+    uint32_t written;
+    uint32_t dropped;           // Ring was full
+    uint32_t drained;
+} dlog_stats_t;
+
+static inline uint32_t dlog_f(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+// Records id with its arguments, each converted to uint32_t (use dlog_f()
+// for floats). Safe from any task; never blocks.
+#define DLOG(id, ...) do { \
+        const uint32_t dlog_args_[] = { __VA_ARGS__ }; \
+        dlog_write((id), sizeof(dlog_args_) / sizeof(dlog_args_[0]), dlog_args_); \
+    } while(0)
+
+void dlog_write(dlog_id_t id, uint8_t argc, const uint32_t *args);
+
+// Starts the drain task
+esp_err_t dlog_start(const dlog_conf_t *conf);
+
+// Formats through ESP_LOG at the record's level
+void dlog_console_sink(const dlog_record_t *rec, void *arg);
+
+void dlog_get_stats(dlog_stats_t *stats);
+
+esp_log_level_t dlog_level(uint16_t id);
+const char *dlog_tag(uint16_t id);
+
+// Formats a record's text without tag or timestamp, returns its length
+int dlog_format(const dlog_record_t *rec, char *buf, size_t len);
+
+// Encodes the drained history as a wire stream, returns the bytes used
+size_t dlog_encode_history(uint8_t *buf, size_t len);
+
+// Decodes one record at *pos of a wire stream past its header, advancing
+// *pos. Returns ESP_ERR_NOT_FOUND at the end and ESP_ERR_INVALID_SIZE or
+// ESP_ERR_INVALID_ARG for a truncated or unknown record.
+esp_err_t dlog_decode(const uint8_t *buf, size_t len, size_t *pos, dlog_record_t *rec);
+
+#endif
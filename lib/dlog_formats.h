@@ -0,0 +1,23 @@
+// Format table for deferred log records, shared by the firmware and the host
+// decoder. Records carry only the index into this table, so entries may be
+// appended but never reordered or removed without bumping DLOG_WIRE_VERSION.
+//
+// Conversions take one 32-bit argument each: %d %i %u %x %X %c read it as an
+// integer, %f %e %g as a float packed with dlog_f().
+//
+// X(id, level, tag, format)
+
+#define DLOG_FORMATS(X) \
+    X(DLOG_PROT_ALERT,      ESP_LOG_INFO, "MAX17330", "%u, Protection alert: 0x%x") \
+    X(DLOG_PROT_STATUS,     ESP_LOG_INFO, "MAX17330", "%u, Protection status: 0x%x") \
+    X(DLOG_GAUGE_NV_CONFIG, ESP_LOG_INFO, "MAX17330", "%u, nICHGCFG = 0x%x, nPACKCFG = 0x%x, nODSCTH = 0x%x, nDESIGNCAP = 0x%x") \
+    X(DLOG_GAUGE_RESET,     ESP_LOG_INFO, "MAX17330", "%u, Reset complete after %u polls") \
+    X(DLOG_BUS_RECOVER,     ESP_LOG_WARN, "i2c-bus",  "%d, Bus stopped responding, recovering") \
+    X(DLOG_BUS_STEP_DOWN,   ESP_LOG_WARN, "i2c-bus",  "%d, Link errors, stepping down to %u Hz") \
+    X(DLOG_BUS_STEP_UP,     ESP_LOG_INFO, "i2c-bus",  "%d, Link clean, stepped up to %u Hz") \
+    X(DLOG_BATTERY,         ESP_LOG_INFO, "power",    "Battery: %u, SOC: %f, charging: %u, curr_cap: %f, max_cap: %f, " \
+                                                      "current: %f, voltage: %f, v_charge: %f, i_charge %f") \
+    X(DLOG_PROT_TRIP,       ESP_LOG_WARN, "protection", "Rule %u tripped on battery %u, value %f, %u us after detection") \
+    X(DLOG_PROT_RELEASE,    ESP_LOG_INFO, "protection", "Safing rules clear after %u ms, arming allowed") \
+    X(DLOG_GAUGE_NV_DIFF,   ESP_LOG_WARN, "MAX17330", "%u, NV profile: %u words differ, %u writes left") \
+    X(DLOG_GAUGE_NV_WRITTEN, ESP_LOG_INFO, "MAX17330", "%u, NV profile: wrote %u words, %u differ after recall")
@@ -0,0 +1,519 @@
+#include "i2c_bus.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_rom_sys.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "dlog.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "i2c-bus";
+
+// Completion slot for a synchronous caller. If the caller gives up first the
+// slot is marked abandoned and released by the bus task instead.
+typedef struct {
+    SemaphoreHandle_t done;
+    StaticSemaphore_t done_buf;
+    i2c_port_t port;
+    uint8_t *rx;
+    size_t rx_len;
+    esp_err_t err;
+    bool busy;
+    bool completed;
+    bool abandoned;
+} i2c_bus_waiter_t;
+
+typedef struct {
+    i2c_bus_conf_t conf;
+    QueueHandle_t queue;
+    TaskHandle_t task;
+    SemaphoreHandle_t lock;     // Protects waiters and stats
+    i2c_bus_waiter_t waiters[I2C_BUS_WAITERS];
+    i2c_bus_stats_t stats;
+    uint32_t consecutive_failures;
+    uint32_t clk;               // Rate the driver is installed with
+    uint32_t window_txns;
+    uint32_t clean_windows;
+    uint32_t clean_required;    // Clean windows needed before the next step up
+    // Kernel objects live here rather than on the heap
+    StaticSemaphore_t lock_buf;
+    StaticQueue_t queue_buf;
+    uint8_t queue_storage[I2C_BUS_QUEUE_LEN * sizeof(i2c_bus_txn_t)];
+    StaticTask_t task_buf;
+    StackType_t task_stack[I2C_BUS_TASK_STACK];
+} i2c_bus_t;
+
+static i2c_bus_t buses[I2C_NUM_MAX];
+
+static esp_err_t i2c_bus_install(i2c_port_t port)
+{
+    i2c_bus_t *bus = &buses[port];
+    i2c_config_t i2c_conf = {
+        .mode = I2C_MODE_MASTER,
+        .sda_io_num = bus->conf.sda,
+        .sda_pullup_en = GPIO_PULLUP_ENABLE,
+        .scl_io_num = bus->conf.scl,
+        .scl_pullup_en = GPIO_PULLUP_ENABLE,
+        .master.clk_speed = bus->clk,
+    };
+
+    i2c_reset_tx_fifo(port);
+    i2c_reset_rx_fifo(port);
+
+    if(i2c_param_config(port, &i2c_conf) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    if(i2c_driver_install(port, I2C_MODE_MASTER, 0, 0, 0) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+// Frees a slave holding SDA low by clocking out the rest of its byte, then
+// issues a STOP and reinstalls the driver
+static void i2c_bus_recover(i2c_port_t port)
+{
+    i2c_bus_t *bus = &buses[port];
+    DLOG(DLOG_BUS_RECOVER, port);
+
+    i2c_driver_delete(port);
+    gpio_set_direction(bus->conf.scl, GPIO_MODE_OUTPUT_OD);
+    gpio_set_direction(bus->conf.sda, GPIO_MODE_OUTPUT_OD);
+    gpio_set_level(bus->conf.sda, 1);
+    for(uint8_t i = 0; i < 9; i++)
+    {
+        gpio_set_level(bus->conf.scl, 0);
+        esp_rom_delay_us(5);
+        gpio_set_level(bus->conf.scl, 1);
+        esp_rom_delay_us(5);
+    }
+    gpio_set_level(bus->conf.scl, 0);
+    esp_rom_delay_us(5);
+    gpio_set_level(bus->conf.sda, 0);
+    esp_rom_delay_us(5);
+    gpio_set_level(bus->conf.scl, 1);
+    esp_rom_delay_us(5);
+    gpio_set_level(bus->conf.sda, 1);
+    esp_rom_delay_us(5);
+
+    if(i2c_bus_install(port) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "%d, Failed to reinstall driver", port);
+    }
+    xSemaphoreTake(bus->lock, portMAX_DELAY);
+    bus->stats.recoveries++;
+    xSemaphoreGive(bus->lock);
+}
+
+// Reinstalls the driver at a new clock rate, only from init or the bus task
+static esp_err_t i2c_bus_set_clk(i2c_port_t port, uint32_t clk)
+{
+    i2c_bus_t *bus = &buses[port];
+    i2c_driver_delete(port);
+    bus->clk = clk;
+    esp_err_t err = i2c_bus_install(port);
+    xSemaphoreTake(bus->lock, portMAX_DELAY);
+    bus->stats.clk = clk;
+    xSemaphoreGive(bus->lock);
+    return err;
+}
+
+static bool i2c_bus_probe(i2c_port_t port)
+{
+    i2c_bus_t *bus = &buses[port];
+    for(uint8_t i = 0; i < I2C_BUS_PROBE_READS; i++)
+    {
+        if(!bus->conf.probe(port, I2C_BUS_PROBE_TICKS, bus->conf.probe_arg))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool i2c_bus_adaptive(const i2c_bus_t *bus)
+{
+    return bus->conf.probe != NULL && bus->conf.clk_max > bus->conf.clk;
+}
+
+// Starts at the fastest rate that passes the probe, falling back to conf.clk
+static esp_err_t i2c_bus_tune(i2c_port_t port)
+{
+    i2c_bus_t *bus = &buses[port];
+    for(uint32_t clk = bus->conf.clk_max; clk > bus->conf.clk; clk /= 2)
+    {
+        if(i2c_bus_set_clk(port, clk) == ESP_OK && i2c_bus_probe(port))
+        {
+            ESP_LOGI(TAG, "%d, Link probed at %lu Hz", port, (unsigned long)clk);
+            return ESP_OK;
+        }
+        xSemaphoreTake(bus->lock, portMAX_DELAY);
+        bus->stats.probes_failed++;
+        xSemaphoreGive(bus->lock);
+    }
+    ESP_LOGI(TAG, "%d, Link using base rate %lu Hz", port, (unsigned long)bus->conf.clk);
+    return i2c_bus_set_clk(port, bus->conf.clk);
+}
+
+// Feeds one transaction result into the error window. Called with the lock
+// held; returns the clock rate to switch to, or 0 to keep the current one.
+static uint32_t i2c_bus_link_update(i2c_bus_t *bus, bool failed)
+{
+    if(!i2c_bus_adaptive(bus))
+    {
+        return 0;
+    }
+    bus->window_txns++;
+    if(failed)
+    {
+        bus->stats.window_errors++;
+    }
+
+    if(bus->stats.window_errors >= I2C_BUS_LINK_MAX_ERRORS)
+    {
+        bus->window_txns = 0;
+        bus->stats.window_errors = 0;
+        bus->clean_windows = 0;
+        if(bus->clk <= bus->conf.clk)
+        {
+            return 0;
+        }
+        // A rate that degraded has to stay clean for longer before the next try
+        if(bus->clean_required < I2C_BUS_LINK_MAX_BACKOFF)
+        {
+            bus->clean_required *= 2;
+        }
+        uint32_t clk = bus->clk / 2;
+        return clk < bus->conf.clk ? bus->conf.clk : clk;
+    }
+
+    if(bus->window_txns >= I2C_BUS_LINK_WINDOW)
+    {
+        bool clean = bus->stats.window_errors == 0;
+        bus->window_txns = 0;
+        bus->stats.window_errors = 0;
+        bus->clean_windows = clean ? bus->clean_windows + 1 : 0;
+        if(bus->clean_windows >= bus->clean_required && bus->clk < bus->conf.clk_max)
+        {
+            bus->clean_windows = 0;
+            uint32_t clk = bus->clk * 2;
+            return clk > bus->conf.clk_max ? bus->conf.clk_max : clk;
+        }
+    }
+    return 0;
+}
+
+static void i2c_bus_change_clk(i2c_port_t port, uint32_t clk)
+{
+    i2c_bus_t *bus = &buses[port];
+    uint32_t old_clk = bus->clk;
+    if(clk < old_clk)
+    {
+        DLOG(DLOG_BUS_STEP_DOWN, port, clk);
+        i2c_bus_set_clk(port, clk);
+        xSemaphoreTake(bus->lock, portMAX_DELAY);
+        bus->stats.step_downs++;
+        xSemaphoreGive(bus->lock);
+        return;
+    }
+
+    bool ok = i2c_bus_set_clk(port, clk) == ESP_OK && i2c_bus_probe(port);
+    if(!ok)
+    {
+        i2c_bus_set_clk(port, old_clk);
+    }
+    xSemaphoreTake(bus->lock, portMAX_DELAY);
+    if(ok)
+    {
+        bus->stats.step_ups++;
+        bus->clean_required = I2C_BUS_LINK_CLEAN_WINDOWS;
+    }
+    else
+    {
+        bus->stats.probes_failed++;
+        if(bus->clean_required < I2C_BUS_LINK_MAX_BACKOFF)
+        {
+            bus->clean_required *= 2;
+        }
+    }
+    xSemaphoreGive(bus->lock);
+    if(ok)
+    {
+        DLOG(DLOG_BUS_STEP_UP, port, clk);
+    }
+}
+
+static void i2c_bus_task(void *arg)
+{
+    i2c_port_t port = (i2c_port_t)(intptr_t)arg;
+    i2c_bus_t *bus = &buses[port];
+    i2c_bus_txn_t txn;
+
+    while(1)
+    {
+        if(xQueueReceive(bus->queue, &txn, portMAX_DELAY) != pdTRUE)
+        {
+            continue;
+        }
+
+        esp_err_t err;
+        bool ran = false;
+        int64_t start_us = 0;
+        TickType_t now = xTaskGetTickCount();
+        if((int32_t)(txn.deadline - now) <= 0)
+        {
+            err = ESP_ERR_TIMEOUT;
+        }
+        else
+        {
+            // Never let the driver block past the caller's deadline
+            TickType_t budget = txn.deadline - now;
+            start_us = esp_timer_get_time();
+            if(txn.rx_len > 0)
+            {
+                err = i2c_master_write_read_device(port, txn.addr, txn.tx, txn.tx_len, txn.rx, txn.rx_len, budget);
+            }
+            else
+            {
+                err = i2c_master_write_to_device(port, txn.addr, txn.tx, txn.tx_len, budget);
+            }
+            ran = true;
+        }
+        uint32_t latency_us = ran ? (uint32_t)(esp_timer_get_time() - start_us) : 0;
+
+        uint32_t next_clk = 0;
+        xSemaphoreTake(bus->lock, portMAX_DELAY);
+        if(!ran)
+        {
+            bus->stats.expired++;
+        }
+        else
+        {
+            bus->stats.transactions++;
+            if(err != ESP_OK)
+            {
+                bus->stats.errors++;
+                if(err == ESP_ERR_TIMEOUT)
+                {
+                    bus->stats.timeouts++;
+                }
+                bus->consecutive_failures++;
+            }
+            else
+            {
+                bus->consecutive_failures = 0;
+            }
+            int32_t delta = (int32_t)latency_us - (int32_t)bus->stats.latency_avg_us;
+            bus->stats.latency_avg_us += delta / 8;
+            if(latency_us > bus->stats.latency_max_us)
+            {
+                bus->stats.latency_max_us = latency_us;
+            }
+            next_clk = i2c_bus_link_update(bus, err != ESP_OK);
+        }
+        bool recover = bus->consecutive_failures >= I2C_BUS_RECOVERY_THRESHOLD;
+        if(recover)
+        {
+            bus->consecutive_failures = 0;
+        }
+        xSemaphoreGive(bus->lock);
+
+        if(txn.cb)
+        {
+            txn.cb(&txn, err, txn.arg);
+        }
+        if(recover)
+        {
+            i2c_bus_recover(port);
+        }
+        if(next_clk != 0)
+        {
+            i2c_bus_change_clk(port, next_clk);
+        }
+    }
+}
+
+esp_err_t i2c_bus_init(i2c_port_t port, const i2c_bus_conf_t *conf)
+{
+    if(port < 0 || port >= I2C_NUM_MAX || conf == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    i2c_bus_t *bus = &buses[port];
+    if(bus->task != NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    bus->conf = *conf;
+    bus->clk = conf->clk;
+    bus->clean_required = I2C_BUS_LINK_CLEAN_WINDOWS;
+
+    bus->lock = xSemaphoreCreateMutexStatic(&bus->lock_buf);
+    bus->queue = xQueueCreateStatic(I2C_BUS_QUEUE_LEN, sizeof(i2c_bus_txn_t), bus->queue_storage, &bus->queue_buf);
+    bus->stats.clk = conf->clk;
+    bus->stats.clk_max = i2c_bus_adaptive(bus) ? conf->clk_max : conf->clk;
+
+    if(i2c_bus_install(port) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    // The bus task does not exist yet, so probing here cannot race it
+    if(i2c_bus_adaptive(bus) && i2c_bus_tune(port) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    for(uint8_t i = 0; i < I2C_BUS_WAITERS; i++)
+    {
+        bus->waiters[i].port = port;
+        bus->waiters[i].done = xSemaphoreCreateBinaryStatic(&bus->waiters[i].done_buf);
+    }
+
+    char name[configMAX_TASK_NAME_LEN];
+    snprintf(name, sizeof(name), "i2c_bus%d", port);
+    bus->task = xTaskCreateStaticPinnedToCore(i2c_bus_task, name, I2C_BUS_TASK_STACK, (void *)(intptr_t)port,
+                                              I2C_BUS_TASK_PRIORITY, bus->task_stack, &bus->task_buf, conf->core);
+    if(bus->task == NULL)
+    {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t i2c_bus_submit(i2c_port_t port, const i2c_bus_txn_t *txn)
+{
+    if(port < 0 || port >= I2C_NUM_MAX || buses[port].queue == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if(txn->tx_len > I2C_BUS_MAX_XFER || txn->rx_len > I2C_BUS_MAX_XFER)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    i2c_bus_t *bus = &buses[port];
+    if(xQueueSend(bus->queue, txn, 0) != pdTRUE)
+    {
+        xSemaphoreTake(bus->lock, portMAX_DELAY);
+        bus->stats.queue_full++;
+        xSemaphoreGive(bus->lock);
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+static void i2c_bus_sync_done(const i2c_bus_txn_t *txn, esp_err_t err, void *arg)
+{
+    i2c_bus_waiter_t *waiter = arg;
+    i2c_bus_t *bus = &buses[waiter->port];
+
+    xSemaphoreTake(bus->lock, portMAX_DELAY);
+    if(waiter->abandoned)
+    {
+        waiter->busy = false;
+    }
+    else
+    {
+        if(err == ESP_OK && waiter->rx_len > 0)
+        {
+            memcpy(waiter->rx, txn->rx, waiter->rx_len);
+        }
+        waiter->err = err;
+        waiter->completed = true;
+        xSemaphoreGive(waiter->done);
+    }
+    xSemaphoreGive(bus->lock);
+}
+
+esp_err_t i2c_bus_transfer(i2c_port_t port, uint8_t addr, const uint8_t *tx, size_t tx_len,
+                           uint8_t *rx, size_t rx_len, uint32_t timeout_ms)
+{
+    if(port < 0 || port >= I2C_NUM_MAX || buses[port].queue == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if(tx_len > I2C_BUS_MAX_XFER || rx_len > I2C_BUS_MAX_XFER)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    i2c_bus_t *bus = &buses[port];
+
+    xSemaphoreTake(bus->lock, portMAX_DELAY);
+    i2c_bus_waiter_t *waiter = NULL;
+    for(uint8_t i = 0; i < I2C_BUS_WAITERS && waiter == NULL; i++)
+    {
+        if(!bus->waiters[i].busy)
+        {
+            waiter = &bus->waiters[i];
+            waiter->busy = true;
+            waiter->completed = false;
+            waiter->abandoned = false;
+            waiter->rx = rx;
+            waiter->rx_len = rx_len;
+        }
+    }
+    xSemaphoreGive(bus->lock);
+    if(waiter == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    TickType_t ticks = pdMS_TO_TICKS(timeout_ms);
+    if(ticks == 0)
+    {
+        ticks = 1;
+    }
+    i2c_bus_txn_t txn = {
+        .addr = addr,
+        .tx_len = tx_len,
+        .rx_len = rx_len,
+        .deadline = xTaskGetTickCount() + ticks,
+        .cb = i2c_bus_sync_done,
+        .arg = waiter,
+    };
+    memcpy(txn.tx, tx, tx_len);
+
+    esp_err_t err = i2c_bus_submit(port, &txn);
+    if(err != ESP_OK)
+    {
+        xSemaphoreTake(bus->lock, portMAX_DELAY);
+        waiter->busy = false;
+        xSemaphoreGive(bus->lock);
+        return err;
+    }
+
+    xSemaphoreTake(waiter->done, ticks + I2C_BUS_GRACE_TICKS);
+    xSemaphoreTake(bus->lock, portMAX_DELAY);
+    if(waiter->completed)
+    {
+        // Consume a completion that raced with our timeout
+        xSemaphoreTake(waiter->done, 0);
+        err = waiter->err;
+        waiter->busy = false;
+    }
+    else
+    {
+        waiter->abandoned = true;
+        err = ESP_ERR_TIMEOUT;
+    }
+    xSemaphoreGive(bus->lock);
+    return err;
+}
+
+esp_err_t i2c_bus_get_stats(i2c_port_t port, i2c_bus_stats_t *stats)
+{
+    if(port < 0 || port >= I2C_NUM_MAX || buses[port].lock == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    i2c_bus_t *bus = &buses[port];
+    xSemaphoreTake(bus->lock, portMAX_DELAY);
+    *stats = bus->stats;
+    xSemaphoreGive(bus->lock);
+    return ESP_OK;
+}
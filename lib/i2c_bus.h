@@ -0,0 +1,103 @@
+#ifndef I2C_BUS_H
+#define I2C_BUS_H
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "driver/i2c.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Asynchronous transaction queue in front of each I2C port. A dedicated task
+// per bus owns the driver, runs queued transactions before their deadline and
+// recovers the bus when a device stops responding, so a stuck gauge only ever
+// delays callers on its own bus, and only up to their deadline.
+//
+// The bus task also tunes the clock between conf.clk and conf.clk_max. At
+// init it picks the fastest rate that passes the device probe, then steps
+// down by half when a window of transactions sees too many errors and tries
+// doubling again after enough clean windows, backing off on every failure.
+
+#define I2C_BUS_MAX_XFER 96             // Largest write or read in one transaction
+#define I2C_BUS_QUEUE_LEN 8
+#define I2C_BUS_WAITERS 4               // Concurrent synchronous callers per bus
+#define I2C_BUS_RECOVERY_THRESHOLD 3    // Consecutive failures before recovering
+#define I2C_BUS_TASK_STACK 3072
+#define I2C_BUS_TASK_PRIORITY (tskIDLE_PRIORITY + 9)
+
+#define I2C_BUS_LINK_WINDOW 64          // Transactions per error-rate window
+#define I2C_BUS_LINK_MAX_ERRORS 2       // Errors within a window that force a step down
+#define I2C_BUS_LINK_CLEAN_WINDOWS 16   // Clean windows before trying a faster clock
+#define I2C_BUS_LINK_MAX_BACKOFF 256    // Cap on the clean windows required after failures
+#define I2C_BUS_PROBE_READS 16          // Probe passes a clock rate needs to be chosen
+#define I2C_BUS_PROBE_TICKS 2
+
+// Extra time a synchronous caller waits past the deadline for the bus task
+#define I2C_BUS_GRACE_TICKS 2
+
+// Longest i2c_bus_transfer() blocks for a given timeout, queueing, bus
+// recovery and clock changes included
+#define I2C_BUS_TRANSFER_MAX_TICKS(timeout_ms) \
+    ((pdMS_TO_TICKS(timeout_ms) > 0 ? pdMS_TO_TICKS(timeout_ms) : 1) + I2C_BUS_GRACE_TICKS)
+
+typedef struct i2c_bus_txn i2c_bus_txn_t;
+
+// Runs on the bus task, must not block
+typedef void (*i2c_bus_cb_t)(const i2c_bus_txn_t *txn, esp_err_t err, void *arg);
+
+struct i2c_bus_txn {
+    uint8_t addr;               // 7-bit device address
+    uint8_t tx_len;
+    uint8_t rx_len;             // 0 for a plain write
+    uint8_t tx[I2C_BUS_MAX_XFER];
+    uint8_t rx[I2C_BUS_MAX_XFER];
+    TickType_t deadline;        // Absolute tick count after which the transaction is dropped
+    i2c_bus_cb_t cb;
+    void *arg;
+};
+
+// Checks that the device answers correctly at the current clock, e.g. by
+// reading an ID register. Runs on the bus task, which owns the driver, so it
+// may call the i2c_master_* functions directly.
+typedef bool (*i2c_bus_probe_t)(i2c_port_t port, TickType_t ticks, void *arg);
+
+typedef struct {
+    int sda;
+    int scl;
+    uint32_t clk;               // Slowest and initial clock rate
+    uint32_t clk_max;           // Fastest rate to try, 0 keeps clk fixed
+    i2c_bus_probe_t probe;      // Required for clk_max to have any effect
+    void *probe_arg;
+    BaseType_t core;            // Core the bus task is pinned to
+} i2c_bus_conf_t;
+
+typedef struct {
+    uint32_t transactions;
+    uint32_t errors;
+    uint32_t timeouts;          // Bus operations that ran out of time
+    uint32_t expired;           // Dropped in the queue after their deadline
+    uint32_t queue_full;
+    uint32_t recoveries;
+    uint32_t clk;               // Current clock rate
+    uint32_t clk_max;
+    uint32_t step_downs;
+    uint32_t step_ups;
+    uint32_t probes_failed;     // Faster rates that were tried and rejected
+    uint32_t window_errors;     // Errors in the current window
+    uint32_t latency_avg_us;    // Moving average over completed transactions
+    uint32_t latency_max_us;
+} i2c_bus_stats_t;
+
+// Configures the port and starts its bus task
+esp_err_t i2c_bus_init(i2c_port_t port, const i2c_bus_conf_t *conf);
+
+// Queues a transaction; its callback reports the result from the bus task
+esp_err_t i2c_bus_submit(i2c_port_t port, const i2c_bus_txn_t *txn);
+
+// Write then optionally read, blocking for at most timeout_ms
+esp_err_t i2c_bus_transfer(i2c_port_t port, uint8_t addr, const uint8_t *tx, size_t tx_len,
+                           uint8_t *rx, size_t rx_len, uint32_t timeout_ms);
+
+esp_err_t i2c_bus_get_stats(i2c_port_t port, i2c_bus_stats_t *stats);
+
+#endif
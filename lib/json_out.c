@@ -0,0 +1,115 @@
+#include "json_out.h"
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+static void json_out_printf(json_out_t *out, const char *fmt, ...)
+{
+    if(out->overflow)
+    {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(out->buf + out->len, out->cap - out->len, fmt, args);
+    va_end(args);
+    if(n < 0 || (size_t)n >= out->cap - out->len)
+    {
+        out->overflow = true;
+        out->buf[out->len] = '\0';
+        return;
+    }
+    out->len += n;
+}
+
+static void json_out_key(json_out_t *out, const char *key)
+{
+    if(out->comma)
+    {
+        json_out_printf(out, ",");
+    }
+    if(key != NULL)
+    {
+        json_out_printf(out, "\"%s\":", key);
+    }
+    out->comma = true;
+}
+
+void json_out_init(json_out_t *out, char *buf, size_t cap)
+{
+    *out = (json_out_t){
+        .buf = buf,
+        .cap = cap,
+    };
+    buf[0] = '\0';
+}
+
+void json_out_begin_object(json_out_t *out, const char *key)
+{
+    json_out_key(out, key);
+    json_out_printf(out, "{");
+    out->comma = false;
+}
+
+void json_out_end_object(json_out_t *out)
+{
+    json_out_printf(out, "}");
+    out->comma = true;
+}
+
+void json_out_begin_array(json_out_t *out, const char *key)
+{
+    json_out_key(out, key);
+    json_out_printf(out, "[");
+    out->comma = false;
+}
+
+void json_out_end_array(json_out_t *out)
+{
+    json_out_printf(out, "]");
+    out->comma = true;
+}
+
+void json_out_number(json_out_t *out, const char *key, double value)
+{
+    json_out_key(out, key);
+    // Same precision cJSON prints, and null where JSON has no number
+    if(isfinite(value))
+    {
+        json_out_printf(out, "%.15g", value);
+    }
+    else
+    {
+        json_out_printf(out, "null");
+    }
+}
+
+void json_out_uint(json_out_t *out, const char *key, uint64_t value)
+{
+    json_out_key(out, key);
+    json_out_printf(out, "%" PRIu64, value);
+}
+
+void json_out_int(json_out_t *out, const char *key, int64_t value)
+{
+    json_out_key(out, key);
+    json_out_printf(out, "%" PRId64, value);
+}
+
+void json_out_bool(json_out_t *out, const char *key, bool value)
+{
+    json_out_key(out, key);
+    json_out_printf(out, value ? "true" : "false");
+}
+
+void json_out_string(json_out_t *out, const char *key, const char *value)
+{
+    json_out_key(out, key);
+    json_out_printf(out, "\"%s\"", value);
+}
+
+size_t json_out_finish(json_out_t *out)
+{
+    return out->overflow ? 0 : out->len;
+}
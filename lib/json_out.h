@@ -0,0 +1,38 @@
+#ifndef JSON_OUT_H
+#define JSON_OUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Writes compact JSON into a caller-provided buffer, so that building a
+// response never touches the heap. Members are added in order like with
+// cJSON_Add*ToObject(); key is ignored inside arrays. Strings are copied
+// without escaping, so only pass identifiers. Output that does not fit is
+// cut off and marks the writer as overflowed.
+
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t len;
+    bool comma;                 // A value precedes the next member
+    bool overflow;
+} json_out_t;
+
+void json_out_init(json_out_t *out, char *buf, size_t cap);
+
+void json_out_begin_object(json_out_t *out, const char *key);
+void json_out_end_object(json_out_t *out);
+void json_out_begin_array(json_out_t *out, const char *key);
+void json_out_end_array(json_out_t *out);
+
+void json_out_number(json_out_t *out, const char *key, double value);
+void json_out_uint(json_out_t *out, const char *key, uint64_t value);
+void json_out_int(json_out_t *out, const char *key, int64_t value);
+void json_out_bool(json_out_t *out, const char *key, bool value);
+void json_out_string(json_out_t *out, const char *key, const char *value);
+
+// Returns the length written, or 0 if the output did not fit
+size_t json_out_finish(json_out_t *out);
+
+#endif
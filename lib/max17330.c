@@ -1,258 +1,680 @@
 #include "max17330.h"
+#include "i2c_bus.h"
 #include "driver/i2c.h"
 #include "esp_log.h"
+#include "freertos/semphr.h"
+#include "dlog.h"
+#include <stdbool.h>
+#include <string.h>
+
+// tBLOCK can run to several seconds, CommStat.NVBusy tells when it is done
+#define MAX17330_NV_COPY_TIMEOUT_MS 8000
+#define MAX17330_NV_POLL_MS 10
+
+// tRECALL, after which recalled registers read back valid
+#define MAX17330_RECALL_MS 5
+
+// Words per NV transfer, leaving room for the register address
+#define MAX17330_NV_BLOCK_WORDS ((I2C_BUS_MAX_XFER - 1) / 2)
+
+#define MAX17330_SHADOW_REGS 0x200
+#define MAX17330_DEVICES 2
+
+typedef enum {
+    MAX17330_REG_VOLATILE = 0,  // Read from the gauge every time
+    MAX17330_REG_SLOW,          // Cached, refreshed every slow_refresh_ms
+    MAX17330_REG_STATIC,        // Cached until written, recalled or reset
+} max17330_reg_class_t;
+
+// Per-device copy of the gauge registers
+typedef struct {
+    SemaphoreHandle_t lock;
+    StaticSemaphore_t lock_buf;
+    uint16_t value[MAX17330_SHADOW_REGS];
+    uint32_t valid[MAX17330_SHADOW_REGS / 32];
+    TickType_t slow_refreshed;
+    bool unlocked;
+    max17330_cache_stats_t stats;
+    uint32_t prot_alert;        // Last logged protection registers, logged again on change
+    uint32_t prot_status;
+} max17330_shadow_t;
+
+static max17330_shadow_t shadows[MAX17330_DEVICES];
+
+static const uint16_t slow_regs[] = {
+    MAX17330_FULLCAPREP,
+    MAX17330_AGE,
+    MAX17330_CYCLES,
+};
+
+static max17330_reg_class_t max17330_reg_class(uint16_t addr)
+{
+    switch(addr)
+    {
+        case MAX17330_DEVNAME:
+            return MAX17330_REG_STATIC;
+        case MAX17330_FULLCAPREP:
+        case MAX17330_AGE:
+        case MAX17330_CYCLES:
+            return MAX17330_REG_SLOW;
+        case MAX17330_nBATTSTATUS:
+            // Updated by the gauge on protection events
+            return MAX17330_REG_VOLATILE;
+        default:
+            // NV configuration only changes when written or recalled
+            return (addr >= 0x180 && addr < 0x1F0) ? MAX17330_REG_STATIC : MAX17330_REG_VOLATILE;
+    }
+}
 
-esp_err_t max17330_write(max17330_conf_t conf, uint16_t addr, uint16_t* data, uint8_t data_len)
+static bool shadow_valid(max17330_shadow_t *shadow, uint16_t addr)
+{
+    return shadow->valid[addr / 32] & (1UL << (addr % 32));
+}
+
+static void shadow_store(max17330_shadow_t *shadow, uint16_t addr, uint16_t value)
+{
+    shadow->value[addr] = value;
+    shadow->valid[addr / 32] |= 1UL << (addr % 32);
+}
+
+static void shadow_drop(max17330_shadow_t *shadow, uint16_t addr)
+{
+    shadow->valid[addr / 32] &= ~(1UL << (addr % 32));
+}
+
+static void shadow_drop_all(max17330_shadow_t *shadow)
+{
+    memset(shadow->valid, 0, sizeof(shadow->valid));
+    shadow->unlocked = false;
+    shadow->slow_refreshed = xTaskGetTickCount();
+}
+
+static void shadow_expire_slow(max17330_shadow_t *shadow, uint32_t refresh_ms)
+{
+    TickType_t now = xTaskGetTickCount();
+    if(now - shadow->slow_refreshed < pdMS_TO_TICKS(refresh_ms ? refresh_ms : MAX17330_SLOW_REFRESH_MS))
+    {
+        return;
+    }
+    shadow->slow_refreshed = now;
+    for(uint8_t i = 0; i < sizeof(slow_regs) / sizeof(slow_regs[0]); i++)
+    {
+        shadow_drop(shadow, slow_regs[i]);
+    }
+}
+
+// Keeps the shadow coherent with commands that change registers behind our back
+static void shadow_after_write(max17330_shadow_t *shadow, uint16_t addr, uint16_t value)
+{
+    if(addr == MAX17330_COMMAND)
+    {
+        if(value == 0x000F)
+        {
+            // Hardware reset
+            shadow_drop_all(shadow);
+            return;
+        }
+        // NV recall and copy commands reload the NV shadow registers
+        for(uint16_t reg = 0x180; reg < MAX17330_SHADOW_REGS; reg++)
+        {
+            shadow_drop(shadow, reg);
+        }
+    }
+    else if(addr == MAX17330_RESET && (value & 0x8000))
+    {
+        // POR reloads the configuration and locks writes again
+        shadow_drop_all(shadow);
+    }
+}
+
+static i2c_port_t max17330_port(max17330_conf_t conf)
+{
+    return conf.battery == FLIGHT_BATTERY ? I2C_NUM_0 : I2C_NUM_1;
+}
+
+// Link probe for the bus task: DEVNAME has to read back as a MAX17330
+static bool max17330_probe(i2c_port_t port, TickType_t ticks, void *arg)
+{
+    (void)arg;
+    uint8_t reg = MAX17330_DEVNAME & 0xFF;
+    uint16_t id = 0;
+    if(i2c_master_write_read_device(port, 0x6C >> 1, &reg, 1, (uint8_t *)&id, 2, ticks) != ESP_OK)
+    {
+        return false;
+    }
+    return id == 0x40B0 || id == 0x40B1;
+}
+
+static esp_err_t max17330_bus_write(max17330_conf_t conf, uint16_t addr, uint16_t* data, uint8_t data_len)
 {
     uint8_t slave_addr = (addr > 0xFF) ? 0x16 : 0x6C;
     slave_addr >>= 1; // The given addresses are 8-bit
-    uint8_t *tx_buf = malloc(sizeof(uint8_t) * data_len * 2 + sizeof(uint8_t));
+    uint8_t tx_buf[I2C_BUS_MAX_XFER];
+    if((size_t)data_len * 2 + 1 > sizeof(tx_buf))
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
     tx_buf[0] = addr & 0xFF;
     xthal_memcpy((void*)(tx_buf + 1), (void*)data, data_len * 2);
-    if(i2c_master_write_to_device(conf.battery, slave_addr, tx_buf, data_len * 2 + 1, 100) != ESP_OK)
+    if(i2c_bus_transfer(max17330_port(conf), slave_addr, tx_buf, data_len * 2 + 1, NULL, 0, MAX17330_I2C_TIMEOUT_MS) != ESP_OK)
     {
         return ESP_FAIL;
     }
-    free(tx_buf);
 
     return ESP_OK;
 }
 
-esp_err_t max17330_read(max17330_conf_t conf, uint16_t addr, uint16_t* data, uint8_t data_len)
+static esp_err_t max17330_bus_read(max17330_conf_t conf, uint16_t addr, uint16_t* data, uint8_t data_len)
 {
     uint8_t slave_addr = (addr > 0xFF) ? 0x16 : 0x6C;
     slave_addr >>= 1; // The given addresses are 8-bit
-    uint8_t *rx_buf = malloc(sizeof(uint8_t) * data_len * 2);
     uint8_t tx_buf = addr & 0xFF;
-    if(i2c_master_write_read_device(conf.battery, slave_addr, &tx_buf, 1, rx_buf, data_len * 2, 100) != ESP_OK)
+    if(data_len * 2 > I2C_BUS_MAX_XFER)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if(i2c_bus_transfer(max17330_port(conf), slave_addr, &tx_buf, 1, (uint8_t *)data, data_len * 2, MAX17330_I2C_TIMEOUT_MS) != ESP_OK)
     {
         return ESP_FAIL;
     }
-    xthal_memcpy((void*)data, (void*)rx_buf, data_len * 2);
-    free(rx_buf);
 
     return ESP_OK;
 }
 
-esp_err_t max17330_first_time_setup(max17330_conf_t conf)
+esp_err_t max17330_write(max17330_conf_t conf, uint16_t addr, uint16_t* data, uint8_t data_len)
 {
-    // NVS should only be written a maximum of 7 times!
-    uint16_t buf;
-    uint16_t read_buf[4];
+    max17330_shadow_t *shadow = &shadows[conf.battery];
+    xSemaphoreTake(shadow->lock, portMAX_DELAY);
 
-    buf = 0xE001;   // NV Recall
-    if(max17330_write(conf, MAX17330_COMMAND, &buf, 1) != ESP_OK)
+    // Skip the bus when every cached word already holds the value
+    bool redundant = true;
+    for(uint8_t i = 0; i < data_len && redundant; i++)
     {
-        return ESP_FAIL;
+        uint16_t reg = addr + i;
+        redundant = reg < MAX17330_SHADOW_REGS && max17330_reg_class(reg) != MAX17330_REG_VOLATILE &&
+                    shadow_valid(shadow, reg) && shadow->value[reg] == data[i];
     }
-
-    if(max17330_read(conf, MAX17330_nICHGCFG, read_buf, 1) != ESP_OK)
+    if(redundant)
     {
-        return ESP_FAIL;
+        shadow->stats.writes_skipped++;
+        xSemaphoreGive(shadow->lock);
+        return ESP_OK;
     }
-    if(max17330_read(conf, MAX17330_nPACKCFG, read_buf+1, 1) != ESP_OK)
+
+    esp_err_t err = max17330_bus_write(conf, addr, data, data_len);
+    if(err == ESP_OK)
     {
-        return ESP_FAIL;
+        shadow->stats.bus_writes++;
+        for(uint8_t i = 0; i < data_len && addr + i < MAX17330_SHADOW_REGS; i++)
+        {
+            if(max17330_reg_class(addr + i) != MAX17330_REG_VOLATILE)
+            {
+                shadow_store(shadow, addr + i, data[i]);
+            }
+        }
+        shadow_after_write(shadow, addr, data[0]);
     }
-    if(max17330_read(conf, MAX17330_nODSCTH, read_buf+2, 1) != ESP_OK)
+    xSemaphoreGive(shadow->lock);
+    return err;
+}
+
+esp_err_t max17330_read(max17330_conf_t conf, uint16_t addr, uint16_t* data, uint8_t data_len)
+{
+    max17330_shadow_t *shadow = &shadows[conf.battery];
+    xSemaphoreTake(shadow->lock, portMAX_DELAY);
+    shadow_expire_slow(shadow, conf.slow_refresh_ms);
+
+    bool cached = true;
+    for(uint8_t i = 0; i < data_len && cached; i++)
     {
-        return ESP_FAIL;
+        uint16_t reg = addr + i;
+        cached = reg < MAX17330_SHADOW_REGS && max17330_reg_class(reg) != MAX17330_REG_VOLATILE &&
+                 shadow_valid(shadow, reg);
     }
-    if(max17330_read(conf, MAX17330_nDESIGNCAP, read_buf+3, 1) != ESP_OK)
+    esp_err_t err = ESP_OK;
+    if(cached)
     {
-        return ESP_FAIL;
+        memcpy(data, &shadow->value[addr], data_len * sizeof(uint16_t));
+        shadow->stats.hits++;
     }
-    printf("MAX17330 %d: nICHGCFG = %x, nPACKCFG = %x, nODSCTH = %x, nDESIGNCAP = %x\n", conf.battery, read_buf[0], read_buf[1], read_buf[2], read_buf[3]);
-    if(read_buf[0] != 0x314B || read_buf[1] != 0x1 || read_buf[2] != 0x0D00 || read_buf[3] != 2*conf.battery_cap_mah)
+    else
     {
-        ESP_LOGI("MAX17330", "First time setup");
+        err = max17330_bus_read(conf, addr, data, data_len);
+        shadow->stats.bus_reads++;
+        for(uint8_t i = 0; err == ESP_OK && i < data_len && addr + i < MAX17330_SHADOW_REGS; i++)
+        {
+            if(max17330_reg_class(addr + i) != MAX17330_REG_VOLATILE)
+            {
+                shadow_store(shadow, addr + i, data[i]);
+            }
+        }
     }
-    else
+    xSemaphoreGive(shadow->lock);
+    return err;
+}
+
+// Unlock write protection, which stays off until the next reset
+static esp_err_t max17330_unlock(max17330_conf_t conf)
+{
+    max17330_shadow_t *shadow = &shadows[conf.battery];
+    if(shadow->unlocked)
     {
-        ESP_LOGI("MAX17330", "Already setup");
         return ESP_OK;
     }
-
-    // Unlock write protection
+    uint16_t buf = 0x0;
     for(uint8_t i = 0; i < 2; i++)
     {
-        buf = 0x0;
         if(max17330_write(conf, MAX17330_COMMSTAT, &buf, 1) != ESP_OK)
         {
             return ESP_FAIL;
         }
     }
+    shadow->unlocked = true;
+    return ESP_OK;
+}
+
+void max17330_invalidate_cache(max17330_conf_t conf)
+{
+    max17330_shadow_t *shadow = &shadows[conf.battery];
+    xSemaphoreTake(shadow->lock, portMAX_DELAY);
+    shadow_drop_all(shadow);
+    xSemaphoreGive(shadow->lock);
+}
 
-    // Set charging current
-    buf = 0x314B;  // 500 mA
-    if(max17330_write(conf, MAX17330_nICHGCFG, &buf, 1) != ESP_OK)
+esp_err_t max17330_get_protection(max17330_conf_t conf, max17330_prot_t *prot)
+{
+    uint16_t buf;
+    if(max17330_read(conf, MAX17330_PROTSTATUS, &buf, 1) != ESP_OK)
     {
         return ESP_FAIL;
     }
-
-    // Set thermistor disabled
-    buf = 0x1;
-    if(max17330_write(conf, MAX17330_nPACKCFG, &buf, 1) != ESP_OK)
+    prot->prot_status = buf;
+    if(max17330_read(conf, MAX17330_PROTALRT, &buf, 1) != ESP_OK)
     {
         return ESP_FAIL;
     }
-
-    // Set protection current threshold
-    buf = 0xD00;
-    if(max17330_write(conf, MAX17330_nODSCTH, &buf, 1) != ESP_OK)
+    prot->prot_alert = buf;
+    if(max17330_read(conf, MAX17330_CURRENT, &buf, 1) != ESP_OK)
     {
         return ESP_FAIL;
     }
-
-    // Set battery design capacity
-    buf = 2 * conf.battery_cap_mah;
-    if(max17330_write(conf, MAX17330_nDESIGNCAP, &buf, 1) != ESP_OK)
+    prot->current_ma = 0.15625 * ((int16_t)buf);
+    if(max17330_read(conf, MAX17330_VCELL, &buf, 1) != ESP_OK)
     {
         return ESP_FAIL;
     }
+    prot->voltage = 78.125e-6 * buf;
+    return ESP_OK;
+}
 
-    buf = 0xE904;   // Copy NV block
-    if(max17330_write(conf, MAX17330_COMMAND, &buf, 1) != ESP_OK)
+esp_err_t max17330_get_link_stats(max17330_conf_t conf, i2c_bus_stats_t *stats)
+{
+    return i2c_bus_get_stats(max17330_port(conf), stats);
+}
+
+esp_err_t max17330_get_cache_stats(max17330_conf_t conf, max17330_cache_stats_t *stats)
+{
+    max17330_shadow_t *shadow = &shadows[conf.battery];
+    if(shadow->lock == NULL)
     {
-        return ESP_FAIL;
+        return ESP_ERR_INVALID_STATE;
     }
-    vTaskDelay(8 / portTICK_PERIOD_MS); // Wait tBLOCK
+    xSemaphoreTake(shadow->lock, portMAX_DELAY);
+    *stats = shadow->stats;
+    xSemaphoreGive(shadow->lock);
+    return ESP_OK;
+}
 
-    // POR
-    buf = 0x8000;
+// Reloads the configuration from NV and restarts the gauge's firmware
+static esp_err_t max17330_config_reset(max17330_conf_t conf)
+{
+    uint16_t buf = 0x8000;
     if(max17330_write(conf, MAX17330_RESET, &buf, 1) != ESP_OK)
     {
         return ESP_FAIL;
     }
-
+    esp_err_t err;
+    uint32_t polls = 0;
+    while((err = max17330_read(conf, MAX17330_RESET, &buf, 1)) == ESP_OK && (buf & 0x8000) != 0)
+    {
+        polls++;
+        vTaskDelay(1 / portTICK_PERIOD_MS);
+    }
+    if(err != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    DLOG(DLOG_GAUGE_RESET, conf.battery, polls);
+    // Anything read while the reset was in progress is stale
+    max17330_invalidate_cache(conf);
     return ESP_OK;
 }
 
-esp_err_t max17330_init(max17330_conf_t conf)
+// Volatile settings, lost on every config reset
+static esp_err_t max17330_setup_ram(max17330_conf_t conf)
 {
-    i2c_config_t i2c_conf = {
-        .mode = I2C_MODE_MASTER,
-        .sda_io_num = conf.sda,
-        .sda_pullup_en = GPIO_PULLUP_ENABLE,
-        .scl_io_num = conf.scl,
-        .scl_pullup_en = GPIO_PULLUP_ENABLE,
-        .master.clk_speed = conf.clk,
-    };
+    if(max17330_unlock(conf) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
 
-    i2c_reset_tx_fifo(conf.battery == FLIGHT_BATTERY ? I2C_NUM_0 : I2C_NUM_1);
-    i2c_reset_rx_fifo(conf.battery == FLIGHT_BATTERY ? I2C_NUM_0 : I2C_NUM_1);
+    // Config disable thermistor
+    uint16_t buf = 0x2204;
+    if(max17330_write(conf, 0x00B, &buf, 1) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
 
-    if(i2c_param_config(conf.battery == FLIGHT_BATTERY ? I2C_NUM_0 : I2C_NUM_1, &i2c_conf) != ESP_OK)
+    // Clear alerts
+    buf = 0x0000;
+    if(max17330_write(conf, MAX17330_PROTALRT, &buf, 1) != ESP_OK)
     {
         return ESP_FAIL;
     }
+    return ESP_OK;
+}
 
-    int err;
-    if((err = i2c_driver_install(conf.battery == FLIGHT_BATTERY ? I2C_NUM_0 : I2C_NUM_1, I2C_MODE_MASTER, 0, 0, 0)) != ESP_OK)
+// Sends a recall command and waits out tRECALL. A delay of n ticks may end
+// just after the next tick, so round up and add one: 5 ms is 0 ticks at 100 Hz.
+static esp_err_t max17330_recall(max17330_conf_t conf, uint16_t command)
+{
+    if(max17330_write(conf, MAX17330_COMMAND, &command, 1) != ESP_OK)
     {
         return ESP_FAIL;
     }
+    vTaskDelay((MAX17330_RECALL_MS + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS + 1);
+    return ESP_OK;
+}
 
-    uint16_t buf = 0;
-    if(max17330_read(conf, MAX17330_DEVNAME, &buf, 1) != ESP_OK)
+// Reads how many NV block copies the gauge has left. The history recall
+// overwrites the NV shadow registers, so NV is recalled again afterwards.
+static esp_err_t max17330_nv_writes_left(max17330_conf_t conf, uint8_t *left)
+{
+    uint16_t buf;
+    if(max17330_recall(conf, 0xE29B) != ESP_OK)  // Recall write history
     {
-        ESP_LOGE("MAX17330", "%d, Failed to read from MAX17330", conf.battery);
         return ESP_FAIL;
     }
-    if(buf != 0x40B0 && buf != 0x40B1)
+    esp_err_t err = max17330_read(conf, MAX17330_HISTORY_WRITES, &buf, 1);
+    if(max17330_recall(conf, 0xE001) != ESP_OK || err != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    if(buf == 0x0000)
     {
-        ESP_LOGI("MAX17330", "%d, Incorrect device ID", conf.battery);
         return ESP_FAIL;
     }
+    buf = (buf >> 8) | (buf & 0xFF);
+    uint8_t count = 0;
+    while(!(buf & 0x80))
+    {
+        buf <<= 1;
+        count++;
+    }
+    *left = count;
+    return ESP_OK;
+}
 
-    // Unlock write protection
-    for(uint8_t i = 0; i < 2; i++)
+// Waits for the gauge to finish an NV block copy
+static esp_err_t max17330_nv_wait(max17330_conf_t conf)
+{
+    uint16_t buf;
+    TickType_t start = xTaskGetTickCount();
+    do
     {
-        buf = 0x0;
-        if(max17330_write(conf, MAX17330_COMMSTAT, &buf, 1) != ESP_OK)
+        vTaskDelay(pdMS_TO_TICKS(MAX17330_NV_POLL_MS));
+        if(max17330_read(conf, MAX17330_COMMSTAT, &buf, 1) != ESP_OK)
         {
             return ESP_FAIL;
         }
+    } while((buf & MAX17330_COMMSTAT_NVBUSY) && xTaskGetTickCount() - start < pdMS_TO_TICKS(MAX17330_NV_COPY_TIMEOUT_MS));
+    if(buf & MAX17330_COMMSTAT_NVBUSY)
+    {
+        return ESP_ERR_TIMEOUT;
     }
+    return (buf & MAX17330_COMMSTAT_NVERROR) ? ESP_FAIL : ESP_OK;
+}
 
-    // Config disable thermistor
-    buf = 0x2204;
-    if(max17330_write(conf, 0x00B, &buf, 1) != ESP_OK)
+// Recalls NV into the shadow registers and reads the span a profile covers
+// in as few transactions as the bus allows
+static esp_err_t max17330_nv_read_span(max17330_conf_t conf, uint16_t first, uint16_t count, uint16_t *data)
+{
+    if(max17330_recall(conf, 0xE001) != ESP_OK)  // NV recall
     {
         return ESP_FAIL;
     }
+    for(uint16_t done = 0; done < count; )
+    {
+        uint8_t len = count - done < MAX17330_NV_BLOCK_WORDS ? count - done : MAX17330_NV_BLOCK_WORDS;
+        if(max17330_read(conf, first + done, data + done, len) != ESP_OK)
+        {
+            return ESP_FAIL;
+        }
+        done += len;
+    }
+    return ESP_OK;
+}
 
-    // Clear alerts
-    buf = 0x0000;
-    if(max17330_write(conf, MAX17330_PROTALRT, &buf, 1) != ESP_OK)
+static esp_err_t max17330_nv_span(const max17330_nv_profile_t *profile, uint16_t *first, uint16_t *count)
+{
+    if(profile->count == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    uint16_t lo = UINT16_MAX, hi = 0;
+    for(uint8_t i = 0; i < profile->count; i++)
+    {
+        uint16_t reg = profile->words[i].reg;
+        if(reg < MAX17330_NV_FIRST || reg >= MAX17330_NV_END)
+        {
+            ESP_LOGE("MAX17330", "0x%x is not an NV configuration register", reg);
+            return ESP_ERR_INVALID_ARG;
+        }
+        lo = reg < lo ? reg : lo;
+        hi = reg > hi ? reg : hi;
+    }
+    *first = lo;
+    *count = hi - lo + 1;
+    return ESP_OK;
+}
+
+static uint8_t max17330_nv_diff(const max17330_nv_profile_t *profile, uint16_t first, const uint16_t *data)
+{
+    uint8_t differing = 0;
+    for(uint8_t i = 0; i < profile->count; i++)
+    {
+        differing += data[profile->words[i].reg - first] != profile->words[i].value;
+    }
+    return differing;
+}
+
+esp_err_t max17330_check_nv_profile(max17330_conf_t conf, const max17330_nv_profile_t *profile,
+                                    max17330_nv_result_t *result)
+{
+    uint16_t first, count;
+    uint16_t data[MAX17330_NV_END - MAX17330_NV_FIRST];
+    memset(result, 0, sizeof(*result));
+    if(max17330_nv_span(profile, &first, &count) != ESP_OK)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if(max17330_nv_read_span(conf, first, count, data) != ESP_OK)
     {
         return ESP_FAIL;
     }
+    result->differing = max17330_nv_diff(profile, first, data);
+    return ESP_OK;
+}
 
-    // Number of writes
-    buf = 0xE29B;
-    if(max17330_write(conf, MAX17330_COMMAND, &buf, 1) != ESP_OK)
+esp_err_t max17330_apply_nv_profile(max17330_conf_t conf, const max17330_nv_profile_t *profile,
+                                    max17330_nv_result_t *result)
+{
+    uint16_t first, count;
+    uint16_t data[MAX17330_NV_END - MAX17330_NV_FIRST];
+    memset(result, 0, sizeof(*result));
+    if(max17330_nv_span(profile, &first, &count) != ESP_OK)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // Every copy burns one of the gauge's few NV writes. The count is read
+    // first, since its recall disturbs the shadow registers the copy stores.
+    if(max17330_nv_writes_left(conf, &result->writes_left) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    if(max17330_nv_read_span(conf, first, count, data) != ESP_OK)
     {
         return ESP_FAIL;
     }
-    vTaskDelay(5 / portTICK_PERIOD_MS); // Wait tRECALL
-    if(max17330_read(conf, MAX17330_HISTORY_WRITES, &buf, 1) != ESP_OK)
+    result->differing = max17330_nv_diff(profile, first, data);
+    if(result->differing == 0)
+    {
+        return ESP_OK;
+    }
+    DLOG(DLOG_GAUGE_NV_DIFF, conf.battery, result->differing, result->writes_left);
+    if(result->writes_left <= profile->reserve_writes)
+    {
+        ESP_LOGE("MAX17330", "%d, NV profile needs a write but only %d remain", conf.battery, result->writes_left);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if(max17330_unlock(conf) != ESP_OK)
     {
         return ESP_FAIL;
     }
-    if(buf != 0x0000)
+    // Patch the span read above and write back runs of changed words
+    bool changed[MAX17330_NV_END - MAX17330_NV_FIRST] = {false};
+    for(uint8_t i = 0; i < profile->count; i++)
     {
-        buf = (buf >> 8) | (buf & 0xFF);
-        uint8_t count = 0;
-        while(!(buf & 0x80))
+        uint16_t at = profile->words[i].reg - first;
+        if(data[at] != profile->words[i].value)
         {
-            buf <<= 1;
-            count++;
+            data[at] = profile->words[i].value;
+            changed[at] = true;
         }
-        ESP_LOGI("MAX17330", "%d, Number of writes remaining: %d", conf.battery, count);
     }
-    else
+    for(uint16_t at = 0; at < count; )
+    {
+        if(!changed[at])
+        {
+            at++;
+            continue;
+        }
+        uint8_t len = 1;
+        while(at + len < count && changed[at + len] && len < MAX17330_NV_BLOCK_WORDS)
+        {
+            len++;
+        }
+        if(max17330_write(conf, first + at, data + at, len) != ESP_OK)
+        {
+            return ESP_FAIL;
+        }
+        at += len;
+    }
+
+    uint16_t buf = 0xE904;   // Copy NV block
+    result->copy_issued = true;
+    if(max17330_write(conf, MAX17330_COMMAND, &buf, 1) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    esp_err_t err = max17330_nv_wait(conf);
+    if(err != ESP_OK)
     {
+        ESP_LOGE("MAX17330", "%d, NV block copy failed: %s", conf.battery, esp_err_to_name(err));
         return ESP_FAIL;
     }
+    result->copied = true;
 
-    return ESP_OK;
+    // Read back what NV now holds
+    if(max17330_nv_read_span(conf, first, count, data) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    uint8_t differing = max17330_nv_diff(profile, first, data);
+    DLOG(DLOG_GAUGE_NV_WRITTEN, conf.battery, result->differing, differing);
+    if(differing != 0)
+    {
+        ESP_LOGE("MAX17330", "%d, %d words differ after the NV copy", conf.battery, differing);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    // Restart the gauge's firmware on the new configuration
+    if(max17330_config_reset(conf) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    return max17330_setup_ram(conf);
 }
 
-esp_err_t max17330_reset(max17330_conf_t conf)
+esp_err_t max17330_init(max17330_conf_t conf)
 {
-    // Hardware Reset
-    uint16_t buf = 0x000F;
-    if(max17330_write(conf, 0x060, &buf, 1) != ESP_OK)
+    max17330_shadow_t *shadow = &shadows[conf.battery];
+    if(shadow->lock == NULL)
+    {
+        shadow->lock = xSemaphoreCreateMutexStatic(&shadow->lock_buf);
+    }
+    max17330_invalidate_cache(conf);
+    shadow->prot_alert = UINT32_MAX;
+    shadow->prot_status = UINT32_MAX;
+
+    i2c_bus_conf_t bus_conf = {
+        .sda = conf.sda,
+        .scl = conf.scl,
+        .clk = conf.clk,
+        .clk_max = conf.clk_max,
+        .probe = max17330_probe,
+        .core = conf.core,
+    };
+    if(i2c_bus_init(max17330_port(conf), &bus_conf) != ESP_OK)
     {
         return ESP_FAIL;
     }
-    vTaskDelay(10 / portTICK_PERIOD_MS);
 
-    // Configuration Reset
-    buf = 0x8000;
-    if(max17330_write(conf, MAX17330_RESET, &buf, 1) != ESP_OK)
+    uint16_t buf = 0;
+    if(max17330_read(conf, MAX17330_DEVNAME, &buf, 1) != ESP_OK)
     {
+        ESP_LOGE("MAX17330", "%d, Failed to read from MAX17330", conf.battery);
         return ESP_FAIL;
     }
-    printf("Resetting MAX17330");
-    esp_err_t err;
-    while((err = max17330_read(conf, MAX17330_RESET, &buf, 1)) == ESP_OK && (buf & 0x8000) != 0)
+    if(buf != 0x40B0 && buf != 0x40B1)
     {
-        printf(".");
-        vTaskDelay(1 / portTICK_PERIOD_MS);
+        ESP_LOGI("MAX17330", "%d, Incorrect device ID", conf.battery);
+        return ESP_FAIL;
     }
-    printf("\n");
-    if(err != ESP_OK)
+
+    if(max17330_setup_ram(conf) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    uint8_t left;
+    if(max17330_nv_writes_left(conf, &left) != ESP_OK)
     {
         return ESP_FAIL;
     }
+    ESP_LOGI("MAX17330", "%d, Number of writes remaining: %d", conf.battery, left);
 
     return ESP_OK;
 }
 
+esp_err_t max17330_reset(max17330_conf_t conf)
+{
+    // Hardware Reset
+    uint16_t buf = 0x000F;
+    if(max17330_write(conf, 0x060, &buf, 1) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    vTaskDelay(10 / portTICK_PERIOD_MS);
+
+    return max17330_config_reset(conf);
+}
+
 esp_err_t max17330_get_battery_state(max17330_conf_t conf, battery_stat_t *stat)
 {
+    max17330_shadow_t *shadow = &shadows[conf.battery];
+
     // Full battery capacity
     uint16_t buf = 0;
     if(max17330_read(conf, MAX17330_FULLCAPREP, &buf, 1) != ESP_OK)
@@ -358,13 +780,21 @@ esp_err_t max17330_get_battery_state(max17330_conf_t conf, battery_stat_t *stat)
     {
         return ESP_FAIL;
     }
-    printf("Protection alert: 0x%x\n", buf);
+    if(buf != shadow->prot_alert)
+    {
+        shadow->prot_alert = buf;
+        DLOG(DLOG_PROT_ALERT, conf.battery, buf);
+    }
 
     if(max17330_read(conf, MAX17330_PROTSTATUS, &buf, 1) != ESP_OK)
     {
         return ESP_FAIL;
     }
-    printf("Protection status: 0x%x\n", buf);
+    if(buf != shadow->prot_status)
+    {
+        shadow->prot_status = buf;
+        DLOG(DLOG_PROT_STATUS, conf.battery, buf);
+    }
     
     return ESP_OK;
 }
\ No newline at end of file
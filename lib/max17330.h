@@ -2,6 +2,13 @@
 #define MAX17330_H
 
 #include "esp_err.h"
+#include "i2c_bus.h"
+#include <stdbool.h>
+
+// Upper bound on any single register transaction, including queueing. A
+// read or write also waits for the gauge's register lock, which is held for
+// at most one transaction of another task.
+#define MAX17330_I2C_TIMEOUT_MS 50
 
 #define MAX17330_ADDR_RAM 0x6C
 #define MAX17330_ADDR_NVS 0x16
@@ -50,6 +57,30 @@
 #define MAX17330_PCKP 0x0DB
 #define MAX17330_VCELL 0x01A
 
+// ProtStatus/ProtAlrt bits
+#define MAX17330_PROT_ODCP (1 << 2)         // Overdischarge current
+#define MAX17330_PROT_UVP (1 << 3)          // Undervoltage
+#define MAX17330_PROT_TOOHOTD (1 << 4)      // Overtemperature while discharging
+#define MAX17330_PROT_DIEHOT (1 << 5)
+#define MAX17330_PROT_PERMFAIL (1 << 6)
+#define MAX17330_PROT_OCCP (1 << 10)        // Overcharge current
+#define MAX17330_PROT_OVP (1 << 11)         // Overvoltage
+
+// CommStat bits
+#define MAX17330_COMMSTAT_NVBUSY (1 << 1)
+#define MAX17330_COMMSTAT_NVERROR (1 << 2)
+
+// NV shadow registers a profile may set
+#define MAX17330_NV_FIRST 0x180
+#define MAX17330_NV_END 0x1F0
+
+// Default refresh period for slowly changing registers (capacity, age, cycles)
+#define MAX17330_SLOW_REFRESH_MS 60000
+
+// Conversion period of Current and VCell. A read returns the last completed
+// conversion, so a fast value can be up to this much older than the read.
+#define MAX17330_ADC_PERIOD_US 175800
+
 typedef enum {
     FLIGHT_BATTERY = 0,
     PYRO_BATTERY = 1,
@@ -76,8 +107,47 @@ typedef struct {
     int sda;
     int scl;
     int clk;
+    int clk_max;                // Fastest clock the link may tune up to, 0 keeps clk
+    int core;                   // Core the bus task is pinned to
+    uint32_t slow_refresh_ms;   // 0 selects MAX17330_SLOW_REFRESH_MS
 } max17330_conf_t;
 
+// Registers the protection engine polls, all read straight from the gauge
+typedef struct {
+    uint16_t prot_status;       // Conditions present now
+    uint16_t prot_alert;        // Conditions seen since last cleared
+    double current_ma;          // Instantaneous, negative while discharging
+    double voltage;
+} max17330_prot_t;
+
+// One word of the gauge's NV configuration
+typedef struct {
+    uint16_t reg;
+    uint16_t value;
+} max17330_nv_word_t;
+
+// What a provisioned gauge's NV configuration must hold; words not listed
+// keep whatever the gauge has
+typedef struct {
+    const max17330_nv_word_t *words;
+    uint8_t count;
+    uint8_t reserve_writes;     // NV block copies that must remain afterwards
+} max17330_nv_profile_t;
+
+typedef struct {
+    uint8_t differing;          // Profile words the gauge did not hold
+    uint8_t writes_left;        // NV block copies left, read by apply only
+    bool copy_issued;           // Copy NV Block was sent, so a write may be spent
+    bool copied;                // The profile was committed to NV
+} max17330_nv_result_t;
+
+typedef struct {
+    uint32_t hits;              // Reads served from the shadow registers
+    uint32_t bus_reads;
+    uint32_t bus_writes;
+    uint32_t writes_skipped;    // Writes of a value the register already holds
+} max17330_cache_stats_t;
+
 esp_err_t max17330_init(max17330_conf_t conf);
 
 // Resets the registers and the fuel gauge
@@ -85,6 +155,27 @@ esp_err_t max17330_reset(max17330_conf_t conf);
 
 esp_err_t max17330_get_battery_state(max17330_conf_t conf, battery_stat_t *stat);
 
-esp_err_t max17330_first_time_setup(max17330_conf_t conf);
+// Compares the gauge's NV configuration against profile in one block read
+esp_err_t max17330_check_nv_profile(max17330_conf_t conf, const max17330_nv_profile_t *profile,
+                                    max17330_nv_result_t *result);
+
+// Writes only the words that differ from profile and commits them with a
+// single NV block copy, then verifies them after a recall and config resets
+// the gauge. A gauge that already matches is left alone, and nothing is
+// written when the copy would leave fewer than reserve_writes.
+esp_err_t max17330_apply_nv_profile(max17330_conf_t conf, const max17330_nv_profile_t *profile,
+                                    max17330_nv_result_t *result);
+
+// Reads only what the protection engine needs, MAX17330_PROT_READS bus transactions
+#define MAX17330_PROT_READS 4
+esp_err_t max17330_get_protection(max17330_conf_t conf, max17330_prot_t *prot);
+
+// Drops every cached register, e.g. after the gauge was power cycled
+void max17330_invalidate_cache(max17330_conf_t conf);
+
+esp_err_t max17330_get_cache_stats(max17330_conf_t conf, max17330_cache_stats_t *stats);
+
+// Clock rate and error statistics of the gauge's I2C bus
+esp_err_t max17330_get_link_stats(max17330_conf_t conf, i2c_bus_stats_t *stats);
 
 #endif
\ No newline at end of file
@@ -7,92 +7,748 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 #include <string.h>
+#include <strings.h>
+#include <stdlib.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
 #include "esp_http_server.h"
 #include "esp_chip_info.h"
 #include "esp_log.h"
 #include "esp_vfs.h"
-#include "cJSON.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_ota_ops.h"
+#include "json_out.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "power_control.h"
+#include "tasks.h"
+#include "protection.h"
+#include "dlog.h"
+#include "ota_update.h"
 #include "main.h"
 
+// Heavy responses (asset downloads) run on a worker pool below
+// the httpd task's priority, which then only parses requests and answers
+// control endpoints and snapshot reads inline. A slow client can therefore
+// only ever hold up a worker.
+#define HTTP_WORKERS 2
+#define HTTP_WORK_QUEUE_LEN 6
+#define HTTP_DRAIN_WARN_MS 2000
+
+// LWIP_MAX_SOCKETS is 10 and httpd keeps 3 for itself
+#define HTTP_MAX_SOCKETS 7
+
+// /status long-polls wait at most this long before a 304
+#define STATUS_LONGPOLL_MS 20000
+#define STATUS_LONGPOLL_CHECK_MS 250
+#define STATUS_MAX_PARKED 4
+
+#define STATUS_FIELD_BATTERY 0x1
+#define STATUS_FIELD_ARMED 0x2
+#define STATUS_FIELD_HEALTH 0x4
+#define STATUS_FIELD_ALL (STATUS_FIELD_BATTERY | STATUS_FIELD_ARMED | STATUS_FIELD_HEALTH)
+
+// /history rows go out HISTORY_BATCH at a time
+#define HISTORY_BATCH 16
+#define HISTORY_ROW_MAX 56
+
+// Response bodies are built in fixed buffers on the handler's stack
+#define STATUS_BODY_MAX 1024
+#define STATUS_ETAG_MAX 32
+#define BATTERY_BODY_MAX 768
+#define LINK_BODY_MAX 1024
+#define TASKS_BODY_MAX (TASK_PERIODIC_MAX * 192)
+#define PROTECTION_BODY_MAX (512 + PROT_MAX_RULES * 128 + PROT_TRIP_LOG * 112)
+#define ARM_BODY_MAX 32
+#define TIME_BODY_MAX 64
+
+// Largest /arm POST body read; the content is ignored
+#define ARM_POST_MAX 64
+
+#define OTA_BODY_MAX 384
+// Upload bodies are read a TCP segment at a time
+#define OTA_RECV_CHUNK 1460
+// Receive timeouts in a row before an upload is given up
+#define OTA_RECV_TIMEOUTS 3
+
+// Assets only change with a new SPIFFS image
+#define ASSET_CACHE_CONTROL "max-age=86400"
+
+typedef struct {
+    httpd_req_t *req;
+    esp_err_t (*handler)(httpd_req_t *req);
+} http_work_t;
+
+typedef struct {
+    const char *path;
+    const char *type;
+    const char *encoding;       // Content-Encoding of the stored file, or NULL
+} static_file_t;
+
+// Board times in esp_timer microseconds, sent with every /status answer so a
+// client can age what it has even when the body did not change
+typedef struct {
+    char checked[24];           // X-Checked-Us: the sampler last confirmed the snapshot
+    char sent[24];              // X-Board-Us: this answer left
+} status_time_hdrs_t;
+
+typedef struct {
+    httpd_req_t *req;           // NULL for a free slot
+    uint32_t since;
+    uint8_t fields;
+    TickType_t deadline;
+} status_waiter_t;
+
 extern uint8_t armed;
 static httpd_handle_t server = NULL;
+static QueueHandle_t work_queue = NULL;
+static StaticQueue_t work_queue_buf;
+static uint8_t work_queue_storage[HTTP_WORK_QUEUE_LEN * sizeof(http_work_t)];
+static TaskHandle_t workers[HTTP_WORKERS];
+static StaticTask_t worker_bufs[HTTP_WORKERS];
+static StackType_t worker_stacks[HTTP_WORKERS][TASK_HTTP_WORKER_STACK];
+static atomic_int work_in_flight = 0;
+static atomic_bool draining = false;
+
+static SemaphoreHandle_t status_cache_lock = NULL;
+static StaticSemaphore_t status_cache_lock_buf;
+static char status_cache[STATUS_BODY_MAX];
+static size_t status_cache_len = 0;         // 0 until the first snapshot is serialized
+static uint32_t status_cache_seq;
+static uint8_t status_cache_fields;
+static uint32_t status_boot_id;             // Keeps a previous boot's ETags from matching
+static SemaphoreHandle_t status_parked_lock = NULL;
+static StaticSemaphore_t status_parked_lock_buf;
+static status_waiter_t status_parked[STATUS_MAX_PARKED];
+static StaticTask_t status_task_buf;
+static StackType_t status_task_stack[TASK_STATUS_POLL_STACK];
+
+// Only the httpd task serves /log, so one buffer will do
+static uint8_t log_buf[DLOG_WIRE_HEADER + DLOG_HISTORY_LEN * DLOG_WIRE_RECORD_MAX];
 
 static const char *HTTP_TAG = "http-server";
-#define INDEX_PATH "/www/index.html"
-#define PSPHA_PNG_PATH "/www/pspha.png"
-#define FAVICON_PATH "/www/favicon.ico"
-#define JQUERY_PATH "/www/jquery.js"
+// Overridden by the host build, which serves the assets from a local copy
+#ifndef WWW_BASE
+#define WWW_BASE "/www"
+#endif
+// front/website.cmake stores the text assets gzipped only
+#define INDEX_PATH WWW_BASE "/index.html.gz"
+#define PSPHA_PNG_PATH WWW_BASE "/pspha.png"
+#define FAVICON_PATH WWW_BASE "/favicon.ico"
+
+static bool http_on_worker()
+{
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    for(uint8_t i = 0; i < HTTP_WORKERS; i++)
+    {
+        if(workers[i] == self)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Moves a request off the httpd task; the handler runs again on a worker
+static esp_err_t http_queue_work(httpd_req_t *req, esp_err_t (*handler)(httpd_req_t *req))
+{
+    // Only the httpd task queues work, so a free slot cannot disappear
+    if(draining || uxQueueSpacesAvailable(work_queue) == 0)
+    {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_set_hdr(req, "Retry-After", "1");
+        httpd_resp_sendstr(req, "Server busy");
+        return ESP_OK;
+    }
+    http_work_t work = {
+        .handler = handler,
+    };
+    if(httpd_req_async_handler_begin(req, &work.req) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    atomic_fetch_add(&work_in_flight, 1);
+    xQueueSend(work_queue, &work, 0);
+    return ESP_OK;
+}
+
+static void http_worker(void *arg)
+{
+    http_work_t work;
+    while(1)
+    {
+        if(xQueueReceive(work_queue, &work, portMAX_DELAY) != pdTRUE)
+        {
+            continue;
+        }
+        // Queued before the server began stopping; its socket is about to go
+        if(draining)
+        {
+            httpd_resp_set_status(work.req, "503 Service Unavailable");
+            httpd_resp_sendstr(work.req, "Server restarting");
+        }
+        else
+        {
+            work.handler(work.req);
+        }
+        httpd_req_async_handler_complete(work.req);
+        atomic_fetch_sub(&work_in_flight, 1);
+    }
+}
+
+static esp_err_t http_start_workers()
+{
+    draining = false;
+    if(work_queue != NULL)
+    {
+        return ESP_OK;
+    }
+    work_queue = xQueueCreateStatic(HTTP_WORK_QUEUE_LEN, sizeof(http_work_t), work_queue_storage, &work_queue_buf);
+    for(uint8_t i = 0; i < HTTP_WORKERS; i++)
+    {
+        workers[i] = xTaskCreateStaticPinnedToCore(http_worker, "http_worker", TASK_HTTP_WORKER_STACK, NULL,
+                                                   TASK_HTTP_WORKER_PRIORITY, worker_stacks[i], &worker_bufs[i],
+                                                   TASK_HTTP_WORKER_CORE);
+        if(workers[i] == NULL)
+        {
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+static void add_battery_obj(json_out_t *out, const battery_stat_t *stat)
+{
+    json_out_begin_object(out, NULL);
+    json_out_number(out, "max_cap", stat->max_cap);                 // Maximum Capacity (mAh)
+    json_out_number(out, "curr_cap", stat->curr_cap);               // Current charge (mAh)
+    json_out_number(out, "soc", stat->soc);                         // State of charge (decimal %)
+    json_out_bool(out, "charging", stat->charging);                 // Charging?
+    json_out_uint(out, "charge_cycles", stat->charge_cycles);       // Charge cycles
+    json_out_number(out, "age", stat->battery_age);                 // Fraction of original capacity
+    json_out_number(out, "ttf", stat->ttf_min);                     // Time to full (min)
+    json_out_number(out, "current", stat->current_mah);             // Current (mA)
+    json_out_number(out, "voltage", stat->batt_voltage);            // Voltage (V)
+    json_out_number(out, "tte", stat->tte_min);                     // Time to empty (min)
+    json_out_end_object(out);
+}
 
-// Handler for getting battery data
+// Sends a body built with json_out, or a 500 if it did not fit
+static esp_err_t json_out_send(httpd_req_t *req, json_out_t *out)
+{
+    size_t len = json_out_finish(out);
+    if(len == 0)
+    {
+        ESP_LOGE(HTTP_TAG, "Response for %s exceeds %u bytes", req->uri, (unsigned)out->cap);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Response too large");
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_send(req, out->buf, len);
+}
+
+// Handler for getting battery data, served from the sampler's snapshot
 static esp_err_t battery_data_get_handler(httpd_req_t *req)
 {
+    power_snapshot_t snap;
+    get_snapshot(&snap);
+
+    char body[BATTERY_BODY_MAX];
+    json_out_t out;
+    json_out_init(&out, body, sizeof(body));
+    json_out_begin_array(&out, NULL);
+    add_battery_obj(&out, &snap.battery[FLIGHT_BATTERY]);
+    add_battery_obj(&out, &snap.battery[PYRO_BATTERY]);
+    json_out_end_array(&out);
+    json_out_send(req, &out);
+    return ESP_OK;
+}
+
+static uint8_t status_parse_fields(httpd_req_t *req)
+{
+    char query[64];
+    char fields[48];
+    if(httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+       httpd_query_key_value(query, "fields", fields, sizeof(fields)) != ESP_OK)
+    {
+        return STATUS_FIELD_ALL;
+    }
+    uint8_t mask = 0;
+    for(char *tok = strtok(fields, ","); tok != NULL; tok = strtok(NULL, ","))
+    {
+        if(strcmp(tok, "battery") == 0)
+        {
+            mask |= STATUS_FIELD_BATTERY;
+        }
+        else if(strcmp(tok, "armed") == 0)
+        {
+            mask |= STATUS_FIELD_ARMED;
+        }
+        else if(strcmp(tok, "health") == 0)
+        {
+            mask |= STATUS_FIELD_HEALTH;
+        }
+    }
+    return mask ? mask : STATUS_FIELD_ALL;
+}
+
+// Stamps the headers last so that X-Board-Us is as close to the send as it gets
+static void status_set_time_headers(httpd_req_t *req, const power_snapshot_t *snap, status_time_hdrs_t *hdrs)
+{
+    snprintf(hdrs->checked, sizeof(hdrs->checked), "%lld", (long long)snap->checked_us);
+    snprintf(hdrs->sent, sizeof(hdrs->sent), "%lld", (long long)esp_timer_get_time());
+    httpd_resp_set_hdr(req, "X-Checked-Us", hdrs->checked);
+    httpd_resp_set_hdr(req, "X-Board-Us", hdrs->sent);
+}
+
+// The snapshot seq starts over on every boot, so the ETag carries the boot too
+static void status_etag(char etag[STATUS_ETAG_MAX], uint32_t seq, uint8_t fields)
+{
+    snprintf(etag, STATUS_ETAG_MAX, "\"%08lx-%lu-%u\"", (unsigned long)status_boot_id, (unsigned long)seq, fields);
+}
+
+// Serializes the selected fields of the current snapshot. Idle clients all
+// ask for the same (seq, fields) pair, so the last body is kept and reused.
+static void status_send(httpd_req_t *req, uint8_t fields)
+{
+    power_snapshot_t snap;
+    get_snapshot(&snap);
+
+    xSemaphoreTake(status_cache_lock, portMAX_DELAY);
+    if(status_cache_len == 0 || status_cache_seq != snap.seq || status_cache_fields != fields)
+    {
+        json_out_t out;
+        json_out_init(&out, status_cache, sizeof(status_cache));
+        json_out_begin_object(&out, NULL);
+        json_out_uint(&out, "seq", snap.seq);
+        json_out_uint(&out, "pdb", PDB);                                 // Board number from main.h
+        if(fields & STATUS_FIELD_BATTERY)
+        {
+            json_out_begin_array(&out, "battery");
+            add_battery_obj(&out, &snap.battery[FLIGHT_BATTERY]);
+            add_battery_obj(&out, &snap.battery[PYRO_BATTERY]);
+            json_out_end_array(&out);
+        }
+        if(fields & STATUS_FIELD_ARMED)
+        {
+            json_out_bool(&out, "armed", snap.armed);
+        }
+        if(fields & STATUS_FIELD_HEALTH)
+        {
+            json_out_begin_array(&out, "health");
+            for(battery_t battery = FLIGHT_BATTERY; battery <= PYRO_BATTERY; battery++)
+            {
+                json_out_begin_object(&out, NULL);
+                json_out_bool(&out, "gauge_ok", snap.gauge_ok[battery]);     // Last gauge read succeeded
+                json_out_uint(&out, "clk", snap.clk[battery]);               // I2C clock (Hz)
+                json_out_end_object(&out);
+            }
+            json_out_end_array(&out);
+        }
+        // When this version was read, published and serialized; see /time for
+        // relating them to the client's clock
+        json_out_begin_object(&out, "t");
+        json_out_begin_array(&out, "read");
+        json_out_int(&out, NULL, snap.stamps.read_us[FLIGHT_BATTERY]);
+        json_out_int(&out, NULL, snap.stamps.read_us[PYRO_BATTERY]);
+        json_out_end_array(&out);
+        json_out_begin_array(&out, "read_end");
+        json_out_int(&out, NULL, snap.stamps.read_end_us[FLIGHT_BATTERY]);
+        json_out_int(&out, NULL, snap.stamps.read_end_us[PYRO_BATTERY]);
+        json_out_end_array(&out);
+        json_out_int(&out, "publish", snap.stamps.publish_us);
+        json_out_int(&out, "json", esp_timer_get_time());
+        json_out_end_object(&out);
+        json_out_end_object(&out);
+        status_cache_len = json_out_finish(&out);
+        status_cache_seq = snap.seq;
+        status_cache_fields = fields;
+    }
+
+    // Send a copy so that a slow client does not hold the cache
+    char body[STATUS_BODY_MAX];
+    size_t len = status_cache_len;
+    memcpy(body, status_cache, len);
+    xSemaphoreGive(status_cache_lock);
+    if(len == 0)
+    {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Status too large");
+        return;
+    }
+
+    char etag[STATUS_ETAG_MAX];
+    status_etag(etag, snap.seq, fields);
     httpd_resp_set_type(req, "application/json");
-    cJSON *root = cJSON_CreateArray();
-
-    // Flight battery info
-    battery_stat_t flight_stat = get_battery(FLIGHT_BATTERY);
-    cJSON *flight_obj = cJSON_CreateObject();
-    cJSON_AddNumberToObject(flight_obj, "max_cap", flight_stat.max_cap);                // Maximum Capacity (mAh)
-    cJSON_AddNumberToObject(flight_obj, "curr_cap", flight_stat.curr_cap);              // Current charge (mAh)
-    cJSON_AddNumberToObject(flight_obj, "soc", flight_stat.soc);                        // State of charge (decimal %)
-    cJSON_AddBoolToObject(flight_obj, "charging", flight_stat.charging);                // Charging?
-    cJSON_AddNumberToObject(flight_obj, "charge_cycles", flight_stat.charge_cycles);    // Maximum Capacity (mAh)
-    cJSON_AddNumberToObject(flight_obj, "age", flight_stat.battery_age);                // Current charge (mAh)
-    cJSON_AddNumberToObject(flight_obj, "ttf", flight_stat.ttf_min);                    // State of charge (decimal %)
-    cJSON_AddNumberToObject(flight_obj, "current", flight_stat.current_mah);            // Current (mAh)
-    cJSON_AddNumberToObject(flight_obj, "voltage", flight_stat.batt_voltage);           // Voltage (V)
-    cJSON_AddNumberToObject(flight_obj, "tte", flight_stat.tte_min);                    // Charging?
-    cJSON_AddItemToArray(root, flight_obj);
-
-    // Pyro battery info
-    battery_stat_t pyro_stat = get_battery(PYRO_BATTERY);
-    cJSON *pyro_obj = cJSON_CreateObject();
-    cJSON_AddNumberToObject(pyro_obj, "max_cap", pyro_stat.max_cap);                    // Maximum Capacity (mAh)
-    cJSON_AddNumberToObject(pyro_obj, "curr_cap", pyro_stat.curr_cap);                  // Current charge (mAh)
-    cJSON_AddNumberToObject(pyro_obj, "soc", pyro_stat.soc);                            // State of charge (decimal %)
-    cJSON_AddBoolToObject(pyro_obj, "charging", pyro_stat.charging);                    // Charging?
-    cJSON_AddNumberToObject(pyro_obj, "charge_cycles", pyro_stat.charge_cycles);        // Maximum Capacity (mAh)
-    cJSON_AddNumberToObject(pyro_obj, "age", pyro_stat.battery_age);                    // Current charge (mAh)
-    cJSON_AddNumberToObject(pyro_obj, "ttf", pyro_stat.ttf_min);                        // State of charge (decimal %)
-    cJSON_AddNumberToObject(pyro_obj, "current", pyro_stat.current_mah);                // Current (mAh)
-    cJSON_AddNumberToObject(pyro_obj, "voltage", pyro_stat.batt_voltage);               // Voltage (V)
-    cJSON_AddNumberToObject(pyro_obj, "tte", pyro_stat.tte_min);                        // Charging?
-    cJSON_AddItemToArray(root, pyro_obj);
-
-    const char *bat_info = cJSON_Print(root);
-    httpd_resp_sendstr(req, bat_info);
-    free((void *)bat_info);
-    cJSON_Delete(root);
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    status_time_hdrs_t hdrs;
+    status_set_time_headers(req, &snap, &hdrs);
+    httpd_resp_send(req, body, len);
+}
+
+static void status_send_not_modified(httpd_req_t *req, const power_snapshot_t *snap)
+{
+    httpd_resp_set_status(req, "304 Not Modified");
+    status_time_hdrs_t hdrs;
+    status_set_time_headers(req, snap, &hdrs);
+    httpd_resp_send(req, NULL, 0);
+}
+
+// Answers long-polls once the snapshot moves past their seq, or with 304 when
+// they time out. Parked requests hold no worker, only their socket.
+static void status_longpoll_task(void *arg)
+{
+    while(1)
+    {
+        wait_snapshot_change(pdMS_TO_TICKS(STATUS_LONGPOLL_CHECK_MS));
+        power_snapshot_t snap;
+        get_snapshot(&snap);
+        TickType_t now = xTaskGetTickCount();
+
+        status_waiter_t ready[STATUS_MAX_PARKED];
+        uint8_t count = 0;
+        xSemaphoreTake(status_parked_lock, portMAX_DELAY);
+        for(uint8_t i = 0; i < STATUS_MAX_PARKED; i++)
+        {
+            status_waiter_t *w = &status_parked[i];
+            if(w->req != NULL && (w->since != snap.seq || (int32_t)(now - w->deadline) >= 0 || draining))
+            {
+                ready[count++] = *w;
+                w->req = NULL;
+            }
+        }
+        xSemaphoreGive(status_parked_lock);
+
+        for(uint8_t i = 0; i < count; i++)
+        {
+            if(ready[i].since != snap.seq || draining)
+            {
+                status_send(ready[i].req, ready[i].fields);
+            }
+            else
+            {
+                status_send_not_modified(ready[i].req, &snap);
+            }
+            httpd_req_async_handler_complete(ready[i].req);
+            atomic_fetch_sub(&work_in_flight, 1);
+        }
+    }
+}
+
+// Parks a long-poll; returns false when every slot is taken
+static bool status_park(httpd_req_t *req, uint32_t since, uint8_t fields)
+{
+    bool parked = false;
+    xSemaphoreTake(status_parked_lock, portMAX_DELAY);
+    for(uint8_t i = 0; i < STATUS_MAX_PARKED && !parked; i++)
+    {
+        status_waiter_t *w = &status_parked[i];
+        if(w->req == NULL && httpd_req_async_handler_begin(req, &w->req) == ESP_OK)
+        {
+            w->since = since;
+            w->fields = fields;
+            w->deadline = xTaskGetTickCount() + pdMS_TO_TICKS(STATUS_LONGPOLL_MS);
+            atomic_fetch_add(&work_in_flight, 1);
+            parked = true;
+        }
+    }
+    xSemaphoreGive(status_parked_lock);
+    return parked;
+}
+
+// Handler for the combined status. Supports ?fields=battery,armed,health,
+// If-None-Match against the ETag, and ?since=<seq> to wait for a change.
+static esp_err_t status_get_handler(httpd_req_t *req)
+{
+    uint8_t fields = status_parse_fields(req);
+    power_snapshot_t snap;
+    get_snapshot(&snap);
+
+    char query[64];
+    char since_str[12];
+    if(!draining && httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+       httpd_query_key_value(query, "since", since_str, sizeof(since_str)) == ESP_OK)
+    {
+        uint32_t since = strtoul(since_str, NULL, 10);
+        if(since == snap.seq && status_park(req, since, fields))
+        {
+            return ESP_OK;
+        }
+        // Already changed, or no slot left: answer like a normal poll
+    }
+
+    char etag[STATUS_ETAG_MAX];
+    char if_none_match[STATUS_ETAG_MAX];
+    status_etag(etag, snap.seq, fields);
+    if(httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) == ESP_OK &&
+       strcmp(if_none_match, etag) == 0)
+    {
+        httpd_resp_set_hdr(req, "ETag", etag);
+        status_send_not_modified(req, &snap);
+        return ESP_OK;
+    }
+    status_send(req, fields);
     return ESP_OK;
 }
 
-// Handler for GETting arm/disarm status
-static esp_err_t arm_get_handler(httpd_req_t *req)
+// Handler for the clock exchange. Answered inline with the board's time taken
+// just before the send: a client brackets the request with its own clock, and
+// the offset is off by at most half the round trip. adc_us is how much older a
+// gauge value can be than its read.
+static esp_err_t time_get_handler(httpd_req_t *req)
+{
+    char body[TIME_BODY_MAX];
+    json_out_t out;
+    json_out_init(&out, body, sizeof(body));
+    json_out_begin_object(&out, NULL);
+    json_out_int(&out, "adc_us", MAX17330_ADC_PERIOD_US);
+    json_out_int(&out, "us", esp_timer_get_time());
+    json_out_end_object(&out);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    return json_out_send(req, &out);
+}
+
+static esp_err_t status_start()
+{
+    if(status_cache_lock != NULL)
+    {
+        return ESP_OK;
+    }
+    status_boot_id = esp_random();
+    status_cache_lock = xSemaphoreCreateMutexStatic(&status_cache_lock_buf);
+    status_parked_lock = xSemaphoreCreateMutexStatic(&status_parked_lock_buf);
+    if(xTaskCreateStaticPinnedToCore(status_longpoll_task, "status_poll", TASK_STATUS_POLL_STACK, NULL,
+                                     TASK_STATUS_POLL_PRIORITY, status_task_stack, &status_task_buf,
+                                     TASK_STATUS_POLL_CORE) == NULL)
+    {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+// Handler for the sampler history behind the UI's charts, ?since=<n> returns
+// only samples from number n on. Up to HISTORY_LEN samples are streamed in
+// small chunks as compact rows of [t_ms, current_ma, voltage_mv] per battery.
+static esp_err_t history_get_handler(httpd_req_t *req)
 {
+    if(!http_on_worker())
+    {
+        return http_queue_work(req, history_get_handler);
+    }
+    uint32_t since = 0;
+    char query[32];
+    char since_str[12];
+    if(httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+       httpd_query_key_value(query, "since", since_str, sizeof(since_str)) == ESP_OK)
+    {
+        since = strtoul(since_str, NULL, 10);
+    }
     httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
 
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddBoolToObject(root, "armed", armed);
+    power_sample_t samples[HISTORY_BATCH];
+    char chunk[HISTORY_BATCH * HISTORY_ROW_MAX + 64];
+    int len = snprintf(chunk, sizeof(chunk), "{\"now_ms\":%lu,\"period_ms\":%d,\"samples\":[",
+                       (unsigned long)(esp_timer_get_time() / 1000), SAMPLE_PERIOD_MS);
+    uint32_t next = since;
+    size_t sent = 0;
+    size_t count;
+    // Bounded, in case the sampler keeps adding while we send
+    while(sent < HISTORY_LEN && (count = get_history(next, samples, HISTORY_BATCH, &next)) > 0)
+    {
+        if(draining)
+        {
+            return ESP_FAIL;
+        }
+        for(size_t i = 0; i < count; i++)
+        {
+            const power_sample_t *s = &samples[i];
+            len += snprintf(chunk + len, sizeof(chunk) - len, "%s[%lu,%ld,%u,%ld,%u]",
+                            sent + i ? "," : "", (unsigned long)s->t_ms,
+                            (long)s->current_ma[FLIGHT_BATTERY], s->voltage_mv[FLIGHT_BATTERY],
+                            (long)s->current_ma[PYRO_BATTERY], s->voltage_mv[PYRO_BATTERY]);
+        }
+        sent += count;
+        if(httpd_resp_send_chunk(req, chunk, len) != ESP_OK)
+        {
+            return ESP_FAIL;
+        }
+        len = 0;
+    }
+    len += snprintf(chunk + len, sizeof(chunk) - len, "],\"next\":%lu}", (unsigned long)next);
+    httpd_resp_send_chunk(req, chunk, len);
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+// Handler for getting I2C link statistics of both gauge buses
+static esp_err_t link_get_handler(httpd_req_t *req)
+{
+    char body[LINK_BODY_MAX];
+    json_out_t out;
+    json_out_init(&out, body, sizeof(body));
+    json_out_begin_array(&out, NULL);
+
+    for(battery_t battery = FLIGHT_BATTERY; battery <= PYRO_BATTERY; battery++)
+    {
+        i2c_bus_stats_t stats;
+        if(get_link_stats(battery, &stats) != ESP_OK)
+        {
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Link statistics unavailable");
+            return ESP_FAIL;
+        }
+        json_out_begin_object(&out, NULL);
+        json_out_uint(&out, "clk", stats.clk);                          // Current clock (Hz)
+        json_out_uint(&out, "clk_max", stats.clk_max);                  // Fastest allowed clock (Hz)
+        json_out_uint(&out, "transactions", stats.transactions);
+        json_out_uint(&out, "errors", stats.errors);                    // NACKs and timeouts
+        json_out_uint(&out, "timeouts", stats.timeouts);
+        json_out_uint(&out, "expired", stats.expired);                  // Dropped before reaching the bus
+        json_out_number(&out, "error_rate", stats.transactions ? (double)stats.errors / stats.transactions : 0);
+        json_out_uint(&out, "recoveries", stats.recoveries);
+        json_out_uint(&out, "step_downs", stats.step_downs);
+        json_out_uint(&out, "step_ups", stats.step_ups);
+        json_out_uint(&out, "probes_failed", stats.probes_failed);
+        json_out_uint(&out, "latency_avg_us", stats.latency_avg_us);
+        json_out_uint(&out, "latency_max_us", stats.latency_max_us);
+        json_out_end_object(&out);
+    }
+    json_out_end_array(&out);
+    json_out_send(req, &out);
+    return ESP_OK;
+}
+
+// Handler for getting periodic task timing
+static esp_err_t tasks_get_handler(httpd_req_t *req)
+{
+    task_period_stats_t stats[TASK_PERIODIC_MAX];
+    size_t count = task_period_get_stats(stats, TASK_PERIODIC_MAX);
+
+    char body[TASKS_BODY_MAX];
+    json_out_t out;
+    json_out_init(&out, body, sizeof(body));
+    json_out_begin_array(&out, NULL);
+    for(size_t i = 0; i < count; i++)
+    {
+        json_out_begin_object(&out, NULL);
+        json_out_string(&out, "name", stats[i].name);
+        json_out_uint(&out, "period_ms", stats[i].period_ms);
+        json_out_uint(&out, "runs", stats[i].runs);
+        json_out_uint(&out, "misses", stats[i].misses);                 // Deadline misses
+        json_out_uint(&out, "jitter_avg_us", stats[i].jitter_avg_us);   // Late start vs schedule
+        json_out_uint(&out, "jitter_max_us", stats[i].jitter_max_us);
+        json_out_uint(&out, "exec_avg_us", stats[i].exec_avg_us);       // Run time per period
+        json_out_uint(&out, "exec_max_us", stats[i].exec_max_us);
+        json_out_end_object(&out);
+    }
+    json_out_end_array(&out);
+    json_out_send(req, &out);
+    return ESP_OK;
+}
+
+// Handler for the protection interlock's rules and recent trips
+static esp_err_t protection_get_handler(httpd_req_t *req)
+{
+    prot_stats_t stats;
+    protection_get_stats(&stats);
+    size_t rule_count;
+    const prot_rule_t *rules = protection_get_rules(&rule_count);
+    prot_trip_t trips[PROT_TRIP_LOG];
+    size_t trip_count = protection_get_trips(trips, PROT_TRIP_LOG);
+
+    char body[PROTECTION_BODY_MAX];
+    json_out_t out;
+    json_out_init(&out, body, sizeof(body));
+    json_out_begin_object(&out, NULL);
+    json_out_bool(&out, "holding_safe", stats.holding_safe);       // Arming refused
+    json_out_uint(&out, "polls", stats.polls);
+    json_out_uint(&out, "poll_errors", stats.poll_errors);
+    json_out_uint(&out, "poll_avg_us", stats.poll_avg_us);
+    json_out_uint(&out, "poll_max_us", stats.poll_max_us);
+    json_out_uint(&out, "budget_overruns", stats.budget_overruns);         // Polls outside bound_us
+
+    json_out_begin_array(&out, "rules");
+    for(size_t i = 0; i < rule_count; i++)
+    {
+        json_out_begin_object(&out, NULL);
+        json_out_string(&out, "name", rules[i].name);
+        json_out_bool(&out, "safe", rules[i].action == PROT_ACTION_SAFE);      // Safes the board, or only logs
+        json_out_bool(&out, "active", (stats.active >> i) & 1);
+        json_out_uint(&out, "bound_us", protection_bound_us(&rules[i]));       // Reaction while polls fit the budget
+        json_out_uint(&out, "worst_us", protection_worst_us(&rules[i]));       // Reaction at the I2C deadlines
+        json_out_end_object(&out);
+    }
+    json_out_end_array(&out);
+
+    json_out_begin_array(&out, "trips");
+    for(size_t i = 0; i < trip_count; i++)
+    {
+        json_out_begin_object(&out, NULL);
+        json_out_string(&out, "rule", trips[i].rule < rule_count ? rules[trips[i].rule].name : "");
+        json_out_int(&out, "ts_us", trips[i].ts_us);                   // Since boot
+        json_out_int(&out, "reaction_us", trips[i].ts_us - trips[i].detect_us);
+        json_out_number(&out, "value", trips[i].value);
+        json_out_end_object(&out);
+    }
+    json_out_end_array(&out);
+    json_out_end_object(&out);
+    json_out_send(req, &out);
+    return ESP_OK;
+}
 
-    const char *resp = cJSON_Print(root);
-    httpd_resp_sendstr(req, resp);
-    free((void *)resp);
-    cJSON_Delete(root);
+// Handler for the recent deferred log records, as a binary stream for pb_dlog
+static esp_err_t log_get_handler(httpd_req_t *req)
+{
+    size_t len = dlog_encode_history(log_buf, sizeof(log_buf));
 
+    dlog_stats_t stats;
+    dlog_get_stats(&stats);
+    char dropped[12];
+    snprintf(dropped, sizeof(dropped), "%lu", (unsigned long)stats.dropped);
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, "X-Log-Dropped", dropped);
+    httpd_resp_send(req, (const char *)log_buf, len);
+    return ESP_OK;
+}
+
+// Handler for GETting arm/disarm status
+static esp_err_t arm_send(httpd_req_t *req)
+{
+    char body[ARM_BODY_MAX];
+    json_out_t out;
+    json_out_init(&out, body, sizeof(body));
+    json_out_begin_object(&out, NULL);
+    json_out_bool(&out, "armed", armed);
+    json_out_end_object(&out);
+    return json_out_send(req, &out);
+}
+
+static esp_err_t arm_get_handler(httpd_req_t *req)
+{
+    arm_send(req);
     return ESP_OK;
 }
 
 // Handler for arming/disarming
 static esp_err_t arm_post_handler(httpd_req_t *req)
 {
+    // The length comes from the client, so bound it before reading
+    if(req->content_len > ARM_POST_MAX)
+    {
+        httpd_resp_set_status(req, "413 Payload Too Large");
+        httpd_resp_sendstr(req, "Request body too large");
+        return ESP_OK;
+    }
     int total_len = req->content_len;
     int cur_len = 0;
-    char buf[total_len + 1];
+    char buf[ARM_POST_MAX + 1];
     int received = 0;
     while (cur_len < total_len) {
-        received = httpd_req_recv(req, buf, total_len);
+        received = httpd_req_recv(req, buf + cur_len, total_len - cur_len);
         if (received <= 0) {
             /* Respond with 500 Internal Server Error */
             httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to post control value");
@@ -106,139 +762,249 @@ static esp_err_t arm_post_handler(httpd_req_t *req)
     {
         set_disarmed();
     }
-    else
+    else if(ota_on_trial() || ota_busy() || set_armed() != ESP_OK)
     {
-        set_armed();
+        // An update has not passed its health check yet or is being
+        // uploaded, or a protection rule is holding the board safe
+        httpd_resp_set_status(req, "409 Conflict");
     }
-    
-    httpd_resp_set_type(req, "application/json");
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddBoolToObject(root, "armed", armed);
-
-    const char *resp = cJSON_Print(root);
-    httpd_resp_sendstr(req, resp);
-    free((void *)resp);
-    cJSON_Delete(root);
-
+    arm_send(req);
     return ESP_OK;
 }
 
-// Handler for GETting index page
-static esp_err_t index_get_handler(httpd_req_t *req)
+// Handler for the update state: running and next images, and the last upload
+static esp_err_t ota_get_handler(httpd_req_t *req)
 {
-    httpd_resp_set_type(req, "text/html");
+    ota_status_t st;
+    ota_get_status(&st);
 
-    FILE *file = fopen(INDEX_PATH, "r");
-    if(file == NULL) {
-        return ESP_FAIL;
+    char body[OTA_BODY_MAX];
+    json_out_t out;
+    json_out_init(&out, body, sizeof(body));
+    json_out_begin_object(&out, NULL);
+    json_out_string(&out, "running", st.running);               // App slot running now
+    json_out_string(&out, "version", st.version);
+    if(st.boot != NULL)
+    {
+        json_out_string(&out, "boot", st.boot);                 // App slot of the next boot
     }
-    char resp[4096];
-    while(!feof(file))
+    json_out_string(&out, "www", st.www);                       // Asset slot mounted now
+    if(st.www_next != NULL)
     {
-        uint16_t len = fread(resp, 1, 4096, file);
-        if(httpd_resp_send_chunk(req, resp, len) != ESP_OK)
+        json_out_string(&out, "www_next", st.www_next);         // Asset slot of the next boot
+    }
+    json_out_bool(&out, "trial", st.trial);                     // Health check still pending
+    json_out_bool(&out, "busy", st.busy);                       // Upload in progress
+    if(st.last_result != ESP_ERR_NOT_FOUND)
+    {
+        char sha256[OTA_SHA256_LEN * 2 + 1];
+        for(int i = 0; i < OTA_SHA256_LEN; i++)
         {
-            fclose(file);
-            return ESP_FAIL;
+            snprintf(&sha256[i * 2], 3, "%02x", st.last_sha256[i]);
         }
+        json_out_begin_object(&out, "last");
+        json_out_string(&out, "image", st.last_image == OTA_IMAGE_APP ? "app" : "www");
+        json_out_string(&out, "result", esp_err_to_name(st.last_result));
+        json_out_uint(&out, "bytes", st.last_bytes);            // Written, after inflating
+        json_out_uint(&out, "ms", st.last_ms);
+        json_out_string(&out, "sha256", sha256);                // Of what was written
+        json_out_end_object(&out);
     }
-    httpd_resp_send_chunk(req, NULL, 0);
-    fclose(file);
-    return ESP_OK;
+    json_out_end_object(&out);
+    return json_out_send(req, &out);
 }
 
-// Handler for GETting pspha.png
-static esp_err_t pspha_png_get_handler(httpd_req_t *req)
+static void ota_send_error(httpd_req_t *req, esp_err_t err)
 {
-    httpd_resp_set_type(req, "image/png");
+    switch(err)
+    {
+        case ESP_ERR_INVALID_STATE:         // Another upload, an update on trial, or armed
+            httpd_resp_set_status(req, "409 Conflict");
+            break;
+        case ESP_ERR_INVALID_SIZE:
+            httpd_resp_set_status(req, "413 Payload Too Large");
+            break;
+        case ESP_ERR_INVALID_CRC:
+        case ESP_ERR_INVALID_RESPONSE:
+        case ESP_ERR_NOT_FINISHED:
+        case ESP_ERR_OTA_VALIDATE_FAILED:
+            httpd_resp_set_status(req, "422 Unprocessable Entity");
+            break;
+        default:
+            httpd_resp_set_status(req, HTTPD_500);
+            break;
+    }
+    httpd_resp_sendstr(req, esp_err_to_name(err));
+}
 
-    FILE *file = fopen(PSPHA_PNG_PATH, "r");
-    if(file == NULL) {
-        return ESP_FAIL;
+static bool parse_sha256(const char *hex, uint8_t *out)
+{
+    if(strlen(hex) != OTA_SHA256_LEN * 2)
+    {
+        return false;
     }
-    char resp[4096];
-    while(!feof(file))
+    for(int i = 0; i < OTA_SHA256_LEN; i++)
     {
-        uint16_t len = fread(resp, 1, 4096, file);
-        if(httpd_resp_send_chunk(req, resp, len) != ESP_OK)
+        char byte[3] = { hex[i * 2], hex[i * 2 + 1], '\0' };
+        char *end;
+        out[i] = strtoul(byte, &end, 16);
+        if(*end != '\0')
         {
-            fclose(file);
-            return ESP_FAIL;
+            return false;
         }
     }
-    httpd_resp_send_chunk(req, NULL, 0);
-    fclose(file);
-    return ESP_OK;
+    return true;
 }
 
-// Handler for GETting favicon.ico
-static esp_err_t favicon_get_handler(httpd_req_t *req)
+// Handler for uploading the image in user_ctx into its idle slot. The body is
+// the image, gzipped if Content-Encoding says so, and X-SHA256 the hex digest
+// of the image itself. It goes to flash as it arrives and takes effect with
+// the next restart.
+static esp_err_t ota_post_handler(httpd_req_t *req)
 {
-    httpd_resp_set_type(req, "image/x-icon");
-
-    FILE *file = fopen(FAVICON_PATH, "r");
-    if(file == NULL) {
-        return ESP_FAIL;
+    // Uploads take seconds, which the httpd task cannot spare
+    if(!http_on_worker())
+    {
+        return http_queue_work(req, ota_post_handler);
     }
-    char resp[4096];
-    while(!feof(file))
+    // Flash writes stall the interlock, and the restart drops the outputs
+    if(armed)
+    {
+        httpd_resp_set_status(req, "409 Conflict");
+        httpd_resp_sendstr(req, "Disarm before updating");
+        return ESP_OK;
+    }
+    char value[OTA_SHA256_LEN * 2 + 1];
+    uint8_t sha256[OTA_SHA256_LEN];
+    if(httpd_req_get_hdr_value_str(req, "X-SHA256", value, sizeof(value)) != ESP_OK || !parse_sha256(value, sha256))
     {
-        uint16_t len = fread(resp, 1, 4096, file);
-        if(httpd_resp_send_chunk(req, resp, len) != ESP_OK)
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "X-SHA256 must hold the image's SHA-256 in hex");
+        return ESP_OK;
+    }
+    bool gzip = false;
+    if(httpd_req_get_hdr_value_str(req, "Content-Encoding", value, sizeof(value)) == ESP_OK)
+    {
+        gzip = strcasecmp(value, "gzip") == 0;
+        if(!gzip && strcasecmp(value, "identity") != 0)
         {
-            fclose(file);
+            httpd_resp_set_status(req, "415 Unsupported Media Type");
+            httpd_resp_sendstr(req, "Send the image plain or gzipped");
+            return ESP_OK;
+        }
+    }
+
+    esp_err_t err = ota_begin((ota_image_t)(intptr_t)req->user_ctx, gzip, req->content_len, sha256);
+    char buf[OTA_RECV_CHUNK];
+    size_t remaining = req->content_len;
+    int timeouts = 0;
+    while(err == ESP_OK && remaining > 0)
+    {
+        int received = httpd_req_recv(req, buf, remaining < sizeof(buf) ? remaining : sizeof(buf));
+        if(received == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts < OTA_RECV_TIMEOUTS)
+        {
+            continue;
+        }
+        if(received <= 0)
+        {
+            // The client is gone, so there is nobody to answer
+            ota_abort();
             return ESP_FAIL;
         }
+        timeouts = 0;
+        remaining -= received;
+        err = ota_write(buf, received);
     }
-    httpd_resp_send_chunk(req, NULL, 0);
-    fclose(file);
+    if(err == ESP_OK)
+    {
+        err = ota_end();
+    }
+    if(err != ESP_OK)
+    {
+        ota_send_error(req, err);
+        return ESP_OK;
+    }
+    return ota_get_handler(req);
+}
+
+// Handler for restarting into the uploaded images
+static esp_err_t ota_restart_post_handler(httpd_req_t *req)
+{
+    if(armed || ota_busy())
+    {
+        httpd_resp_set_status(req, "409 Conflict");
+        httpd_resp_sendstr(req, armed ? "Disarm before restarting" : "Upload in progress");
+        return ESP_OK;
+    }
+    if(ota_restart() != ESP_OK)
+    {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to restart");
+        return ESP_OK;
+    }
+    httpd_resp_sendstr(req, "Restarting");
     return ESP_OK;
 }
 
-// Handler for GETting favicon.ico
-static esp_err_t jquery_get_handler(httpd_req_t *req)
+// Handler for GETting the static assets in user_ctx
+static esp_err_t static_file_get_handler(httpd_req_t *req)
 {
-    httpd_resp_set_type(req, "text/javascript");
+    if(!http_on_worker())
+    {
+        return http_queue_work(req, static_file_get_handler);
+    }
+    const static_file_t *asset = req->user_ctx;
+    httpd_resp_set_type(req, asset->type);
+    httpd_resp_set_hdr(req, "Cache-Control", ASSET_CACHE_CONTROL);
+    if(asset->encoding != NULL)
+    {
+        // Every browser that can run the UI accepts gzip
+        httpd_resp_set_hdr(req, "Content-Encoding", asset->encoding);
+    }
 
-    FILE *file = fopen(JQUERY_PATH, "r");
-    if(file == NULL) {
+    // Plain file descriptors, as stdio would allocate a FILE and its buffer
+    int fd = open(asset->path, O_RDONLY);
+    if(fd < 0) {
         return ESP_FAIL;
     }
     char resp[4096];
-    while(!feof(file))
+    ssize_t len;
+    while((len = read(fd, resp, sizeof(resp))) > 0)
     {
-        uint16_t len = fread(resp, 1, 4096, file);
-        if(httpd_resp_send_chunk(req, resp, len) != ESP_OK)
+        // A slow client would hold up stop_http_server(), so the rest is dropped
+        if(draining || httpd_resp_send_chunk(req, resp, len) != ESP_OK)
         {
-            fclose(file);
+            close(fd);
             return ESP_FAIL;
         }
     }
     httpd_resp_send_chunk(req, NULL, 0);
-    fclose(file);
+    close(fd);
     return ESP_OK;
 }
 
+static const static_file_t index_file = { INDEX_PATH, "text/html", "gzip" };
+static const static_file_t pspha_png_file = { PSPHA_PNG_PATH, "image/png", NULL };
+static const static_file_t favicon_file = { FAVICON_PATH, "image/x-icon", NULL };
+
 esp_err_t start_http_server()
 {
-    FILE *file = fopen(INDEX_PATH, "r+");
-
-    if (file == NULL) {
+    if(http_start_workers() != ESP_OK || status_start() != ESP_OK)
+    {
+        ESP_LOGE(HTTP_TAG, "Failed to start HTTP workers");
         return ESP_FAIL;
     }
-    do {
-        char c = fgetc(file);
-        if (c == '~') {
-            fseek(file, -1, SEEK_CUR);
-            fputc('0' + PDB, file);
-        }
-    } while (!feof(file));
-
-    fclose(file);
 
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-    config.stack_size = 8192;
+    config.stack_size = TASK_HTTPD_STACK;
     config.uri_match_fn = httpd_uri_match_wildcard;
+    config.task_priority = TASK_HTTPD_PRIORITY;
+    config.core_id = TASK_HTTPD_CORE;
+    config.max_uri_handlers = 20;
+    config.max_open_sockets = HTTP_MAX_SOCKETS;
+    config.lru_purge_enable = true;             // Drop the idlest client rather than refuse a new one
+    config.keep_alive_enable = true;            // Notice phones that left the AP without closing
+    config.keep_alive_idle = 5;
+    config.keep_alive_interval = 5;
+    config.keep_alive_count = 3;
 
     ESP_LOGI(HTTP_TAG, "Starting HTTP Server");
     if(httpd_start(&server, &config) != ESP_OK) {
@@ -254,6 +1020,62 @@ esp_err_t start_http_server()
     };
     httpd_register_uri_handler(server, &battery_data_get_uri);
 
+    /* URI handler for the combined, cacheable status */
+    httpd_uri_t status_get_uri = {
+        .uri = "/status",
+        .method = HTTP_GET,
+        .handler = status_get_handler,
+    };
+    httpd_register_uri_handler(server, &status_get_uri);
+
+    /* URI handler for the clock exchange behind latency tracing */
+    httpd_uri_t time_get_uri = {
+        .uri = "/time",
+        .method = HTTP_GET,
+        .handler = time_get_handler,
+    };
+    httpd_register_uri_handler(server, &time_get_uri);
+
+    /* URI handler for the chart history */
+    httpd_uri_t history_get_uri = {
+        .uri = "/history",
+        .method = HTTP_GET,
+        .handler = history_get_handler,
+    };
+    httpd_register_uri_handler(server, &history_get_uri);
+
+    /* URI handler for fetching I2C link statistics */
+    httpd_uri_t link_get_uri = {
+        .uri = "/link",
+        .method = HTTP_GET,
+        .handler = link_get_handler,
+    };
+    httpd_register_uri_handler(server, &link_get_uri);
+
+    /* URI handler for periodic task timing */
+    httpd_uri_t tasks_get_uri = {
+        .uri = "/tasks",
+        .method = HTTP_GET,
+        .handler = tasks_get_handler,
+    };
+    httpd_register_uri_handler(server, &tasks_get_uri);
+
+    /* URI handler for the protection interlock */
+    httpd_uri_t protection_get_uri = {
+        .uri = "/protection",
+        .method = HTTP_GET,
+        .handler = protection_get_handler,
+    };
+    httpd_register_uri_handler(server, &protection_get_uri);
+
+    /* URI handler for the deferred log */
+    httpd_uri_t log_get_uri = {
+        .uri = "/log",
+        .method = HTTP_GET,
+        .handler = log_get_handler,
+    };
+    httpd_register_uri_handler(server, &log_get_uri);
+
     /* URI handler for arming status */
     httpd_uri_t arm_get_uri = {
         .uri = "/arm",
@@ -270,11 +1092,43 @@ esp_err_t start_http_server()
     };
     httpd_register_uri_handler(server, &arm_post_uri);
 
+    /* URI handlers for updates */
+    httpd_uri_t ota_get_uri = {
+        .uri = "/ota",
+        .method = HTTP_GET,
+        .handler = ota_get_handler,
+    };
+    httpd_register_uri_handler(server, &ota_get_uri);
+
+    httpd_uri_t ota_app_post_uri = {
+        .uri = "/ota/app",
+        .method = HTTP_POST,
+        .handler = ota_post_handler,
+        .user_ctx = (void *)OTA_IMAGE_APP,
+    };
+    httpd_register_uri_handler(server, &ota_app_post_uri);
+
+    httpd_uri_t ota_www_post_uri = {
+        .uri = "/ota/www",
+        .method = HTTP_POST,
+        .handler = ota_post_handler,
+        .user_ctx = (void *)OTA_IMAGE_WWW,
+    };
+    httpd_register_uri_handler(server, &ota_www_post_uri);
+
+    httpd_uri_t ota_restart_post_uri = {
+        .uri = "/ota/restart",
+        .method = HTTP_POST,
+        .handler = ota_restart_post_handler,
+    };
+    httpd_register_uri_handler(server, &ota_restart_post_uri);
+
     /* URI handler for fetching index page */
     httpd_uri_t index_get_uri = {
         .uri = "/",
         .method = HTTP_GET,
-        .handler = index_get_handler,
+        .handler = static_file_get_handler,
+        .user_ctx = (void *)&index_file,
     };
     httpd_register_uri_handler(server, &index_get_uri);
 
@@ -282,7 +1136,8 @@ esp_err_t start_http_server()
     httpd_uri_t pspha_png_get_uri = {
         .uri = "/pspha.png",
         .method = HTTP_GET,
-        .handler = pspha_png_get_handler,
+        .handler = static_file_get_handler,
+        .user_ctx = (void *)&pspha_png_file,
     };
     httpd_register_uri_handler(server, &pspha_png_get_uri);
 
@@ -290,25 +1145,34 @@ esp_err_t start_http_server()
     httpd_uri_t favicon_get_uri = {
         .uri = "/favicon.ico",
         .method = HTTP_GET,
-        .handler = favicon_get_handler,
+        .handler = static_file_get_handler,
+        .user_ctx = (void *)&favicon_file,
     };
     httpd_register_uri_handler(server, &favicon_get_uri);
 
-    /* URI handler for fetching jquery.js */
-    httpd_uri_t jquery_get_uri = {
-        .uri = "/jquery.js",
-        .method = HTTP_GET,
-        .handler = jquery_get_handler,
-    };
-    httpd_register_uri_handler(server, &jquery_get_uri);
-
     return ESP_OK;
 }
 
 esp_err_t stop_http_server()
 {
     ESP_LOGI(HTTP_TAG, "Stopping HTTP Server");
-    if(httpd_stop(&server) != ESP_OK) {
+    // Async requests still hold sockets of the server being stopped, which
+    // httpd_stop() would close under them. Downloads stop at their next chunk
+    // and parked long-polls are answered, so each one left is only waiting on
+    // its socket's timeouts. An upload runs to its end.
+    draining = true;
+    TickType_t start = xTaskGetTickCount();
+    bool warned = false;
+    while(work_in_flight > 0)
+    {
+        if(!warned && xTaskGetTickCount() - start >= pdMS_TO_TICKS(HTTP_DRAIN_WARN_MS))
+        {
+            ESP_LOGW(HTTP_TAG, "Still waiting for %d requests", atomic_load(&work_in_flight));
+            warned = true;
+        }
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    if(httpd_stop(server) != ESP_OK) {
         ESP_LOGE(HTTP_TAG, "stop server failed");
         return ESP_FAIL;
     }
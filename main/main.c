@@ -16,8 +16,13 @@
 #include "esp_wifi.h"
 #include "esp_log.h"
 #include "power_control.h"
+#include "tasks.h"
+#include "protection.h"
+#include "dlog.h"
+#include "ota_update.h"
 #include "dirent.h"
 #include "string.h"
+#include "unistd.h"
 #include "main.h"
 
 #if PDB == 1
@@ -34,6 +39,11 @@ static const char *TAG = "Powerboard2";
 static const char *TAG = "Powerboard3";
 #endif
 
+// Served as / by http_server.c, so its absence means a broken asset image
+#define WWW_PROBE_PATH "/www/index.html.gz"
+// Sampler passes an updated image must complete before it is kept
+#define HEALTH_SAMPLES 5
+
 nvs_handle_t nvs;
 
 esp_err_t start_http_server();
@@ -41,12 +51,16 @@ esp_err_t stop_http_server();
 esp_netif_t *wifi_if;
 TaskHandle_t print_info_handle;
 TaskHandle_t reset_interface_handle;
+static StaticTask_t print_info_buf;
+static StackType_t print_info_stack[TASK_PRINT_INFO_STACK];
+static StaticTask_t reset_interface_buf;
+static StackType_t reset_interface_stack[TASK_RESET_INTERFACE_STACK];
 
-esp_err_t init_fs(void)
+static esp_err_t mount_www(const char *label)
 {
     esp_vfs_spiffs_conf_t conf = {
         .base_path = "/www",
-        .partition_label = NULL,
+        .partition_label = label,
         .max_files = 5,
         .format_if_mount_failed = false
     };
@@ -62,17 +76,38 @@ esp_err_t init_fs(void)
         }
         return ESP_FAIL;
     }
+    if(access(WWW_PROBE_PATH, R_OK) != 0)
+    {
+        ESP_LOGE(TAG, "%s has no " WWW_PROBE_PATH, label);
+        esp_vfs_spiffs_unregister(label);
+        return ESP_FAIL;
+    }
 
     size_t total = 0, used = 0;
-    ret = esp_spiffs_info(NULL, &total, &used);
+    ret = esp_spiffs_info(label, &total, &used);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Failed to get SPIFFS partition information (%s)", esp_err_to_name(ret));
     } else {
-        ESP_LOGI(TAG, "Partition size: total: %d, used: %d", total, used);
+        ESP_LOGI(TAG, "Partition %s size: total: %d, used: %d", label, total, used);
     }
     return ESP_OK;
 }
 
+esp_err_t init_fs(void)
+{
+    if(mount_www(ota_www_label()) == ESP_OK)
+    {
+        return ESP_OK;
+    }
+    // Freshly uploaded assets that do not mount fall back to the previous slot
+    if(!ota_on_trial())
+    {
+        return ESP_FAIL;
+    }
+    ota_www_rejected();
+    return mount_www(ota_www_label());
+}
+
 esp_err_t init_wifi(void)
 {
     wifi_init_config_t init_conf = WIFI_INIT_CONFIG_DEFAULT();
@@ -148,21 +183,58 @@ esp_err_t init_nvs(void)
 
 void print_info()
 {
+    static task_period_t period;
+    task_period_init(&period, "print_info", 1000);
     while(1) {
-        battery_stat_t stat = get_battery(FLIGHT_BATTERY);
-        ESP_LOGI(TAG, "Battery: %d, SOC: %f, charging: %d, curr_cap: %f, max_cap: %f, current: %f, voltage: %f, v_charge: %f, i_charge %f", FLIGHT_BATTERY, stat.soc, stat.charging, stat.curr_cap, stat.max_cap, stat.current_mah, stat.batt_voltage, stat.charge_voltage, stat.charge_current);
-        stat = get_battery(PYRO_BATTERY);
-        ESP_LOGI(TAG, "Battery: %d, SOC: %f, charging: %d, curr_cap: %f, max_cap: %f, current: %f, voltage: %f, v_charge: %f, i_charge %f", PYRO_BATTERY, stat.soc, stat.charging, stat.curr_cap, stat.max_cap, stat.current_mah, stat.batt_voltage, stat.charge_voltage, stat.charge_current);
-        
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        task_period_wait(&period);
+        power_snapshot_t snap;
+        get_snapshot(&snap);
+        for(battery_t battery = FLIGHT_BATTERY; battery <= PYRO_BATTERY; battery++)
+        {
+            battery_stat_t *stat = &snap.battery[battery];
+            DLOG(DLOG_BATTERY, battery, dlog_f(stat->soc), stat->charging, dlog_f(stat->curr_cap), dlog_f(stat->max_cap),
+                 dlog_f(stat->current_mah), dlog_f(stat->batt_voltage), dlog_f(stat->charge_voltage),
+                 dlog_f(stat->charge_current));
+        }
     }
 }
 
+// What an updated image has to show within OTA_HEALTH_TIMEOUT_MS to be kept:
+// the sampler and the interlock running with both gauges answering, and the
+// web UI in place. Wi-Fi and the HTTP server already came up by then, or
+// app_main() would have aborted.
+static bool board_healthy(void)
+{
+    task_period_stats_t tasks[TASK_PERIODIC_MAX];
+    size_t count = task_period_get_stats(tasks, TASK_PERIODIC_MAX);
+    uint32_t samples = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(strcmp(tasks[i].name, "sampler") == 0)
+        {
+            samples = tasks[i].runs;
+        }
+    }
+    power_snapshot_t snap;
+    get_snapshot(&snap);
+    prot_stats_t prot;
+    protection_get_stats(&prot);
+    return samples >= HEALTH_SAMPLES && snap.gauge_ok[FLIGHT_BATTERY] && snap.gauge_ok[PYRO_BATTERY] &&
+           prot.polls > prot.poll_errors && access(WWW_PROBE_PATH, R_OK) == 0;
+}
+
 void reset_interface()
 {
+    static task_period_t period;
+    task_period_init(&period, "reset_interface", RESET_INTERVAL);
     while (1)
     {
-        vTaskDelay(RESET_INTERVAL / portTICK_PERIOD_MS);
+        task_period_wait(&period);
+        // Would cut an upload short
+        if(ota_busy())
+        {
+            continue;
+        }
         ESP_ERROR_CHECK(stop_http_server());
         ESP_ERROR_CHECK(esp_wifi_stop());
         ESP_ERROR_CHECK(esp_wifi_deinit());
@@ -176,13 +248,22 @@ void app_main(void)
     // Prioritize loading the last state of the board
     ESP_ERROR_CHECK(nvs_flash_init());
     ESP_ERROR_CHECK(init_nvs());
+    ESP_ERROR_CHECK(ota_init());
 
     // Then handle the rest
+    dlog_conf_t log_conf = {
+        .priority = TASK_DLOG_PRIORITY,
+        .core = TASK_DLOG_CORE,
+        .sink = dlog_console_sink,
+    };
+    ESP_ERROR_CHECK(dlog_start(&log_conf));
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
     wifi_if = esp_netif_create_default_wifi_ap();
 
     ESP_ERROR_CHECK(init_power_control());
+    ESP_ERROR_CHECK(start_sampler());
+    ESP_ERROR_CHECK(protection_start(protection_default_rules, protection_default_rule_count));
     ESP_ERROR_CHECK(init_wifi());
     ESP_ERROR_CHECK(init_fs());
     ESP_ERROR_CHECK(start_http_server());
@@ -191,6 +272,12 @@ void app_main(void)
     esp_netif_get_ip_info(wifi_if, &ip_info);
     ESP_LOGI(TAG, "IP Address: " IPSTR, IP2STR(&ip_info.ip));
 
-    xTaskCreate(print_info, "print_info", 4096, NULL, tskIDLE_PRIORITY + 1, &print_info_handle);
-    xTaskCreate(reset_interface, "reset_interface", 2048, NULL, tskIDLE_PRIORITY + 2, &reset_interface_handle);
+    print_info_handle = xTaskCreateStaticPinnedToCore(print_info, "print_info", TASK_PRINT_INFO_STACK, NULL,
+                                                      TASK_PRINT_INFO_PRIORITY, print_info_stack, &print_info_buf,
+                                                      TASK_PRINT_INFO_CORE);
+    reset_interface_handle = xTaskCreateStaticPinnedToCore(reset_interface, "reset_interface",
+                                                           TASK_RESET_INTERFACE_STACK, NULL,
+                                                           TASK_RESET_INTERFACE_PRIORITY, reset_interface_stack,
+                                                           &reset_interface_buf, TASK_RESET_INTERFACE_CORE);
+    ESP_ERROR_CHECK(ota_health_start(board_healthy));
 }
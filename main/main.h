@@ -6,4 +6,9 @@
 #define PASSWORD "iusucks1234"
 #define RESET_INTERVAL (60000 * 5)
 
+// Write the gauge NV profiles in power_control.c at boot where they differ.
+// A profile whose copy does not read back is not copied again. When 0, boot
+// only logs the difference.
+#define GAUGE_PROVISION 1
+
 #endif
\ No newline at end of file
@@ -0,0 +1,641 @@
+#include "ota_update.h"
+#include "sdkconfig.h"
+#include "tasks.h"
+#include "power_control.h"
+#include "nvs.h"
+#include "esp_ota_ops.h"
+#include "esp_app_desc.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "mbedtls/sha256.h"
+#include "rom/miniz.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include <string.h>
+#include <stdatomic.h>
+
+static const char *TAG = "ota";
+
+// Without it the bootloader never reverts an app that failed its health check
+#ifndef CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+#error "Updates need CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE"
+#endif
+
+extern nvs_handle_t nvs;
+
+// Asset slots in NVS, stored as index + 1 so that 0 means none. The slot on
+// trial is cleared as soon as a boot picks it up, so it only gets one boot.
+#define NVS_WWW_SLOT "www_slot"
+#define NVS_WWW_TRY "www_try"
+
+// gzip member framing, RFC 1952
+#define GZIP_HEADER_LEN 10
+#define GZIP_TRAILER_LEN 8
+#define GZIP_FHCRC 0x02
+#define GZIP_FEXTRA 0x04
+#define GZIP_FNAME 0x08
+#define GZIP_FCOMMENT 0x10
+#define GZIP_FRESERVED 0xE0
+
+typedef enum {
+    GZ_HEADER = 0,
+    GZ_EXTRA_LEN,
+    GZ_EXTRA,
+    GZ_NAME,
+    GZ_COMMENT,
+    GZ_HCRC,
+    GZ_DEFLATE,
+    GZ_TRAILER,
+} gz_state_t;
+
+typedef struct {
+    ota_image_t image;
+    const esp_partition_t *part;
+    esp_ota_handle_t handle;        // App uploads only, 0 once closed
+    mbedtls_sha256_context sha;
+    uint8_t expect[OTA_SHA256_LEN];
+    size_t written;                 // Image bytes handed to flash
+    int64_t start_us;
+    bool gzip;
+    gz_state_t gz_state;
+    uint8_t gz_flags;
+    uint8_t gz_buf[GZIP_HEADER_LEN];    // Fixed header, later the trailer
+    size_t gz_len;                  // Bytes in gz_buf, or left of the current field
+    tinfl_decompressor inflator;
+    // Plain uploads collect a page here. Gzipped ones inflate into it as the
+    // wrapping TINFL_LZ_DICT_SIZE window and write each page out of it.
+    uint8_t *window;
+    size_t window_len;
+    size_t window_flushed;          // Gzip: start of the window not yet written
+} ota_session_t;
+
+static const char *const www_labels[2] = { "www", "www_b" };
+
+// Only one upload runs at a time, so its state is static like every other
+// buffer; the window is sized for a gzipped upload
+static ota_session_t session_buf;
+static uint8_t session_window[TINFL_LZ_DICT_SIZE];
+static ota_session_t *session = NULL;
+static atomic_bool busy = false;
+static uint8_t www_slot = 0;            // Mounted asset slot
+static uint8_t www_prev = 0;            // Slot to fall back to while www_slot is on trial
+static int8_t www_next = -1;            // Slot the next boot tries
+static bool www_trial = false;
+static bool app_trial = false;
+static bool (*health_check)(void);
+static TaskHandle_t health_handle = NULL;
+static StaticTask_t health_buf;
+static StackType_t health_stack[TASK_OTA_STACK];
+static TaskHandle_t restart_handle = NULL;
+static StaticTask_t restart_buf;
+static StackType_t restart_stack[TASK_OTA_STACK];
+
+static SemaphoreHandle_t last_lock = NULL;     // Protects the last upload's result
+static StaticSemaphore_t last_lock_buf;
+static esp_err_t last_result = ESP_ERR_NOT_FOUND;
+static ota_image_t last_image;
+static uint32_t last_bytes;
+static uint32_t last_ms;
+static uint8_t last_sha256[OTA_SHA256_LEN];
+
+esp_err_t ota_init()
+{
+    if(last_lock == NULL)
+    {
+        last_lock = xSemaphoreCreateMutexStatic(&last_lock_buf);
+    }
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    esp_ota_img_states_t state;
+    esp_err_t err = esp_ota_get_state_partition(running, &state);
+    app_trial = err == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY;
+
+    uint8_t slot = 0;
+    uint8_t next = 0;
+    if(err == ESP_ERR_NOT_FOUND)
+    {
+        // No OTA record means a USB flash, which writes its assets to www
+        nvs_set_u8(nvs, NVS_WWW_SLOT, 0);
+    }
+    else
+    {
+        nvs_get_u8(nvs, NVS_WWW_SLOT, &slot);
+        nvs_get_u8(nvs, NVS_WWW_TRY, &next);
+    }
+    nvs_set_u8(nvs, NVS_WWW_TRY, 0);
+    nvs_commit(nvs);
+    www_prev = slot == 2 ? 1 : 0;
+    www_trial = next == 1 || next == 2;
+    www_slot = www_trial ? next - 1 : www_prev;
+    www_next = -1;
+
+    ESP_LOGI(TAG, "Running %s%s, assets from %s%s", running->label, app_trial ? " on trial" : "",
+             www_labels[www_slot], www_trial ? " on trial" : "");
+    return ESP_OK;
+}
+
+const char *ota_www_label()
+{
+    return www_labels[www_slot];
+}
+
+void ota_www_rejected()
+{
+    if(www_trial)
+    {
+        ESP_LOGE(TAG, "Assets in %s did not mount, back to %s", www_labels[www_slot], www_labels[www_prev]);
+        www_trial = false;
+        www_slot = www_prev;
+    }
+}
+
+bool ota_on_trial()
+{
+    return app_trial || www_trial;
+}
+
+// Keeps the images this boot tried
+static void ota_confirm()
+{
+    if(app_trial && esp_ota_mark_app_valid_cancel_rollback() == ESP_OK)
+    {
+        app_trial = false;
+    }
+    if(www_trial)
+    {
+        nvs_set_u8(nvs, NVS_WWW_SLOT, www_slot + 1);
+        nvs_commit(nvs);
+        www_prev = www_slot;
+        www_trial = false;
+    }
+    ESP_LOGI(TAG, "Update passed its health check");
+}
+
+static void ota_health_task(void *arg)
+{
+    int64_t deadline_us = esp_timer_get_time() + (int64_t)OTA_HEALTH_TIMEOUT_MS * 1000;
+    bool healthy = false;
+    while(!healthy && esp_timer_get_time() < deadline_us)
+    {
+        vTaskDelay(pdMS_TO_TICKS(OTA_HEALTH_PERIOD_MS));
+        healthy = health_check();
+    }
+    if(!healthy)
+    {
+        // The asset slot on trial was already given up in NVS, so a restart
+        // is enough for it. The app needs the bootloader told, which restarts.
+        ESP_LOGE(TAG, "Update failed its health check, rolling back");
+        if(app_trial)
+        {
+            esp_ota_mark_app_invalid_rollback_and_reboot();
+        }
+        esp_restart();
+    }
+    ota_confirm();
+    health_handle = NULL;
+    vTaskDelete(NULL);
+}
+
+esp_err_t ota_health_start(bool (*healthy)(void))
+{
+    if(!ota_on_trial())
+    {
+        return ESP_OK;
+    }
+    health_check = healthy;
+    health_handle = xTaskCreateStaticPinnedToCore(ota_health_task, "ota_health", TASK_OTA_STACK, NULL,
+                                                  TASK_OTA_PRIORITY, health_stack, &health_buf, TASK_OTA_CORE);
+    return health_handle != NULL ? ESP_OK : ESP_FAIL;
+}
+
+// ---- Upload ----
+
+// Hashes one page of the image and writes it where it belongs in the slot
+static esp_err_t ota_flush(ota_session_t *s, const uint8_t *page, size_t len)
+{
+    if(s->written + len > s->part->size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    mbedtls_sha256_update(&s->sha, page, len);
+    esp_err_t err;
+    if(s->image == OTA_IMAGE_APP)
+    {
+        // Opened with OTA_WITH_SEQUENTIAL_WRITES, so this erases as it goes
+        err = esp_ota_write(s->handle, page, len);
+    }
+    else
+    {
+        err = esp_partition_erase_range(s->part, s->written, OTA_PAGE_SIZE);
+        if(err == ESP_OK)
+        {
+            err = esp_partition_write(s->part, s->written, page, len);
+        }
+    }
+    s->written += len;
+    return err;
+}
+
+// Ends the session, keeping its result and the digest of what was written
+// for ota_get_status()
+static void ota_finish(ota_session_t *s, esp_err_t result, const uint8_t *digest)
+{
+    if(s->handle != 0)
+    {
+        esp_ota_abort(s->handle);
+    }
+    mbedtls_sha256_free(&s->sha);
+    xSemaphoreTake(last_lock, portMAX_DELAY);
+    last_result = result;
+    last_image = s->image;
+    last_bytes = s->written;
+    last_ms = (esp_timer_get_time() - s->start_us) / 1000;
+    if(digest != NULL)
+    {
+        memcpy(last_sha256, digest, OTA_SHA256_LEN);
+    }
+    else
+    {
+        memset(last_sha256, 0, OTA_SHA256_LEN);
+    }
+    xSemaphoreGive(last_lock);
+    if(result == ESP_OK)
+    {
+        ESP_LOGI(TAG, "Wrote %u bytes to %s in %u ms", (unsigned)s->written, s->part->label, (unsigned)last_ms);
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Upload to %s failed after %u bytes (%s)", s->part->label, (unsigned)s->written,
+                 esp_err_to_name(result));
+    }
+    session = NULL;
+    release_disarmed();
+    atomic_store(&busy, false);
+}
+
+esp_err_t ota_begin(ota_image_t image, bool gzip, size_t content_len, const uint8_t sha256[OTA_SHA256_LEN])
+{
+    // The idle slots are the fallback while an update is on trial
+    if(ota_on_trial())
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    bool idle = false;
+    if(!atomic_compare_exchange_strong(&busy, &idle, true))
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    // Flash writes stall the interlock, so the board stays disarmed until the
+    // upload ends
+    if(hold_disarmed() != ESP_OK)
+    {
+        atomic_store(&busy, false);
+        return ESP_ERR_INVALID_STATE;
+    }
+    const esp_partition_t *part = image == OTA_IMAGE_APP ? esp_ota_get_next_update_partition(NULL) :
+                                  esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS,
+                                                           www_labels[!www_slot]);
+    esp_err_t err = part == NULL ? ESP_ERR_NOT_FOUND : ESP_OK;
+    // Only a plain image is as long as its body
+    if(err == ESP_OK && !gzip && content_len > part->size)
+    {
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    ota_session_t *s = &session_buf;
+    memset(s, 0, sizeof(*s));
+    s->window = session_window;
+    // A half written slot must not be tried if the board restarts meanwhile
+    if(err == ESP_OK && image == OTA_IMAGE_WWW)
+    {
+        nvs_set_u8(nvs, NVS_WWW_TRY, 0);
+        nvs_commit(nvs);
+        www_next = -1;
+    }
+    else if(err == ESP_OK)
+    {
+        if(esp_ota_get_boot_partition() == part)
+        {
+            err = esp_ota_set_boot_partition(esp_ota_get_running_partition());
+        }
+        if(err == ESP_OK)
+        {
+            err = esp_ota_begin(part, OTA_WITH_SEQUENTIAL_WRITES, &s->handle);
+        }
+    }
+    if(err != ESP_OK)
+    {
+        release_disarmed();
+        atomic_store(&busy, false);
+        return err;
+    }
+
+    s->image = image;
+    s->part = part;
+    s->gzip = gzip;
+    s->start_us = esp_timer_get_time();
+    memcpy(s->expect, sha256, OTA_SHA256_LEN);
+    mbedtls_sha256_init(&s->sha);
+    mbedtls_sha256_starts(&s->sha, 0);
+    tinfl_init(&s->inflator);
+    session = s;
+    ESP_LOGI(TAG, "Receiving %s%s image of %u bytes into %s", image == OTA_IMAGE_APP ? "app" : "asset",
+             gzip ? " gzip" : "", (unsigned)content_len, part->label);
+    return ESP_OK;
+}
+
+// Steps over the optional header fields this member does not carry
+static void gz_skip_absent(ota_session_t *s)
+{
+    if(s->gz_state == GZ_EXTRA_LEN && !(s->gz_flags & GZIP_FEXTRA))
+    {
+        s->gz_state = GZ_NAME;
+    }
+    if(s->gz_state == GZ_EXTRA && s->gz_len == 0)
+    {
+        s->gz_state = GZ_NAME;
+    }
+    if(s->gz_state == GZ_NAME && !(s->gz_flags & GZIP_FNAME))
+    {
+        s->gz_state = GZ_COMMENT;
+    }
+    if(s->gz_state == GZ_COMMENT && !(s->gz_flags & GZIP_FCOMMENT))
+    {
+        s->gz_state = GZ_HCRC;
+        s->gz_len = 2;
+    }
+    if(s->gz_state == GZ_HCRC && (!(s->gz_flags & GZIP_FHCRC) || s->gz_len == 0))
+    {
+        s->gz_state = GZ_DEFLATE;
+    }
+}
+
+static esp_err_t gz_header_byte(ota_session_t *s, uint8_t b)
+{
+    switch(s->gz_state)
+    {
+        case GZ_HEADER:
+            s->gz_buf[s->gz_len++] = b;
+            if(s->gz_len < GZIP_HEADER_LEN)
+            {
+                return ESP_OK;
+            }
+            // Magic, then deflate as the only method there is
+            if(s->gz_buf[0] != 0x1f || s->gz_buf[1] != 0x8b || s->gz_buf[2] != 8 ||
+               (s->gz_buf[3] & GZIP_FRESERVED) != 0)
+            {
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+            s->gz_flags = s->gz_buf[3];
+            s->gz_len = 0;
+            s->gz_state = GZ_EXTRA_LEN;
+            break;
+        case GZ_EXTRA_LEN:
+            s->gz_buf[s->gz_len++] = b;
+            if(s->gz_len < 2)
+            {
+                return ESP_OK;
+            }
+            s->gz_len = s->gz_buf[0] | (s->gz_buf[1] << 8);
+            s->gz_state = GZ_EXTRA;
+            break;
+        case GZ_EXTRA:
+        case GZ_HCRC:
+            s->gz_len--;
+            break;
+        case GZ_NAME:
+            if(b == 0)
+            {
+                s->gz_state = GZ_COMMENT;
+            }
+            break;
+        case GZ_COMMENT:
+            if(b == 0)
+            {
+                s->gz_state = GZ_HCRC;
+                s->gz_len = 2;
+            }
+            break;
+        default:
+            break;
+    }
+    gz_skip_absent(s);
+    return ESP_OK;
+}
+
+static esp_err_t ota_write_gzip(ota_session_t *s, const uint8_t *data, size_t len)
+{
+    while(len > 0)
+    {
+        if(s->gz_state < GZ_DEFLATE)
+        {
+            esp_err_t err = gz_header_byte(s, *data++);
+            len--;
+            if(err != ESP_OK)
+            {
+                return err;
+            }
+            continue;
+        }
+        if(s->gz_state == GZ_TRAILER)
+        {
+            // A second member or trailing garbage is not an image we sent
+            if(s->gz_len == GZIP_TRAILER_LEN)
+            {
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+            s->gz_buf[s->gz_len++] = *data++;
+            len--;
+            continue;
+        }
+        tinfl_status status;
+        do
+        {
+            // tinfl takes the whole window as the output buffer, whose size is
+            // the dictionary mask, and inflates up to its end
+            size_t in_len = len;
+            size_t out_len = TINFL_LZ_DICT_SIZE - s->window_len;
+            status = tinfl_decompress(&s->inflator, data, &in_len, s->window, s->window + s->window_len, &out_len,
+                                      TINFL_FLAG_HAS_MORE_INPUT);
+            data += in_len;
+            len -= in_len;
+            s->window_len += out_len;
+            // Every full page, then the tail once the stream ends
+            while(s->window_len - s->window_flushed >= OTA_PAGE_SIZE ||
+                  (status == TINFL_STATUS_DONE && s->window_len > s->window_flushed))
+            {
+                size_t page_len = s->window_len - s->window_flushed;
+                page_len = page_len < OTA_PAGE_SIZE ? page_len : OTA_PAGE_SIZE;
+                esp_err_t err = ota_flush(s, s->window + s->window_flushed, page_len);
+                if(err != ESP_OK)
+                {
+                    return err;
+                }
+                s->window_flushed += page_len;
+            }
+            if(s->window_len == TINFL_LZ_DICT_SIZE)
+            {
+                s->window_len = 0;
+                s->window_flushed = 0;
+            }
+        } while(status == TINFL_STATUS_HAS_MORE_OUTPUT || (status == TINFL_STATUS_NEEDS_MORE_INPUT && len > 0));
+        if(status == TINFL_STATUS_DONE)
+        {
+            s->gz_state = GZ_TRAILER;
+            s->gz_len = 0;
+        }
+        else if(status < 0)
+        {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t ota_write_plain(ota_session_t *s, const uint8_t *data, size_t len)
+{
+    while(len > 0)
+    {
+        size_t n = OTA_PAGE_SIZE - s->window_len < len ? OTA_PAGE_SIZE - s->window_len : len;
+        memcpy(s->window + s->window_len, data, n);
+        s->window_len += n;
+        data += n;
+        len -= n;
+        if(s->window_len == OTA_PAGE_SIZE)
+        {
+            esp_err_t err = ota_flush(s, s->window, OTA_PAGE_SIZE);
+            if(err != ESP_OK)
+            {
+                return err;
+            }
+            s->window_len = 0;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t ota_write(const void *data, size_t len)
+{
+    ota_session_t *s = session;
+    if(s == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = s->gzip ? ota_write_gzip(s, data, len) : ota_write_plain(s, data, len);
+    if(err != ESP_OK)
+    {
+        ota_finish(s, err, NULL);
+    }
+    return err;
+}
+
+esp_err_t ota_end()
+{
+    ota_session_t *s = session;
+    if(s == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = ESP_OK;
+    if(s->gzip)
+    {
+        // The trailer closes the member and carries its length modulo 2^32
+        uint32_t isize = s->gz_buf[4] | (s->gz_buf[5] << 8) | (s->gz_buf[6] << 16) | ((uint32_t)s->gz_buf[7] << 24);
+        if(s->gz_state != GZ_TRAILER || s->gz_len != GZIP_TRAILER_LEN)
+        {
+            err = ESP_ERR_NOT_FINISHED;
+        }
+        else if(isize != (uint32_t)s->written)
+        {
+            err = ESP_ERR_INVALID_RESPONSE;
+        }
+    }
+    else if(s->window_len > 0)
+    {
+        err = ota_flush(s, s->window, s->window_len);
+    }
+
+    uint8_t digest[OTA_SHA256_LEN];
+    mbedtls_sha256_finish(&s->sha, digest);
+    if(err == ESP_OK && memcmp(digest, s->expect, OTA_SHA256_LEN) != 0)
+    {
+        err = ESP_ERR_INVALID_CRC;
+    }
+    // Anything shorter would leave the previous file system's blocks behind
+    if(err == ESP_OK && s->image == OTA_IMAGE_WWW && s->written != s->part->size)
+    {
+        err = ESP_ERR_NOT_FINISHED;
+    }
+
+    if(s->image == OTA_IMAGE_APP && err == ESP_OK)
+    {
+        // Checks the image the way the bootloader will, and frees the handle either way
+        err = esp_ota_end(s->handle);
+        s->handle = 0;
+        if(err == ESP_OK)
+        {
+            err = esp_ota_set_boot_partition(s->part);
+        }
+    }
+    else if(err == ESP_OK)
+    {
+        www_next = !www_slot;
+        nvs_set_u8(nvs, NVS_WWW_TRY, www_next + 1);
+        nvs_commit(nvs);
+    }
+    ota_finish(s, err, digest);
+    return err;
+}
+
+void ota_abort()
+{
+    if(session != NULL)
+    {
+        ota_finish(session, ESP_ERR_NOT_FINISHED, NULL);
+    }
+}
+
+bool ota_busy()
+{
+    return atomic_load(&busy);
+}
+
+void ota_get_status(ota_status_t *status)
+{
+    const esp_partition_t *boot = esp_ota_get_boot_partition();
+    status->running = esp_ota_get_running_partition()->label;
+    status->version = esp_app_get_description()->version;
+    status->boot = boot != NULL ? boot->label : NULL;
+    status->www = www_labels[www_slot];
+    status->www_next = www_next >= 0 ? www_labels[www_next] : NULL;
+    status->trial = ota_on_trial();
+    status->busy = ota_busy();
+    xSemaphoreTake(last_lock, portMAX_DELAY);
+    status->last_result = last_result;
+    status->last_image = last_image;
+    status->last_bytes = last_bytes;
+    status->last_ms = last_ms;
+    memcpy(status->last_sha256, last_sha256, OTA_SHA256_LEN);
+    xSemaphoreGive(last_lock);
+}
+
+static void ota_restart_task(void *arg)
+{
+    vTaskDelay(pdMS_TO_TICKS(OTA_RESTART_DELAY_MS));
+    esp_restart();
+}
+
+esp_err_t ota_restart()
+{
+    if(restart_handle != NULL)
+    {
+        return ESP_OK;
+    }
+    const esp_partition_t *boot = esp_ota_get_boot_partition();
+    ESP_LOGW(TAG, "Restarting into %s with assets from %s", boot != NULL ? boot->label : "?",
+             www_labels[www_next >= 0 ? www_next : www_slot]);
+    restart_handle = xTaskCreateStaticPinnedToCore(ota_restart_task, "ota_restart", TASK_OTA_STACK, NULL,
+                                                   TASK_OTA_PRIORITY, restart_stack, &restart_buf, TASK_OTA_CORE);
+    return restart_handle != NULL ? ESP_OK : ESP_FAIL;
+}
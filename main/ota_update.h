@@ -0,0 +1,86 @@
+#ifndef OTA_UPDATE_H
+#define OTA_UPDATE_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Updates over Wi-Fi. The app has two slots, ota_0 and ota_1, and the web
+// assets two SPIFFS slots, www and www_b. An upload streams into the slot
+// that is not in use, a page at a time, hashing the image as it is written
+// and inflating it first if it was sent gzipped. Nothing changes until the
+// next boot, which tries the new images: the app through the bootloader's
+// rollback, the assets through NVS. Once the health check passes they are
+// kept; if it fails or the app crashes first, the board restarts into the
+// previous images.
+
+// Flash is erased and written one sector at a time
+#define OTA_PAGE_SIZE 4096
+#define OTA_SHA256_LEN 32
+
+// Time an update has to pass the health check before it is rolled back
+#define OTA_HEALTH_TIMEOUT_MS 30000
+#define OTA_HEALTH_PERIOD_MS 1000
+
+// Lets the response to /ota/restart reach the client first
+#define OTA_RESTART_DELAY_MS 500
+
+typedef enum {
+    OTA_IMAGE_APP = 0,          // Firmware for the idle app slot
+    OTA_IMAGE_WWW,              // SPIFFS image for the idle asset slot, exactly the slot's size
+} ota_image_t;
+
+typedef struct {
+    const char *running;        // App slot this boot started
+    const char *version;        // Version of the running app
+    const char *boot;           // App slot the next boot starts
+    const char *www;            // Asset slot mounted at /www
+    const char *www_next;       // Asset slot the next boot tries, or NULL
+    bool trial;                 // This boot is trying an update that has not passed the health check yet
+    bool busy;                  // An upload is in progress
+    esp_err_t last_result;      // Of the last upload, ESP_ERR_NOT_FOUND before the first
+    ota_image_t last_image;
+    uint32_t last_bytes;        // Image bytes written, after inflating
+    uint32_t last_ms;
+    uint8_t last_sha256[OTA_SHA256_LEN];
+} ota_status_t;
+
+// Reads which images this boot is trying; call once NVS is open and before
+// mounting the assets
+esp_err_t ota_init();
+
+// Label of the asset slot to mount at /www
+const char *ota_www_label();
+
+// The asset slot on trial did not mount; falls back to the previous one
+void ota_www_rejected();
+
+// While an update is on trial, calls healthy() every OTA_HEALTH_PERIOD_MS
+// until it returns true, then keeps the update. Rolls back and restarts if
+// that does not happen within OTA_HEALTH_TIMEOUT_MS. Does nothing otherwise.
+esp_err_t ota_health_start(bool (*healthy)(void));
+bool ota_on_trial();
+
+// Upload of one image. begin fails with ESP_ERR_INVALID_STATE while another
+// upload runs, an update is on trial or the board is armed, and holds arming
+// off until the upload ends. It fails with ESP_ERR_INVALID_SIZE if
+// content_len cannot fit. write fails with ESP_ERR_INVALID_SIZE once the
+// image outgrows its slot and ESP_ERR_INVALID_RESPONSE on a corrupt gzip
+// stream. end fails with ESP_ERR_INVALID_CRC if the SHA-256 of the written
+// image is not sha256, ESP_ERR_NOT_FINISHED if the image is incomplete, or
+// with the error of esp_ota_end() for an app the bootloader would not start.
+// Any failure, and abort, ends the upload; the next boot will not try the slot.
+esp_err_t ota_begin(ota_image_t image, bool gzip, size_t content_len, const uint8_t sha256[OTA_SHA256_LEN]);
+esp_err_t ota_write(const void *data, size_t len);
+esp_err_t ota_end();
+void ota_abort();
+bool ota_busy();
+
+void ota_get_status(ota_status_t *status);
+
+// Restarts into whatever was uploaded after OTA_RESTART_DELAY_MS, from a task
+// of its own so that the caller can still answer
+esp_err_t ota_restart();
+
+#endif
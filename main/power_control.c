@@ -1,29 +1,321 @@
 #include "power_control.h"
+#include "tasks.h"
+#include "main.h"
 #include "driver/gpio.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
 #include <nvs.h>
+#include <string.h>
 
 #define ARM_PIN GPIO_NUM_5
+
+#define FLIGHT_CAP_MAH 2000
+#define PYRO_CAP_MAH 1000
+
+// Keep the last NV write for recovering a gauge by hand
+#define NV_RESERVE_WRITES 1
+
+static const char *TAG = "power";
+
 uint8_t armed;
 extern nvs_handle_t nvs;
 
+static power_snapshot_t snapshot;
+static SemaphoreHandle_t snapshot_lock = NULL;
+static StaticSemaphore_t snapshot_lock_buf;
+static SemaphoreHandle_t snapshot_event = NULL;
+static StaticSemaphore_t snapshot_event_buf;
+static TaskHandle_t sampler_handle = NULL;
+static StaticTask_t sampler_buf;
+static StackType_t sampler_stack[TASK_SAMPLER_STACK];
+static power_sample_t history[HISTORY_LEN];
+static uint32_t history_count = 0;           // Samples ever recorded
+static SemaphoreHandle_t arm_lock = NULL;
+static StaticSemaphore_t arm_lock_buf;
+static bool arm_inhibited = false;
+static bool arm_held = false;               // hold_disarmed()
+
 const max17330_conf_t flight = {
     .battery = FLIGHT_BATTERY,
     .clk = 100000,
-    .battery_cap_mah = 2000,
+    .clk_max = 400000,
+    .battery_cap_mah = FLIGHT_CAP_MAH,
     .scl = GPIO_NUM_2,
     .sda = GPIO_NUM_1,
+    .core = TASK_I2C_BUS_CORE,
+    .slow_refresh_ms = MAX17330_SLOW_REFRESH_MS,
 };
 
 const max17330_conf_t pyro = {
     .battery = PYRO_BATTERY,
     .clk = 100000,
-    .battery_cap_mah = 1000,
+    .clk_max = 400000,
+    .battery_cap_mah = PYRO_CAP_MAH,
     .scl = GPIO_NUM_4,
     .sda = GPIO_NUM_3,
+    .core = TASK_I2C_BUS_CORE,
+    .slow_refresh_ms = MAX17330_SLOW_REFRESH_MS,
+};
+
+static const max17330_nv_word_t flight_nv_words[] = {
+    { MAX17330_nDESIGNCAP, 2 * FLIGHT_CAP_MAH },    // 0.5 mAh per LSB
+    { MAX17330_nPACKCFG, 0x0001 },                  // Thermistor disabled
+    { MAX17330_nICHGCFG, 0x314B },                  // 500 mA charge current
+    { MAX17330_nODSCTH, 0x0D00 },                   // Overdischarge current threshold
+};
+
+static const max17330_nv_word_t pyro_nv_words[] = {
+    { MAX17330_nDESIGNCAP, 2 * PYRO_CAP_MAH },
+    { MAX17330_nPACKCFG, 0x0001 },
+    { MAX17330_nICHGCFG, 0x314B },
+    { MAX17330_nODSCTH, 0x0D00 },
 };
 
+static const max17330_nv_profile_t flight_nv_profile = {
+    .words = flight_nv_words,
+    .count = sizeof(flight_nv_words) / sizeof(flight_nv_words[0]),
+    .reserve_writes = NV_RESERVE_WRITES,
+};
+
+static const max17330_nv_profile_t pyro_nv_profile = {
+    .words = pyro_nv_words,
+    .count = sizeof(pyro_nv_words) / sizeof(pyro_nv_words[0]),
+    .reserve_writes = NV_RESERVE_WRITES,
+};
+
+// Replaces the sampler's part of the snapshot when anything in it changed,
+// bumping its sequence number. armed is publish_armed()'s alone, since a pass
+// that read it before a change would publish the old value after it.
+static void publish_snapshot(const power_snapshot_t *next)
+{
+    if(snapshot_lock == NULL)
+    {
+        return;
+    }
+    xSemaphoreTake(snapshot_lock, portMAX_DELAY);
+    bool changed = memcmp(&next->battery, &snapshot.battery, sizeof(snapshot.battery)) != 0 ||
+                   memcmp(&next->gauge_ok, &snapshot.gauge_ok, sizeof(snapshot.gauge_ok)) != 0 ||
+                   memcmp(&next->clk, &snapshot.clk, sizeof(snapshot.clk)) != 0;
+    if(changed)
+    {
+        uint32_t seq = snapshot.seq + 1;
+        uint8_t was_armed = snapshot.armed;
+        snapshot = *next;
+        snapshot.armed = was_armed;
+        snapshot.seq = seq;
+        snapshot.stamps.publish_us = esp_timer_get_time();
+    }
+    // Stamps stay out of the change check, but an unchanged pass still
+    // vouches for the values
+    snapshot.checked_us = next->checked_us;
+    xSemaphoreGive(snapshot_lock);
+    if(changed)
+    {
+        xSemaphoreGive(snapshot_event);
+    }
+}
+
+// Records every pass, changed or not, so the charts keep an even time base
+static void record_sample(const power_snapshot_t *next)
+{
+    power_sample_t sample = {
+        .t_ms = (uint32_t)(esp_timer_get_time() / 1000),
+    };
+    for(battery_t battery = FLIGHT_BATTERY; battery <= PYRO_BATTERY; battery++)
+    {
+        sample.current_ma[battery] = (int32_t)next->battery[battery].current_mah;
+        sample.voltage_mv[battery] = (uint16_t)(next->battery[battery].batt_voltage * 1000);
+    }
+    xSemaphoreTake(snapshot_lock, portMAX_DELAY);
+    history[history_count % HISTORY_LEN] = sample;
+    history_count++;
+    xSemaphoreGive(snapshot_lock);
+}
+
+// Called under arm_lock, so changes of armed are published in order
+static void publish_armed()
+{
+    if(snapshot_lock == NULL)
+    {
+        return;
+    }
+    xSemaphoreTake(snapshot_lock, portMAX_DELAY);
+    bool changed = snapshot.armed != armed;
+    if(changed)
+    {
+        snapshot.armed = armed;
+        snapshot.seq++;
+        snapshot.stamps.publish_us = esp_timer_get_time();
+    }
+    xSemaphoreGive(snapshot_lock);
+    if(changed)
+    {
+        xSemaphoreGive(snapshot_event);
+    }
+}
+
+static void sampler_task(void *arg)
+{
+    static task_period_t period;
+    task_period_init(&period, "sampler", SAMPLE_PERIOD_MS);
+    power_snapshot_t next = {0};
+    while(1)
+    {
+        task_period_wait(&period);
+        next.checked_us = esp_timer_get_time();
+        for(battery_t battery = FLIGHT_BATTERY; battery <= PYRO_BATTERY; battery++)
+        {
+            battery_stat_t stat;
+            memset(&stat, 0, sizeof(stat)); // Padding takes part in the change check
+            const max17330_conf_t *conf = battery ? &pyro : &flight;
+            int64_t read_us = esp_timer_get_time();
+            next.gauge_ok[battery] = max17330_get_battery_state(*conf, &stat) == ESP_OK;
+            if(next.gauge_ok[battery])
+            {
+                next.battery[battery] = stat;
+                next.stamps.read_us[battery] = read_us;
+                next.stamps.read_end_us[battery] = esp_timer_get_time();
+            }
+            i2c_bus_stats_t link;
+            if(max17330_get_link_stats(*conf, &link) == ESP_OK)
+            {
+                next.clk[battery] = link.clk;
+            }
+        }
+        publish_snapshot(&next);
+        record_sample(&next);
+    }
+}
+
+esp_err_t start_sampler()
+{
+    if(sampler_handle != NULL)
+    {
+        return ESP_OK;
+    }
+    snapshot_lock = xSemaphoreCreateMutexStatic(&snapshot_lock_buf);
+    snapshot_event = xSemaphoreCreateBinaryStatic(&snapshot_event_buf);
+    snapshot.armed = armed;
+    sampler_handle = xTaskCreateStaticPinnedToCore(sampler_task, "sampler", TASK_SAMPLER_STACK, NULL,
+                                                   TASK_SAMPLER_PRIORITY, sampler_stack, &sampler_buf,
+                                                   TASK_SAMPLER_CORE);
+    if(sampler_handle == NULL)
+    {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+void get_snapshot(power_snapshot_t *out)
+{
+    if(snapshot_lock == NULL)
+    {
+        memset(out, 0, sizeof(*out));
+        out->armed = armed;
+        return;
+    }
+    xSemaphoreTake(snapshot_lock, portMAX_DELAY);
+    *out = snapshot;
+    xSemaphoreGive(snapshot_lock);
+}
+
+BaseType_t wait_snapshot_change(TickType_t ticks)
+{
+    if(snapshot_event == NULL)
+    {
+        vTaskDelay(ticks);
+        return pdFALSE;
+    }
+    return xSemaphoreTake(snapshot_event, ticks);
+}
+
+size_t get_history(uint32_t since, power_sample_t *out, size_t max, uint32_t *next)
+{
+    if(snapshot_lock == NULL)
+    {
+        *next = since;
+        return 0;
+    }
+    xSemaphoreTake(snapshot_lock, portMAX_DELAY);
+    uint32_t oldest = history_count > HISTORY_LEN ? history_count - HISTORY_LEN : 0;
+    uint32_t first = since < oldest || since > history_count ? oldest : since;
+    size_t count = 0;
+    while(count < max && first + count < history_count)
+    {
+        out[count] = history[(first + count) % HISTORY_LEN];
+        count++;
+    }
+    *next = first + count;
+    xSemaphoreGive(snapshot_lock);
+    return count;
+}
+
+// FNV-1a over the profile's words, to recognize it across boots
+static uint32_t profile_hash(const max17330_nv_profile_t *profile)
+{
+    uint32_t hash = 2166136261u;
+    for(uint8_t i = 0; i < profile->count; i++)
+    {
+        const max17330_nv_word_t *w = &profile->words[i];
+        const uint8_t bytes[4] = { w->reg & 0xFF, w->reg >> 8, w->value & 0xFF, w->value >> 8 };
+        for(uint8_t j = 0; j < 4; j++)
+        {
+            hash = (hash ^ bytes[j]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+// A profile whose copy did not read back would spend another of the gauge's
+// NV writes on every boot. Its hash is kept per battery in NVS, and that
+// profile is only compared from then on; a changed profile gets one try.
+static const char *const nv_failed_keys[2] = { "nv_fail_flight", "nv_fail_pyro" };
+
+static esp_err_t provision_gauge(const max17330_conf_t *conf, const max17330_nv_profile_t *profile)
+{
+    max17330_nv_result_t result;
+    uint32_t hash = profile_hash(profile);
+    uint32_t failed = 0;
+    bool copy = GAUGE_PROVISION && (nvs_get_u32(nvs, nv_failed_keys[conf->battery], &failed) != ESP_OK ||
+                                    failed != hash);
+    esp_err_t err;
+    if(copy)
+    {
+        err = max17330_apply_nv_profile(*conf, profile, &result);
+        if(err != ESP_OK && result.copy_issued)
+        {
+            nvs_set_u32(nvs, nv_failed_keys[conf->battery], hash);
+            nvs_commit(nvs);
+            ESP_LOGE(TAG, "%d, NV copy did not take, this profile will not be copied again", conf->battery);
+        }
+    }
+    else
+    {
+        err = max17330_check_nv_profile(*conf, profile, &result);
+        if(GAUGE_PROVISION && err == ESP_OK && result.differing)
+        {
+            ESP_LOGE(TAG, "%d, Not copying a profile that failed to verify before", conf->battery);
+        }
+    }
+    if(err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "%d, NV profile not applied: %s", conf->battery, esp_err_to_name(err));
+    }
+    else if(result.differing && !result.copied)
+    {
+        ESP_LOGW(TAG, "%d, %d NV words differ from the profile", conf->battery, result.differing);
+    }
+    return err;
+}
+
 esp_err_t init_power_control()
 {
+    if(arm_lock == NULL)
+    {
+        arm_lock = xSemaphoreCreateMutexStatic(&arm_lock_buf);
+    }
     if(max17330_init(flight) != ESP_OK)
     {
         return ESP_FAIL;
@@ -32,36 +324,100 @@ esp_err_t init_power_control()
     {
         return ESP_FAIL;
     }
-    /*
-    if(max17330_first_time_setup(flight) != ESP_OK)
+    // A gauge that cannot be provisioned still reports, so carry on
+    provision_gauge(&flight, &flight_nv_profile);
+    provision_gauge(&pyro, &pyro_nv_profile);
+
+    return ESP_OK;
+}
+
+// The lock only exists once power control is initialized; NVS restores the
+// armed state before that, while nothing else runs
+static void arm_lock_take()
+{
+    if(arm_lock != NULL)
     {
-        return ESP_FAIL;
+        xSemaphoreTake(arm_lock, portMAX_DELAY);
     }
-    if(max17330_first_time_setup(pyro) != ESP_OK)
+}
+
+static void arm_lock_give()
+{
+    if(arm_lock != NULL)
     {
-        return ESP_FAIL;
+        xSemaphoreGive(arm_lock);
     }
-    */
-    
-    return ESP_OK;
 }
 
-void set_armed()
+static void disarm_locked()
 {
+    gpio_set_level(ARM_PIN, 0);
+    gpio_set_direction(ARM_PIN, GPIO_MODE_OUTPUT);
+    armed = 0;
+    nvs_set_u8(nvs, "armed", 0);
+    nvs_commit(nvs);
+    publish_armed();
+}
+
+esp_err_t set_armed()
+{
+    arm_lock_take();
+    if(arm_inhibited || arm_held)
+    {
+        arm_lock_give();
+        return ESP_ERR_INVALID_STATE;
+    }
     armed = 1;
     gpio_set_direction(ARM_PIN, GPIO_MODE_OUTPUT);
     gpio_set_level(ARM_PIN, 1);
     nvs_set_u8(nvs, "armed", 1);
     nvs_commit(nvs);
+    publish_armed();
+    arm_lock_give();
+    return ESP_OK;
 }
 
 void set_disarmed()
 {
-    armed = 0;
-    gpio_set_direction(ARM_PIN, GPIO_MODE_OUTPUT);
+    arm_lock_take();
+    disarm_locked();
+    arm_lock_give();
+}
+
+void set_safe()
+{
+    // Drive the output first: the lock may be held through an NVS commit
     gpio_set_level(ARM_PIN, 0);
-    nvs_set_u8(nvs, "armed", 0);
-    nvs_commit(nvs);
+    arm_lock_take();
+    arm_inhibited = true;
+    disarm_locked();
+    arm_lock_give();
+}
+
+void release_safe()
+{
+    arm_lock_take();
+    arm_inhibited = false;
+    arm_lock_give();
+}
+
+esp_err_t hold_disarmed()
+{
+    arm_lock_take();
+    esp_err_t err = armed || arm_held ? ESP_ERR_INVALID_STATE : ESP_OK;
+    if(err == ESP_OK)
+    {
+        arm_held = true;
+    }
+    arm_lock_give();
+    return err;
+}
+
+void release_disarmed()
+{
+    arm_lock_take();
+    arm_held = false;
+    arm_lock_give();
 }
 
 battery_stat_t get_battery(battery_t battery)
@@ -70,4 +426,19 @@ battery_stat_t get_battery(battery_t battery)
     max17330_get_battery_state(battery ? pyro : flight, &res);
 
     return res;
+}
+
+esp_err_t get_cache_stats(battery_t battery, max17330_cache_stats_t *stats)
+{
+    return max17330_get_cache_stats(battery ? pyro : flight, stats);
+}
+
+esp_err_t get_link_stats(battery_t battery, i2c_bus_stats_t *stats)
+{
+    return max17330_get_link_stats(battery ? pyro : flight, stats);
+}
+
+esp_err_t get_protection(battery_t battery, max17330_prot_t *prot)
+{
+    return max17330_get_protection(battery ? pyro : flight, prot);
 }
\ No newline at end of file
@@ -3,10 +3,75 @@
 
 #include "max17330.h"
 #include "stdint.h"
+#include "stdbool.h"
+#include "freertos/FreeRTOS.h"
+
+#define SAMPLE_PERIOD_MS 1000
+
+// Samples kept for the charts, five minutes at SAMPLE_PERIOD_MS
+#define HISTORY_LEN 300
+
+// When the values of a snapshot were taken, in esp_timer microseconds since
+// boot. A gauge keeps its stamps while its reads fail, like its values.
+typedef struct {
+    int64_t read_us[2];         // Start of the last good read of each gauge
+    int64_t read_end_us[2];
+    int64_t publish_us;         // This version of the snapshot went out
+} power_stamps_t;
+
+// Everything the API reports, taken by the sampler task in one pass. seq only
+// advances when a value differs from the previous snapshot, so it doubles as
+// a version for caching and long-polling.
+typedef struct {
+    uint32_t seq;
+    battery_stat_t battery[2];
+    uint8_t armed;
+    bool gauge_ok[2];           // Last read of the gauge succeeded
+    uint32_t clk[2];            // Current I2C clock of each gauge bus
+    power_stamps_t stamps;      // Of the pass that produced this version
+    int64_t checked_us;         // Start of the latest pass, which may have changed nothing
+} power_snapshot_t;
+
+// One sampler pass, trimmed to what the web UI charts
+typedef struct {
+    uint32_t t_ms;              // Since boot
+    int32_t current_ma[2];
+    uint16_t voltage_mv[2];
+} power_sample_t;
 
 esp_err_t init_power_control();
-void set_armed();
+
+// Fails with ESP_ERR_INVALID_STATE while the protection engine holds the
+// board safe
+esp_err_t set_armed();
 void set_disarmed();
+
+// Disarms with the output driven low before anything slow, and refuses to
+// arm again until release_safe()
+void set_safe();
+void release_safe();
+
+// Keeps the board from arming without touching the output, e.g. while flash
+// writes stall the interlock. Fails with ESP_ERR_INVALID_STATE if it is armed
+// already or another hold is in place.
+esp_err_t hold_disarmed();
+void release_disarmed();
 battery_stat_t get_battery(battery_t battery);
+esp_err_t get_cache_stats(battery_t battery, max17330_cache_stats_t *stats);
+esp_err_t get_link_stats(battery_t battery, i2c_bus_stats_t *stats);
+esp_err_t get_protection(battery_t battery, max17330_prot_t *prot);
+
+// Starts the task that samples both gauges every SAMPLE_PERIOD_MS
+esp_err_t start_sampler();
+void get_snapshot(power_snapshot_t *snapshot);
+
+// Blocks until a new snapshot is published or ticks pass. Meant for a single
+// consumer; returns pdTRUE if the snapshot changed.
+BaseType_t wait_snapshot_change(TickType_t ticks);
+
+// Copies up to max samples starting at sample number since, skipping ahead to
+// the oldest one still kept. Returns how many were copied and sets next to the
+// number to continue from.
+size_t get_history(uint32_t since, power_sample_t *out, size_t max, uint32_t *next);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,261 @@
+#include "protection.h"
+#include "power_control.h"
+#include "tasks.h"
+#include "dlog.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include <string.h>
+
+static const char *TAG = "protection";
+
+// Defaults for the flight and pyro packs. Limits are per cell; tune them
+// together with the gauges' own nUVPrtTh and nODSCTh thresholds.
+const prot_rule_t protection_default_rules[] = {
+    { "pyro_fault",     PYRO_BATTERY,   PROT_STATUS_BITS,  PROT_DISCHARGE_FAULTS, 0,    1,  PROT_ACTION_SAFE },
+    { "pyro_uv",        PYRO_BATTERY,   PROT_UNDERVOLTAGE, 0,                     3.0,  2,  PROT_ACTION_SAFE },
+    // Igniters draw amps for a few ms, well short of three polls
+    { "pyro_oc",        PYRO_BATTERY,   PROT_OVERCURRENT,  0,                     4000, 3,  PROT_ACTION_SAFE },
+    { "flight_fault",   FLIGHT_BATTERY, PROT_STATUS_BITS,  PROT_DISCHARGE_FAULTS, 0,    1,  PROT_ACTION_SAFE },
+    { "flight_uv",      FLIGHT_BATTERY, PROT_UNDERVOLTAGE, 0,                     3.0,  2,  PROT_ACTION_SAFE },
+    { "pyro_alert",     PYRO_BATTERY,   PROT_ALERT_BITS,   0xFFFF,                0,    1,  PROT_ACTION_LOG },
+    { "flight_alert",   FLIGHT_BATTERY, PROT_ALERT_BITS,   0xFFFF,                0,    1,  PROT_ACTION_LOG },
+    { "pyro_gauge",     PYRO_BATTERY,   PROT_GAUGE_LOST,   0,                     0,    10, PROT_ACTION_LOG },
+    { "flight_gauge",   FLIGHT_BATTERY, PROT_GAUGE_LOST,   0,                     0,    10, PROT_ACTION_LOG },
+};
+const size_t protection_default_rule_count = sizeof(protection_default_rules) / sizeof(protection_default_rules[0]);
+
+static prot_rule_t rules[PROT_MAX_RULES];
+static size_t rule_count = 0;
+static uint8_t hits[PROT_MAX_RULES];
+
+static SemaphoreHandle_t prot_lock = NULL;     // Protects stats and trips
+static StaticSemaphore_t prot_lock_buf;
+static prot_stats_t stats;
+static prot_trip_t trips[PROT_TRIP_LOG];
+static uint32_t trip_count = 0;
+static int64_t safe_since_us;
+static TaskHandle_t protection_handle = NULL;
+static StaticTask_t protection_buf;
+static StackType_t protection_stack[TASK_PROTECTION_STACK];
+
+// Returns whether the rule's condition holds, with the value it saw
+static bool protection_eval(const prot_rule_t *rule, const max17330_prot_t *prot, bool ok, float *value)
+{
+    *value = 0;
+    if(rule->metric == PROT_GAUGE_LOST)
+    {
+        return !ok;
+    }
+    if(!ok)
+    {
+        return false;
+    }
+    switch(rule->metric)
+    {
+        case PROT_STATUS_BITS:
+            *value = prot->prot_status;
+            return (prot->prot_status & rule->mask) != 0;
+        case PROT_ALERT_BITS:
+            *value = prot->prot_alert;
+            return (prot->prot_alert & rule->mask) != 0;
+        case PROT_UNDERVOLTAGE:
+            *value = prot->voltage;
+            return prot->voltage < rule->limit;
+        case PROT_OVERCURRENT:
+            *value = -prot->current_ma;
+            return -prot->current_ma > rule->limit;
+        default:
+            return false;
+    }
+}
+
+static void protection_record(uint8_t rule, float value, int64_t detect_us, int64_t ts_us)
+{
+    xSemaphoreTake(prot_lock, portMAX_DELAY);
+    trips[trip_count % PROT_TRIP_LOG] = (prot_trip_t){
+        .ts_us = ts_us,
+        .detect_us = detect_us,
+        .rule = rule,
+        .value = value,
+    };
+    trip_count++;
+    stats.trips++;
+    xSemaphoreGive(prot_lock);
+    DLOG(DLOG_PROT_TRIP, rule, rules[rule].battery, dlog_f(value), (uint32_t)(ts_us - detect_us));
+}
+
+static void protection_poll()
+{
+    int64_t start_us = esp_timer_get_time();
+    max17330_prot_t prot[2];
+    bool ok[2];
+    for(battery_t battery = FLIGHT_BATTERY; battery <= PYRO_BATTERY; battery++)
+    {
+        ok[battery] = get_protection(battery, &prot[battery]) == ESP_OK;
+    }
+
+    uint32_t active = 0;
+    bool safe_needed = false;
+    // Only this task writes holding_safe; readers see it once it is published below
+    bool holding = stats.holding_safe;
+    for(uint8_t i = 0; i < rule_count; i++)
+    {
+        const prot_rule_t *rule = &rules[i];
+        float value;
+        if(!protection_eval(rule, &prot[rule->battery], ok[rule->battery], &value))
+        {
+            hits[i] = 0;
+            continue;
+        }
+        if(hits[i] < rule->debounce)
+        {
+            hits[i]++;
+        }
+        if(hits[i] < rule->debounce)
+        {
+            continue;
+        }
+        active |= 1UL << i;
+        if(rule->action == PROT_ACTION_SAFE)
+        {
+            safe_needed = true;
+        }
+        // Trip once per onset, when the debounce count is first reached
+        if(stats.active & (1UL << i))
+        {
+            continue;
+        }
+        if(rule->action == PROT_ACTION_SAFE && !holding)
+        {
+            int64_t ts_us = esp_timer_get_time();
+            set_safe();
+            holding = true;
+            safe_since_us = ts_us;
+            protection_record(i, value, start_us, ts_us);
+        }
+        else
+        {
+            protection_record(i, value, start_us, esp_timer_get_time());
+        }
+    }
+
+    if(holding && !safe_needed)
+    {
+        release_safe();
+        DLOG(DLOG_PROT_RELEASE, (uint32_t)((esp_timer_get_time() - safe_since_us) / 1000));
+    }
+
+    uint32_t poll_us = (uint32_t)(esp_timer_get_time() - start_us);
+    xSemaphoreTake(prot_lock, portMAX_DELAY);
+    stats.polls++;
+    stats.poll_errors += !ok[FLIGHT_BATTERY] + !ok[PYRO_BATTERY];
+    stats.poll_avg_us = stats.poll_avg_us ? stats.poll_avg_us - stats.poll_avg_us / 8 + poll_us / 8 : poll_us;
+    if(poll_us > PROT_POLL_BUDGET_US)
+    {
+        stats.budget_overruns++;
+    }
+    if(poll_us > stats.poll_max_us)
+    {
+        stats.poll_max_us = poll_us;
+    }
+    stats.active = active;
+    stats.holding_safe = holding && safe_needed;
+    xSemaphoreGive(prot_lock);
+}
+
+static void protection_task(void *arg)
+{
+    static task_period_t period;
+    task_period_init(&period, "protection", PROT_PERIOD_MS);
+    while(1)
+    {
+        task_period_wait(&period);
+        protection_poll();
+    }
+}
+
+esp_err_t protection_start(const prot_rule_t *new_rules, size_t count)
+{
+    if(protection_handle != NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if(count > PROT_MAX_RULES)
+    {
+        ESP_LOGE(TAG, "Too many rules: %u", (unsigned)count);
+        return ESP_ERR_INVALID_ARG;
+    }
+    for(size_t i = 0; i < count; i++)
+    {
+        if(new_rules[i].debounce == 0 || new_rules[i].battery > PYRO_BATTERY)
+        {
+            ESP_LOGE(TAG, "Invalid rule %s", new_rules[i].name);
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    memcpy(rules, new_rules, count * sizeof(prot_rule_t));
+    rule_count = count;
+    prot_lock = xSemaphoreCreateMutexStatic(&prot_lock_buf);
+    protection_handle = xTaskCreateStaticPinnedToCore(protection_task, "protection", TASK_PROTECTION_STACK, NULL,
+                                                      TASK_PROTECTION_PRIORITY, protection_stack, &protection_buf,
+                                                      TASK_PROTECTION_CORE);
+    if(protection_handle == NULL)
+    {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+const prot_rule_t *protection_get_rules(size_t *count)
+{
+    *count = rule_count;
+    return rules;
+}
+
+uint32_t protection_bound_us(const prot_rule_t *rule)
+{
+    return rule->debounce * PROT_PERIOD_MS * 1000 + PROT_POLL_BUDGET_US;
+}
+
+uint32_t protection_worst_us(const prot_rule_t *rule)
+{
+    // A poll longer than the period starts the next one late
+    uint32_t interval_us = PROT_POLL_WORST_US > PROT_PERIOD_MS * 1000 ? PROT_POLL_WORST_US : PROT_PERIOD_MS * 1000;
+    return rule->debounce * interval_us + PROT_POLL_WORST_US;
+}
+
+void protection_get_stats(prot_stats_t *out)
+{
+    if(prot_lock == NULL)
+    {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+    xSemaphoreTake(prot_lock, portMAX_DELAY);
+    *out = stats;
+    xSemaphoreGive(prot_lock);
+}
+
+size_t protection_get_trips(prot_trip_t *out, size_t max)
+{
+    if(prot_lock == NULL)
+    {
+        return 0;
+    }
+    xSemaphoreTake(prot_lock, portMAX_DELAY);
+    uint32_t first = trip_count > PROT_TRIP_LOG ? trip_count - PROT_TRIP_LOG : 0;
+    if(trip_count - first > max)
+    {
+        first = trip_count - max;
+    }
+    size_t n = 0;
+    for(uint32_t i = first; i < trip_count; i++)
+    {
+        out[n++] = trips[i % PROT_TRIP_LOG];
+    }
+    xSemaphoreGive(prot_lock);
+    return n;
+}
@@ -0,0 +1,101 @@
+#ifndef PROTECTION_H
+#define PROTECTION_H
+
+#include "esp_err.h"
+#include "max17330.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Protection interlock. A task above the sampler polls the protection,
+// current and voltage registers of both gauges every PROT_PERIOD_MS and
+// evaluates each rule against the fresh values. A rule that holds for its
+// debounce count of consecutive polls trips: safing rules drive the output
+// low through set_safe() and keep the board from arming until every safing
+// rule has cleared, logging rules only record the trigger.
+//
+// While every poll fits PROT_POLL_BUDGET_US, the reaction from a condition
+// appearing on the gauge to the output being safe is at most debounce *
+// PROT_PERIOD_MS plus one poll: protection_bound_us(). Polls over budget are
+// counted, since the bound does not hold around them. The worst case follows
+// from the I2C deadlines instead: each of the MAX17330_PROT_READS reads per
+// gauge may wait out another task's transaction on the gauge's register lock
+// and then run to its own deadline, bus recovery included. Polls that long
+// also push back the ones after them: protection_worst_us().
+//
+// Losing a gauge only logs. The gauge keeps protecting its pack with its own
+// FETs without the host, so the link going down costs visibility but not
+// protection, while safing would drop an armed output in flight over an I2C
+// fault. The trip log still records the loss.
+
+#define PROT_PERIOD_MS 50
+#define PROT_MAX_RULES 16
+#define PROT_TRIP_LOG 8
+
+// Time one poll of both gauges may take on a healthy bus
+#define PROT_POLL_BUDGET_US 10000
+
+// Longest one poll of both gauges can take within the I2C deadlines
+#define PROT_POLL_WORST_US (2 * MAX17330_PROT_READS * 2 * \
+                            I2C_BUS_TRANSFER_MAX_TICKS(MAX17330_I2C_TIMEOUT_MS) * portTICK_PERIOD_MS * 1000)
+
+// Conditions in ProtStatus that end in the gauge opening its discharge FETs
+#define PROT_DISCHARGE_FAULTS (MAX17330_PROT_ODCP | MAX17330_PROT_UVP | MAX17330_PROT_TOOHOTD | \
+                               MAX17330_PROT_DIEHOT | MAX17330_PROT_PERMFAIL)
+
+typedef enum {
+    PROT_STATUS_BITS = 0,       // Any of mask set in ProtStatus
+    PROT_ALERT_BITS,            // Any of mask set in the latched ProtAlrt
+    PROT_UNDERVOLTAGE,          // Cell voltage below limit (V)
+    PROT_OVERCURRENT,           // Discharge current above limit (mA)
+    PROT_GAUGE_LOST,            // Gauge did not answer the poll
+} prot_metric_t;
+
+typedef enum {
+    PROT_ACTION_LOG = 0,
+    PROT_ACTION_SAFE,
+} prot_action_t;
+
+typedef struct {
+    const char *name;
+    battery_t battery;
+    prot_metric_t metric;
+    uint16_t mask;
+    float limit;
+    uint8_t debounce;           // Consecutive polls the condition must hold, at least 1
+    prot_action_t action;
+} prot_rule_t;
+
+typedef struct {
+    int64_t ts_us;              // Output driven safe, or the trigger logged
+    int64_t detect_us;          // Start of the poll that confirmed the condition
+    uint8_t rule;
+    float value;
+} prot_trip_t;
+
+typedef struct {
+    uint32_t polls;
+    uint32_t poll_errors;
+    uint32_t poll_avg_us;
+    uint32_t poll_max_us;
+    uint32_t budget_overruns;   // Polls over PROT_POLL_BUDGET_US
+    uint32_t trips;
+    uint32_t active;            // Bit per rule whose condition currently holds
+    bool holding_safe;
+} prot_stats_t;
+
+extern const prot_rule_t protection_default_rules[];
+extern const size_t protection_default_rule_count;
+
+// Starts the protection task with a copy of rules
+esp_err_t protection_start(const prot_rule_t *rules, size_t count);
+
+const prot_rule_t *protection_get_rules(size_t *count);
+uint32_t protection_bound_us(const prot_rule_t *rule);
+uint32_t protection_worst_us(const prot_rule_t *rule);
+void protection_get_stats(prot_stats_t *stats);
+
+// Copies the most recent trips, oldest first, returns how many
+size_t protection_get_trips(prot_trip_t *trips, size_t max);
+
+#endif
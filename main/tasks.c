@@ -0,0 +1,90 @@
+#include "tasks.h"
+#include "esp_timer.h"
+#include <stdatomic.h>
+
+static task_period_t *periodic[TASK_PERIODIC_MAX];
+static atomic_uint periodic_count = 0;
+
+void task_period_init(task_period_t *p, const char *name, uint32_t period_ms)
+{
+    *p = (task_period_t){
+        .stats = {
+            .name = name,
+            .period_ms = period_ms,
+        },
+        .period = pdMS_TO_TICKS(period_ms),
+        .last_wake = xTaskGetTickCount(),
+    };
+    unsigned slot = atomic_fetch_add(&periodic_count, 1);
+    if(slot < TASK_PERIODIC_MAX)
+    {
+        periodic[slot] = p;
+    }
+}
+
+// Moving average with a weight of 1/8 for the newest value
+static void task_period_record(uint32_t *avg, uint32_t *max, int64_t us)
+{
+    uint32_t v = us > 0 ? (uint32_t)us : 0;
+    *avg = *avg ? *avg - *avg / 8 + v / 8 : v;
+    if(v > *max)
+    {
+        *max = v;
+    }
+}
+
+void task_period_wait(task_period_t *p)
+{
+    task_period_stats_t *st = &p->stats;
+    int64_t period_us = (int64_t)p->stats.period_ms * 1000;
+    if(p->release_us != 0)
+    {
+        int64_t end_us = esp_timer_get_time();
+        task_period_record(&st->exec_avg_us, &st->exec_max_us, end_us - p->start_us);
+        if(end_us > p->release_us + period_us)
+        {
+            st->misses++;
+        }
+    }
+
+    vTaskDelayUntil(&p->last_wake, p->period);
+    int64_t now_us = esp_timer_get_time();
+    if(p->release_us == 0)
+    {
+        p->release_us = now_us;
+    }
+    else
+    {
+        p->release_us += period_us;
+    }
+    int64_t late_us = now_us - p->release_us;
+    if(late_us >= period_us)
+    {
+        // A whole slot went by, start the schedule over from here
+        st->misses++;
+        p->release_us = now_us;
+        p->last_wake = xTaskGetTickCount();
+    }
+    else
+    {
+        task_period_record(&st->jitter_avg_us, &st->jitter_max_us, late_us);
+    }
+    p->start_us = now_us;
+    st->runs++;
+}
+
+// Every field is written by its own task only, so a copy may mix two runs but
+// never holds a torn value
+size_t task_period_get_stats(task_period_stats_t *out, size_t max)
+{
+    unsigned count = atomic_load(&periodic_count);
+    size_t n = 0;
+    for(unsigned i = 0; i < count && i < TASK_PERIODIC_MAX && n < max; i++)
+    {
+        if(periodic[i] != NULL)
+        {
+            out[n++] = periodic[i]->stats;
+        }
+    }
+    return n;
+}
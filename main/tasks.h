@@ -0,0 +1,108 @@
+#ifndef TASKS_H
+#define TASKS_H
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "i2c_bus.h"
+#include <stddef.h>
+
+// Scheduling plan for every task the firmware creates. Gauge sampling and arm
+// control run on CONTROL_CORE, the network side on NET_CORE, where ESP-IDF
+// pins the Wi-Fi task by default. The ESP32-S2 is single core, so both are
+// core 0 there and the priorities below do all the work. Everything stays
+// under lwIP (18) and Wi-Fi (23) so the network stack keeps its timing.
+//
+// Order, highest first: I2C bus tasks, protection interlock, sampler, httpd, HTTP workers and the
+// status long-poll, interface reset, then info printing, the health check of
+// a freshly updated image and the deferred log drain, which is the only task
+// that writes to the UART in steady state.
+
+#if CONFIG_FREERTOS_UNICORE
+#define CONTROL_CORE 0
+#else
+#define CONTROL_CORE 1
+#endif
+#define NET_CORE 0
+
+#define TASK_I2C_BUS_CORE CONTROL_CORE
+
+#define TASK_PROTECTION_STACK 4096
+#define TASK_PROTECTION_PRIORITY (tskIDLE_PRIORITY + 8)
+#define TASK_PROTECTION_CORE CONTROL_CORE
+
+#define TASK_SAMPLER_STACK 4096
+#define TASK_SAMPLER_PRIORITY (tskIDLE_PRIORITY + 7)
+#define TASK_SAMPLER_CORE CONTROL_CORE
+
+#define TASK_HTTPD_STACK 8192
+#define TASK_HTTPD_PRIORITY (tskIDLE_PRIORITY + 5)
+#define TASK_HTTPD_CORE NET_CORE
+
+#define TASK_HTTP_WORKER_STACK 6144
+#define TASK_HTTP_WORKER_PRIORITY (tskIDLE_PRIORITY + 4)
+#define TASK_HTTP_WORKER_CORE NET_CORE
+
+#define TASK_STATUS_POLL_STACK 4096
+#define TASK_STATUS_POLL_PRIORITY (tskIDLE_PRIORITY + 4)
+#define TASK_STATUS_POLL_CORE NET_CORE
+
+#define TASK_RESET_INTERFACE_STACK 2048
+#define TASK_RESET_INTERFACE_PRIORITY (tskIDLE_PRIORITY + 2)
+#define TASK_RESET_INTERFACE_CORE NET_CORE
+
+#define TASK_PRINT_INFO_STACK 4096
+#define TASK_PRINT_INFO_PRIORITY (tskIDLE_PRIORITY + 1)
+#define TASK_PRINT_INFO_CORE CONTROL_CORE
+
+// The health check of an updated image, and the restart into one
+#define TASK_OTA_STACK 3072
+#define TASK_OTA_PRIORITY (tskIDLE_PRIORITY + 1)
+#define TASK_OTA_CORE CONTROL_CORE
+
+#define TASK_DLOG_PRIORITY (tskIDLE_PRIORITY + 1)
+#define TASK_DLOG_CORE NET_CORE
+
+// Protection polls must not wait behind a sample, and a sample has to finish
+// before anything network facing may run again
+_Static_assert(TASK_PROTECTION_PRIORITY < I2C_BUS_TASK_PRIORITY, "bus tasks must preempt protection");
+_Static_assert(TASK_SAMPLER_PRIORITY < TASK_PROTECTION_PRIORITY, "protection must preempt the sampler");
+_Static_assert(TASK_SAMPLER_PRIORITY > TASK_HTTPD_PRIORITY, "the sampler must preempt httpd");
+_Static_assert(TASK_HTTPD_PRIORITY > TASK_HTTP_WORKER_PRIORITY, "httpd must preempt its workers");
+
+// ---- Periodic task instrumentation ----
+
+#define TASK_PERIODIC_MAX 8
+
+// Timing of one periodic task. Release jitter is how late the task started
+// relative to its schedule, anchored at the first run. A deadline miss is a
+// run that ended after the next release, or a wake-up that skipped a slot.
+typedef struct {
+    const char *name;
+    uint32_t period_ms;
+    uint32_t runs;
+    uint32_t misses;
+    uint32_t jitter_avg_us;     // Moving average over runs
+    uint32_t jitter_max_us;
+    uint32_t exec_avg_us;
+    uint32_t exec_max_us;
+} task_period_stats_t;
+
+typedef struct {
+    task_period_stats_t stats;
+    TickType_t period;
+    TickType_t last_wake;
+    int64_t release_us;         // Scheduled start of the current run, 0 before the first
+    int64_t start_us;
+} task_period_t;
+
+// Registers a periodic task; call from the task itself before its loop
+void task_period_init(task_period_t *p, const char *name, uint32_t period_ms);
+
+// Ends the current run, sleeps until the next release and starts that run
+void task_period_wait(task_period_t *p);
+
+// Copies the stats of every registered task, returns how many were copied
+size_t task_period_get_stats(task_period_stats_t *out, size_t max);
+
+#endif